@@ -0,0 +1,163 @@
+#ifndef _BITSET_
+#define _BITSET_
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+  Bit-packed boolean boxes.
+
+  The halo finder's in_halo and forbidden masks and gen_size_distr's in_bubble box only
+  need one bit per cell, so they are stored here as arrays of 64-bit words instead of chars
+  (an 8x memory saving, 64 MB instead of 512 MB for the DIM=800 masks).  Cell ct of a box
+  is bit ct of the array, with ct given by R_INDEX/HII_R_INDEX as before, so a row of a box
+  (fixed x and y) is a contiguous run of bits.  This lets the sphere primitives below set or
+  test a whole row of a sphere with a few word operations.
+*/
+
+typedef unsigned long long bitset_word;
+
+#define BITSET_WORD_BITS (unsigned long long) (64)
+#define BITSET_WORDS(n) (((unsigned long long)(n) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+#define BITSET_TEST(b, i) (((b)[(unsigned long long)(i) / BITSET_WORD_BITS] >> ((unsigned long long)(i) % BITSET_WORD_BITS)) & 1llu)
+#define BITSET_SET(b, i) ((b)[(unsigned long long)(i) / BITSET_WORD_BITS] |= 1llu << ((unsigned long long)(i) % BITSET_WORD_BITS))
+#define BITSET_UNSET(b, i) ((b)[(unsigned long long)(i) / BITSET_WORD_BITS] &= ~(1llu << ((unsigned long long)(i) % BITSET_WORD_BITS)))
+
+
+/* allocates a bitset of n bits, all unset; free it with free() */
+bitset_word *bitset_alloc(unsigned long long n){
+  return (bitset_word *) calloc(BITSET_WORDS(n), sizeof(bitset_word));
+}
+
+void bitset_clear(bitset_word *b, unsigned long long n){
+  memset(b, 0, BITSET_WORDS(n)*sizeof(bitset_word));
+}
+
+
+/* sets bits [start, start+len) */
+void bitset_set_range(bitset_word *b, unsigned long long start, unsigned long long len){
+  unsigned long long w, first = start / BITSET_WORD_BITS, last = (start + len - 1) / BITSET_WORD_BITS;
+  bitset_word lo = ~0llu << (start % BITSET_WORD_BITS);
+  bitset_word hi = ~0llu >> (BITSET_WORD_BITS - 1 - (start + len - 1) % BITSET_WORD_BITS);
+
+  if (len == 0)
+    return;
+  if (first == last){
+    b[first] |= lo & hi;
+    return;
+  }
+  b[first] |= lo;
+  for (w=first+1; w<last; w++)
+    b[w] = ~0llu;
+  b[last] |= hi;
+}
+
+/* returns 1 if any of bits [start, start+len) is set */
+int bitset_any_range(const bitset_word *b, unsigned long long start, unsigned long long len){
+  unsigned long long w, first = start / BITSET_WORD_BITS, last = (start + len - 1) / BITSET_WORD_BITS;
+  bitset_word lo = ~0llu << (start % BITSET_WORD_BITS);
+  bitset_word hi = ~0llu >> (BITSET_WORD_BITS - 1 - (start + len - 1) % BITSET_WORD_BITS);
+
+  if (len == 0)
+    return 0;
+  if (first == last)
+    return (b[first] & lo & hi) != 0;
+  if (b[first] & lo)
+    return 1;
+  for (w=first+1; w<last; w++){
+    if (b[w])
+      return 1;
+  }
+  return (b[last] & hi) != 0;
+}
+
+
+/*
+  Square of the distance from center c to cell index i along one axis of a periodic box of
+  size dim, taking the closest of the three periodic images (as the halo finder always has).
+*/
+static long long bitset_axis_sq(long long c, long long i, long long dim){
+  long long d = c - i, best = d*d;
+
+  if ((d+dim)*(d+dim) < best) best = (d+dim)*(d+dim);
+  if ((d-dim)*(d-dim) < best) best = (d-dim)*(d-dim);
+  return best;
+}
+
+/*
+  Largest dz >= 0 with dz^2 < rem, or -1 if there is none.
+*/
+static long long bitset_half_width(double rem){
+  long long dz;
+
+  if (rem <= 0)
+    return -1;
+  dz = (long long) sqrt(rem);
+  while ((dz > 0) && ((double)(dz*dz) >= rem)) dz--;
+  while ((double)((dz+1)*(dz+1)) < rem) dz++;
+  return dz;
+}
+
+/*
+  Function BITSET_SPHERE_ROWS visits the rows of the periodic dim^3 box crossed by the sphere
+  of squared radius Rsq (index units; R_index = ceil(sqrt(Rsq))) centred on (x,y,z): a cell is
+  inside if the squared distance to its closest image is < Rsq.  For each row the cells inside
+  form at most two runs of bits, which are set (paint=1) or tested (paint=0).
+  When testing, returns 1 as soon as a set bit is found.
+*/
+static int bitset_sphere_rows(bitset_word *b, int dim, float Rsq, int R_index, int x, int y, int z, int paint){
+  long long x_curr, y_curr, x_index, y_index, dz, lo, hi;
+  unsigned long long row;
+  double rem;
+
+  // (if the sphere is wider than the box, each index is visited once)
+  for (x_curr=x-R_index; (x_curr<=x+R_index) && (x_curr<x-R_index+dim); x_curr++){
+    x_index = ((x_curr % dim) + dim) % dim;
+    for (y_curr=y-R_index; (y_curr<=y+R_index) && (y_curr<y-R_index+dim); y_curr++){
+      y_index = ((y_curr % dim) + dim) % dim;
+
+      rem = (double)Rsq - (double)(bitset_axis_sq(x, x_index, dim) + bitset_axis_sq(y, y_index, dim));
+      if ((dz = bitset_half_width(rem)) < 0)
+	continue;
+      row = ((unsigned long long)x_index*dim + y_index) * dim;
+
+      // cells z-dz .. z+dz, wrapped into the row
+      if (2*dz+1 >= dim){
+	lo = 0;
+	hi = dim-1;
+      }
+      else{
+	lo = ((z-dz) % dim + dim) % dim;
+	hi = ((z+dz) % dim + dim) % dim;
+      }
+      if (lo <= hi){
+	if (paint)
+	  bitset_set_range(b, row+lo, hi-lo+1);
+	else if (bitset_any_range(b, row+lo, hi-lo+1))
+	  return 1;
+      }
+      else{
+	if (paint){
+	  bitset_set_range(b, row+lo, dim-lo);
+	  bitset_set_range(b, row, hi+1);
+	}
+	else if (bitset_any_range(b, row+lo, dim-lo) || bitset_any_range(b, row, hi+1))
+	  return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* sets every cell of the periodic dim^3 box <b> inside the sphere (see bitset_sphere_rows) */
+void bitset_paint_sphere(bitset_word *b, int dim, float Rsq, int R_index, int x, int y, int z){
+  bitset_sphere_rows(b, dim, Rsq, R_index, x, y, z, 1);
+}
+
+/* returns 1 if any cell of the periodic dim^3 box <b> inside the sphere is set */
+int bitset_sphere_any(const bitset_word *b, int dim, float Rsq, int R_index, int x, int y, int z){
+  return bitset_sphere_rows((bitset_word *)b, dim, Rsq, R_index, x, y, z, 0);
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef _IO_ACCOUNT_
+#define _IO_ACCOUNT_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+  Accounting of the binary I/O of a stage.
+
+  With IO_ACCOUNTING set (INIT_PARAMS.H), every mod_fread, mod_fread_padded, mod_fread_region,
+  mod_fwrite, lossy_fwrite and sparse_fwrite call (macros passing their call site, see the end of
+  misc.c), and every raw box read or write that a program makes through
+  io_account_fread/io_account_fwrite, is timed and charged to the file it accesses and to its
+  call site (source file and line).  Boxes written by the write-behind thread are charged to
+  async_writer.  A read that starts before the
+  furthest point of the file already read (after a rewind, a seek back, or reopening the file) is
+  counted as a re-read.
+
+  At exit, each stage (i.e. program) prints its read and write totals and bandwidth, and its
+  IO_ACCOUNTING_TOP most expensive files (plus every file it re-read) and call sites to stderr,
+  and appends the same report to IO_ACCOUNTING_LOG, so that the log of a driver run covers all
+  of its stages.
+
+  The I/O that misc.c does on behalf of an accounted call goes through unaccounted versions of
+  the functions, so it is not counted twice; other stdio calls (parameter files, tables, logs)
+  are not accounted.  Streams from box_fopen are charged to the box's name, also when it is read
+  from the run archive (RUN_ARCHIVE).  Output to the archive is charged when it is written to the
+  stream.  Without IO_ACCOUNTING everything calls straight through.
+*/
+
+#ifndef IO_ACCOUNTING
+#define IO_ACCOUNTING (int) (0)
+#endif
+#ifndef IO_ACCOUNTING_LOG
+#define IO_ACCOUNTING_LOG "../Log_files/io_accounting"
+#endif
+#ifndef IO_ACCOUNTING_TOP
+#define IO_ACCOUNTING_TOP (int) (10) // files and call sites listed in the report
+#endif
+#define IO_ACCOUNT_SITES (int) (1024) // sizes of the hash tables, powers of 2
+#define IO_ACCOUNT_FILES (int) (1024)
+#define IO_ACCOUNT_STREAMS (int) (64) // open streams whose file names are remembered
+
+typedef struct {
+  unsigned long long calls, bytes, reread;
+  double seconds;
+} io_account_total;
+
+typedef struct {
+  FILE *stream;
+  const char *name, *src;
+  int line, write;
+  off_t pos;
+  struct timespec start;
+} io_account_call;
+
+static struct {
+  const char *src;
+  int line, write;
+  io_account_total total;
+} io_account_site[IO_ACCOUNT_SITES];
+static struct {
+  char *name;
+  off_t extent; // furthest position read so far
+  io_account_total total[2]; // read, write
+} io_account_file[IO_ACCOUNT_FILES];
+static struct {
+  FILE *stream;
+  char name[1000];
+} io_account_stream[IO_ACCOUNT_STREAMS];
+static io_account_total io_account_stage[2];
+extern char *program_invocation_short_name; // glibc, names the stage in the report
+static unsigned long long io_account_lost = 0; // calls not charged to a file or site (full tables)
+static int io_account_started = 0;
+static pthread_mutex_t io_account_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void async_write_wait(void); // misc.c
+void io_account_start(io_account_call *, FILE *, const char *, const char *, int, int);
+void io_account_stop(io_account_call *, unsigned long long);
+size_t io_account_fread(void *, size_t, size_t, FILE *, const char *, int);
+size_t io_account_fwrite(const void *, size_t, size_t, FILE *, const char *, int);
+
+
+static unsigned long long io_account_hash(const char *s){
+  unsigned long long h = 5381;
+
+  while (*s)
+    h = 33*h + (unsigned char)*s++;
+  return h;
+}
+
+
+/* remembers (name != NULL) or forgets the file name of an open stream */
+static void io_account_name(FILE *stream, const char *name){
+  int i;
+
+  if (!stream)
+    return;
+  pthread_mutex_lock(&io_account_mutex);
+  for (i=0; (i<IO_ACCOUNT_STREAMS) && (io_account_stream[i].stream != stream); i++);
+  if (name && (i == IO_ACCOUNT_STREAMS))
+    for (i=0; (i<IO_ACCOUNT_STREAMS) && io_account_stream[i].stream; i++);
+  if (i < IO_ACCOUNT_STREAMS){
+    io_account_stream[i].stream = name ? stream : NULL;
+    if (name){
+      strncpy(io_account_stream[i].name, name, sizeof(io_account_stream[i].name)-1);
+      io_account_stream[i].name[sizeof(io_account_stream[i].name)-1] = '\0';
+    }
+  }
+  pthread_mutex_unlock(&io_account_mutex);
+}
+
+
+/* the name of the file behind <stream> (call with the mutex held) */
+static const char *io_account_stream_name(FILE *stream, char *buffer, size_t size){
+  char link[64];
+  ssize_t len;
+  int i;
+
+  for (i=0; i<IO_ACCOUNT_STREAMS; i++){
+    if (io_account_stream[i].stream == stream)
+      return io_account_stream[i].name;
+  }
+  if (stream == stdin) return "(stdin)";
+  if (stream == stdout) return "(stdout)";
+  if (fileno(stream) < 0) return "(memory)";
+  sprintf(link, "/proc/self/fd/%i", fileno(stream));
+  if ((len = readlink(link, buffer, size-1)) < 0)
+    return "(unknown)";
+  buffer[len] = '\0';
+  return buffer;
+}
+
+
+static int io_account_file_index(const char *name){
+  unsigned long long h = io_account_hash(name);
+  int i, probe;
+
+  for (probe=0; probe<IO_ACCOUNT_FILES; probe++){
+    i = (h + probe) & (IO_ACCOUNT_FILES-1);
+    if (!io_account_file[i].name){
+      if (!(io_account_file[i].name = strdup(name)))
+	return -1;
+      return i;
+    }
+    if (!strcmp(io_account_file[i].name, name))
+      return i;
+  }
+  return -1;
+}
+
+
+static int io_account_site_index(const char *src, int line, int write){
+  unsigned long long h = io_account_hash(src) + 31*(unsigned long long)line + write;
+  int i, probe;
+
+  for (probe=0; probe<IO_ACCOUNT_SITES; probe++){
+    i = (h + probe) & (IO_ACCOUNT_SITES-1);
+    if (!io_account_site[i].src){
+      io_account_site[i].src = src;
+      io_account_site[i].line = line;
+      io_account_site[i].write = write;
+      return i;
+    }
+    if ((io_account_site[i].line == line) && (io_account_site[i].write == write) && !strcmp(io_account_site[i].src, src))
+      return i;
+  }
+  return -1;
+}
+
+
+static void io_account_add(io_account_total *total, unsigned long long bytes, int reread, double seconds){
+  total->calls++;
+  total->bytes += bytes;
+  if (reread)
+    total->reread += bytes;
+  total->seconds += seconds;
+}
+
+
+static double io_account_rate(const io_account_total *total){
+  return (total->seconds > 0) ? total->bytes/1e6/total->seconds : 0;
+}
+
+
+static int io_account_compare_sites(const void *a, const void *b){
+  double ta = io_account_site[*(const int *)a].total.seconds, tb = io_account_site[*(const int *)b].total.seconds;
+  return (ta < tb) - (ta > tb);
+}
+
+
+static int io_account_compare_files(const void *a, const void *b){
+  int i = *(const int *)a, j = *(const int *)b;
+  double ta = io_account_file[i].total[0].seconds + io_account_file[i].total[1].seconds;
+  double tb = io_account_file[j].total[0].seconds + io_account_file[j].total[1].seconds;
+  return (ta < tb) - (ta > tb);
+}
+
+
+static void io_account_print(FILE *out, const int *files, int n_files, const int *sites, int n_sites){
+  const char *op[2] = {"read", "write"};
+  int i, rw, shown;
+
+  fprintf(out, "io_accounting: stage %s (pid %i)\n", program_invocation_short_name, (int)getpid());
+  for (rw=0; rw<2; rw++)
+    fprintf(out, "  %-5s %12.1f MB in %10llu calls, %9.3f s, %9.1f MB/s\n", op[rw], io_account_stage[rw].bytes/1e6,
+	    io_account_stage[rw].calls, io_account_stage[rw].seconds, io_account_rate(&io_account_stage[rw]));
+  if (io_account_stage[0].reread > 0)
+    fprintf(out, "  re-read %.1f MB (%.0f%% of the bytes read)\n", io_account_stage[0].reread/1e6,
+	    100.0*io_account_stage[0].reread/io_account_stage[0].bytes);
+  if (io_account_lost > 0)
+    fprintf(out, "  (%llu calls not itemised below, the tables are full)\n", io_account_lost);
+
+  fprintf(out, "  files, by time:\n  %10s %10s %10s %9s %9s %10s %10s %9s %9s  %s\n",
+	  "read MB", "calls", "re-read MB", "s", "MB/s", "written MB", "calls", "s", "MB/s", "file");
+  for (i=0, shown=0; i<n_files; i++){
+    if ((i >= IO_ACCOUNTING_TOP) && !io_account_file[files[i]].total[0].reread)
+      continue; // list every file that was re-read
+    shown++;
+    fprintf(out, "  %10.1f %10llu %10.1f %9.3f %9.1f %10.1f %10llu %9.3f %9.1f  %s\n",
+	    io_account_file[files[i]].total[0].bytes/1e6, io_account_file[files[i]].total[0].calls,
+	    io_account_file[files[i]].total[0].reread/1e6, io_account_file[files[i]].total[0].seconds,
+	    io_account_rate(&io_account_file[files[i]].total[0]),
+	    io_account_file[files[i]].total[1].bytes/1e6, io_account_file[files[i]].total[1].calls,
+	    io_account_file[files[i]].total[1].seconds, io_account_rate(&io_account_file[files[i]].total[1]),
+	    io_account_file[files[i]].name);
+  }
+  if (shown < n_files)
+    fprintf(out, "  (and %i other files)\n", n_files-shown);
+
+  fprintf(out, "  top call sites, by time:\n  %-5s %10s %10s %10s %9s %9s  %s\n",
+	  "op", "MB", "calls", "re-read MB", "s", "MB/s", "site");
+  for (i=0; (i<n_sites) && (i<IO_ACCOUNTING_TOP); i++){
+    fprintf(out, "  %-5s %10.1f %10llu %10.1f %9.3f %9.1f  %s", op[io_account_site[sites[i]].write],
+	    io_account_site[sites[i]].total.bytes/1e6, io_account_site[sites[i]].total.calls,
+	    io_account_site[sites[i]].total.reread/1e6, io_account_site[sites[i]].total.seconds,
+	    io_account_rate(&io_account_site[sites[i]].total), io_account_site[sites[i]].src);
+    if (io_account_site[sites[i]].line > 0)
+      fprintf(out, ":%i", io_account_site[sites[i]].line);
+    fprintf(out, "\n");
+  }
+}
+
+
+static void io_account_report(void){
+  int files[IO_ACCOUNT_FILES], sites[IO_ACCOUNT_SITES], n_files = 0, n_sites = 0, i;
+  FILE *LOG;
+
+  // boxes still queued for the write-behind thread are part of this stage
+  async_write_wait();
+
+  pthread_mutex_lock(&io_account_mutex);
+  for (i=0; i<IO_ACCOUNT_FILES; i++){
+    if (io_account_file[i].name)
+      files[n_files++] = i;
+  }
+  for (i=0; i<IO_ACCOUNT_SITES; i++){
+    if (io_account_site[i].src)
+      sites[n_sites++] = i;
+  }
+  qsort(files, n_files, sizeof(int), io_account_compare_files);
+  qsort(sites, n_sites, sizeof(int), io_account_compare_sites);
+
+  io_account_print(stderr, files, n_files, sites, n_sites);
+  if ((LOG = fopen(IO_ACCOUNTING_LOG, "a"))){
+    io_account_print(LOG, files, n_files, sites, n_sites);
+    fclose(LOG);
+  }
+  pthread_mutex_unlock(&io_account_mutex);
+}
+
+
+/* starts timing a call on <stream> (or on the file <name>, if given) */
+void io_account_start(io_account_call *call, FILE *stream, const char *name, const char *src, int line, int write){
+  call->stream = stream;
+  call->name = name;
+  call->src = src;
+  call->line = line;
+  call->write = write;
+  call->pos = (!write && stream) ? ftello(stream) : -1;
+  clock_gettime(CLOCK_MONOTONIC, &call->start);
+}
+
+
+/* charges the call to its stage, file and call site, once it has transferred <bytes> */
+void io_account_stop(io_account_call *call, unsigned long long bytes){
+  struct timespec stop;
+  char buffer[1000];
+  const char *name;
+  double seconds;
+  off_t end;
+  int file, site, reread = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  seconds = (stop.tv_sec - call->start.tv_sec) + 1e-9*(stop.tv_nsec - call->start.tv_nsec);
+  end = (call->pos >= 0) ? ftello(call->stream) : -1;
+
+  pthread_mutex_lock(&io_account_mutex);
+  if (!io_account_started){
+    io_account_started = 1;
+    atexit(io_account_report);
+  }
+  name = call->name ? call->name : io_account_stream_name(call->stream, buffer, sizeof(buffer));
+  file = io_account_file_index(name);
+  site = io_account_site_index(call->src, call->line, call->write);
+  if ((file >= 0) && (call->pos >= 0) && (end >= 0)){
+    reread = (call->pos < io_account_file[file].extent);
+    if (end > io_account_file[file].extent)
+      io_account_file[file].extent = end;
+  }
+  io_account_add(&io_account_stage[call->write], bytes, reread, seconds);
+  if (file >= 0)
+    io_account_add(&io_account_file[file].total[call->write], bytes, reread, seconds);
+  if (site >= 0)
+    io_account_add(&io_account_site[site].total, bytes, reread, seconds);
+  if ((file < 0) || (site < 0))
+    io_account_lost++;
+  pthread_mutex_unlock(&io_account_mutex);
+}
+
+
+/* fread and fwrite of a box, charged to the call site <src>:<line> (__FILE__, __LINE__) */
+size_t io_account_fread(void *ptr, size_t size, size_t n, FILE *stream, const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return fread(ptr, size, n, stream);
+  io_account_start(&call, stream, NULL, src, line, 0);
+  ret = fread(ptr, size, n, stream);
+  io_account_stop(&call, size*ret);
+  return ret;
+}
+
+
+size_t io_account_fwrite(const void *ptr, size_t size, size_t n, FILE *stream, const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return fwrite(ptr, size, n, stream);
+  io_account_start(&call, stream, NULL, src, line, 1);
+  ret = fwrite(ptr, size, n, stream);
+  io_account_stop(&call, size*ret);
+  return ret;
+}
+
+
+#endif
@@ -5,6 +5,14 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "bitset.c"
+#include "io_account.c"
+#include "run_archive.c"
 
 /*** Some usefull math macros ***/
 #define SIGN(a,b) ((b) >= 0.0 ? fabs(a) : -fabs(a))
@@ -21,9 +29,88 @@ static double mnarg1,mnarg2;
 
 /*** Wrapper functions for the std library functions fwrite and fread
      which should improve stability on certain 64-bit operating systems
-     when dealing with large (>4GB) files ***/
-size_t mod_fwrite (const void *, unsigned long long, unsigned long long, FILE *);
-size_t mod_fread(void *, unsigned long long, unsigned long long, FILE *);
+     when dealing with large (>4GB) files.  These and the box I/O functions below are called
+     through macros of their own names (end of this file), which pass the caller's source file
+     and line on to the I/O accounting (io_account.c). ***/
+size_t mod_fwrite_at(const void *, unsigned long long, unsigned long long, FILE *, const char *, int);
+size_t mod_fread_at(void *, unsigned long long, unsigned long long, FILE *, const char *, int);
+
+/*** Optional lossless box compression.  With COMPRESS_BOXES (INIT_PARAMS.H) set, mod_fwrite
+     stores its buffer as a BOX_CODEC_MAGIC stream of BOX_CODEC_CHUNK byte chunks, each
+     byte-shuffled (4-byte words) and LZ-coded; mod_fread recognises the magic and decodes the
+     chunks in parallel with OpenMP, so uncompressed and compressed boxes are read the same way.
+     mod_fread_padded reads an unpadded d^3 float box into the FFT-padded layout. ***/
+#ifndef COMPRESS_BOXES
+#define COMPRESS_BOXES (int) (0)
+#endif
+#define BOX_CODEC_MAGIC "21cmLZ1"
+#define BOX_CODEC_CHUNK (unsigned long long) (1<<20)
+#define BOX_CODEC_BATCH (unsigned long long) (64) // chunks (de)compressed together
+size_t mod_fread_padded_at(float *, unsigned long long, FILE *, const char *, int);
+
+/*** Error-bounded lossy storage of float boxes.  lossy_fwrite stores each slab of slab_len
+     floats as 16-bit integers with its own offset and scale, provided every value decodes to
+     within max_error (>0: absolute bound, <0: bound relative to the slab's largest |value|);
+     slabs that cannot meet the bound are kept as floats.  The quantised payload goes through
+     mod_fwrite, so COMPRESS_BOXES applies on top.  mod_fread recognises LOSSY_MAGIC and
+     decodes back to float, so readers need no changes.  max_error=0 is a plain mod_fwrite. ***/
+#define LOSSY_MAGIC "21cmQ16"
+size_t lossy_fwrite_at(const float *, unsigned long long, unsigned long long, float, FILE *, const char *, int);
+
+/*** Sparse storage of mostly-constant float boxes (e.g. xH, which is exactly 0 or 1 in most
+     cells).  sparse_fwrite stores the box as a constant (whichever of 0 and 1 is more common),
+     a bitset (bitset.c) flagging the cells that differ from it, and the values of those cells,
+     through mod_fwrite.  Boxes for which this is not smaller are written with a plain mod_fwrite.
+     mod_fread recognises SPARSE_MAGIC and expands the box again. ***/
+#define SPARSE_MAGIC "21cmSP1"
+size_t sparse_fwrite_at(const float *, unsigned long long, FILE *, const char *, int);
+
+/*** Random-access reads of part of a box.  mod_fread_region reads the sub-volume
+     [i0,i0+ni) x [j0,j0+nj) x [k0,k0+nk) of an unpadded d^3 float box, stored from the stream's
+     current position, into a dense ni*nj*nk array (k fastest), e.g. a slab or a single plane.
+     Raw boxes are read row by row, rows less than BOX_REGION_GAP bytes apart being merged into
+     one read; compressed boxes only decode the chunks that the region touches.  Lossy and
+     sparse boxes have no random access, and are decoded whole. ***/
+#define BOX_REGION_GAP (unsigned long long) (1<<16)
+#define BOX_REGION_SPAN (unsigned long long) (1<<24) // largest merged read, in bytes
+size_t mod_fread_region_at(float *, unsigned long long, unsigned long long, unsigned long long,
+			   unsigned long long, unsigned long long, unsigned long long, unsigned long long, FILE *,
+			   const char *, int);
+
+/*** Parallel box I/O.  Uncompressed transfers of at least PARALLEL_IO_MIN bytes through
+     mod_fread/mod_fwrite bypass stdio: they are split into PARALLEL_IO_CHUNK byte chunks
+     (aligned to PARALLEL_IO_ALIGN in the file) that PARALLEL_IO_THREADS threads (INIT_PARAMS.H)
+     transfer with pread/pwrite.  With PARALLEL_IO_DIRECT, the aligned part of each chunk goes
+     through an O_DIRECT descriptor, falling back to buffered I/O where that is refused.
+     Streams without a file descriptor or opened for appending use stdio as before. ***/
+#ifndef PARALLEL_IO_MIN
+#define PARALLEL_IO_MIN (unsigned long long) (1<<25)
+#endif
+#ifndef PARALLEL_IO_CHUNK
+#define PARALLEL_IO_CHUNK (unsigned long long) (1<<23)
+#endif
+#define PARALLEL_IO_ALIGN (unsigned long long) (4096)
+#ifndef PARALLEL_IO_THREADS
+#define PARALLEL_IO_THREADS (int) (1)
+#endif
+#ifndef PARALLEL_IO_DIRECT
+#define PARALLEL_IO_DIRECT (int) (0)
+#endif
+
+/*** Asynchronous (write-behind) output.  A box is copied into one of ASYNC_WRITE_BUFFERS
+     buffers and written to disk by a dedicated thread, so computation can continue while
+     it drains.  Either fill a buffer from async_write_buffer() and hand it over with
+     async_write_submit(), or let async_fwrite() copy an array.  async_write_flush() waits
+     until everything queued is written and fsync-ed, and returns the number of failed writes;
+     call it at stage exit (it is also called at exit, as a safety net). ***/
+#define ASYNC_WRITE_BUFFERS (int) (2)
+void *async_write_buffer(const char *, unsigned long long);
+int async_write_submit(void);
+int async_fwrite(const char *, const void *, unsigned long long);
+int async_fwrite_lossy(const char *, const float *, unsigned long long, unsigned long long, float);
+int async_fwrite_sparse(const char *, const float *, unsigned long long);
+int async_write_flush(void);
+void async_write_wait(void);
 
 /* generic function to compare floats */
 int compare_floats(const void *, const void *);
@@ -36,13 +123,608 @@ FILE *log_open(const char *);
 
 /*********   END PROTOTYPE DEFINITIONS  ***********/
 
+/* the box I/O functions above are charged to the I/O accounting (io_account.c) at the end of
+   this file; these do the actual work, and are what misc.c calls internally */
+static size_t mod_fwrite_unaccounted(const void *, unsigned long long, unsigned long long, FILE *);
+static size_t mod_fread_unaccounted(void *, unsigned long long, unsigned long long, FILE *);
+static size_t mod_fread_padded_unaccounted(float *, unsigned long long, FILE *);
+static size_t lossy_fwrite_unaccounted(const float *, unsigned long long, unsigned long long, float, FILE *);
+static size_t sparse_fwrite_unaccounted(const float *, unsigned long long, FILE *);
+static size_t mod_fread_region_unaccounted(float *, unsigned long long, unsigned long long, unsigned long long,
+					   unsigned long long, unsigned long long, unsigned long long, unsigned long long, FILE *);
+
+
+/*** LZ coder for the box codec.  A compressed chunk is a list of sequences: a token byte
+     (literal count in the high nibble, match length-4 in the low nibble, 15 meaning "more
+     length bytes follow"), the literals, then a 2-byte little-endian match offset and any
+     extra match length bytes.  The last sequence has literals only. ***/
+#define LZ_HASH_BITS (int) (14)
+#define LZ_MIN_MATCH (unsigned long long) (4)
+#define LZ_MAX_OFFSET (unsigned long long) (65535)
+#define LZ_BOUND(n) ((n) + (n)/255 + 16)
+
+static unsigned char *lz_put_length(unsigned char *op, unsigned long long len){
+  while (len >= 255){
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char) len;
+  return op;
+}
+
+static unsigned char *lz_put_sequence(unsigned char *op, const unsigned char *lit, unsigned long long n_lit,
+				      unsigned long long offset, unsigned long long match_len){
+  unsigned char *token = op++;
+  unsigned long long ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+  *token = (unsigned char) (((n_lit < 15 ? n_lit : 15) << 4) | (ml < 15 ? ml : 15));
+  if (n_lit >= 15)
+    op = lz_put_length(op, n_lit - 15);
+  memcpy(op, lit, n_lit);
+  op += n_lit;
+  if (match_len){
+    *op++ = (unsigned char) (offset & 255);
+    *op++ = (unsigned char) (offset >> 8);
+    if (ml >= 15)
+      op = lz_put_length(op, ml - 15);
+  }
+  return op;
+}
+
+/* compresses n bytes of in into out (at least LZ_BOUND(n) bytes), returning the compressed size */
+static unsigned long long lz_compress(const unsigned char *in, unsigned long long n, unsigned char *out, unsigned int *table){
+  unsigned long long ip = 0, anchor = 0, ref, len, limit;
+  unsigned int h, word;
+  unsigned char *op = out;
+
+  memset(table, 0, sizeof(unsigned int) << LZ_HASH_BITS);
+  limit = n > 12 ? n - 12 : 0; // the tail is always sent as literals
+  while (ip < limit){
+    memcpy(&word, in+ip, 4);
+    h = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+    ref = table[h];
+    table[h] = (unsigned int) ip + 1;
+    if (ref-- && (ip - ref <= LZ_MAX_OFFSET) && !memcmp(in+ref, in+ip, 4)){
+      len = LZ_MIN_MATCH;
+      while ((ip+len < n-5) && (in[ref+len] == in[ip+len]))
+	len++;
+      op = lz_put_sequence(op, in+anchor, ip-anchor, ip-ref, len);
+      ip += len;
+      anchor = ip;
+    }
+    else
+      ip++;
+  }
+  op = lz_put_sequence(op, in+anchor, n-anchor, 0, 0);
+  return op - out;
+}
+
+/* decompresses in (n_in bytes) into exactly n_out bytes of out; returns 0 on success */
+static int lz_decompress(const unsigned char *in, unsigned long long n_in, unsigned char *out, unsigned long long n_out){
+  const unsigned char *ip = in, *end = in + n_in;
+  unsigned long long op = 0, n_lit, len, offset;
+  unsigned char c;
+
+  while (ip < end){
+    c = *ip++;
+    n_lit = c >> 4;
+    if (n_lit == 15){
+      do{
+	if (ip >= end) return -1;
+	n_lit += *ip;
+      } while (*ip++ == 255);
+    }
+    if ((n_lit > (unsigned long long)(end - ip)) || (n_lit > n_out - op)) return -1;
+    memcpy(out+op, ip, n_lit);
+    ip += n_lit;
+    op += n_lit;
+    if (ip == end) // last sequence
+      break;
+
+    if (end - ip < 2) return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    len = c & 15;
+    if (len == 15){
+      do{
+	if (ip >= end) return -1;
+	len += *ip;
+      } while (*ip++ == 255);
+    }
+    len += LZ_MIN_MATCH;
+    if ((offset == 0) || (offset > op) || (len > n_out - op)) return -1;
+    for (; len>0; len--, op++) // may overlap
+      out[op] = out[op-offset];
+  }
+  return (op == n_out) ? 0 : -1;
+}
+
+/* groups byte b of every 4-byte word together (and back), which makes float boxes far more compressible */
+static void byte_shuffle(const unsigned char *in, unsigned char *out, unsigned long long n, int inverse){
+  unsigned long long i, words = n/4;
+  int b;
+
+  for (b=0; b<4; b++){
+    for (i=0; i<words; i++){
+      if (inverse)
+	out[4*i+b] = in[b*words+i];
+      else
+	out[b*words+i] = in[4*i+b];
+    }
+  }
+  memcpy(out+4*words, in+4*words, n-4*words);
+}
+
+
+/*
+  Function BOX_CODEC_WRITE writes tot_size bytes of array as a compressed stream: the magic,
+  the raw size and chunk size (8-byte), then for each chunk its 4-byte compressed size and data.
+  A chunk whose compressed size equals its raw size is stored as is.
+  Returns 1 on success.
+*/
+static size_t box_codec_write(const void *array, unsigned long long tot_size, FILE *stream){
+  unsigned long long header[2], n_chunks, first, n_batch, c, raw, bound;
+  unsigned char *scratch;
+  unsigned int *sizes;
+  char magic[sizeof(BOX_CODEC_MAGIC)] = BOX_CODEC_MAGIC;
+  int failed = 0;
+
+  n_chunks = (tot_size + BOX_CODEC_CHUNK - 1) / BOX_CODEC_CHUNK;
+  bound = LZ_BOUND(BOX_CODEC_CHUNK);
+  scratch = (unsigned char *) malloc(BOX_CODEC_BATCH * (bound + BOX_CODEC_CHUNK));
+  sizes = (unsigned int *) malloc(sizeof(unsigned int) * BOX_CODEC_BATCH);
+  if (!scratch || !sizes){
+    free(scratch); free(sizes);
+    return 0;
+  }
+
+  header[0] = tot_size;
+  header[1] = BOX_CODEC_CHUNK;
+  if ((fwrite(magic, sizeof(magic), 1, stream) != 1) || (fwrite(header, sizeof(header), 1, stream) != 1))
+    failed = 1;
+
+  for (first=0; (first<n_chunks) && !failed; first+=BOX_CODEC_BATCH){
+    n_batch = (n_chunks - first < BOX_CODEC_BATCH) ? n_chunks - first : BOX_CODEC_BATCH;
+
+#pragma omp parallel for private(raw)
+    for (c=0; c<n_batch; c++){
+      unsigned char *shuffled = scratch + c*(bound + BOX_CODEC_CHUNK);
+      unsigned char *coded = shuffled + BOX_CODEC_CHUNK;
+      unsigned int table[1 << LZ_HASH_BITS];
+      unsigned long long len;
+
+      raw = ((first+c+1)*BOX_CODEC_CHUNK <= tot_size) ? BOX_CODEC_CHUNK : tot_size - (first+c)*BOX_CODEC_CHUNK;
+      byte_shuffle((const unsigned char *)array + (first+c)*BOX_CODEC_CHUNK, shuffled, raw, 0);
+      len = lz_compress(shuffled, raw, coded, table);
+      if (len >= raw){ // incompressible, store it
+	memcpy(coded, (const unsigned char *)array + (first+c)*BOX_CODEC_CHUNK, raw);
+	len = raw;
+      }
+      sizes[c] = (unsigned int) len;
+    }
+
+    for (c=0; (c<n_batch) && !failed; c++){
+      if ((fwrite(&sizes[c], sizeof(unsigned int), 1, stream) != 1) ||
+	  (fwrite(scratch + c*(bound + BOX_CODEC_CHUNK) + BOX_CODEC_CHUNK, sizes[c], 1, stream) != 1))
+	failed = 1;
+    }
+  }
+
+  free(scratch); free(sizes);
+  return !failed;
+}
+
+
+/* decodes one chunk (size bytes, raw bytes once decoded) into dest; returns 0 on success */
+static int box_codec_decode(const unsigned char *coded, unsigned int size, unsigned char *dest, unsigned long long raw){
+  unsigned char *shuffled;
+  int status;
+
+  if (size == raw){
+    memcpy(dest, coded, raw);
+    return 0;
+  }
+  if (!(shuffled = (unsigned char *) malloc(raw)))
+    return -1;
+  if ((status = lz_decompress(coded, size, shuffled, raw)) == 0)
+    byte_shuffle(shuffled, dest, raw, 1);
+  free(shuffled);
+  return status;
+}
+
+
+/*
+  Function BOX_CODEC_READ decodes a compressed stream (whose magic has already been read) into
+  the tot_size bytes of array.  Returns 1 on success.
+*/
+static size_t box_codec_read(void *array, unsigned long long tot_size, FILE *stream){
+  unsigned long long header[2], n_chunks, first, n_batch, c, bound, offset[BOX_CODEC_BATCH];
+  unsigned int sizes[BOX_CODEC_BATCH];
+  unsigned char *coded;
+  int failed = 0;
+
+  if (fread(header, sizeof(header), 1, stream) != 1)
+    return 0;
+  if ((header[0] != tot_size) || (header[1] == 0)){
+    fprintf(stderr, "mod_fread: ERROR: compressed box holds %llu bytes, expected %llu\n", header[0], tot_size);
+    return 0;
+  }
+  n_chunks = (tot_size + header[1] - 1) / header[1];
+  bound = LZ_BOUND(header[1]);
+  if (!(coded = (unsigned char *) malloc(BOX_CODEC_BATCH * bound)))
+    return 0;
+
+  for (first=0; (first<n_chunks) && !failed; first+=BOX_CODEC_BATCH){
+    n_batch = (n_chunks - first < BOX_CODEC_BATCH) ? n_chunks - first : BOX_CODEC_BATCH;
+
+    // read the batch, then decode its chunks in parallel
+    for (c=0; (c<n_batch) && !failed; c++){
+      offset[c] = c*bound;
+      if ((fread(&sizes[c], sizeof(unsigned int), 1, stream) != 1) || (sizes[c] > bound) ||
+	  (fread(coded + offset[c], sizes[c], 1, stream) != 1))
+	failed = 1;
+    }
+    if (failed)
+      break;
+
+#pragma omp parallel for reduction(+:failed)
+    for (c=0; c<n_batch; c++){
+      unsigned long long raw = ((first+c+1)*header[1] <= tot_size) ? header[1] : tot_size - (first+c)*header[1];
+
+      if (box_codec_decode(coded + offset[c], sizes[c], (unsigned char *)array + (first+c)*header[1], raw) != 0)
+	failed++;
+    }
+  }
+
+  free(coded);
+  if (failed)
+    fprintf(stderr, "mod_fread: ERROR: corrupt or truncated compressed box\n");
+  return !failed;
+}
+
+
+/* the decoded value of q; used by both the encoder (to check the bound) and the decoder */
+static float lossy_decode(float offset, float scale, unsigned short q){
+  return (float) ((double)offset + (double)scale * (double)q);
+}
+
+
+/*
+  Function LOSSY_FWRITE writes the num floats of box in the LOSSY_MAGIC format: the magic, the
+  number of floats, slab_len and the payload size (8-byte), then the payload (through mod_fwrite).
+  The payload holds an (offset, scale) pair per slab followed by the slabs, as unsigned shorts,
+  or as floats for slabs flagged by scale<0.  Returns 1 on success.
+*/
+static size_t lossy_fwrite_unaccounted(const float *box, unsigned long long num, unsigned long long slab_len, float max_error, FILE *stream){
+  unsigned long long header[3], n_slabs, s, *start;
+  unsigned char *payload;
+  float *table;
+  char magic[sizeof(LOSSY_MAGIC)] = LOSSY_MAGIC;
+  size_t status;
+
+  if ((max_error == 0) || (slab_len == 0) || (num == 0))
+    return mod_fwrite_unaccounted(box, sizeof(float)*num, 1, stream);
+
+  n_slabs = (num + slab_len - 1) / slab_len;
+  // worst case: every slab kept as floats
+  payload = (unsigned char *) malloc(2*sizeof(float)*n_slabs + sizeof(float)*num);
+  start = (unsigned long long *) malloc(sizeof(unsigned long long)*(n_slabs+1));
+  if (!payload || !start){
+    free(payload); free(start);
+    return 0;
+  }
+  table = (float *) payload;
+
+  // choose offset and scale for each slab, keeping it only if every value meets the bound
+#pragma omp parallel for
+  for (s=0; s<n_slabs; s++){
+    const float *x = box + s*slab_len;
+    unsigned long long i, len = (s+1 < n_slabs) ? slab_len : num - s*slab_len;
+    float min = x[0], max = x[0], bound, scale;
+    unsigned short q;
+    int ok = 1;
+
+    for (i=0; i<len; i++){
+      if (!isfinite(x[i])) ok = 0;
+      if (x[i] < min) min = x[i];
+      if (x[i] > max) max = x[i];
+    }
+    bound = (max_error > 0) ? max_error : -max_error * fmaxf(fabsf(min), fabsf(max));
+    scale = (max - min) / 65535.0;
+    if (scale > 2*bound)
+      ok = 0;
+    for (i=0; ok && (i<len); i++){
+      q = (scale > 0) ? (unsigned short) ((x[i] - min) / scale + 0.5) : 0;
+      if (fabsf(lossy_decode(min, scale, q) - x[i]) > bound)
+	ok = 0;
+    }
+    table[2*s] = min;
+    table[2*s+1] = ok ? scale : -1;
+  }
+
+  // where each slab starts in the payload
+  start[0] = 2*sizeof(float)*n_slabs;
+  for (s=0; s<n_slabs; s++)
+    start[s+1] = start[s] + (((s+1 < n_slabs) ? slab_len : num - s*slab_len) * ((table[2*s+1] < 0) ? sizeof(float) : sizeof(unsigned short)));
+
+#pragma omp parallel for
+  for (s=0; s<n_slabs; s++){
+    const float *x = box + s*slab_len;
+    unsigned long long i, len = (s+1 < n_slabs) ? slab_len : num - s*slab_len;
+    unsigned short *q = (unsigned short *) (payload + start[s]);
+
+    if (table[2*s+1] < 0)
+      memcpy(payload + start[s], x, sizeof(float)*len);
+    else{
+      for (i=0; i<len; i++)
+	q[i] = (table[2*s+1] > 0) ? (unsigned short) ((x[i] - table[2*s]) / table[2*s+1] + 0.5) : 0;
+    }
+  }
+
+  header[0] = num;
+  header[1] = slab_len;
+  header[2] = start[n_slabs];
+  status = (fwrite(magic, sizeof(magic), 1, stream) == 1) && (fwrite(header, sizeof(header), 1, stream) == 1) &&
+    (mod_fwrite_unaccounted(payload, header[2], 1, stream) == 1);
+  free(payload); free(start);
+  return status;
+}
+
+
+/*
+  Function LOSSY_FREAD decodes a LOSSY_MAGIC stream (whose magic has already been read) into
+  the tot_size bytes of array.  Returns 1 on success.
+*/
+static size_t lossy_fread(void *array, unsigned long long tot_size, FILE *stream){
+  unsigned long long header[3], n_slabs, s, *start;
+  unsigned char *payload;
+  float *table, *box = (float *) array;
+
+  if (fread(header, sizeof(header), 1, stream) != 1)
+    return 0;
+  if ((sizeof(float)*header[0] != tot_size) || (header[1] == 0)){
+    fprintf(stderr, "mod_fread: ERROR: quantised box holds %llu floats, expected %llu\n", header[0], tot_size/sizeof(float));
+    return 0;
+  }
+  n_slabs = (header[0] + header[1] - 1) / header[1];
+  if (header[2] > 2*sizeof(float)*n_slabs + sizeof(float)*header[0])
+    return 0;
+  payload = (unsigned char *) malloc(header[2]);
+  start = (unsigned long long *) malloc(sizeof(unsigned long long)*(n_slabs+1));
+  if (!payload || !start || (mod_fread_unaccounted(payload, header[2], 1, stream) != 1)){
+    free(payload); free(start);
+    return 0;
+  }
+  table = (float *) payload;
+
+  start[0] = 2*sizeof(float)*n_slabs;
+  for (s=0; s<n_slabs; s++)
+    start[s+1] = start[s] + (((s+1 < n_slabs) ? header[1] : header[0] - s*header[1]) * ((table[2*s+1] < 0) ? sizeof(float) : sizeof(unsigned short)));
+  if (start[n_slabs] != header[2]){
+    fprintf(stderr, "mod_fread: ERROR: corrupt quantised box\n");
+    free(payload); free(start);
+    return 0;
+  }
+
+#pragma omp parallel for
+  for (s=0; s<n_slabs; s++){
+    unsigned long long i, len = (s+1 < n_slabs) ? header[1] : header[0] - s*header[1];
+    unsigned short *q = (unsigned short *) (payload + start[s]);
+
+    if (table[2*s+1] < 0)
+      memcpy(box + s*header[1], payload + start[s], sizeof(float)*len);
+    else{
+      for (i=0; i<len; i++)
+	box[s*header[1] + i] = lossy_decode(table[2*s], table[2*s+1], q[i]);
+    }
+  }
+
+  free(payload); free(start);
+  return 1;
+}
+
+
+/*
+  Function SPARSE_FWRITE writes the num floats of box in the SPARSE_MAGIC format: the magic, the
+  number of floats and of exceptions (8-byte), the constant, then the payload (through
+  mod_fwrite): the bitset of exceptions followed by their values, in cell order.
+  Returns 1 on success.
+*/
+static size_t sparse_fwrite_unaccounted(const float *box, unsigned long long num, FILE *stream){
+  unsigned long long header[2], ct, n_zero=0, n_one=0, n_exc, mask_size;
+  unsigned char *payload;
+  bitset_word *mask;
+  float constant, *values;
+  char magic[sizeof(SPARSE_MAGIC)] = SPARSE_MAGIC;
+  size_t status;
+
+#pragma omp parallel for reduction(+:n_zero,n_one)
+  for (ct=0; ct<num; ct++){
+    if (box[ct] == 0) n_zero++;
+    else if (box[ct] == 1) n_one++;
+  }
+  constant = (n_one > n_zero) ? 1 : 0;
+  n_exc = num - ((n_one > n_zero) ? n_one : n_zero);
+  mask_size = sizeof(bitset_word)*BITSET_WORDS(num);
+  if (mask_size + sizeof(float)*n_exc + sizeof(header) + sizeof(float) >= sizeof(float)*num)
+    return mod_fwrite_unaccounted(box, sizeof(float)*num, 1, stream);
+
+  if (!(payload = (unsigned char *) calloc(mask_size + sizeof(float)*n_exc, 1)))
+    return 0;
+  mask = (bitset_word *) payload;
+  values = (float *) (payload + mask_size);
+  n_exc = 0;
+  for (ct=0; ct<num; ct++){
+    if (box[ct] != constant){
+      BITSET_SET(mask, ct);
+      values[n_exc++] = box[ct];
+    }
+  }
+
+  header[0] = num;
+  header[1] = n_exc;
+  status = (fwrite(magic, sizeof(magic), 1, stream) == 1) && (fwrite(header, sizeof(header), 1, stream) == 1) &&
+    (fwrite(&constant, sizeof(float), 1, stream) == 1) &&
+    (mod_fwrite_unaccounted(payload, mask_size + sizeof(float)*n_exc, 1, stream) == 1);
+  free(payload);
+  return status;
+}
+
+
+/*
+  Function SPARSE_FREAD expands a SPARSE_MAGIC stream (whose magic has already been read) into
+  the tot_size bytes of array.  Returns 1 on success.
+*/
+static size_t sparse_fread(void *array, unsigned long long tot_size, FILE *stream){
+  unsigned long long header[2], ct, n_exc, mask_size;
+  unsigned char *payload;
+  bitset_word *mask;
+  float constant, *values, *box = (float *) array;
+
+  if ((fread(header, sizeof(header), 1, stream) != 1) || (fread(&constant, sizeof(float), 1, stream) != 1))
+    return 0;
+  if ((sizeof(float)*header[0] != tot_size) || (header[1] > header[0])){
+    fprintf(stderr, "mod_fread: ERROR: sparse box holds %llu floats, expected %llu\n", header[0], tot_size/sizeof(float));
+    return 0;
+  }
+  mask_size = sizeof(bitset_word)*BITSET_WORDS(header[0]);
+  payload = (unsigned char *) malloc(mask_size + sizeof(float)*header[1]);
+  if (!payload || (mod_fread_unaccounted(payload, mask_size + sizeof(float)*header[1], 1, stream) != 1)){
+    free(payload);
+    return 0;
+  }
+  mask = (bitset_word *) payload;
+  values = (float *) (payload + mask_size);
+
+  n_exc = 0;
+  for (ct=0; ct<header[0]; ct++){
+    if (BITSET_TEST(mask, ct)){
+      if (n_exc == header[1])
+	break;
+      box[ct] = values[n_exc++];
+    }
+    else
+      box[ct] = constant;
+  }
+  free(payload);
+  if ((ct != header[0]) || (n_exc != header[1])){
+    fprintf(stderr, "mod_fread: ERROR: corrupt sparse box\n");
+    return 0;
+  }
+  return 1;
+}
+
+
+/* transfers all len bytes at offset with pread (write=0) or pwrite (write=1); returns 0 on success */
+static int parallel_io_all(int fd, unsigned char *buf, unsigned long long len, off_t offset, int write){
+  ssize_t n;
+
+  while (len > 0){
+    n = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/* transfers the bytes [begin, end) of the file, held in buf, through direct_fd if possible */
+static int parallel_io_chunk(int fd, int direct_fd, unsigned char *buf, off_t begin, off_t end, int write){
+  off_t a0 = (begin + PARALLEL_IO_ALIGN - 1) / PARALLEL_IO_ALIGN * PARALLEL_IO_ALIGN;
+  off_t a1 = end / PARALLEL_IO_ALIGN * PARALLEL_IO_ALIGN;
+  void *bounce;
+  int status;
+
+  if ((direct_fd < 0) || (a1 <= a0))
+    return parallel_io_all(fd, buf, end - begin, begin, write);
+
+  // O_DIRECT needs an aligned buffer, offset and length
+  if (posix_memalign(&bounce, PARALLEL_IO_ALIGN, a1 - a0) != 0)
+    return parallel_io_all(fd, buf, end - begin, begin, write);
+  if (write)
+    memcpy(bounce, buf + (a0 - begin), a1 - a0);
+  status = parallel_io_all(direct_fd, (unsigned char *)bounce, a1 - a0, a0, write);
+  if (status != 0) // refused, e.g. by the file system
+    status = parallel_io_all(fd, buf + (a0 - begin), a1 - a0, a0, write);
+  else if (!write)
+    memcpy(buf + (a0 - begin), bounce, a1 - a0);
+  free(bounce);
+
+  if ((status == 0) && (a0 > begin))
+    status = parallel_io_all(fd, buf, a0 - begin, begin, write);
+  if ((status == 0) && (end > a1))
+    status = parallel_io_all(fd, buf + (a1 - begin), end - a1, a1, write);
+  return status;
+}
+
+/*
+  Function PARALLEL_IO reads (write=0) or writes (write=1) the tot_size bytes of array at the
+  current position of stream in parallel chunks, and leaves the stream positioned after them.
+  Returns 1 on success, 0 on failure and -1 if the stream has to go through stdio instead.
+*/
+static int parallel_io(void *array, unsigned long long tot_size, FILE *stream, int write){
+  unsigned long long c, n_chunks;
+  off_t pos, base, start, end;
+  int fd, direct_fd = -1, failed = 0;
+#ifdef O_DIRECT
+  char path[100];
+#endif
+
+  // (an archived box is a record of the run archive, see box_fileno)
+  if ((fd = box_fileno(stream, &start, &end)) < 0)
+    return -1;
+  if (write && ((fcntl(fd, F_GETFL) & O_APPEND) || (fflush(stream) != 0)))
+    return -1;
+  if ((pos = ftello(stream)) < 0)
+    return -1;
+  pos += start;
+  if ((end >= 0) && (pos + (off_t)tot_size > end))
+    return -1; // leave reading past the end of the box to stdio
+#ifdef O_DIRECT
+  if (PARALLEL_IO_DIRECT){
+    sprintf(path, "/proc/self/fd/%i", fd);
+    direct_fd = open(path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+  }
+#endif
+
+  // chunk boundaries are aligned in the file
+  base = pos / PARALLEL_IO_ALIGN * PARALLEL_IO_ALIGN;
+  n_chunks = (pos - base + tot_size + PARALLEL_IO_CHUNK - 1) / PARALLEL_IO_CHUNK;
+#pragma omp parallel for num_threads(PARALLEL_IO_THREADS) schedule(dynamic) reduction(+:failed)
+  for (c=0; c<n_chunks; c++){
+    off_t begin = base + c*PARALLEL_IO_CHUNK, end = begin + PARALLEL_IO_CHUNK;
 
-size_t mod_fwrite (const void *array, unsigned long long size, unsigned long long count, FILE *stream){
+    if (begin < pos) begin = pos;
+    if (end > pos + (off_t)tot_size) end = pos + tot_size;
+    if (parallel_io_chunk(fd, direct_fd, (unsigned char *)array + (begin - pos), begin, end, write) != 0)
+      failed++;
+  }
+
+  if (direct_fd >= 0)
+    close(direct_fd);
+  if (fseeko(stream, pos - start + tot_size, SEEK_SET) != 0)
+    failed++;
+  return !failed;
+}
+
+
+static size_t mod_fwrite_unaccounted(const void *array, unsigned long long size, unsigned long long count, FILE *stream){
   unsigned long long pos, tot_size, pos_ct;
   const unsigned long long block_size = 4*512*512*512;
+  int status;
 
   tot_size = size*count; // total size of buffer to be written
 
+  // (buffers no longer than the magic are never compressed, see mod_fread)
+  if (COMPRESS_BOXES && (tot_size > sizeof(BOX_CODEC_MAGIC)))
+    return box_codec_write(array, tot_size, stream) ? count : 0;
+  if ((tot_size >= PARALLEL_IO_MIN) && ((status = parallel_io((void *)array, tot_size, stream, 1)) >= 0))
+    return status ? count : 0;
+
   //check if the buffer is smaller than our pre-defined block size
   if (tot_size <= block_size)
     return fwrite(array, size, count, stream);
@@ -60,11 +742,14 @@ size_t mod_fwrite (const void *array, unsigned long long size, unsigned long lon
 }
 
 
-size_t mod_fread(void * array, unsigned long long size, unsigned long long count, FILE * stream){
+static size_t raw_fread(void * array, unsigned long long size, unsigned long long count, FILE * stream){
   unsigned long long pos, tot_size, pos_ct;
   const unsigned long long block_size = 512*512*512*4;
+  int status;
 
   tot_size = size*count; // total size of buffer to be written
+  if ((tot_size >= PARALLEL_IO_MIN) && ((status = parallel_io(array, tot_size, stream, 0)) >= 0))
+    return status ? count : 0;
   //check if the buffer is smaller than our pre-defined block size
   if (tot_size <= block_size)
     return fread(array, size, count, stream);
@@ -81,6 +766,432 @@ size_t mod_fread(void * array, unsigned long long size, unsigned long long count
   }
 }
 
+
+static size_t mod_fread_unaccounted(void * array, unsigned long long size, unsigned long long count, FILE * stream){
+  const unsigned long long magic_size = sizeof(BOX_CODEC_MAGIC);
+  unsigned long long tot_size = size*count;
+
+  if (tot_size <= magic_size)
+    return raw_fread(array, size, count, stream);
+
+  // is this a compressed box?  Otherwise the bytes peeked at are the start of the data
+  if (fread(array, magic_size, 1, stream) != 1)
+    return 0;
+  if (!memcmp(array, BOX_CODEC_MAGIC, magic_size))
+    return box_codec_read(array, tot_size, stream) ? count : 0;
+  if (!memcmp(array, LOSSY_MAGIC, magic_size))
+    return lossy_fread(array, tot_size, stream) ? count : 0;
+  if (!memcmp(array, SPARSE_MAGIC, magic_size))
+    return sparse_fread(array, tot_size, stream) ? count : 0;
+  return (raw_fread((char *)array + magic_size, tot_size - magic_size, 1, stream) == 1) ? count : 0;
+}
+
+
+/*** Region reads.  The region is a list of rows (i,j) of nk floats, in file order ***/
+typedef struct {
+  unsigned long long d, i0, j0, k0, nj, nk, n_rows;
+} box_region;
+
+/* byte offset in the box of row r of the region */
+static unsigned long long box_region_row(const box_region *reg, unsigned long long r){
+  return sizeof(float)*(reg->k0 + reg->d*(reg->j0 + r%reg->nj + reg->d*(reg->i0 + r/reg->nj)));
+}
+
+/* reads the region from a raw box starting at byte <start> of the stream */
+static size_t raw_fread_region(float *out, const box_region *reg, off_t start, FILE *stream){
+  unsigned long long first, r, begin, end, row_size = sizeof(float)*reg->nk;
+  unsigned long long span = (row_size > BOX_REGION_SPAN) ? row_size : BOX_REGION_SPAN;
+  unsigned char *scratch = NULL;
+
+  for (r=0; r<reg->n_rows; r++){
+    // merge the following rows into this read while the gaps are small
+    first = r;
+    begin = box_region_row(reg, r);
+    end = begin + row_size;
+    while ((r+1 < reg->n_rows) && (box_region_row(reg, r+1) - end <= BOX_REGION_GAP) &&
+	   (box_region_row(reg, r+1) + row_size - begin <= span)){
+      r++;
+      end = box_region_row(reg, r) + row_size;
+    }
+    if (fseeko(stream, start + begin, SEEK_SET) != 0){
+      free(scratch);
+      return 0;
+    }
+
+    if (first == r){ // a single row goes straight to the output
+      if (fread(out + first*reg->nk, row_size, 1, stream) != 1){
+	free(scratch);
+	return 0;
+      }
+      continue;
+    }
+    if (!scratch && !(scratch = (unsigned char *) malloc(span)))
+      return 0;
+    if (fread(scratch, end - begin, 1, stream) != 1){
+      free(scratch);
+      return 0;
+    }
+    for (; first<=r; first++)
+      memcpy(out + first*reg->nk, scratch + box_region_row(reg, first) - begin, row_size);
+  }
+  free(scratch);
+  return 1;
+}
+
+/* reads the region from a compressed box (whose magic has already been read), decoding only the chunks it overlaps */
+static size_t box_codec_read_region(float *out, const box_region *reg, FILE *stream){
+  unsigned long long header[2], n_chunks, c, r, q, begin, end, lo, hi, raw, bound, row_size = sizeof(float)*reg->nk;
+  unsigned char *coded, *chunk;
+  unsigned int size;
+  int failed = 0;
+
+  if (fread(header, sizeof(header), 1, stream) != 1)
+    return 0;
+  if ((header[0] != sizeof(float)*reg->d*reg->d*reg->d) || (header[1] == 0)){
+    fprintf(stderr, "mod_fread_region: ERROR: compressed box holds %llu bytes, expected %llu\n", header[0], sizeof(float)*reg->d*reg->d*reg->d);
+    return 0;
+  }
+  n_chunks = (header[0] + header[1] - 1) / header[1];
+  bound = LZ_BOUND(header[1]);
+  coded = (unsigned char *) malloc(bound);
+  chunk = (unsigned char *) malloc(header[1]);
+  if (!coded || !chunk){
+    free(coded); free(chunk);
+    return 0;
+  }
+
+  r = 0; // first row not yet complete
+  for (c=0; (c<n_chunks) && (r<reg->n_rows) && !failed; c++){
+    begin = c*header[1];
+    raw = (begin + header[1] <= header[0]) ? header[1] : header[0] - begin;
+    end = begin + raw;
+    if ((fread(&size, sizeof(unsigned int), 1, stream) != 1) || (size > bound)){
+      failed = 1;
+      break;
+    }
+    if (box_region_row(reg, r) >= end){ // nothing of the region in this chunk
+      if (fseeko(stream, size, SEEK_CUR) != 0)
+	failed = 1;
+      continue;
+    }
+    if ((fread(coded, size, 1, stream) != 1) || (box_codec_decode(coded, size, chunk, raw) != 0)){
+      failed = 1;
+      break;
+    }
+    // copy the parts of the rows that lie in this chunk
+    for (q=r; (q<reg->n_rows) && (box_region_row(reg, q) < end); q++){
+      lo = (box_region_row(reg, q) > begin) ? box_region_row(reg, q) : begin;
+      hi = (box_region_row(reg, q) + row_size < end) ? box_region_row(reg, q) + row_size : end;
+      memcpy((unsigned char *)(out + q*reg->nk) + lo - box_region_row(reg, q), chunk + lo - begin, hi - lo);
+    }
+    while ((r < reg->n_rows) && (box_region_row(reg, r) + row_size <= end))
+      r++;
+  }
+
+  free(coded); free(chunk);
+  if (failed || (r < reg->n_rows)){
+    fprintf(stderr, "mod_fread_region: ERROR: corrupt or truncated compressed box\n");
+    return 0;
+  }
+  return 1;
+}
+
+
+/*
+  Function MOD_FREAD_REGION reads the sub-volume [i0,i0+ni) x [j0,j0+nj) x [k0,k0+nk) of the
+  unpadded d^3 float box (in any of the formats mod_fwrite, lossy_fwrite and sparse_fwrite
+  write) that starts at the current position of stream into out, which must hold ni*nj*nk
+  floats.  Returns 1 on success.
+*/
+static size_t mod_fread_region_unaccounted(float *out, unsigned long long d, unsigned long long i0, unsigned long long ni,
+					   unsigned long long j0, unsigned long long nj, unsigned long long k0, unsigned long long nk, FILE *stream){
+  char magic[sizeof(BOX_CODEC_MAGIC)];
+  unsigned long long r;
+  box_region reg;
+  off_t start;
+  float *box;
+  size_t status;
+
+  if ((i0+ni > d) || (j0+nj > d) || (k0+nk > d)){
+    fprintf(stderr, "mod_fread_region: ERROR: region [%llu,%llu)x[%llu,%llu)x[%llu,%llu) is not within a %llu^3 box\n",
+	    i0, i0+ni, j0, j0+nj, k0, k0+nk, d);
+    return 0;
+  }
+  if (ni*nj*nk == 0)
+    return 1;
+  reg.d = d; reg.i0 = i0; reg.j0 = j0; reg.k0 = k0; reg.nj = nj; reg.nk = nk;
+  reg.n_rows = ni*nj;
+
+  if (((start = ftello(stream)) < 0) || (fread(magic, sizeof(magic), 1, stream) != 1))
+    return 0;
+  if (!memcmp(magic, BOX_CODEC_MAGIC, sizeof(magic)))
+    return box_codec_read_region(out, &reg, stream);
+  if (memcmp(magic, LOSSY_MAGIC, sizeof(magic)) && memcmp(magic, SPARSE_MAGIC, sizeof(magic)))
+    return raw_fread_region(out, &reg, start, stream);
+
+  // no random access into these, decode the whole box
+  if (!(box = (float *) malloc(sizeof(float)*d*d*d)))
+    return 0;
+  status = (fseeko(stream, start, SEEK_SET) == 0) && (mod_fread_unaccounted(box, sizeof(float)*d*d*d, 1, stream) == 1);
+  for (r=0; status && (r<reg.n_rows); r++)
+    memcpy(out + r*nk, (unsigned char *)box + box_region_row(&reg, r), sizeof(float)*nk);
+  free(box);
+  return status;
+}
+
+
+/*
+  Function MOD_FREAD_PADDED reads an unpadded d^3 float box (raw or compressed) and spreads it
+  into the FFT-padded layout of box, which must hold d*d*2*(d/2+1) floats.
+  Returns 1 on success.
+*/
+static size_t mod_fread_padded_unaccounted(float *box, unsigned long long d, FILE *stream){
+  unsigned long long i, j, k, pad = 2*(d/2+1);
+
+  if (mod_fread_unaccounted(box, sizeof(float)*d*d*d, 1, stream) != 1)
+    return 0;
+
+  // working backwards, each cell moves to an index at least as large as its own
+  for (i=d; i-->0;){
+    for (j=d; j-->0;){
+      for (k=d; k-->0;){
+	box[k + pad*(j + d*i)] = box[k + d*(j + d*i)];
+      }
+    }
+  }
+  return 1;
+}
+
+
+/*** Write-behind queue.  Slots cycle FREE -> FILLING (owned by the caller) -> QUEUED -> WRITING
+     (owned by the writer thread) -> FREE, and are written in the order they were submitted ***/
+#define ASYNC_FREE (int) (0)
+#define ASYNC_FILLING (int) (1)
+#define ASYNC_QUEUED (int) (2)
+#define ASYNC_WRITING (int) (3)
+
+static struct {
+  char filename[1000];
+  void *data;
+  unsigned long long size, capacity, seq, slab_len;
+  float max_error; // lossy_fwrite bound, 0 for an exact copy
+  int sparse; // 1 to store with sparse_fwrite
+  int state;
+} async_slot[ASYNC_WRITE_BUFFERS];
+static pthread_t async_thread;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static int async_started = 0, async_filling = -1, async_failures = 0;
+static unsigned long long async_next_seq = 0;
+
+
+static void *async_writer(void *arg){
+  io_account_call call;
+  int i, next, failed;
+  FILE *F;
+
+  (void) arg;
+  pthread_mutex_lock(&async_lock);
+  while (1){
+    // oldest queued buffer
+    next = -1;
+    for (i=0; i<ASYNC_WRITE_BUFFERS; i++){
+      if ((async_slot[i].state == ASYNC_QUEUED) && ((next < 0) || (async_slot[i].seq < async_slot[next].seq)))
+	next = i;
+    }
+    if (next < 0){
+      pthread_cond_wait(&async_cond, &async_lock);
+      continue;
+    }
+    async_slot[next].state = ASYNC_WRITING;
+    pthread_mutex_unlock(&async_lock);
+
+    failed = 0;
+    if (IO_ACCOUNTING)
+      io_account_start(&call, NULL, async_slot[next].filename, "async_writer", 0, 1);
+    if (!(F = box_fopen(async_slot[next].filename, "wb"))){
+      fprintf(stderr, "async_writer: ERROR: unable to open %s for writting\n", async_slot[next].filename);
+      failed = 1;
+    }
+    else{
+      if ((async_slot[next].size > 0) &&
+	  ((async_slot[next].sparse ? sparse_fwrite_unaccounted((float *)async_slot[next].data, async_slot[next].size/sizeof(float), F) :
+	    lossy_fwrite_unaccounted((float *)async_slot[next].data, async_slot[next].size/sizeof(float), async_slot[next].slab_len, async_slot[next].max_error, F)) != 1)){
+	fprintf(stderr, "async_writer: ERROR: write error occured while writting %s\n", async_slot[next].filename);
+	failed = 1;
+      }
+      if ((fflush(F) != 0) || (box_fsync(F) != 0)){
+	fprintf(stderr, "async_writer: ERROR: unable to flush %s to disk\n", async_slot[next].filename);
+	failed = 1;
+      }
+      if (box_fclose(F) != 0)
+	failed = 1;
+    }
+    if (IO_ACCOUNTING)
+      io_account_stop(&call, failed ? 0 : async_slot[next].size);
+
+    pthread_mutex_lock(&async_lock);
+    async_slot[next].state = ASYNC_FREE;
+    async_failures += failed;
+    pthread_cond_broadcast(&async_cond);
+  }
+  return NULL;
+}
+
+
+static void async_write_exit(void){
+  int failed = async_write_flush();
+  if (failed)
+    fprintf(stderr, "async_writer: WARNING: %i box(es) could not be written\n", failed);
+}
+
+
+void *async_write_buffer(const char *filename, unsigned long long size){
+  int i;
+
+  pthread_mutex_lock(&async_lock);
+  if (!async_started){
+    if (pthread_create(&async_thread, NULL, async_writer, NULL) != 0){
+      pthread_mutex_unlock(&async_lock);
+      fprintf(stderr, "async_write_buffer: ERROR: unable to start the writer thread\n");
+      return NULL;
+    }
+    async_started = 1;
+    atexit(async_write_exit);
+  }
+  if (async_filling >= 0){
+    pthread_mutex_unlock(&async_lock);
+    fprintf(stderr, "async_write_buffer: ERROR: buffer for %s was never submitted\n", async_slot[async_filling].filename);
+    return NULL;
+  }
+
+  // wait for a free buffer
+  while (1){
+    for (i=0; i<ASYNC_WRITE_BUFFERS; i++){
+      if (async_slot[i].state == ASYNC_FREE)
+	break;
+    }
+    if (i < ASYNC_WRITE_BUFFERS)
+      break;
+    pthread_cond_wait(&async_cond, &async_lock);
+  }
+
+  if (async_slot[i].capacity < size){
+    free(async_slot[i].data);
+    if (!(async_slot[i].data = malloc(size))){
+      async_slot[i].capacity = 0;
+      pthread_mutex_unlock(&async_lock);
+      fprintf(stderr, "async_write_buffer: ERROR: unable to allocate %llu bytes for %s\n", size, filename);
+      return NULL;
+    }
+    async_slot[i].capacity = size;
+  }
+  strncpy(async_slot[i].filename, filename, sizeof(async_slot[i].filename)-1);
+  async_slot[i].filename[sizeof(async_slot[i].filename)-1] = '\0';
+  async_slot[i].size = size;
+  async_slot[i].slab_len = 0;
+  async_slot[i].max_error = 0;
+  async_slot[i].sparse = 0;
+  async_slot[i].state = ASYNC_FILLING;
+  async_filling = i;
+  pthread_mutex_unlock(&async_lock);
+
+  return async_slot[i].data;
+}
+
+
+int async_write_submit(void){
+  pthread_mutex_lock(&async_lock);
+  if (async_filling < 0){
+    pthread_mutex_unlock(&async_lock);
+    fprintf(stderr, "async_write_submit: ERROR: no buffer to submit\n");
+    return -1;
+  }
+  async_slot[async_filling].state = ASYNC_QUEUED;
+  async_slot[async_filling].seq = async_next_seq++;
+  async_filling = -1;
+  pthread_cond_broadcast(&async_cond);
+  pthread_mutex_unlock(&async_lock);
+  return 0;
+}
+
+
+int async_fwrite(const char *filename, const void *array, unsigned long long size){
+  void *buffer;
+
+  if (!(buffer = async_write_buffer(filename, size)))
+    return -1;
+  memcpy(buffer, array, size);
+  return async_write_submit();
+}
+
+
+/* as async_fwrite, for a box of num floats to be stored with lossy_fwrite */
+int async_fwrite_lossy(const char *filename, const float *box, unsigned long long num, unsigned long long slab_len, float max_error){
+  void *buffer;
+
+  if (!(buffer = async_write_buffer(filename, sizeof(float)*num)))
+    return -1;
+  memcpy(buffer, box, sizeof(float)*num);
+  pthread_mutex_lock(&async_lock);
+  async_slot[async_filling].slab_len = slab_len;
+  async_slot[async_filling].max_error = max_error;
+  pthread_mutex_unlock(&async_lock);
+  return async_write_submit();
+}
+
+
+/* as async_fwrite, for a box of num floats to be stored with sparse_fwrite */
+int async_fwrite_sparse(const char *filename, const float *box, unsigned long long num){
+  void *buffer;
+
+  if (!(buffer = async_write_buffer(filename, sizeof(float)*num)))
+    return -1;
+  memcpy(buffer, box, sizeof(float)*num);
+  pthread_mutex_lock(&async_lock);
+  async_slot[async_filling].sparse = 1;
+  pthread_mutex_unlock(&async_lock);
+  return async_write_submit();
+}
+
+
+/* waits until the queue is empty (call with async_lock held) */
+static void async_write_drain(void){
+  int i, busy;
+
+  do{
+    busy = 0;
+    for (i=0; i<ASYNC_WRITE_BUFFERS; i++){
+      if ((async_slot[i].state == ASYNC_QUEUED) || (async_slot[i].state == ASYNC_WRITING))
+	busy = 1;
+    }
+    if (busy)
+      pthread_cond_wait(&async_cond, &async_lock);
+  } while (busy);
+}
+
+
+/* as async_write_flush, but leaves the failures to be reported by it */
+void async_write_wait(void){
+  pthread_mutex_lock(&async_lock);
+  async_write_drain();
+  pthread_mutex_unlock(&async_lock);
+}
+
+
+int async_write_flush(void){
+  int failed;
+
+  pthread_mutex_lock(&async_lock);
+  async_write_drain();
+  failed = async_failures;
+  async_failures = 0;
+  pthread_mutex_unlock(&async_lock);
+
+  return failed;
+}
+
+
 int compare_floats (const void *a, const void *b)
      {
        const float *da = (const float *) a;
@@ -119,4 +1230,98 @@ FILE *log_open(const char *filename)
   return LOG;
 }
 
+
+/*** The box I/O functions, charged to the I/O accounting (see io_account.c) at the call site
+     <src>:<line> passed in by the macros below.  The I/O that misc.c itself does on behalf of
+     one of them goes through the unaccounted versions above, and so is not counted twice.
+     Without IO_ACCOUNTING they call straight through. ***/
+size_t mod_fread_at(void *array, unsigned long long size, unsigned long long count, FILE *stream, const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return mod_fread_unaccounted(array, size, count, stream);
+  io_account_start(&call, stream, NULL, src, line, 0);
+  ret = mod_fread_unaccounted(array, size, count, stream);
+  io_account_stop(&call, size*count*ret);
+  return ret;
+}
+
+
+size_t mod_fread_padded_at(float *box, unsigned long long d, FILE *stream, const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return mod_fread_padded_unaccounted(box, d, stream);
+  io_account_start(&call, stream, NULL, src, line, 0);
+  ret = mod_fread_padded_unaccounted(box, d, stream);
+  io_account_stop(&call, sizeof(float)*d*d*d*ret);
+  return ret;
+}
+
+
+size_t mod_fread_region_at(float *out, unsigned long long d, unsigned long long i0, unsigned long long ni,
+			   unsigned long long j0, unsigned long long nj, unsigned long long k0, unsigned long long nk, FILE *stream,
+			   const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return mod_fread_region_unaccounted(out, d, i0, ni, j0, nj, k0, nk, stream);
+  io_account_start(&call, stream, NULL, src, line, 0);
+  ret = mod_fread_region_unaccounted(out, d, i0, ni, j0, nj, k0, nk, stream);
+  io_account_stop(&call, sizeof(float)*ni*nj*nk*ret);
+  return ret;
+}
+
+
+size_t mod_fwrite_at(const void *array, unsigned long long size, unsigned long long count, FILE *stream, const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return mod_fwrite_unaccounted(array, size, count, stream);
+  io_account_start(&call, stream, NULL, src, line, 1);
+  ret = mod_fwrite_unaccounted(array, size, count, stream);
+  io_account_stop(&call, size*count*ret);
+  return ret;
+}
+
+
+size_t lossy_fwrite_at(const float *box, unsigned long long num, unsigned long long slab_len, float max_error, FILE *stream,
+		       const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return lossy_fwrite_unaccounted(box, num, slab_len, max_error, stream);
+  io_account_start(&call, stream, NULL, src, line, 1);
+  ret = lossy_fwrite_unaccounted(box, num, slab_len, max_error, stream);
+  io_account_stop(&call, sizeof(float)*num*ret);
+  return ret;
+}
+
+
+size_t sparse_fwrite_at(const float *box, unsigned long long num, FILE *stream, const char *src, int line){
+  io_account_call call;
+  size_t ret;
+
+  if (!IO_ACCOUNTING)
+    return sparse_fwrite_unaccounted(box, num, stream);
+  io_account_start(&call, stream, NULL, src, line, 1);
+  ret = sparse_fwrite_unaccounted(box, num, stream);
+  io_account_stop(&call, sizeof(float)*num*ret);
+  return ret;
+}
+
+/* called by these names, each call is charged to its own call site */
+#define mod_fread(array, size, count, stream) mod_fread_at(array, size, count, stream, __FILE__, __LINE__)
+#define mod_fread_padded(box, d, stream) mod_fread_padded_at(box, d, stream, __FILE__, __LINE__)
+#define mod_fread_region(out, d, i0, ni, j0, nj, k0, nk, stream) \
+  mod_fread_region_at(out, d, i0, ni, j0, nj, k0, nk, stream, __FILE__, __LINE__)
+#define mod_fwrite(array, size, count, stream) mod_fwrite_at(array, size, count, stream, __FILE__, __LINE__)
+#define lossy_fwrite(box, num, slab_len, max_error, stream) lossy_fwrite_at(box, num, slab_len, max_error, stream, __FILE__, __LINE__)
+#define sparse_fwrite(box, num, stream) sparse_fwrite_at(box, num, stream, __FILE__, __LINE__)
+
 #endif
@@ -0,0 +1,747 @@
+#ifndef _RUN_ARCHIVE_
+#define _RUN_ARCHIVE_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+  Single-file run archive.
+
+  With RUN_ARCHIVE set (INIT_PARAMS.H), the boxes and text outputs that a run writes under
+  ../Boxes and ../Output_files are appended as records to one file, RUN_ARCHIVE_FILE, instead of
+  being created as thousands of separate files.  A record is
+
+    RUN_ARCHIVE_RECORD (8 bytes), payload size, redshift, key length, key, payload
+
+  where the key is the file's path relative to the run directory (e.g. Boxes/xH_nohalos_z006.00_
+  nf0.3_..._32_300Mpc).  The record headers form the archive's index: each process reads them
+  once (and then only the records appended since) into memory, splitting every key into
+  (quantity, redshift, parameters), e.g. (Boxes/xH_nohalos, 6.00, nf0.3_..._32_300Mpc).  A later
+  record with the same key supersedes an earlier one.
+
+  Records are appended under an exclusive flock(), so concurrent stages can share the archive.
+  A record is written with a pending tag (RUN_ARCHIVE_PENDING), which the index skips, and its
+  header is fixed up once the payload has been synced to disk; an incomplete record left by a
+  crash is dropped by the next append.
+
+  Programs open boxes with BOX_FOPEN/BOX_FCLOSE in place of fopen/fclose.  Reading returns a
+  stream over the record's payload alone, so that reading to the end of it or seeking from its
+  end behaves as for the file, and accepts shell patterns (e.g. ../Boxes/Ts_z006.00_*_300Mpc),
+  replacing the shell globs the drivers used to pass.  Writing ("w"/"wb") streams the output
+  straight into a new record at the end of the archive, which stays locked until box_fclose; an
+  output opened while the process is already writing one goes to an (unlinked) temporary file
+  next to the archive, and is copied in at box_fclose.  Paths outside ../Boxes and
+  ../Output_files, appends ("a"), and files not found in the archive (e.g. the initial
+  conditions) go to the file system as before.  BOX_FILENO gives the file descriptor and offset
+  behind a box stream, for the direct (parallel, shared memory) I/O of misc.c and shm_store.c.
+*/
+
+#ifndef RUN_ARCHIVE
+#define RUN_ARCHIVE (int) (0)
+#endif
+#ifndef RUN_ARCHIVE_FILE
+#define RUN_ARCHIVE_FILE "../Boxes/run_archive"
+#endif
+#define RUN_ARCHIVE_MAGIC "21cmRA1"
+#define RUN_ARCHIVE_RECORD "21cmREC"
+#define RUN_ARCHIVE_PENDING "21cmTMP" // a record still being written
+#define RUN_ARCHIVE_STREAMS (int) (64) // archived boxes that may be open at once
+
+typedef struct {
+  char tag[8];
+  unsigned long long size; // of the payload
+  double redshift; // -1 if the name carries none
+  unsigned long long key_len;
+} run_archive_header;
+
+typedef struct {
+  const char *key, *quantity, *params;
+  double redshift;
+  off_t offset; // of the payload
+  unsigned long long size;
+} run_archive_entry;
+
+const char *run_archive_key(const char *);
+int run_archive_append(const char *, const void *, unsigned long long);
+int run_archive_find(const char *, run_archive_entry *);
+int run_archive_lookup(const char *, double, const char *, run_archive_entry *);
+int run_archive_list(const char *, FILE *);
+int run_archive_extract(const char *);
+int run_archive_expand(char *);
+FILE *box_fopen(const char *, const char *);
+int box_fclose(FILE *);
+int box_fsync(FILE *);
+int box_fileno(FILE *, off_t *, off_t *);
+
+
+static run_archive_entry *run_archive_index = NULL;
+static unsigned long long run_archive_entries = 0, run_archive_capacity = 0;
+static off_t run_archive_scanned = 0; // end of the last record indexed
+static pthread_mutex_t run_archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+  FILE *F;
+  int write; // 0: reads a record, 1: writes the record being appended, 2: writes a temporary file
+  int fd; // reads: the archive
+  void *map; // reads: the mapping of the record
+  size_t map_len;
+  off_t offset; // reads: of the payload in the archive
+  unsigned long long size; // reads: of the payload
+  char key[1000];
+} run_archive_stream[RUN_ARCHIVE_STREAMS];
+
+// the record being appended by this process; one at a time, as the archive stays locked meanwhile
+static struct {
+  int active, fd;
+  pthread_t owner;
+  off_t offset, payload; // of the record and of its payload
+} run_archive_writer;
+static pthread_cond_t run_archive_writer_done = PTHREAD_COND_INITIALIZER;
+
+
+/*
+  Returns the archive key of <filename> (the path without leading ./ and ../), or NULL if the
+  file does not belong in the archive.
+*/
+static const char *run_archive_strip(const char *filename){
+  while (1){
+    if (!strncmp(filename, "./", 2)) filename += 2;
+    else if (!strncmp(filename, "../", 3)) filename += 3;
+    else return filename;
+  }
+}
+
+const char *run_archive_key(const char *filename){
+  filename = run_archive_strip(filename);
+  if (strncmp(filename, "Boxes/", 6) && strncmp(filename, "Output_files/", 13))
+    return NULL;
+  if (!strcmp(filename, run_archive_strip(RUN_ARCHIVE_FILE)))
+    return NULL;
+  return filename;
+}
+
+
+/* adds a record to the in-memory index, splitting its key into quantity, redshift and parameters */
+static int run_archive_add(const char *key, unsigned long long key_len, double redshift, off_t offset, unsigned long long size){
+  run_archive_entry *e;
+  char *k, *q, *p, *s;
+
+  if (run_archive_entries == run_archive_capacity){
+    run_archive_capacity = run_archive_capacity ? 2*run_archive_capacity : 1024;
+    if (!(e = (run_archive_entry *) realloc(run_archive_index, sizeof(run_archive_entry)*run_archive_capacity)))
+      return -1;
+    run_archive_index = e;
+  }
+  if (!(k = (char *) malloc(2*key_len + 2)))
+    return -1;
+  memcpy(k, key, key_len);
+  k[key_len] = '\0';
+  q = k + key_len + 1;
+  strcpy(q, k);
+
+  // the redshift follows the first "_z" (or e.g. "_zprime") that is followed by a number
+  p = "";
+  for (s=strstr(q, "_z"); s; s=strstr(s+1, "_z")){
+    char *t = s+2;
+    while ((*t >= 'a') && (*t <= 'z')) t++;
+    if ((*t >= '0') && (*t <= '9')){
+      *s = '\0';
+      strtod(t, &p);
+      while (*p == '_') p++;
+      break;
+    }
+  }
+
+  e = run_archive_index + run_archive_entries++;
+  e->key = k;
+  e->quantity = q;
+  e->params = p;
+  e->redshift = redshift;
+  e->offset = offset;
+  e->size = size;
+  return 0;
+}
+
+
+/* the redshift carried by a key, or -1 */
+static double run_archive_redshift(const char *key){
+  const char *s, *t;
+
+  for (s=strstr(key, "_z"); s; s=strstr(s+1, "_z")){
+    t = s+2;
+    while ((*t >= 'a') && (*t <= 'z')) t++;
+    if ((*t >= '0') && (*t <= '9'))
+      return strtod(t, NULL);
+  }
+  return -1;
+}
+
+
+/* indexes the records of the (locked) archive <fd> that have not been indexed yet */
+static int run_archive_scan(int fd){
+  run_archive_header header;
+  struct stat st;
+  char magic[sizeof(RUN_ARCHIVE_MAGIC)], *key;
+
+  if (fstat(fd, &st) != 0)
+    return -1;
+  if (run_archive_scanned == 0){
+    if (st.st_size == 0)
+      return 0;
+    if ((pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) || memcmp(magic, RUN_ARCHIVE_MAGIC, sizeof(magic))){
+      fprintf(stderr, "run_archive: ERROR: %s is not a run archive\n", RUN_ARCHIVE_FILE);
+      return -1;
+    }
+    run_archive_scanned = sizeof(magic);
+  }
+
+  while (run_archive_scanned + (off_t)sizeof(header) <= st.st_size){
+    if ((pread(fd, &header, sizeof(header), run_archive_scanned) != sizeof(header)) ||
+	memcmp(header.tag, RUN_ARCHIVE_RECORD, sizeof(header.tag)) ||
+	(run_archive_scanned + (off_t)(sizeof(header) + header.key_len + header.size) > st.st_size))
+      break; // an incomplete record
+    if (!(key = (char *) malloc(header.key_len + 1)) ||
+	(pread(fd, key, header.key_len, run_archive_scanned + sizeof(header)) != (ssize_t)header.key_len) ||
+	(run_archive_add(key, header.key_len, header.redshift, run_archive_scanned + sizeof(header) + header.key_len, header.size) != 0)){
+      free(key);
+      return -1;
+    }
+    free(key);
+    run_archive_scanned += sizeof(header) + header.key_len + header.size;
+  }
+  return 0;
+}
+
+
+/*
+  brings the in-memory index up to date with the archive on disk (without locking it: complete
+  records never change, and the one being appended is pending until its payload is on disk)
+*/
+static int run_archive_refresh(void){
+  int fd, status;
+
+  if ((fd = open(RUN_ARCHIVE_FILE, O_RDONLY)) < 0)
+    return 0; // nothing archived yet
+  status = run_archive_scan(fd);
+  close(fd);
+  return status;
+}
+
+
+static int run_archive_pwrite(int fd, const void *data, unsigned long long size, off_t offset){
+  ssize_t n;
+
+  while (size > 0){
+    if ((n = pwrite(fd, data, (size > (1llu<<30)) ? (1llu<<30) : size, offset)) <= 0)
+      return -1;
+    data = (const char *)data + n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+
+/*
+  locks the archive and starts the pending record <key> at its end.  If this process is already
+  appending a record, waits for it to be done, or returns 1 at once if <wait> is 0.  Returns 0 on
+  success, -1 otherwise.
+*/
+static int run_archive_begin(const char *key, int wait){
+  run_archive_header header;
+  int fd;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  while (run_archive_writer.active){
+    if (!wait){
+      pthread_mutex_unlock(&run_archive_mutex);
+      return 1;
+    }
+    if (pthread_equal(run_archive_writer.owner, pthread_self())){
+      pthread_mutex_unlock(&run_archive_mutex);
+      fprintf(stderr, "run_archive: ERROR: unable to append %s while %s is being written; close the outputs in the order they were opened\n",
+	      key, RUN_ARCHIVE_FILE);
+      return -1;
+    }
+    pthread_cond_wait(&run_archive_writer_done, &run_archive_mutex);
+  }
+  if ((fd = open(RUN_ARCHIVE_FILE, O_RDWR | O_CREAT, 0644)) < 0){
+    fprintf(stderr, "run_archive: ERROR: unable to open %s\n", RUN_ARCHIVE_FILE);
+    pthread_mutex_unlock(&run_archive_mutex);
+    return -1;
+  }
+  flock(fd, LOCK_EX);
+  if (run_archive_scan(fd) != 0)
+    goto FAIL;
+  if (run_archive_scanned == 0){
+    if (run_archive_pwrite(fd, RUN_ARCHIVE_MAGIC, sizeof(RUN_ARCHIVE_MAGIC), 0) != 0)
+      goto FAIL;
+    run_archive_scanned = sizeof(RUN_ARCHIVE_MAGIC);
+  }
+  // drop whatever an interrupted append left behind
+  if (ftruncate(fd, run_archive_scanned) != 0)
+    goto FAIL;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.tag, RUN_ARCHIVE_PENDING, sizeof(header.tag));
+  header.redshift = run_archive_redshift(key);
+  header.key_len = strlen(key);
+  if ((run_archive_pwrite(fd, &header, sizeof(header), run_archive_scanned) != 0) ||
+      (run_archive_pwrite(fd, key, header.key_len, run_archive_scanned + sizeof(header)) != 0))
+    goto FAIL;
+  run_archive_writer.active = 1;
+  run_archive_writer.fd = fd;
+  run_archive_writer.owner = pthread_self();
+  run_archive_writer.offset = run_archive_scanned;
+  run_archive_writer.payload = run_archive_scanned + sizeof(header) + header.key_len;
+  pthread_mutex_unlock(&run_archive_mutex);
+  return 0;
+
+ FAIL:
+  fprintf(stderr, "run_archive: ERROR: unable to append %s to %s\n", key, RUN_ARCHIVE_FILE);
+  flock(fd, LOCK_UN);
+  close(fd);
+  pthread_mutex_unlock(&run_archive_mutex);
+  return -1;
+}
+
+
+/*
+  completes the pending record <key> with a payload of <size> bytes, syncing it to disk, or drops
+  it if <commit> is 0, and unlocks the archive.  Returns 0 on success, -1 otherwise.
+*/
+static int run_archive_end(const char *key, unsigned long long size, int commit){
+  run_archive_header header;
+  int fd = run_archive_writer.fd, status = -1;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  if (commit){
+    memset(&header, 0, sizeof(header));
+    memcpy(header.tag, RUN_ARCHIVE_RECORD, sizeof(header.tag));
+    header.size = size;
+    header.redshift = run_archive_redshift(key);
+    header.key_len = strlen(key);
+    // the payload reaches the disk before the header that makes it visible
+    if ((fdatasync(fd) == 0) && (run_archive_pwrite(fd, &header, sizeof(header), run_archive_writer.offset) == 0) &&
+	(fdatasync(fd) == 0) && (run_archive_add(key, header.key_len, header.redshift, run_archive_writer.payload, size) == 0)){
+      run_archive_scanned = run_archive_writer.payload + size;
+      status = 0;
+    }
+  }
+  if (status){
+    fprintf(stderr, "run_archive: ERROR: unable to append %s to %s\n", key, RUN_ARCHIVE_FILE);
+    if (ftruncate(fd, run_archive_writer.offset) != 0)
+      fprintf(stderr, "run_archive: WARNING: unable to drop the incomplete record %s\n", key);
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  run_archive_writer.active = 0;
+  pthread_cond_broadcast(&run_archive_writer_done);
+  pthread_mutex_unlock(&run_archive_mutex);
+  return status;
+}
+
+
+/*
+  Function RUN_ARCHIVE_APPEND appends the <size> bytes of <data> to the archive as the record
+  <key>, and syncs it to disk.  Returns 0 on success, -1 otherwise.
+*/
+int run_archive_append(const char *key, const void *data, unsigned long long size){
+  if (run_archive_begin(key, 1) != 0)
+    return -1;
+  return run_archive_end(key, size, run_archive_pwrite(run_archive_writer.fd, data, size, run_archive_writer.payload) == 0);
+}
+
+
+/*
+  Function RUN_ARCHIVE_FIND looks up the latest record whose key matches <pattern> (a key or a
+  shell pattern, see run_archive_key) and copies it to <entry>.  Returns 0 if found, -1 otherwise.
+*/
+int run_archive_find(const char *pattern, run_archive_entry *entry){
+  unsigned long long ct;
+  const char *key = run_archive_key(pattern);
+  int status = -1;
+
+  if (!key)
+    return -1;
+  pthread_mutex_lock(&run_archive_mutex);
+  if (run_archive_refresh() == 0){
+    for (ct=run_archive_entries; ct-->0;){
+      if (!fnmatch(key, run_archive_index[ct].key, FNM_PATHNAME)){
+	*entry = run_archive_index[ct];
+	status = 0;
+	break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&run_archive_mutex);
+  return status;
+}
+
+
+/*
+  Function RUN_ARCHIVE_LOOKUP looks up the latest record of <quantity> (e.g. Boxes/xH_nohalos) at
+  <redshift> (to the two decimals of the file names) whose parameters match the shell pattern
+  <params>.  Returns 0 if found, -1 otherwise.
+*/
+int run_archive_lookup(const char *quantity, double redshift, const char *params, run_archive_entry *entry){
+  unsigned long long ct;
+  int status = -1;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  if (run_archive_refresh() == 0){
+    for (ct=run_archive_entries; ct-->0;){
+      if (!strcmp(quantity, run_archive_index[ct].quantity) && (fabs(redshift - run_archive_index[ct].redshift) < 0.005) &&
+	  !fnmatch(params, run_archive_index[ct].params, 0)){
+	*entry = run_archive_index[ct];
+	status = 0;
+	break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&run_archive_mutex);
+  return status;
+}
+
+
+static int run_archive_compare_keys(const void *a, const void *b){
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* collects the distinct keys matching <pattern>, sorted; the caller frees the array */
+static unsigned long long run_archive_match(const char *pattern, const char ***keys){
+  unsigned long long ct, n=0, n_unique=0;
+  const char *key = run_archive_key(pattern);
+
+  *keys = NULL;
+  if (!key || (run_archive_refresh() != 0))
+    return 0;
+  if (!(*keys = (const char **) malloc(sizeof(char *)*(run_archive_entries+1))))
+    return 0;
+  for (ct=0; ct<run_archive_entries; ct++){
+    if (!fnmatch(key, run_archive_index[ct].key, FNM_PATHNAME))
+      (*keys)[n++] = run_archive_index[ct].key;
+  }
+  qsort(*keys, n, sizeof(char *), run_archive_compare_keys);
+  for (ct=0; ct<n; ct++){
+    if (!n_unique || strcmp((*keys)[ct], (*keys)[n_unique-1]))
+      (*keys)[n_unique++] = (*keys)[ct];
+  }
+  return n_unique;
+}
+
+
+/*
+  Function RUN_ARCHIVE_LIST writes the paths (as ../<key>) of the archived files matching
+  <pattern> to <out>, one per line in alphabetical order, like ls.  Returns the number listed.
+*/
+int run_archive_list(const char *pattern, FILE *out){
+  unsigned long long ct, n;
+  const char **keys;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  n = run_archive_match(pattern, &keys);
+  for (ct=0; ct<n; ct++)
+    fprintf(out, "../%s\n", keys[ct]);
+  free(keys);
+  pthread_mutex_unlock(&run_archive_mutex);
+  return n;
+}
+
+
+/*
+  Function RUN_ARCHIVE_EXTRACT writes the latest version of every archived file matching
+  <pattern> back to the file system (as ../<key>).  Returns the number extracted, or -1 on error.
+*/
+int run_archive_extract(const char *pattern){
+  unsigned long long ct, n;
+  const char **keys;
+  char filename[1000], *buffer;
+  run_archive_entry entry;
+  FILE *IN, *OUT;
+  int extracted = 0;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  n = run_archive_match(pattern, &keys);
+  pthread_mutex_unlock(&run_archive_mutex);
+  for (ct=0; (ct<n) && (extracted >= 0); ct++){
+    sprintf(filename, "../%s", keys[ct]);
+    if (run_archive_find(filename, &entry) != 0)
+      continue;
+    buffer = (char *) malloc(entry.size + 1);
+    IN = fopen(RUN_ARCHIVE_FILE, "rb");
+    OUT = fopen(filename, "wb");
+    if (!buffer || !IN || !OUT || (fseeko(IN, entry.offset, SEEK_SET) != 0) ||
+	(fread(buffer, 1, entry.size, IN) != entry.size) || (fwrite(buffer, 1, entry.size, OUT) != entry.size)){
+      fprintf(stderr, "run_archive: ERROR: unable to extract %s\n", filename);
+      extracted = -1;
+    }
+    else
+      extracted++;
+    if (IN) fclose(IN);
+    if (OUT) fclose(OUT);
+    free(buffer);
+  }
+  free(keys);
+  return extracted;
+}
+
+
+/*
+  Function RUN_ARCHIVE_EXPAND replaces the shell pattern in <filename> by the path of the latest
+  archived file it matches, as the shell would have expanded it on disk (for programs that parse
+  parameters out of their arguments).  Returns 0 if a match was found, -1 otherwise.
+*/
+int run_archive_expand(char *filename){
+  run_archive_entry entry;
+  const char *key = run_archive_key(filename);
+
+  if (!key || (run_archive_find(filename, &entry) != 0))
+    return -1;
+  strcpy((char *)key, entry.key);
+  return 0;
+}
+
+
+/* a free slot of run_archive_stream (call with the mutex held), or -1 */
+static int run_archive_slot(void){
+  int i;
+
+  for (i=0; (i<RUN_ARCHIVE_STREAMS) && run_archive_stream[i].F; i++);
+  return (i < RUN_ARCHIVE_STREAMS) ? i : -1;
+}
+
+
+/* a stream over the payload of the archived record <entry> */
+static FILE *run_archive_fopen_record(const run_archive_entry *entry){
+  off_t start = entry->offset / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+  void *map = MAP_FAILED;
+  size_t map_len = entry->offset - start + entry->size;
+  FILE *F = NULL;
+  int i, fd;
+
+  if ((fd = open(RUN_ARCHIVE_FILE, O_RDONLY)) < 0)
+    return NULL;
+  if (entry->size == 0)
+    F = fopen("/dev/null", "rb");
+  else if ((map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, start)) != MAP_FAILED)
+    F = fmemopen((char *)map + (entry->offset - start), entry->size, "rb");
+  pthread_mutex_lock(&run_archive_mutex);
+  if (!F || ((i = run_archive_slot()) < 0)){
+    pthread_mutex_unlock(&run_archive_mutex);
+    if (F) fclose(F);
+    if (map != MAP_FAILED) munmap(map, map_len);
+    close(fd);
+    return NULL;
+  }
+  run_archive_stream[i].F = F;
+  run_archive_stream[i].write = 0;
+  run_archive_stream[i].fd = fd;
+  run_archive_stream[i].map = (map != MAP_FAILED) ? map : NULL;
+  run_archive_stream[i].map_len = map_len;
+  run_archive_stream[i].offset = entry->offset;
+  run_archive_stream[i].size = entry->size;
+  pthread_mutex_unlock(&run_archive_mutex);
+  return F;
+}
+
+
+/* a stream writing the record <key>, straight into the archive or through a temporary file */
+static FILE *run_archive_fopen_output(const char *key, const char *mode){
+  char spill[1000];
+  FILE *F = NULL;
+  int i, fd, write = 1;
+
+  if (strlen(key) >= sizeof(run_archive_stream[0].key))
+    return NULL;
+  switch (run_archive_begin(key, 0)){
+  case 0:
+    if (((fd = dup(run_archive_writer.fd)) < 0) || !(F = fdopen(fd, mode)) || (fseeko(F, run_archive_writer.payload, SEEK_SET) != 0)){
+      if (F) fclose(F); else if (fd >= 0) close(fd);
+      run_archive_end(key, 0, 0);
+      return NULL;
+    }
+    break;
+  case 1: // already appending another record
+    write = 2;
+    sprintf(spill, "%s.XXXXXX", RUN_ARCHIVE_FILE);
+    if ((fd = mkstemp(spill)) < 0)
+      return NULL;
+    unlink(spill);
+    if (!(F = fdopen(fd, mode))){
+      close(fd);
+      return NULL;
+    }
+    break;
+  default:
+    return NULL;
+  }
+
+  pthread_mutex_lock(&run_archive_mutex);
+  if ((i = run_archive_slot()) < 0){
+    pthread_mutex_unlock(&run_archive_mutex);
+    fclose(F);
+    if (write == 1)
+      run_archive_end(key, 0, 0);
+    return NULL;
+  }
+  run_archive_stream[i].F = F;
+  run_archive_stream[i].write = write;
+  strcpy(run_archive_stream[i].key, key);
+  pthread_mutex_unlock(&run_archive_mutex);
+  return F;
+}
+
+
+/* copies the temporary file <fd> into the archive as the record <key> */
+static int run_archive_append_spill(const char *key, int fd){
+  unsigned long long size, done, n;
+  struct stat st;
+  char *buffer;
+  int status;
+
+  if ((fstat(fd, &st) != 0) || !(buffer = (char *) malloc(1llu<<24)))
+    return -1;
+  if (run_archive_begin(key, 1) != 0){
+    free(buffer);
+    return -1;
+  }
+  size = st.st_size;
+  for (done=0, status=1; status && (done<size); done+=n){
+    n = (size - done > (1llu<<24)) ? (1llu<<24) : (size - done);
+    status = (pread(fd, buffer, n, done) == (ssize_t)n) &&
+      (run_archive_pwrite(run_archive_writer.fd, buffer, n, run_archive_writer.payload + done) == 0);
+  }
+  free(buffer);
+  return run_archive_end(key, size, status);
+}
+
+
+/*
+  Function BOX_FOPEN opens <filename> with <mode>, through the run archive when RUN_ARCHIVE is set
+  (see above).  Close the stream with box_fclose.
+*/
+FILE *box_fopen(const char *filename, const char *mode){
+  run_archive_entry entry;
+  const char *key;
+  FILE *F;
+
+  if (!RUN_ARCHIVE || !(key = run_archive_key(filename)))
+    F = fopen(filename, mode);
+  else if (mode[0] == 'r')
+    F = (run_archive_find(filename, &entry) == 0) ? run_archive_fopen_record(&entry) : fopen(filename, mode);
+  else if (mode[0] == 'w'){
+    if (!(F = run_archive_fopen_output(key, mode)))
+      fprintf(stderr, "run_archive: ERROR: unable to open %s for writting\n", filename);
+  }
+  else
+    F = fopen(filename, mode);
+
+  if (IO_ACCOUNTING && F)
+    io_account_name(F, filename); // rather than the archive's
+  return F;
+}
+
+
+/*
+  Function BOX_FCLOSE closes a stream opened with box_fopen; output written to the archive is
+  completed (and synced) here.  Returns 0 on success, EOF otherwise.
+*/
+int box_fclose(FILE *F){
+  char key[1000];
+  struct stat st;
+  int i, write, fd, status;
+
+  if (IO_ACCOUNTING)
+    io_account_name(F, NULL);
+  pthread_mutex_lock(&run_archive_mutex);
+  for (i=0; (i<RUN_ARCHIVE_STREAMS) && (run_archive_stream[i].F != F); i++);
+  pthread_mutex_unlock(&run_archive_mutex);
+  if (!F || (i == RUN_ARCHIVE_STREAMS))
+    return fclose(F);
+
+  write = run_archive_stream[i].write;
+  strcpy(key, run_archive_stream[i].key);
+  if (write == 0){
+    status = fclose(F);
+    if (run_archive_stream[i].map)
+      munmap(run_archive_stream[i].map, run_archive_stream[i].map_len);
+    close(run_archive_stream[i].fd);
+  }
+  else if (write == 1){
+    // the archive ends with this record's payload
+    status = fclose(F);
+    if (fstat(run_archive_writer.fd, &st) != 0){
+      status = EOF;
+      st.st_size = run_archive_writer.payload;
+    }
+    if (run_archive_end(key, st.st_size - run_archive_writer.payload, status == 0) != 0)
+      status = EOF;
+  }
+  else {
+    fd = dup(fileno(F));
+    status = fclose(F);
+    if ((fd < 0) || (status != 0) || (run_archive_append_spill(key, fd) != 0))
+      status = EOF;
+    if (fd >= 0)
+      close(fd);
+  }
+
+  pthread_mutex_lock(&run_archive_mutex);
+  run_archive_stream[i].F = NULL;
+  pthread_mutex_unlock(&run_archive_mutex);
+  return status;
+}
+
+
+/* fsync for a stream from box_fopen (archive records are synced when completed) */
+int box_fsync(FILE *F){
+  int i;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  for (i=0; (i<RUN_ARCHIVE_STREAMS) && (run_archive_stream[i].F != F); i++);
+  pthread_mutex_unlock(&run_archive_mutex);
+  if (i < RUN_ARCHIVE_STREAMS)
+    return 0;
+  if ((fsync(fileno(F)) != 0) && (errno != EINVAL))
+    return -1;
+  return 0;
+}
+
+
+/*
+  Function BOX_FILENO returns the file descriptor behind a stream from box_fopen (or any stream),
+  with the offsets in that file of the stream's start (*start) and end (*end, -1 if the stream
+  may grow), or -1 if it has none.  For an archived box these are the bounds of its record.
+*/
+int box_fileno(FILE *F, off_t *start, off_t *end){
+  int i, fd;
+
+  pthread_mutex_lock(&run_archive_mutex);
+  for (i=0; (i<RUN_ARCHIVE_STREAMS) && ((run_archive_stream[i].F != F) || run_archive_stream[i].write); i++);
+  if (i < RUN_ARCHIVE_STREAMS){
+    fd = run_archive_stream[i].fd;
+    *start = run_archive_stream[i].offset;
+    *end = run_archive_stream[i].offset + run_archive_stream[i].size;
+  }
+  else {
+    fd = fileno(F);
+    *start = 0;
+    *end = -1;
+  }
+  pthread_mutex_unlock(&run_archive_mutex);
+  return fd;
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef _SHM_STORE_
+#define _SHM_STORE_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+  Node-local shared-memory box store.
+
+  With SHM_BOX_STORE set (INIT_PARAMS.H), stages attach to large read-only input boxes (e.g. the
+  DIM^3 linear density field) with shm_box_attach instead of reading them into private memory.
+  The first process on the node to ask for a box loads it (with mod_fread, so in any format)
+  into a POSIX shared-memory segment; every other process maps the same pages, so N concurrent
+  jobs reading the same box hold one copy of it.  Boxes are mapped read-only, so only boxes that
+  a stage never modifies can be shared: the DIM^3 density boxes of find_halos and perturb_field.
+  (perturb_field scales its HII_DIM velocity boxes in place, so it still reads private copies.)
+
+  A segment is named after the box's key: the device, inode, modification time and size of the
+  file it is read from, and the box's offset in it (for boxes held in the run archive), so a box
+  that is written again gets a new segment.  The segment is a page holding an shm_box_header,
+  followed by the box.
+
+  The loader holds an exclusive flock() on the segment until the box is in place; the others
+  wait for it with a shared one, and keep it while attached.  The kernel thus does the
+  reference counting: the process that detaches last (the one that can upgrade to an exclusive
+  lock) removes the segment, unless SHM_BOX_KEEP is set, in which case it stays for later stages
+  (remove such segments with rm /dev/shm/21cm_box_*).  Locks of processes that die are released.
+*/
+
+#ifndef SHM_BOX_STORE
+#define SHM_BOX_STORE (int) (0)
+#endif
+#ifndef SHM_BOX_KEEP
+#define SHM_BOX_KEEP (int) (0)
+#endif
+#define SHM_BOX_MAGIC "21cmSHM"
+#define SHM_BOX_PREFIX "/21cm_box_"
+#define SHM_BOX_HEADER (unsigned long long) (4096) // bytes before the box, keeps it page aligned
+#define SHM_BOX_ATTACHED (int) (64) // boxes a process may have attached at once
+#define SHM_BOX_RETRIES (int) (10000) // 1ms waits for a segment that is being created
+
+typedef struct {
+  char magic[8];
+  unsigned long long size; // of the box
+  int ready; // set once the box is loaded
+  char filename[1000]; // the box it was loaded from
+} shm_box_header;
+
+const void *shm_box_attach(const char *, unsigned long long);
+int shm_box_detach(const void *);
+
+
+static struct {
+  void *map;
+  unsigned long long length;
+  int fd;
+  char name[64];
+} shm_box_attached[SHM_BOX_ATTACHED];
+static int shm_box_exit_registered = 0;
+static pthread_mutex_t shm_box_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void shm_box_detach_all(void){
+  int i;
+
+  for (i=0; i<SHM_BOX_ATTACHED; i++){
+    if (shm_box_attached[i].map)
+      shm_box_detach((char *)shm_box_attached[i].map + SHM_BOX_HEADER);
+  }
+}
+
+
+/* the segment name of the box at the current position of F */
+static int shm_box_name(FILE *F, unsigned long long size, char *name){
+  unsigned long long key[6], h = 1469598103934665603llu;
+  unsigned char *c = (unsigned char *)key;
+  struct stat st;
+  off_t offset, start, end;
+  size_t i;
+  int fd;
+
+  if (((fd = box_fileno(F, &start, &end)) < 0) || (fstat(fd, &st) != 0) || ((offset = ftello(F)) < 0))
+    return -1;
+  offset += start;
+  key[0] = st.st_dev; key[1] = st.st_ino; key[2] = st.st_mtime;
+  key[3] = st.st_size; key[4] = offset; key[5] = size;
+  for (i=0; i<sizeof(key); i++) // FNV-1a
+    h = (h ^ c[i])*1099511628211llu;
+  sprintf(name, "%s%016llx", SHM_BOX_PREFIX, h);
+  return 0;
+}
+
+
+/* creates the segment <name> and loads the box into it; returns the fd (shared-locked) or -1 */
+static int shm_box_create(const char *name, const char *filename, unsigned long long size, FILE *F){
+  unsigned long long length = SHM_BOX_HEADER + size;
+  shm_box_header *header;
+  void *map;
+  int fd;
+
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+    return -1;
+  if ((flock(fd, LOCK_EX) != 0) || (ftruncate(fd, length) != 0) ||
+      ((map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)){
+    fprintf(stderr, "shm_box_attach: ERROR: unable to create a shared-memory segment of %llu bytes for %s\n", length, filename);
+    shm_unlink(name);
+    close(fd);
+    errno = EIO;
+    return -1;
+  }
+  if (mod_fread((char *)map + SHM_BOX_HEADER, size, 1, F) != 1){
+    fprintf(stderr, "shm_box_attach: ERROR: read error occured while reading %s\n", filename);
+    munmap(map, length);
+    shm_unlink(name);
+    close(fd);
+    errno = EIO;
+    return -1;
+  }
+  header = (shm_box_header *)map;
+  memcpy(header->magic, SHM_BOX_MAGIC, sizeof(header->magic));
+  header->size = size;
+  strncpy(header->filename, filename, sizeof(header->filename)-1);
+  header->ready = 1;
+  munmap(map, length);
+  flock(fd, LOCK_SH); // let the others in
+  return fd;
+}
+
+
+/*
+  Function SHM_BOX_ATTACH returns the box of <size> bytes stored in <filename>, from the node's
+  shared-memory store (loading it there first, if no other process has).  The box is read-only.
+  Returns NULL on failure; release the box with shm_box_detach.
+*/
+const void *shm_box_attach(const char *filename, unsigned long long size){
+  unsigned long long length = SHM_BOX_HEADER + size;
+  const shm_box_header *header;
+  struct stat st;
+  char name[64];
+  void *map = MAP_FAILED;
+  int fd = -1, i, try;
+  FILE *F;
+
+  if (!(F = box_fopen(filename, "rb"))){
+    fprintf(stderr, "shm_box_attach: ERROR: unable to open %s for reading\n", filename);
+    return NULL;
+  }
+  if (shm_box_name(F, size, name) != 0){
+    fprintf(stderr, "shm_box_attach: ERROR: %s can not be shared\n", filename);
+    box_fclose(F);
+    return NULL;
+  }
+
+  for (try=0; try<SHM_BOX_RETRIES; try++){
+    if ((fd = shm_box_create(name, filename, size, F)) >= 0)
+      break;
+    if (errno != EEXIST){
+      box_fclose(F);
+      return NULL;
+    }
+    // someone else has created it; wait until it is loaded
+    if ((fd = shm_open(name, O_RDONLY, 0)) >= 0){
+      if ((flock(fd, LOCK_SH) == 0) && (fstat(fd, &st) == 0) && ((unsigned long long)st.st_size == length) &&
+	  ((map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED)){
+	header = (const shm_box_header *)map;
+	if (header->ready && !memcmp(header->magic, SHM_BOX_MAGIC, sizeof(header->magic)) && (header->size == size))
+	  break;
+	munmap(map, length);
+	map = MAP_FAILED;
+      }
+      close(fd);
+      fd = -1;
+    }
+    usleep(1000); // between its creation and its loader taking the lock, or its loader failed
+  }
+  box_fclose(F);
+  if (fd < 0){
+    fprintf(stderr, "shm_box_attach: ERROR: timed out waiting for the shared copy of %s\n", filename);
+    return NULL;
+  }
+  if ((map == MAP_FAILED) && ((map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)){
+    fprintf(stderr, "shm_box_attach: ERROR: unable to map the shared copy of %s\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&shm_box_mutex);
+  for (i=0; (i<SHM_BOX_ATTACHED) && shm_box_attached[i].map; i++);
+  if (i == SHM_BOX_ATTACHED){
+    pthread_mutex_unlock(&shm_box_mutex);
+    fprintf(stderr, "shm_box_attach: ERROR: more than %i boxes attached\n", SHM_BOX_ATTACHED);
+    munmap(map, length);
+    close(fd);
+    return NULL;
+  }
+  shm_box_attached[i].map = map;
+  shm_box_attached[i].length = length;
+  shm_box_attached[i].fd = fd;
+  strcpy(shm_box_attached[i].name, name);
+  if (!shm_box_exit_registered){
+    shm_box_exit_registered = 1;
+    atexit(shm_box_detach_all);
+  }
+  pthread_mutex_unlock(&shm_box_mutex);
+
+  return (char *)map + SHM_BOX_HEADER;
+}
+
+
+/*
+  Function SHM_BOX_DETACH releases a box returned by shm_box_attach, removing its segment if no
+  other process is attached (and SHM_BOX_KEEP is not set).  Returns 0 on success, -1 otherwise.
+*/
+int shm_box_detach(const void *box){
+  int i;
+
+  pthread_mutex_lock(&shm_box_mutex);
+  for (i=0; (i<SHM_BOX_ATTACHED) && (!shm_box_attached[i].map ||
+				     ((char *)shm_box_attached[i].map + SHM_BOX_HEADER != (const char *)box)); i++);
+  if (i == SHM_BOX_ATTACHED){
+    pthread_mutex_unlock(&shm_box_mutex);
+    fprintf(stderr, "shm_box_detach: ERROR: box is not attached\n");
+    return -1;
+  }
+  munmap(shm_box_attached[i].map, shm_box_attached[i].length);
+  if (!SHM_BOX_KEEP && (flock(shm_box_attached[i].fd, LOCK_EX | LOCK_NB) == 0))
+    shm_unlink(shm_box_attached[i].name);
+  close(shm_box_attached[i].fd);
+  shm_box_attached[i].map = NULL;
+  pthread_mutex_unlock(&shm_box_mutex);
+  return 0;
+}
+
+#endif
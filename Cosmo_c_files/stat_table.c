@@ -0,0 +1,393 @@
+#ifndef _STAT_TABLE_
+#define _STAT_TABLE_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+  Binary multi-redshift tables, for the statistics the programs write besides boxes (power
+  spectra, global histories, halo mass functions).
+
+  A table has a fixed set of typed columns and of per-block attributes, and holds one block per
+  redshift (appended by the stage that computes it).  The file layout is:
+
+    STAT_TABLE_MAGIC (8 bytes)
+    length of the column list, column list, e.g. "k:f8,power:f8,n_modes:i8" (8 bytes each + text)
+    length of the attribute list, attribute list, e.g. "nf,aveTb" (attributes are doubles)
+    blocks:
+      STAT_TABLE_BLOCK (8 bytes), number of rows n (8 bytes), redshift (double),
+      the attributes (doubles), then each column in turn (n values of its type)
+
+  Column types are f4 (float), f8 (double) and i8 (long long), all in native byte order.  A later
+  block with the same redshift supersedes an earlier one.
+
+  Blocks are appended under an exclusive flock(), so concurrent stages can share a table; an
+  incomplete block left by a crash is dropped by the next append.  read_stat_table reads a table
+  back with every column converted to double; Pics/stat_table.py reads it from Python.
+*/
+
+#define STAT_TABLE_MAGIC "21cmTB1"
+#define STAT_TABLE_BLOCK "21cmBLK"
+#define STAT_TABLE_MAX_COLUMNS (int) (64) // columns or attributes
+#define STAT_TABLE_NAME_LEN (int) (32)
+
+typedef struct {
+  int n_columns, n_attributes;
+  char column_name[STAT_TABLE_MAX_COLUMNS][STAT_TABLE_NAME_LEN];
+  char column_type[STAT_TABLE_MAX_COLUMNS][4];
+  char attribute_name[STAT_TABLE_MAX_COLUMNS][STAT_TABLE_NAME_LEN];
+  unsigned long long n_blocks, n_rows;
+  double *redshift; // of each block
+  double *attribute; // attribute a of block b is attribute[b*n_attributes + a]
+  unsigned long long *block_start; // rows block_start[b] ... block_start[b+1]-1 are block b's
+  double *column[STAT_TABLE_MAX_COLUMNS]; // n_rows values each
+} stat_table;
+
+int stat_table_append(const char *, const char *, const char *, double, const double *, unsigned long long, const void * const *);
+int read_stat_table(const char *, stat_table *);
+int stat_table_column(const stat_table *, const char *);
+int stat_table_attribute(const stat_table *, const char *);
+void free_stat_table(stat_table *);
+
+
+/* splits a comma-separated list of <name>[:<type>] into <names> (and <types>); returns the count, or -1 */
+static int stat_table_parse(const char *list, char names[][STAT_TABLE_NAME_LEN], char types[][4]){
+  const char *p = list, *end, *colon;
+  int n = 0;
+
+  while (*p){
+    if (n == STAT_TABLE_MAX_COLUMNS)
+      return -1;
+    if (!(end = strchr(p, ',')))
+      end = p + strlen(p);
+    colon = memchr(p, ':', end-p);
+    if (!colon)
+      colon = end;
+    if ((colon == p) || (colon-p >= STAT_TABLE_NAME_LEN))
+      return -1;
+    memcpy(names[n], p, colon-p);
+    names[n][colon-p] = '\0';
+    if (types){
+      if ((end-colon != 3) || (strncmp(colon+1, "f4", 2) && strncmp(colon+1, "f8", 2) && strncmp(colon+1, "i8", 2)))
+	return -1;
+      memcpy(types[n], colon+1, 2);
+      types[n][2] = '\0';
+    }
+    n++;
+    p = *end ? end+1 : end;
+  }
+  return n;
+}
+
+
+static unsigned long long stat_table_type_size(const char *type){
+  return (type[1] == '4') ? 4 : 8;
+}
+
+
+/*
+  Parses the header of the <size> byte table image <data> into <table>, and returns the offset
+  of the first block (0 if the header is incomplete, -1 if it is not a table).
+*/
+static long long stat_table_header(const unsigned char *data, unsigned long long size, stat_table *table){
+  unsigned long long len[2], offset = sizeof(STAT_TABLE_MAGIC);
+  char list[2][4096];
+  int i;
+
+  if (size < sizeof(STAT_TABLE_MAGIC))
+    return 0;
+  if (memcmp(data, STAT_TABLE_MAGIC, sizeof(STAT_TABLE_MAGIC)))
+    return -1;
+  for (i=0; i<2; i++){
+    if (offset + sizeof(unsigned long long) > size)
+      return 0;
+    memcpy(&len[i], data+offset, sizeof(unsigned long long));
+    offset += sizeof(unsigned long long);
+    if (len[i] >= sizeof(list[i]))
+      return -1;
+    if (offset + len[i] > size)
+      return 0;
+    memcpy(list[i], data+offset, len[i]);
+    list[i][len[i]] = '\0';
+    offset += len[i];
+  }
+  memset(table, 0, sizeof(stat_table));
+  if (((table->n_columns = stat_table_parse(list[0], table->column_name, table->column_type)) < 0) ||
+      ((table->n_attributes = stat_table_parse(list[1], table->attribute_name, NULL)) < 0))
+    return -1;
+  return offset;
+}
+
+
+/* the size of the block at <data> (at most <size> bytes available), or 0 if it is incomplete */
+static unsigned long long stat_table_block_size(const unsigned char *data, unsigned long long size, const stat_table *table){
+  unsigned long long n_rows, block = 2*sizeof(unsigned long long) + sizeof(double)*(1 + table->n_attributes);
+  int c;
+
+  if ((size < block) || memcmp(data, STAT_TABLE_BLOCK, sizeof(STAT_TABLE_BLOCK)))
+    return 0;
+  memcpy(&n_rows, data + sizeof(STAT_TABLE_BLOCK), sizeof(unsigned long long));
+  for (c=0; c<table->n_columns; c++)
+    block += n_rows*stat_table_type_size(table->column_type[c]);
+  return (block <= size) ? block : 0;
+}
+
+
+/* reads the whole file <fd> into memory */
+static unsigned char *stat_table_load(int fd, unsigned long long *size){
+  unsigned char *data;
+  struct stat st;
+  ssize_t n;
+  unsigned long long done = 0, file_size;
+
+  *size = 0;
+  if (fstat(fd, &st) != 0)
+    return NULL;
+  file_size = (unsigned long long) st.st_size;
+  if (!(data = (unsigned char *) malloc(file_size + 1)))
+    return NULL;
+  while (done < file_size){
+    if ((n = pread(fd, data + done, file_size - done, done)) <= 0){
+      free(data);
+      return NULL;
+    }
+    done += n;
+  }
+  *size = done;
+  return data;
+}
+
+
+/*
+  Function STAT_TABLE_APPEND appends a block of <n_rows> rows at <redshift> to the table
+  <filename>, creating it if needed.  <columns> and <attributes> are the comma-separated column
+  (name:type) and attribute lists, which must match those of an existing table; <attribute_values>
+  holds one double per attribute, and data[c] points to the n_rows values of column c.
+  Returns 0 on success, -1 otherwise.
+*/
+int stat_table_append(const char *filename, const char *columns, const char *attributes, double redshift,
+		      const double *attribute_values, unsigned long long n_rows, const void * const *data){
+  unsigned long long size, len, offset, block_size, end;
+  unsigned char *existing = NULL, *block = NULL, *p;
+  stat_table table, check;
+  long long start;
+  int fd, c, status = -1;
+
+  memset(&table, 0, sizeof(stat_table));
+  if (((table.n_columns = stat_table_parse(columns, table.column_name, table.column_type)) < 0) ||
+      ((table.n_attributes = stat_table_parse(attributes, table.attribute_name, NULL)) < 0)){
+    fprintf(stderr, "stat_table_append: ERROR: bad column (%s) or attribute (%s) list\n", columns, attributes);
+    return -1;
+  }
+  if ((fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0){
+    fprintf(stderr, "stat_table_append: ERROR: unable to open %s\n", filename);
+    return -1;
+  }
+  flock(fd, LOCK_EX);
+  if (!(existing = stat_table_load(fd, &size)))
+    goto UNLOCK;
+
+  // write the header of a new table, or check that of the existing one and find its last block
+  if ((start = (size > 0) ? stat_table_header(existing, size, &check) : 0) < 0){
+    fprintf(stderr, "stat_table_append: ERROR: %s is not a statistics table\n", filename);
+    goto UNLOCK;
+  }
+  if (start == 0){
+    offset = 0;
+    if (run_archive_pwrite(fd, STAT_TABLE_MAGIC, sizeof(STAT_TABLE_MAGIC), offset) != 0)
+      goto UNLOCK;
+    offset += sizeof(STAT_TABLE_MAGIC);
+    len = strlen(columns);
+    if ((run_archive_pwrite(fd, &len, sizeof(len), offset) != 0) || (run_archive_pwrite(fd, columns, len, offset+sizeof(len)) != 0))
+      goto UNLOCK;
+    offset += sizeof(len) + len;
+    len = strlen(attributes);
+    if ((run_archive_pwrite(fd, &len, sizeof(len), offset) != 0) || (run_archive_pwrite(fd, attributes, len, offset+sizeof(len)) != 0))
+      goto UNLOCK;
+    end = offset + sizeof(len) + len;
+  }
+  else{
+    if ((check.n_columns != table.n_columns) || (check.n_attributes != table.n_attributes) ||
+	memcmp(check.column_name, table.column_name, sizeof(table.column_name[0])*table.n_columns) ||
+	memcmp(check.column_type, table.column_type, sizeof(table.column_type[0])*table.n_columns) ||
+	memcmp(check.attribute_name, table.attribute_name, sizeof(table.attribute_name[0])*table.n_attributes)){
+      fprintf(stderr, "stat_table_append: ERROR: %s has different columns\n", filename);
+      goto UNLOCK;
+    }
+    for (end=start; (block_size = stat_table_block_size(existing+end, size-end, &table)) > 0; end += block_size);
+  }
+  // drop whatever an interrupted append left behind
+  if (ftruncate(fd, end) != 0)
+    goto UNLOCK;
+
+  // the block
+  block_size = 2*sizeof(unsigned long long) + sizeof(double)*(1 + table.n_attributes);
+  for (c=0; c<table.n_columns; c++)
+    block_size += n_rows*stat_table_type_size(table.column_type[c]);
+  if (!(block = (unsigned char *) malloc(block_size)))
+    goto UNLOCK;
+  p = block;
+  memcpy(p, STAT_TABLE_BLOCK, sizeof(STAT_TABLE_BLOCK)); p += sizeof(STAT_TABLE_BLOCK);
+  memcpy(p, &n_rows, sizeof(n_rows)); p += sizeof(n_rows);
+  memcpy(p, &redshift, sizeof(double)); p += sizeof(double);
+  if (table.n_attributes > 0)
+    memcpy(p, attribute_values, sizeof(double)*table.n_attributes);
+  p += sizeof(double)*table.n_attributes;
+  for (c=0; c<table.n_columns; c++){
+    memcpy(p, data[c], n_rows*stat_table_type_size(table.column_type[c]));
+    p += n_rows*stat_table_type_size(table.column_type[c]);
+  }
+  if ((run_archive_pwrite(fd, block, block_size, end) != 0) || (fdatasync(fd) != 0))
+    goto UNLOCK;
+  status = 0;
+
+ UNLOCK:
+  if (status)
+    fprintf(stderr, "stat_table_append: ERROR: unable to append to %s\n", filename);
+  flock(fd, LOCK_UN);
+  close(fd);
+  free(existing);
+  free(block);
+  return status;
+}
+
+
+/*
+  Function READ_STAT_TABLE reads the table <filename> into <table>, keeping the latest block for
+  each redshift (in the order they were appended), with all columns converted to double.
+  Returns 0 on success, -1 otherwise; free the table with free_stat_table().
+*/
+int read_stat_table(const char *filename, stat_table *table){
+  unsigned long long size, offset, block_size, n_rows, b, kept, row, ct, *block_offset;
+  unsigned char *data;
+  const unsigned char *col;
+  long long start;
+  float f;
+  double d;
+  long long l;
+  int fd, c;
+
+  memset(table, 0, sizeof(stat_table));
+  if ((fd = open(filename, O_RDONLY)) < 0){
+    fprintf(stderr, "read_stat_table: ERROR: unable to open %s\n", filename);
+    return -1;
+  }
+  flock(fd, LOCK_SH);
+  data = stat_table_load(fd, &size);
+  flock(fd, LOCK_UN);
+  close(fd);
+  if (!data || ((start = stat_table_header(data, size, table)) <= 0)){
+    fprintf(stderr, "read_stat_table: ERROR: %s is not a statistics table\n", filename);
+    free(data);
+    return -1;
+  }
+
+  // index the blocks, dropping superseded ones
+  for (offset=start; (block_size = stat_table_block_size(data+offset, size-offset, table)) > 0; offset += block_size)
+    table->n_blocks++;
+  block_offset = (unsigned long long *) malloc(sizeof(unsigned long long)*(table->n_blocks+1));
+  table->redshift = (double *) malloc(sizeof(double)*(table->n_blocks+1));
+  table->attribute = (double *) malloc(sizeof(double)*(table->n_blocks*table->n_attributes+1));
+  table->block_start = (unsigned long long *) malloc(sizeof(unsigned long long)*(table->n_blocks+1));
+  if (!block_offset || !table->redshift || !table->attribute || !table->block_start){
+    fprintf(stderr, "read_stat_table: ERROR: unable to allocate memory for %s\n", filename);
+    free(data); free(block_offset); free_stat_table(table);
+    return -1;
+  }
+  kept = 0;
+  for (offset=start; (block_size = stat_table_block_size(data+offset, size-offset, table)) > 0; offset += block_size){
+    memcpy(&d, data + offset + 2*sizeof(unsigned long long), sizeof(double));
+    for (b=0; (b<kept) && (table->redshift[b] != d); b++);
+    if (b < kept){ // supersedes block b
+      memmove(block_offset+b, block_offset+b+1, sizeof(unsigned long long)*(kept-b-1));
+      memmove(table->redshift+b, table->redshift+b+1, sizeof(double)*(kept-b-1));
+      kept--;
+    }
+    block_offset[kept] = offset;
+    table->redshift[kept++] = d;
+  }
+  table->n_blocks = kept;
+
+  // gather the rows
+  table->n_rows = 0;
+  for (b=0; b<table->n_blocks; b++){
+    memcpy(&n_rows, data + block_offset[b] + sizeof(STAT_TABLE_BLOCK), sizeof(unsigned long long));
+    memcpy(table->attribute + b*table->n_attributes, data + block_offset[b] + 2*sizeof(unsigned long long) + sizeof(double),
+	   sizeof(double)*table->n_attributes);
+    table->block_start[b] = table->n_rows;
+    table->n_rows += n_rows;
+  }
+  table->block_start[table->n_blocks] = table->n_rows;
+  for (c=0; c<table->n_columns; c++){
+    if (!(table->column[c] = (double *) malloc(sizeof(double)*(table->n_rows+1)))){
+      fprintf(stderr, "read_stat_table: ERROR: unable to allocate memory for %s\n", filename);
+      free(data); free(block_offset); free_stat_table(table);
+      return -1;
+    }
+  }
+  for (b=0; b<table->n_blocks; b++){
+    n_rows = table->block_start[b+1] - table->block_start[b];
+    col = data + block_offset[b] + 2*sizeof(unsigned long long) + sizeof(double)*(1 + table->n_attributes);
+    for (c=0; c<table->n_columns; c++){
+      for (ct=0, row=table->block_start[b]; ct<n_rows; ct++, row++){
+	if (!strcmp(table->column_type[c], "f4")){
+	  memcpy(&f, col + 4*ct, 4);
+	  table->column[c][row] = f;
+	}
+	else if (!strcmp(table->column_type[c], "f8")){
+	  memcpy(&d, col + 8*ct, 8);
+	  table->column[c][row] = d;
+	}
+	else{
+	  memcpy(&l, col + 8*ct, 8);
+	  table->column[c][row] = l;
+	}
+      }
+      col += n_rows*stat_table_type_size(table->column_type[c]);
+    }
+  }
+
+  free(data);
+  free(block_offset);
+  return 0;
+}
+
+
+/* the index of the column (attribute) <name> of <table>, or -1 */
+int stat_table_column(const stat_table *table, const char *name){
+  int c;
+
+  for (c=0; c<table->n_columns; c++){
+    if (!strcmp(table->column_name[c], name))
+      return c;
+  }
+  return -1;
+}
+
+int stat_table_attribute(const stat_table *table, const char *name){
+  int a;
+
+  for (a=0; a<table->n_attributes; a++){
+    if (!strcmp(table->attribute_name[a], name))
+      return a;
+  }
+  return -1;
+}
+
+
+void free_stat_table(stat_table *table){
+  int c;
+
+  free(table->redshift); free(table->attribute); free(table->block_start);
+  for (c=0; c<STAT_TABLE_MAX_COLUMNS; c++)
+    free(table->column[c]);
+  memset(table, 0, sizeof(stat_table));
+}
+
+#endif
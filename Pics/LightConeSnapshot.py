@@ -22,6 +22,7 @@ import glob
 import re
 from matplotlib.widgets import Slider
 from mpl_toolkits.axes_grid1.inset_locator import inset_axes
+from read_box import read_box
 
 C = 29979245800.0 # speed of light  (cm/s)
 OMm = 0.31
@@ -251,9 +252,7 @@ if __name__ == '__main__':
         BoxNames = "%s/delta_T_v3__zstart%s_zend%s_FLIPBOXES0_%s_%s_lighttravel"%(DataLocation,Redshifts_LightCone_Begin[k],Redshifts_LightCone_End[k],BoxRes,BoxSize)
 
         # Read in the 21cm brightness temperature data from file
-        f = open("%s"%(BoxNames),'rb')
-        IndividualLightConeBox = numpy.fromfile(f, dtype = numpy.dtype('float32'), count = int(BoxRes)*int(BoxRes)*int(BoxRes))    
-        f.close()
+        IndividualLightConeBox = read_box("%s"%(BoxNames))[:int(BoxRes)*int(BoxRes)*int(BoxRes)]
 
         # Take out the randomly determined slice and store the full light-cone slice
         for ii in range(int(BoxRes)):
@@ -18,6 +18,13 @@ if length(varargin) > 3
 end
 
 fid1 = fopen(infile,'r','n');
+% boxes stored compressed, quantised or sparse (see Pics/read_box.py) are not raw float arrays
+magic = fread(fid1,[1,7],'*char');
+if any(strcmp(magic, {'21cmLZ1','21cmQ16','21cmSP1'}))
+    fclose(fid1);
+    error('%s is stored as %s; convert it first with: python read_box.py %s <raw file>', infile, magic, infile);
+end
+frewind(fid1);
 dim2=dim1;
 dim3=dim1;
 variable = fread(fid1,[dim1,dim2*dim3],'real*4');
@@ -0,0 +1,178 @@
+#!/usr/bin/env python
+# Reader for the boxes written by the programs, whichever way they were stored (see mod_fwrite,
+# lossy_fwrite and sparse_fwrite in Cosmo_c_files/misc.c): raw little-endian float32 arrays,
+# or streams starting with one of the magics
+#   21cmLZ1  losslessly compressed (COMPRESS_BOXES)
+#   21cmQ16  quantised to 16 bits per slab (DELTA_T_BOX_ERROR, TS_BOX_ERROR, GAMMA12_BOX_ERROR)
+#   21cmSP1  sparse, as a constant plus the cells that differ (SPARSE_XH_BOXES)
+# which would otherwise be misread as floats.
+#
+# SIMPLEST USAGE: python read_box.py <box> <raw file>
+#   writes the box as a raw float32 array, for tools that cannot read the formats above (e.g.
+#   the Matlab scripts)
+#
+# From Python:
+#   box = read_box(filename)              the box as a flat float32 array
+#   box = read_box_cube(filename, DIM)    reshaped to (DIM, DIM, DIM), the last index fastest
+#   is_encoded(filename)                  whether the box is stored in one of the formats above
+
+import numpy as np
+import struct
+import sys
+
+CODEC_MAGIC = b"21cmLZ1\0"
+LOSSY_MAGIC = b"21cmQ16\0"
+SPARSE_MAGIC = b"21cmSP1\0"
+MAGICS = (CODEC_MAGIC, LOSSY_MAGIC, SPARSE_MAGIC)
+LZ_MIN_MATCH = 4
+
+
+def lz_decompress(coded, n_out):
+    """ decodes the LZ sequences of one chunk (see lz_decompress in misc.c) """
+    coded = bytearray(coded)
+    out = bytearray(n_out)
+    ip, op, end = 0, 0, len(coded)
+    while ip < end:
+        token = coded[ip]
+        ip += 1
+        n_lit = token >> 4
+        if n_lit == 15:
+            while True:
+                n_lit += coded[ip]
+                ip += 1
+                if coded[ip-1] != 255:
+                    break
+        out[op:op+n_lit] = coded[ip:ip+n_lit]
+        ip += n_lit
+        op += n_lit
+        if ip == end: # last sequence
+            break
+        offset = coded[ip] | (coded[ip+1] << 8)
+        ip += 2
+        length = token & 15
+        if length == 15:
+            while True:
+                length += coded[ip]
+                ip += 1
+                if coded[ip-1] != 255:
+                    break
+        length += LZ_MIN_MATCH
+        if offset == 0 or offset > op or op + length > n_out:
+            raise IOError("corrupt compressed box")
+        if offset >= length:
+            out[op:op+length] = out[op-offset:op-offset+length]
+        else: # the match overlaps its own output: repeat the last offset bytes
+            pattern = out[op-offset:op]
+            out[op:op+length] = (pattern * (length//offset + 1))[:length]
+        op += length
+    if op != n_out:
+        raise IOError("corrupt compressed box")
+    return out
+
+
+def byte_unshuffle(shuffled):
+    """ undoes byte_shuffle in misc.c, which grouped byte b of every 4-byte word together """
+    words = len(shuffled)//4
+    data = np.frombuffer(bytes(shuffled), dtype=np.uint8)
+    head = data[:4*words].reshape(4, words).T.reshape(-1)
+    return head.tobytes() + data[4*words:].tobytes()
+
+
+def codec_read(data, pos):
+    """ decodes a 21cmLZ1 stream at data[pos:] (after the magic); returns the bytes and the end """
+    raw_size, chunk = struct.unpack_from('<QQ', data, pos)
+    pos += 16
+    out = []
+    done = 0
+    while done < raw_size:
+        raw = min(chunk, raw_size - done)
+        size, = struct.unpack_from('<I', data, pos)
+        pos += 4
+        coded = data[pos:pos+size]
+        pos += size
+        if size == raw: # stored as is
+            out.append(bytes(coded))
+        else:
+            out.append(byte_unshuffle(lz_decompress(coded, raw)))
+        done += raw
+    return b''.join(out), pos
+
+
+def mod_fread(data, pos, size):
+    """ reads size bytes written by mod_fwrite at data[pos:]; returns them and the end """
+    if size > len(CODEC_MAGIC) and bytes(data[pos:pos+8]) == CODEC_MAGIC:
+        return codec_read(data, pos+8)
+    return bytes(data[pos:pos+size]), pos+size
+
+
+def lossy_read(data, pos):
+    """ decodes a 21cmQ16 stream (after the magic), see lossy_fread in misc.c """
+    num, slab_len, payload_size = struct.unpack_from('<QQQ', data, pos)
+    payload, pos = mod_fread(data, pos+24, payload_size)
+    n_slabs = (num + slab_len - 1)//slab_len
+    table = np.frombuffer(payload, dtype='<f4', count=2*n_slabs)
+    box = np.empty(num, dtype=np.float32)
+    start = 8*n_slabs
+    for s in range(n_slabs):
+        length = min(slab_len, num - s*slab_len)
+        offset, scale = table[2*s], table[2*s+1]
+        if scale < 0: # kept as floats
+            box[s*slab_len:s*slab_len+length] = np.frombuffer(payload, dtype='<f4', count=length, offset=start)
+            start += 4*length
+        else:
+            q = np.frombuffer(payload, dtype='<u2', count=length, offset=start)
+            box[s*slab_len:s*slab_len+length] = (np.float64(offset) + np.float64(scale)*q).astype(np.float32)
+            start += 2*length
+    return box, pos
+
+
+def sparse_read(data, pos):
+    """ expands a 21cmSP1 stream (after the magic), see sparse_fread in misc.c """
+    num, n_exc = struct.unpack_from('<QQ', data, pos)
+    constant, = struct.unpack_from('<f', data, pos+16)
+    mask_size = 8*((num + 63)//64)
+    payload, pos = mod_fread(data, pos+20, mask_size + 4*n_exc)
+    mask = np.unpackbits(np.frombuffer(payload, dtype=np.uint8, count=mask_size), bitorder='little')[:num].astype(bool)
+    if mask.sum() != n_exc:
+        raise IOError("corrupt sparse box")
+    box = np.full(num, constant, dtype=np.float32)
+    box[mask] = np.frombuffer(payload, dtype='<f4', count=n_exc, offset=mask_size)
+    return box, pos
+
+
+def decode_box(data):
+    """ the float32 box held in the bytes data, in any of the formats above """
+    magic = bytes(data[:8])
+    if magic == CODEC_MAGIC:
+        raw, pos = codec_read(data, 8)
+        return np.frombuffer(raw, dtype='<f4').astype(np.float32)
+    if magic == LOSSY_MAGIC:
+        return lossy_read(data, 8)[0]
+    if magic == SPARSE_MAGIC:
+        return sparse_read(data, 8)[0]
+    return np.frombuffer(data, dtype='<f4', count=len(data)//4).astype(np.float32)
+
+
+def is_encoded(filename):
+    f = open(filename, 'rb')
+    magic = f.read(8)
+    f.close()
+    return magic in MAGICS
+
+
+def read_box(filename):
+    f = open(filename, 'rb')
+    data = f.read()
+    f.close()
+    return decode_box(data)
+
+
+def read_box_cube(filename, DIM):
+    return read_box(filename).reshape((DIM, DIM, DIM))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.stderr.write("USAGE: python read_box.py <box> <raw file>\n")
+        sys.exit(1)
+    read_box(sys.argv[1]).astype('<f4').tofile(sys.argv[2])
@@ -29,6 +29,7 @@ from matplotlib.colors import Normalize
 from os.path import basename
 import os
 import sys, argparse
+from read_box import read_box, is_encoded
 
 
 #To normalize the midpoint of the colorbar
@@ -44,15 +45,25 @@ class MidpointNormalize(Normalize):
 def load_binary_data(filename, dtype=np.float32): 
      """ 
      We assume that the data was written 
-     with write_binary_data() (little endian). 
+     with write_binary_data() (little endian), or by the programs
+     compressed, quantised or sparse (see read_box.py). 
      """ 
-     f = open(filename, "rb") 
-     data = f.read() 
-     f.close() 
-     _data = np.fromstring(data, dtype) 
-     if sys.byteorder == 'big':
-       _data = _data.byteswap()
-     return _data 
+     return read_box(filename).astype(dtype)
+
+def load_binary_slice(filename, DIM, axis, index, dtype=np.float32):
+     """
+     Reads only the plane data1[index,:,:] (axis=0) or data1[:,:,index] (axis=2) of the cube
+     by memory-mapping the file, so that the rest of the box is not read (the axis=0 plane is
+     contiguous on disk).  Boxes stored compressed, quantised or sparse have no random access,
+     and are decoded whole.
+     """
+     if is_encoded(filename):
+       cube = load_binary_data(filename, dtype).reshape((DIM, DIM, DIM))
+     else:
+       cube = np.memmap(filename, dtype=np.dtype(dtype).newbyteorder('<'), mode='r', shape=(DIM, DIM, DIM))
+     if axis == 0:
+       return np.array(cube[index,:,:])
+     return np.array(cube[:,:,index])
 
 # Parse the command line options
 parser = argparse.ArgumentParser()
@@ -88,54 +99,68 @@ for path in args.input:
     if args.zindex >= 0:
         z_index = args.zindex
 
-    # read in the data cube located in 21cmFast/Boxes/delta_T*
-    data1 = load_binary_data(path)
-    data1.shape = (DIM, DIM, DIM)
-    data1 = data1.reshape((DIM, DIM, DIM), order='F')
+    x_index = DIM/2
+    if (args.filter < 0) and (args.filterx < 0) and (args.filtery < 0) and (args.filterz < 0):
+        # no smoothing, so only read the slice(s) we plot from the data cube
+        if args.zindex < 0:
+            print "Taking a yz slice at x index="+str(x_index)
+            slice = load_binary_slice(path, DIM, 0, x_index)
+            endstr = '_xindex'+str(x_index)
+        else:
+            print "Taking an xy slice at z index="+str(z_index)
+            slice = load_binary_slice(path, DIM, 2, z_index)
+            endstr = '_zindex'+str(z_index)
+            if args.delzindex >= 0: #difference image is wanted
+                del_z_index = args.delzindex
+                other_z_index = int(z_index+del_z_index)
+                print "Subtracting the slice at index="+str(other_z_index)
+                slice = slice - load_binary_slice(path, DIM, 2, other_z_index)
+                endstr = '_zindex'+str(z_index)+'-'+str(z_index+del_z_index)
 
-    # smooth the field?
-    if args.filter >= 0:
-        iso_sigma = args.filter
-        print "Smoothing the entire cube with a Gassian filter of width="+str(iso_sigma)
-        data1 = scipy.ndimage.filters.gaussian_filter(data1, sigma=iso_sigma)
     else:
-        if args.filterx >= 0:
-            x_sigma = args.filterx
-            print "Smoothing along the x (horizontal) axis with a Gassian filter of width="+str(x_sigma)
-            data1 = scipy.ndimage.filters.gaussian_filter1d(data1, sigma=x_sigma, axis=1)
-        if args.filtery >= 0:
-            y_sigma = args.filtery
-            print "Smoothing along the y (vertical) axis with a Gassian filter of width="+str(y_sigma)
-            data1 = scipy.ndimage.filters.gaussian_filter1d(data1, sigma=y_sigma, axis=0)
-        if args.filterz >= 0:
-            z_sigma = args.filterz
-            print "Smoothing along the z (line of sight) axis with a Gassian filter of width="+str(z_sigma)
-            data1 = scipy.ndimage.filters.gaussian_filter1d(data1, sigma=z_sigma, axis=2)
-
-        
-    fig = plt.figure(dpi=72)
-    sub_fig = fig.add_subplot(111)
+        # read in the data cube located in 21cmFast/Boxes/delta_T*
+        data1 = load_binary_data(path)
+        data1.shape = (DIM, DIM, DIM)
+        data1 = data1.reshape((DIM, DIM, DIM), order='F')
 
-    # extract a slice from the 3D cube
-    x_index = DIM/2
-    if args.zindex < 0:
-        print "Taking a yz slice at x index="+str(x_index)
-        slice = data1[x_index,:,:]
-        endstr = '_xindex'+str(x_index)
-    else:
-        print "Taking an xy slice at z index="+str(z_index)
-        slice = data1[:,:,z_index]
-        endstr = '_zindex'+str(z_index)
-        if args.delzindex >= 0: #difference image is wanted
-            del_z_index = args.delzindex
-            other_z_index = int(z_index+del_z_index)
-            print "Subtracting the slice at index="+str(other_z_index)
-            slice = slice - data1[:,:,other_z_index]
-            endstr = '_zindex'+str(z_index)+'-'+str(z_index+del_z_index)
+        # smooth the field
+        if args.filter >= 0:
+            iso_sigma = args.filter
+            print "Smoothing the entire cube with a Gassian filter of width="+str(iso_sigma)
+            data1 = scipy.ndimage.filters.gaussian_filter(data1, sigma=iso_sigma)
+        else:
+            if args.filterx >= 0:
+                x_sigma = args.filterx
+                print "Smoothing along the x (horizontal) axis with a Gassian filter of width="+str(x_sigma)
+                data1 = scipy.ndimage.filters.gaussian_filter1d(data1, sigma=x_sigma, axis=1)
+            if args.filtery >= 0:
+                y_sigma = args.filtery
+                print "Smoothing along the y (vertical) axis with a Gassian filter of width="+str(y_sigma)
+                data1 = scipy.ndimage.filters.gaussian_filter1d(data1, sigma=y_sigma, axis=0)
+            if args.filterz >= 0:
+                z_sigma = args.filterz
+                print "Smoothing along the z (line of sight) axis with a Gassian filter of width="+str(z_sigma)
+                data1 = scipy.ndimage.filters.gaussian_filter1d(data1, sigma=z_sigma, axis=2)
 
+        # extract a slice from the 3D cube
+        if args.zindex < 0:
+            print "Taking a yz slice at x index="+str(x_index)
+            slice = data1[x_index,:,:]
+            endstr = '_xindex'+str(x_index)
+        else:
+            print "Taking an xy slice at z index="+str(z_index)
+            slice = data1[:,:,z_index]
+            endstr = '_zindex'+str(z_index)
+            if args.delzindex >= 0: #difference image is wanted
+                del_z_index = args.delzindex
+                other_z_index = int(z_index+del_z_index)
+                print "Subtracting the slice at index="+str(other_z_index)
+                slice = slice - data1[:,:,other_z_index]
+                endstr = '_zindex'+str(z_index)+'-'+str(z_index+del_z_index)
 
+    fig = plt.figure(dpi=72)
+    sub_fig = fig.add_subplot(111)
 
-    
     # check box type to determine default plotting options
     # check if it is a 21cm brightness temperature box
     if basename(filename)[0:3]=='del':
@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+# Reader for the binary multi-redshift tables (*.tbl) written by delta_T, Ts and find_halos
+# (power spectra, global evolution and halo mass functions; see Cosmo_c_files/stat_table.c).
+#
+# SIMPLEST USAGE: python stat_table.py <table>
+#   prints the table, one row per line, preceded by the redshift (and attributes) of its block
+#
+# USAGE: python stat_table.py --pivot=<k> <power spectrum table>
+#   prints z, nf, aveTb, log10(k), log10(P(k)) and dlog10(P)/dlog10(k) at the pivot k of every
+#   redshift with nf >= 0.01, like extract_delTps.pl does from the text power spectra
+#
+# From Python:
+#   table = read_stat_table(filename)
+#   table['redshift'], table['k'], table['power'], table['nf'] ... are arrays with one value per
+#   row (the attributes and redshift of its block); table['columns'] and table['attributes'] list
+#   the names, and table['blocks'] the redshift and row range of each block.
+
+import numpy as np
+import sys, argparse
+
+MAGIC = b"21cmTB1\0"
+BLOCK = b"21cmBLK\0"
+TYPES = {'f4': np.float32, 'f8': np.float64, 'i8': np.int64}
+
+
+def parse_list(text):
+    names, types = [], []
+    for item in filter(None, text.split(',')):
+        name, _, type = item.partition(':')
+        names.append(name)
+        types.append(type or 'f8')
+    return names, types
+
+
+def read_stat_table(filename):
+    data = open(filename, 'rb').read()
+    if data[:8] != MAGIC:
+        raise IOError("%s is not a statistics table" % filename)
+    pos = 8
+    lists = []
+    for i in range(2):
+        length = int(np.frombuffer(data, np.uint64, 1, pos)[0])
+        lists.append(data[pos+8:pos+8+length].decode())
+        pos += 8 + length
+    columns, types = parse_list(lists[0])
+    attributes = parse_list(lists[1])[0]
+
+    # read the blocks, a later block with the same redshift superseding an earlier one
+    blocks = {}
+    while pos + 24 <= len(data) and data[pos:pos+8] == BLOCK:
+        n = int(np.frombuffer(data, np.uint64, 1, pos+8)[0])
+        z = float(np.frombuffer(data, np.float64, 1, pos+16)[0])
+        size = 24 + 8*len(attributes) + n*sum(np.dtype(TYPES[t]).itemsize for t in types)
+        if pos + size > len(data):
+            break # an incomplete block
+        values = np.frombuffer(data, np.float64, len(attributes), pos+24)
+        start = pos + 24 + 8*len(attributes)
+        block = []
+        for t in types:
+            block.append(np.frombuffer(data, TYPES[t], n, start))
+            start += n*np.dtype(TYPES[t]).itemsize
+        blocks.pop(z, None)
+        blocks[z] = (values, block, n)
+        pos += size
+
+    table = {'columns': columns, 'attributes': attributes, 'blocks': []}
+    rows = 0
+    for z, (values, block, n) in blocks.items():
+        table['blocks'].append((z, rows, rows+n))
+        rows += n
+    table['redshift'] = np.concatenate([np.full(n, z) for z, (v, b, n) in blocks.items()] or [np.zeros(0)])
+    for i, name in enumerate(attributes):
+        table[name] = np.concatenate([np.full(n, v[i]) for v, b, n in blocks.values()] or [np.zeros(0)])
+    for i, name in enumerate(columns):
+        table[name] = np.concatenate([b[i] for v, b, n in blocks.values()] or [np.zeros(0, TYPES[types[i]])])
+    return table
+
+
+def pivot_power(table, pivot_k):
+    # the power spectrum at pivot_k (interpolated in log-log) and its slope there, for each redshift
+    lines = []
+    lpivot_k = np.log10(pivot_k)
+    for z, start, end in table['blocks']:
+        nf = table['nf'][start] if end > start else 0
+        if nf < 0.01:
+            continue
+        lk = np.log10(table['k'][start:end])
+        lp = np.log10(table['power'][start:end])
+        above = np.nonzero(table['k'][start:end] > pivot_k)[0]
+        if len(above) == 0 or above[0] == 0:
+            continue
+        i = above[0]
+        slope = (lp[i] - lp[i-1])/(lk[i] - lk[i-1])
+        lines.append((z, nf, table['aveTb'][start], lpivot_k, lp[i-1] + slope*(lpivot_k - lk[i-1]), slope))
+    return sorted(lines)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Prints a binary statistics table.')
+    parser.add_argument('--pivot', type=float, help='print the power spectrum at this k (in Mpc^-1)')
+    parser.add_argument('filename')
+    args = parser.parse_args()
+
+    table = read_stat_table(args.filename)
+    if args.pivot:
+        for line in pivot_power(table, args.pivot):
+            print("%06.2f\t%f\t%g\t%g\t%g\t%g" % line)
+    else:
+        print("# z\t" + "\t".join(table['attributes'] + table['columns']))
+        for row in range(len(table['redshift'])):
+            print("\t".join(["%06.2f" % table['redshift'][row]] +
+                            ["%e" % table[name][row] for name in table['attributes'] + table['columns']]))
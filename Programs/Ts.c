@@ -1,4 +1,5 @@
 #include "heating_helper_progs.c"
+#include "memory_planner.c"
 
 /* 
   This is completed version.
@@ -8,7 +9,7 @@
   Program Ts calculates the spin temperature field, according to the perscription outlined in
   Mesinger, Furlanetto, Cen (2010).  The fluctuating component is sourced by the mean EPS collapsed fraction in spherical annyli surrounding each cell.
 
-  Usage: Ts <REDSHIFT> [reload zp redshift]  [<stellar fraction for 10^10 Msun halos> <power law index for stellar fraction halo mass scaling> 
+  Usage: Ts [-p <NUM THREADS>] <REDSHIFT> [reload zp redshift]  [<stellar fraction for 10^10 Msun halos> <power law index for stellar fraction halo mass scaling> 
        <escape fraction for 10^10 Msun halos> <power law index for escape fraction halo mass scaling>
 	   <turn-over scale for the duty cycle of galaxies, in units of halo mass> <Soft band X-ray luminosity>]
 
@@ -16,6 +17,8 @@
   evolution files in ../Boxes/Ts_evolution/
 
   Memory usage (in floats)~ (<NUMBER OF FILTER STEPS> + 3) x HII_DIM^3
+  If this exceeds RAM, the smoothed density boxes are held as 16-bit integers instead,
+  halving the dominant term (see memory_planner.c).
 
   Author: Andrei Mesinger
   Date: 9.2.2009
@@ -92,6 +95,11 @@ void destroy_21cmMC_arrays() {
 #define MAX_TK (float) 5e4 
 
 
+// smoothed z=0 density on scale R_ct in cell ct, from either the float or the quantised stack
+#define DELNL0(R_ct, ct) (QUANTISE_delNL0 ? \
+			  delNL0_offset[(R_ct)] + delNL0_scale[(R_ct)]*((unsigned short *)delNL0[(R_ct)])[(ct)] : \
+			  delNL0[(R_ct)][(ct)])
+
 int main(int argc, char ** argv){
   fftwf_complex *box, *unfiltered_box;
   fftwf_plan plan;
@@ -101,7 +109,10 @@ int main(int argc, char ** argv){
   int ithread;
   float *Tk_box, *x_e_box, *Ts, J_star_Lya, dzp, prev_zp, zpp, prev_zpp, prev_R;
   FILE *F, *GLOBAL_EVOL, *OUT;
-  char filename[500];
+  char filename[500], evol_table[520];
+  double evol_row[9];
+  const void *evol_columns[9];
+  int evol_ct, write_status;
   float dz, zeta_ion_eff, Tk_BC, xe_BC, nu, zprev, zcurr, curr_delNL0[NUM_FILTER_STEPS_FOR_Ts];
   double *evolve_ans, ans[2], dansdz[5], Tk_ave, J_alpha_ave, xalpha_ave, J_alpha_tot, Xheat_ave,
     Xion_ave;
@@ -111,7 +122,10 @@ double freq_int_heat_tbl[x_int_NXHII][NUM_FILTER_STEPS_FOR_Ts], freq_int_ion_tbl
 double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR_Ts], freq_int_lya[NUM_FILTER_STEPS_FOR_Ts];
  double nuprime, fcoll_R, Ts_ave;
  float *delNL0[NUM_FILTER_STEPS_FOR_Ts], xHII_call, curr_xalpha;
- float z, Jalpha, TK, TS, xe, deltax;
+ float delNL0_offset[NUM_FILTER_STEPS_FOR_Ts], delNL0_scale[NUM_FILTER_STEPS_FOR_Ts], delNL0_val;
+ int QUANTISE_delNL0;
+ memory_plan mem_plan;
+ float z, Jalpha, TK, TS, xe, deltax, *deltax_box=NULL;
  time_t start_time, curr_time;
  double J_alpha_threads[NUMCORES], xalpha_threads[NUMCORES], Xheat_threads[NUMCORES],
    Xion_threads[NUMCORES], lower_int_limit;
@@ -121,9 +135,19 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
  double Luminosity_conversion_factor;
  float prev_zp_temp, zp_temp;
  int RESTART = 0;
+ int num_th = NUMCORES;
 
 
  /**********  BEGIN INITIALIZATION   **************************************/
+ // check if user wants to specify the multi threading
+ if ((argc > 2) && (argv[1][0]=='-') && ((argv[1][1]=='p') || (argv[1][1]=='P'))){
+   // user specified num proc; the per-thread accumulators below are sized by NUMCORES
+   num_th = atoi(argv[2]);
+   if (num_th > NUMCORES)
+     num_th = NUMCORES;
+   argc -= 2;
+   argv += 2;
+ }
  //New in v2
  if (SHARP_CUTOFF) {
    if (argc == 3){
@@ -195,7 +219,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
  system("cp ../Parameter_files/* ../Output_files/Ts_outs/");
  system("cp ../Parameter_files/* ../Boxes/Ts_evolution/");
  init_ps();
- omp_set_num_threads(NUMCORES);
+ omp_set_num_threads(num_th);
  growth_factor_z = dicke(REDSHIFT);
  
   
@@ -220,8 +244,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
    // open input
    sprintf(filename, "../Boxes/updated_smoothed_deltax_z%06.2f_%i_%.0fMpc", 
 	   REDSHIFT, HII_DIM, BOX_LEN);
-   F = fopen(filename, "rb");
-   if ( !(F = fopen(filename, "rb") ) ){
+   if ( !(F = box_fopen(filename, "rb") ) ){
      fprintf(stderr, "Error opening file %s for reading.\nAborting...\n", filename);
      fprintf(LOG, "Error opening file %s for reading.\nAborting...\n", filename);
      destruct_heat(); return -1;
@@ -237,7 +260,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
    else {
    sprintf(filename, "../Boxes/Ts_z%06.2f_L_X%.1e_alphaX%.1f_MminX%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", REDSHIFT, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN); 
    }
-   if (!(OUT=fopen(filename, "wb"))){
+   if (!(OUT=box_fopen(filename, "wb"))){
      fprintf(stderr, "Ts.c: WARNING: Unable to open output file %s\n", filename);
      fprintf(LOG, "Ts.c: WARNING: Unable to open output file %s\n", filename);
      destruct_heat(); return -1;
@@ -246,30 +269,32 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
    fprintf(LOG, "Opened TS file %s for writting\n", filename);
 
    // read file
+   deltax_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+   if (!deltax_box || (mod_fread(deltax_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1)){
+     fprintf(stderr, "Error reading-in binary density file\nAborting...\n");
+     fprintf(LOG, "Error reading-in binary density file\nAborting...\n");
+     free(deltax_box); destruct_heat(); return -1;
+   }
    for (i=0; i<HII_DIM; i++){
      for (j=0; j<HII_DIM; j++){
        for (k=0; k<HII_DIM; k++){
-	 if (fread(&deltax, sizeof(float), 1, F)!=1){
-	  fprintf(stderr, "Error reading-in binary density file\nAborting...\n");
-	  fprintf(LOG, "Error reading-in binary density file\nAborting...\n");
-	  destruct_heat(); return -1;
-	 }
+	 deltax = deltax_box[HII_R_INDEX(i,j,k)];
 
 	 // compute the spin temperature
 	TS = get_Ts(REDSHIFT, deltax, TK, xe, 0, &curr_xalpha);
 
 	// and print it out
-	if (fwrite(&TS, sizeof(float), 1, OUT)!=1){
+	if (io_account_fwrite(&TS, sizeof(float), 1, OUT, __FILE__, __LINE__)!=1){
 	  fprintf(stderr, "Ts.c: Write error occured while writting Tk box.\n");
 	  fprintf(LOG, "Ts.c: Write error occured while writting Tk box.\n");
-	  destruct_heat(); return -1;
+	  free(deltax_box); destruct_heat(); return -1;
 	 }
 
        }
      }
    }
 
-   destruct_heat(); fclose(F); fclose(OUT);
+   destruct_heat(); fclose(F); box_fclose(OUT); free(deltax_box);
    return 0;
  }
 
@@ -278,17 +303,23 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
  // New in v2
  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
  sprintf(filename, "../Output_files/Ts_outs/global_evolution_Nsteps%i_zprimestepfactor%.3f_L_X%.1e_alphaX%.1f_f_star10%06.4f_alpha_star%06.4f_f_esc10%06.4f_alpha_esc%06.4f_Mturn%.1e_t_star%06.4f_Pop%i_%i_%.0fMpc", NUM_FILTER_STEPS_FOR_Ts, ZPRIME_STEP_FACTOR, X_LUMINOSITY, X_RAY_SPEC_INDEX, F_STAR10, ALPHA_STAR, F_ESC10, ALPHA_ESC, M_TURN, T_AST, Pop, HII_DIM, BOX_LEN);
+   sprintf(evol_table, "%s.tbl", filename);
    if (argc == 3 || argc == 9) // restarting
      GLOBAL_EVOL = fopen(filename, "a");
-   else
+   else{
      GLOBAL_EVOL = fopen(filename, "w");
+     remove(evol_table);
+   }
  }
  else {
  sprintf(filename, "../Output_files/Ts_outs/global_evolution_zetaIon%.2f_Nsteps%i_zprimestepfactor%.3f_L_X%.1e_alphaX%.1f_TvirminX%.1e_Pop%i_%i_%.0fMpc", HII_EFF_FACTOR, NUM_FILTER_STEPS_FOR_Ts, ZPRIME_STEP_FACTOR, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_TURN, Pop, HII_DIM, BOX_LEN);
+   sprintf(evol_table, "%s.tbl", filename);
    if (argc > 2) // restarting
      GLOBAL_EVOL = fopen(filename, "a");
-   else
+   else{
      GLOBAL_EVOL = fopen(filename, "w");
+     remove(evol_table);
+   }
  }
  if (!GLOBAL_EVOL){
    fprintf(stderr, "Unable to open global evolution file at %s\nAborting...\n",
@@ -312,11 +343,16 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 
   /******  Now allocate large arrays  ******/
 
+  // check they fit in RAM; if not, hold the smoothed density boxes as 16-bit integers
+  mem_plan = plan_memory(MEM_STAGE_TS);
+  print_memory_plan(stderr, &mem_plan);
+  print_memory_plan(LOG, &mem_plan);
+  QUANTISE_delNL0 = mem_plan.strategies & MEM_QUANTISED_STACK;
+
   // allocate memory for the nonlinear density field and open file
   sprintf(filename, "../Boxes/updated_smoothed_deltax_z%06.2f_%i_%.0fMpc", 
 	  REDSHIFT, HII_DIM, BOX_LEN);
-  F = fopen(filename, "rb");
-  if ( !(F = fopen(filename, "rb") ) ){
+  if ( !(F = box_fopen(filename, "rb") ) ){
     fprintf(stderr, "Error opening file %s for reading.\nAborting...\n", filename);
     fprintf(LOG, "Error opening file %s for reading.\nAborting...\n", filename);
     fclose(LOG); fclose(GLOBAL_EVOL);
@@ -337,18 +373,12 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
   }
   fprintf(stderr, "Reading in deltax box\n");
   fprintf(LOG, "Reading in deltax box\n");
-  for (i=0; i<HII_DIM; i++){
-    for (j=0; j<HII_DIM; j++){
-      for (k=0; k<HII_DIM; k++){
-	if (fread((float *)unfiltered_box + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	  fprintf(stderr, "Error reading-in binary file %s\nAborting...\n", filename);
-	  fprintf(LOG, "Error reading-in binary file %s\nAborting...\n", filename);
-	  fftwf_free(box); fclose(GLOBAL_EVOL); fclose(F); fclose(LOG); fftwf_free(unfiltered_box);
-	  destruct_heat();
-	  return -1;
-	}
-      }
-    }
+  if (mod_fread_padded((float *)unfiltered_box, HII_DIM, F)!=1){
+    fprintf(stderr, "Error reading-in binary file %s\nAborting...\n", filename);
+    fprintf(LOG, "Error reading-in binary file %s\nAborting...\n", filename);
+    fftwf_free(box); fclose(GLOBAL_EVOL); fclose(F); fclose(LOG); fftwf_free(unfiltered_box);
+    destruct_heat();
+    return -1;
   }
   fclose(F);
 
@@ -380,7 +410,11 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	    (double)clock()/CLOCKS_PER_SEC/60.0);
     fprintf(LOG, "Processing scale R= %06.2fMpc, time=%06.2f min\n", R, 
 	    (double)clock()/CLOCKS_PER_SEC/60.0);
-    if (! (delNL0[R_ct] = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
+    if (QUANTISE_delNL0)
+      delNL0[R_ct] = (float *) malloc(sizeof(unsigned short)*HII_TOT_NUM_PIXELS);
+    else
+      delNL0[R_ct] = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+    if (!delNL0[R_ct]){
       fprintf(stderr, "Error in memory allocation\nAborting...\n");
       fprintf(LOG, "Error in memory allocation\nAborting...\n");
       fclose(LOG); fclose(GLOBAL_EVOL);fftwf_free(box);  fftwf_free(unfiltered_box);
@@ -404,15 +438,21 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
-	  delNL0[R_ct][HII_R_INDEX(i,j,k)] = *((float *) box + HII_R_FFT_INDEX(i,j,k));
-	  if (delNL0[R_ct][HII_R_INDEX(i,j,k)] < -1){ // correct for alliasing in the filtering step
-	    delNL0[R_ct][HII_R_INDEX(i,j,k)] = -1+FRACT_FLOAT_ERR;
+	  delNL0_val = *((float *) box + HII_R_FFT_INDEX(i,j,k));
+	  if (delNL0_val < -1){ // correct for alliasing in the filtering step
+	    delNL0_val = -1+FRACT_FLOAT_ERR;
 	  }
 	  // and linearly extrapolate to z=0
-	  delNL0[R_ct][HII_R_INDEX(i,j,k)] /= growth_factor_z; 
+	  delNL0_val /= growth_factor_z; 
+	  if (QUANTISE_delNL0)
+	    *((float *) box + HII_R_FFT_INDEX(i,j,k)) = delNL0_val;
+	  else
+	    delNL0[R_ct][HII_R_INDEX(i,j,k)] = delNL0_val;
 	}
       }
     }
+    if (QUANTISE_delNL0)
+      quantise_HII_box((float *) box, (unsigned short *) delNL0[R_ct], &delNL0_offset[R_ct], &delNL0_scale[R_ct]);
 
     R *= R_factor;
   } //end for loop through the filter scales R
@@ -475,7 +515,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	else {
     sprintf(filename, "../Boxes/Ts_evolution/Tk_zprime%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", zp, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN);
 	}
-    if (!(F=fopen(filename, "rb"))){
+    if (!(F=box_fopen(filename, "rb"))){
       fprintf(stderr, "Ts.c: WARNING: Unable to open input file %s\nAborting\n", filename);
       fprintf(LOG, "Ts.c: WARNING: Unable to open input file %s\nAborting\n", filename);
       fclose(LOG); fclose(GLOBAL_EVOL); free(Tk_box); free(x_e_box); free(Ts);
@@ -505,7 +545,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	else {
     sprintf(filename, "../Boxes/Ts_evolution/xeneutral_zprime%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", zp, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN);
 	}
-      if (!(F=fopen(filename, "rb"))){
+      if (!(F=box_fopen(filename, "rb"))){
       fprintf(stderr, "Ts.c: WARNING: Unable to open output file %s\nAborting\n", filename);
       fprintf(LOG, "Ts.c: WARNING: Unable to open output file %s\nAborting\n", filename);
       fclose(LOG);  free(Tk_box); free(x_e_box); free(Ts);
@@ -724,22 +764,22 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	  growth_zpp = dicke(zpp);
       //---------- interpolation for fcoll starts ----------
 	  // Here 'fcoll' is not the collpased fraction, but leave this name as is to simplify the variable name.
-      if (delNL0[R_ct][box_ct]*growth_zpp < 1.5){
-        if (delNL0[R_ct][box_ct]*growth_zpp < -1.) {
+      if (DELNL0(R_ct, box_ct)*growth_zpp < 1.5){
+        if (DELNL0(R_ct, box_ct)*growth_zpp < -1.) {
 		  fcoll = 0;
         }    
         else {
-          fcoll = gsl_spline_eval(SFRDLow_zpp_spline[R_ct], log10(delNL0[R_ct][box_ct]*growth_zpp+1.), SFRDLow_zpp_spline_acc[R_ct]);
+          fcoll = gsl_spline_eval(SFRDLow_zpp_spline[R_ct], log10(DELNL0(R_ct, box_ct)*growth_zpp+1.), SFRDLow_zpp_spline_acc[R_ct]);
           fcoll = pow(10., fcoll);
         }    
       }    
       else {
-        if (delNL0[R_ct][box_ct]*growth_zpp < 0.99*Deltac) {
+        if (DELNL0(R_ct, box_ct)*growth_zpp < 0.99*Deltac) {
           // Usage of 0.99*Deltac arises due to the fact that close to the critical density, the collapsed fraction becomes a little unstable
           // However, such densities should always be collapsed, so just set f_coll to unity. 
           // Additionally, the fraction of points in this regime relative to the entire simulation volume is extremely small.
 		  //New
-          splint(Overdense_high_table-1,SFRD_z_high_table[arr_num+R_ct]-1,second_derivs_Nion_zpp[R_ct]-1,NSFR_high,delNL0[R_ct][box_ct]*growth_zpp,&(fcoll));
+          splint(Overdense_high_table-1,SFRD_z_high_table[arr_num+R_ct]-1,second_derivs_Nion_zpp[R_ct]-1,NSFR_high,DELNL0(R_ct, box_ct)*growth_zpp,&(fcoll));
         }    
         else {
 		  fcoll = 1.;
@@ -751,7 +791,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	} 
 	else {
 	  fcoll_R += sigmaparam_FgtrM_bias(zpp, sigma_Tmin[R_ct], 
-					 delNL0[R_ct][box_ct], sigma_atR[R_ct]);
+					 DELNL0(R_ct, box_ct), sigma_atR[R_ct]);
     }
 	  }
 
@@ -876,7 +916,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
       }
       //interpolate to correct nu integral value based on the cell's ionization state
       for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-	curr_delNL0[R_ct] = delNL0[R_ct][box_ct];
+	curr_delNL0[R_ct] = DELNL0(R_ct, box_ct);
 	m_xHII_low = locate_xHII_index(xHII_call);
 	m_xHII_high = m_xHII_low + 1;
 
@@ -962,6 +1002,15 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
     Xion_ave /= (double)HII_TOT_NUM_PIXELS;
     // write to global evolution file
     fprintf(GLOBAL_EVOL, "%f\t%f\t%f\t%e\t%f\t%f\t%e\t%e\t%e\t%e\n", zp, filling_factor_of_HI_zp, Tk_ave, x_e_ave, Ts_ave, T_cmb*(1+zp), J_alpha_ave, xalpha_ave, Xheat_ave, Xion_ave);
+    // and as a row of its binary table (see stat_table.c)
+    evol_row[0] = filling_factor_of_HI_zp; evol_row[1] = Tk_ave; evol_row[2] = x_e_ave;
+    evol_row[3] = Ts_ave; evol_row[4] = T_cmb*(1+zp); evol_row[5] = J_alpha_ave;
+    evol_row[6] = xalpha_ave; evol_row[7] = Xheat_ave; evol_row[8] = Xion_ave;
+    for (evol_ct=0; evol_ct<9; evol_ct++)
+      evol_columns[evol_ct] = &evol_row[evol_ct];
+    if (stat_table_append(evol_table, "x_HI:f8,Tk:f8,x_e:f8,Ts:f8,T_cmb:f8,J_alpha:f8,x_alpha:f8,X_heat:f8,X_ion:f8", "",
+			  zp, NULL, 1, evol_columns) != 0)
+      fprintf(LOG, "Unable to append to the global evolution table %s\n", evol_table);
     fflush(NULL);
 
     // output these intermediate boxes
@@ -971,7 +1020,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
       fprintf(LOG, "Writting the intermediate output at zp = %.4f, <Tk>=%f, <x_e>=%e\n", zp, Tk_ave, x_e_ave);
       fflush(NULL);
 
-      // first Tk
+      // first Tk (the boxes are written in the background, see async_fwrite in misc.c)
 	    // New v2
 	  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
       sprintf(filename, "../Boxes/Ts_evolution/Tk_zprime%06.2f_L_X%.1e_alphaX%.1f_f_star10_%06.4f_alpha_star%06.4f_f_esc10_%06.4f_alpha_esc%06.4f_Mturn%.1e_t_star%06.4f_Pop%i_%i_%.0fMpc", zp, X_LUMINOSITY, X_RAY_SPEC_INDEX, F_STAR10, ALPHA_STAR, F_ESC10, ALPHA_ESC, M_TURN, T_AST, Pop, HII_DIM, BOX_LEN);
@@ -979,16 +1028,9 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	  else {
       sprintf(filename, "../Boxes/Ts_evolution/Tk_zprime%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", zp, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN);
 	  }
-      if (!(F=fopen(filename, "wb"))){
-	fprintf(stderr, "Ts.c: WARNING: Unable to open output file %s\n", filename);
-	fprintf(LOG, "Ts.c: WARNING: Unable to open output file %s\n", filename);
-      }
-      else{
-	if (mod_fwrite(Tk_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-	  fprintf(stderr, "Ts.c: Write error occured while writting Tk box.\n");
-	  fprintf(LOG, "Ts.c: Write error occured while writting Tk box.\n");
-	}
-	fclose(F);
+      if (async_fwrite(filename, Tk_box, sizeof(float)*HII_TOT_NUM_PIXELS) < 0){
+	fprintf(stderr, "Ts.c: WARNING: Unable to queue output file %s\n", filename);
+	fprintf(LOG, "Ts.c: WARNING: Unable to queue output file %s\n", filename);
       }
       // then xe_neutral
 	    // New in v2
@@ -998,16 +1040,9 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	  else {
       sprintf(filename, "../Boxes/Ts_evolution/xeneutral_zprime%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", zp, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN);
 	  }
-      if (!(F=fopen(filename, "wb"))){
-	fprintf(stderr, "Ts.c: WARNING: Unable to open output file %s\n", filename);
-	fprintf(LOG, "Ts.c: WARNING: Unable to open output file %s\n", filename);
-      }
-      else{
-	if (mod_fwrite(x_e_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-	  fprintf(stderr, "Ts.c: Write error occured while writting Tk box.\n");
-	  fprintf(LOG, "Ts.c: Write error occured while writting Tk box.\n");
-	}
-	fclose(F);
+      if (async_fwrite(filename, x_e_box, sizeof(float)*HII_TOT_NUM_PIXELS) < 0){
+	fprintf(stderr, "Ts.c: WARNING: Unable to queue output file %s\n", filename);
+	fprintf(LOG, "Ts.c: WARNING: Unable to queue output file %s\n", filename);
       }
     }
 
@@ -1020,16 +1055,9 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 	else {
     sprintf(filename, "../Boxes/Ts_z%06.2f_L_X%.1e_alphaX%.1f_TvirminX%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", zp, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_TURN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN); 
 	}
-      if (!(F=fopen(filename, "wb"))){
-	fprintf(stderr, "Ts.c: WARNING: Unable to open output file %s\n", filename);
-	fprintf(LOG, "Ts.c: WARNING: Unable to open output file %s\n", filename);
-      }
-      else{
-	if (mod_fwrite(Ts, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-	  fprintf(stderr, "Ts.c: Write error occured while writting Tk box.\n");
-	  fprintf(LOG, "Ts.c: Write error occured while writting Tk box.\n");
-	}
-	fclose(F);
+      if (async_fwrite_lossy(filename, Ts, HII_TOT_NUM_PIXELS, HII_D*HII_D, TS_BOX_ERROR) < 0){
+	fprintf(stderr, "Ts.c: WARNING: Unable to queue output file %s\n", filename);
+	fprintf(LOG, "Ts.c: WARNING: Unable to queue output file %s\n", filename);
       }
     }
 
@@ -1041,6 +1069,12 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
 
 
 
+  // stage exit: wait for the queued boxes to reach the disk
+  if ((write_status = async_write_flush()) != 0){
+    fprintf(stderr, "Ts.c: Write error occured while writting the output boxes.\n");
+    fprintf(LOG, "Ts.c: Write error occured while writting the output boxes.\n");
+  }
+
   //deallocate
   fclose(LOG); fclose(GLOBAL_EVOL); free(Tk_box); free(x_e_box); free(Ts);
   if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
@@ -1051,7 +1085,7 @@ double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR
     free(delNL0[R_ct]);
   }
   destruct_heat();
-  return 0;
+  return write_status ? -1 : 0;
 }
 
 
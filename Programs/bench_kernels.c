@@ -0,0 +1,553 @@
+#include "heating_helper_progs.c"
+#include "halo_helper_progs.c"
+#include "power_spec_helper_progs.c"
+
+/*
+  USAGE: bench_kernels [-r <repetitions>] [<kernel name> ...]
+
+  Program BENCH_KERNELS times the numerical hot spots of the code in isolation, on synthetic
+  inputs sized according to DIM and HII_DIM in INIT_PARAMS.H.  Each kernel is run
+  BENCH_WARMUP_REPS times untimed, and then <repetitions> (default BENCH_REPS) timed times.
+  For each kernel it reports the min, median, mean and standard deviation of the wall time,
+  together with the median time per cell (ns/cell) and the effective memory bandwidth (GB/s),
+  estimated from the bytes that the kernel must read and write per run.
+
+  If kernel names are given, only those are run.  The available kernels are:
+  HII_filter, evolveInt, Nion_Spline_density, splint, splined_recombination_rate,
+  update_in_sphere, overlap_halo, bin_power_spec and mod_fread.
+
+  NOTE: evolveInt is timed with the constant ionizing efficiency (SHARP_CUTOFF) parametrization,
+  which doesn't require the v2 conditional SFRD tables of Ts.c.  Threaded kernels use NUMCORES threads.
+  The program needs to be run from the Programs directory, as init_heat reads ../External_tables/.
+*/
+
+#define BENCH_WARMUP_REPS (int) 2
+#define BENCH_REPS (int) 10
+#define BENCH_EVOLVE_CELLS (int) 65536 // number of cells passed through evolveInt per run
+#define BENCH_SPLINE_EVALS (int) 4000000 // number of spline evaluations per run
+#define BENCH_NUM_SPHERES (int) 1000 // number of spheres painted per run
+#define BENCH_SPHERE_R (float) 5 // radius of the spheres in cells
+#define BENCH_NUM_HALOS (int) 200 // number of halo overlap checks per run
+#define BENCH_HALO_R (float) 5 // radius of the halos in cells of the high-res box
+#define BENCH_FREAD_FILE "../Boxes/bench_kernels_mod_fread_tmp"
+
+struct bench_kernel{
+  const char *name;
+  int (*setup)(double *cells, double *bytes); // returns 0 on success; sets the work per run
+  void (*prepare)(); // untimed, called before every run (can be NULL)
+  void (*run)();
+  void (*teardown)();
+};
+
+static gsl_rng *bench_rng;
+
+
+/************************  HII_filter  ************************/
+static fftwf_complex *filter_box, *filter_box_orig;
+
+int setup_HII_filter(double *cells, double *bytes){
+  unsigned long long ct;
+
+  filter_box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  filter_box_orig = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  if (!filter_box || !filter_box_orig)
+    return -1;
+  for (ct=0; ct<HII_KSPACE_NUM_PIXELS; ct++)
+    filter_box_orig[ct] = gsl_ran_ugaussian(bench_rng) + gsl_ran_ugaussian(bench_rng)*I;
+  *cells = HII_KSPACE_NUM_PIXELS;
+  *bytes = 2.0*sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS; // read and write of the box
+  return 0;
+}
+void prepare_HII_filter(){
+  memcpy(filter_box, filter_box_orig, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+}
+void run_HII_filter(){
+  HII_filter(filter_box, HII_FILTER, 10*BOX_LEN/(float)HII_DIM);
+}
+void teardown_HII_filter(){
+  fftwf_free(filter_box); fftwf_free(filter_box_orig);
+}
+
+
+/************************  evolveInt  ************************/
+static float (*evolve_delNL0)[NUM_FILTER_STEPS_FOR_Ts];
+static double evolve_freq_int[NUM_FILTER_STEPS_FOR_Ts];
+static double *evolve_ans;
+static float evolve_zp;
+
+int setup_evolveInt(double *cells, double *bytes){
+  int R_ct, ct;
+  float R, R_factor, prev_zpp, prev_R;
+
+  if (init_heat() < 0)
+    return -1;
+  evolve_delNL0 = malloc(sizeof(float)*NUM_FILTER_STEPS_FOR_Ts*BENCH_EVOLVE_CELLS);
+  evolve_ans = malloc(sizeof(double)*2*BENCH_EVOLVE_CELLS);
+  if (!evolve_delNL0 || !evolve_ans)
+    return -1;
+
+  // same set-up as the zp loop in Ts.c, for a single z'
+  HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY = 0;
+  M_MIN = M_TURNOVER;
+  F_STAR10 = STELLAR_BARYON_FRAC;
+  X_LUMINOSITY = pow(10., L_X);
+  evolve_zp = 15;
+  NO_LIGHT = 0;
+  R = L_FACTOR*BOX_LEN/(float)HII_DIM;
+  R_factor = pow(R_XLy_MAX/R, 1/(float)NUM_FILTER_STEPS_FOR_Ts);
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
+    R_values[R_ct] = R;
+    sigma_atR[R_ct] = sigma_z0(RtoM(R));
+    sigma_Tmin[R_ct] = sigma_z0(M_MIN);
+    ST_over_PS[R_ct] = 1;
+    sum_lyn[R_ct] = 1;
+    evolve_freq_int[R_ct] = 1e-20;
+    if (R_ct==0){
+      prev_zpp = evolve_zp;
+      prev_R = 0;
+    }
+    else{
+      prev_zpp = zpp_edge[R_ct-1];
+      prev_R = R_values[R_ct-1];
+    }
+    zpp_edge[R_ct] = prev_zpp - (R_values[R_ct] - prev_R)*CMperMPC / drdz(prev_zpp);
+    R *= R_factor;
+  }
+  growth_factor_zp = dicke(evolve_zp);
+  dgrowth_factor_dzp = ddicke_dz(evolve_zp);
+  dt_dzp = dtdz(evolve_zp);
+  const_zp_prefactor = 1;
+
+  // synthetic density field, with the smoothed fluctuations decreasing with filter scale
+  for (ct=0; ct<BENCH_EVOLVE_CELLS; ct++){
+    for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++)
+      evolve_delNL0[ct][R_ct] = gsl_ran_gaussian(bench_rng, sigma_atR[R_ct]);
+    evolve_ans[2*ct] = 1e-3;
+    evolve_ans[2*ct+1] = T_cmb*(1+evolve_zp);
+  }
+  *cells = BENCH_EVOLVE_CELLS;
+  *bytes = (sizeof(float)*NUM_FILTER_STEPS_FOR_Ts + 2*sizeof(double))*(double)BENCH_EVOLVE_CELLS;
+  return 0;
+}
+void run_evolveInt(){
+  int ct;
+  double dansdz[5];
+
+#pragma omp parallel for private(dansdz)
+  for (ct=0; ct<BENCH_EVOLVE_CELLS; ct++){
+    evolveInt(evolve_zp, 0, evolve_delNL0[ct], evolve_freq_int, evolve_freq_int, evolve_freq_int,
+	      1, &evolve_ans[2*ct], dansdz);
+  }
+}
+void teardown_evolveInt(){
+  free(evolve_delNL0); free(evolve_ans);
+  destruct_heat();
+}
+
+
+/************************  Nion_Spline_density and splint  ************************/
+static float *spline_delta;
+static float spline_sum;
+
+void destroy_bench_Nion_spline(){
+  free(Mass_Spline); free(Sigma_Spline); free(dSigmadm_Spline);
+  free(second_derivs_sigma); free(second_derivs_dsigma);
+  free(Overdense_spline_SFR); free(Nion_spline); free(second_derivs_Nion);
+  free(xi_SFR); free(wi_SFR);
+  gsl_spline_free(NionLow_spline);
+  gsl_interp_accel_free(NionLow_spline_acc);
+}
+
+// set up the Nion interpolation tables as find_HII_bubbles does, at z=8 for R=10 cells
+int init_bench_Nion_spline(){
+  float massofscaleR;
+
+  Overdense_spline_SFR = calloc(NSFR_high,sizeof(float));
+  Nion_spline = calloc(NSFR_high,sizeof(float));
+  second_derivs_Nion = calloc(NSFR_high,sizeof(float));
+  xi_SFR = calloc((NGL_SFR+1),sizeof(float));
+  wi_SFR = calloc((NGL_SFR+1),sizeof(float));
+  if (!Overdense_spline_SFR || !Nion_spline || !second_derivs_Nion || !xi_SFR || !wi_SFR)
+    return -1;
+  Mlim_Fstar = Mass_limit(STELLAR_BARYON_PL, STELLAR_BARYON_FRAC);
+  Mlim_Fesc = Mass_limit(ESC_PL, ESC_FRAC);
+  initialiseSplinedSigmaM(M_TURNOVER/50.0, 5e16);
+  massofscaleR = RtoM(10*BOX_LEN/(float)HII_DIM);
+  initialiseGL_Nion(NGL_SFR, M_TURNOVER, massofscaleR);
+  initialise_Nion_spline(8, massofscaleR, M_TURNOVER, STELLAR_BARYON_PL, ESC_PL, STELLAR_BARYON_FRAC, ESC_FRAC, Mlim_Fstar, Mlim_Fesc);
+  return 0;
+}
+
+int setup_Nion_Spline_density(double *cells, double *bytes){
+  int ct;
+
+  if (init_bench_Nion_spline() < 0)
+    return -1;
+  if (!(spline_delta = malloc(sizeof(float)*BENCH_SPLINE_EVALS)))
+    return -1;
+  // lognormal-like overdensities, mostly in the low density (gsl spline) regime
+  for (ct=0; ct<BENCH_SPLINE_EVALS; ct++)
+    spline_delta[ct] = exp(gsl_ran_gaussian(bench_rng, 0.5)) - 1;
+  *cells = BENCH_SPLINE_EVALS;
+  *bytes = sizeof(float)*(double)BENCH_SPLINE_EVALS;
+  return 0;
+}
+void run_Nion_Spline_density(){
+  int ct;
+  float val, sum=0;
+
+  for (ct=0; ct<BENCH_SPLINE_EVALS; ct++){
+    Nion_Spline_density(spline_delta[ct], &val);
+    sum += val;
+  }
+  spline_sum = sum;
+}
+void teardown_Nion_Spline_density(){
+  free(spline_delta);
+  destroy_bench_Nion_spline();
+}
+
+int setup_splint(double *cells, double *bytes){
+  int ct;
+
+  if (init_bench_Nion_spline() < 0)
+    return -1;
+  if (!(spline_delta = malloc(sizeof(float)*BENCH_SPLINE_EVALS)))
+    return -1;
+  // high density regime, interpolated with splint
+  for (ct=0; ct<BENCH_SPLINE_EVALS; ct++)
+    spline_delta[ct] = 1.5 + gsl_rng_uniform(bench_rng)*(0.99*Deltac - 1.5);
+  *cells = BENCH_SPLINE_EVALS;
+  *bytes = sizeof(float)*(double)BENCH_SPLINE_EVALS;
+  return 0;
+}
+void run_splint(){
+  int ct;
+  float val, sum=0;
+
+  for (ct=0; ct<BENCH_SPLINE_EVALS; ct++){
+    splint(Overdense_spline_SFR-1, Nion_spline-1, second_derivs_Nion-1, NSFR_high, spline_delta[ct], &val);
+    sum += val;
+  }
+  spline_sum = sum;
+}
+void teardown_splint(){
+  free(spline_delta);
+  destroy_bench_Nion_spline();
+}
+
+
+/************************  splined_recombination_rate  ************************/
+static float *rr_z, *rr_gamma;
+static double rr_sum;
+
+int setup_splined_recombination_rate(double *cells, double *bytes){
+  int ct;
+
+  init_MHR();
+  rr_z = malloc(sizeof(float)*BENCH_SPLINE_EVALS);
+  rr_gamma = malloc(sizeof(float)*BENCH_SPLINE_EVALS);
+  if (!rr_z || !rr_gamma)
+    return -1;
+  // effective redshifts and photo-ionization rates in the range of find_HII_bubbles
+  for (ct=0; ct<BENCH_SPLINE_EVALS; ct++){
+    rr_z[ct] = 6 + 14*gsl_rng_uniform(bench_rng);
+    rr_gamma[ct] = exp(RR_lnGamma_min + gsl_rng_uniform(bench_rng)*RR_DEL_lnGamma*(RR_lnGamma_NPTS-1));
+  }
+  *cells = BENCH_SPLINE_EVALS;
+  *bytes = 2*sizeof(float)*(double)BENCH_SPLINE_EVALS;
+  return 0;
+}
+void run_splined_recombination_rate(){
+  int ct;
+  double sum=0;
+
+  for (ct=0; ct<BENCH_SPLINE_EVALS; ct++)
+    sum += splined_recombination_rate(rr_z[ct], rr_gamma[ct]);
+  rr_sum = sum;
+}
+void teardown_splined_recombination_rate(){
+  free(rr_z); free(rr_gamma);
+  free_MHR();
+}
+
+
+/************************  update_in_sphere  ************************/
+static float *sphere_box, *sphere_pos;
+
+int setup_update_in_sphere(double *cells, double *bytes){
+  int ct, R_index;
+
+  sphere_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+  sphere_pos = (float *) malloc(sizeof(float)*3*BENCH_NUM_SPHERES);
+  if (!sphere_box || !sphere_pos)
+    return -1;
+  for (ct=0; ct<3*BENCH_NUM_SPHERES; ct++)
+    sphere_pos[ct] = gsl_rng_uniform(bench_rng);
+  // the cells of the cube enclosing each sphere are visited
+  R_index = ceil(BENCH_SPHERE_R);
+  *cells = BENCH_NUM_SPHERES * pow(2*R_index+1, 3);
+  *bytes = *cells * sizeof(float);
+  return 0;
+}
+void prepare_update_in_sphere(){
+  unsigned long long ct;
+  for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+    sphere_box[ct] = 1;
+}
+void run_update_in_sphere(){
+  int ct;
+
+  for (ct=0; ct<BENCH_NUM_SPHERES; ct++)
+    update_in_sphere(sphere_box, HII_DIM, BENCH_SPHERE_R/(float)HII_DIM,
+		     sphere_pos[3*ct], sphere_pos[3*ct+1], sphere_pos[3*ct+2]);
+}
+void teardown_update_in_sphere(){
+  free(sphere_box); free(sphere_pos);
+}
+
+
+/************************  overlap_halo  ************************/
+static bitset_word *halo_box;
+static int *halo_pos, halo_overlaps;
+
+int setup_overlap_halo(double *cells, double *bytes){
+  int ct, R_index;
+
+  halo_box = bitset_alloc(TOT_NUM_PIXELS);
+  halo_pos = (int *) malloc(sizeof(int)*3*BENCH_NUM_HALOS);
+  if (!halo_box || !halo_pos)
+    return -1;
+  // overlap_halo writes to the log file, so point it somewhere harmless
+  if (!(LOG = fopen("/dev/null", "w")))
+    return -1;
+  // an empty in_halo box is the worst case, in which the entire sphere is checked
+  for (ct=0; ct<3*BENCH_NUM_HALOS; ct++)
+    halo_pos[ct] = gsl_rng_uniform_int(bench_rng, DIM);
+  R_index = ceil(BENCH_HALO_R*R_OVERLAP_FACTOR);
+  *cells = BENCH_NUM_HALOS * pow(2*R_index+1, 3);
+  *bytes = *cells / 8; // one bit per cell
+  return 0;
+}
+void run_overlap_halo(){
+  int ct, n=0;
+
+  for (ct=0; ct<BENCH_NUM_HALOS; ct++)
+    n += overlap_halo(halo_box, BENCH_HALO_R*BOX_LEN/(float)DIM, halo_pos[3*ct], halo_pos[3*ct+1], halo_pos[3*ct+2]);
+  halo_overlaps = n;
+}
+void teardown_overlap_halo(){
+  free(halo_box); free(halo_pos);
+  if (LOG) fclose(LOG);
+}
+
+
+/************************  delta_T power spectrum binning  ************************/
+static fftwf_complex *ps_box;
+static double *ps_p_box, *ps_k_ave;
+static unsigned long long *ps_in_bin_ct;
+static int ps_num_bins;
+static float ps_k_factor, ps_k_first_bin_ceil, ps_k_max;
+
+int setup_bin_power_spec(double *cells, double *bytes){
+  unsigned long long ct;
+  float k_ceil;
+
+  // same binning as in delta_T.c
+  ps_k_factor = 1.5;
+  ps_k_first_bin_ceil = DELTA_K;
+  ps_k_max = DELTA_K*HII_DIM;
+  ps_num_bins = 0;
+  k_ceil = ps_k_first_bin_ceil;
+  while (k_ceil < ps_k_max){
+    ps_num_bins++;
+    k_ceil*=ps_k_factor;
+  }
+  ps_box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  ps_p_box = (double *) malloc(sizeof(double)*ps_num_bins);
+  ps_k_ave = (double *) malloc(sizeof(double)*ps_num_bins);
+  ps_in_bin_ct = (unsigned long long *) malloc(sizeof(unsigned long long)*ps_num_bins);
+  if (!ps_box || !ps_p_box || !ps_k_ave || !ps_in_bin_ct)
+    return -1;
+  for (ct=0; ct<HII_KSPACE_NUM_PIXELS; ct++)
+    ps_box[ct] = gsl_ran_ugaussian(bench_rng) + gsl_ran_ugaussian(bench_rng)*I;
+  *cells = HII_KSPACE_NUM_PIXELS;
+  *bytes = sizeof(fftwf_complex)*(double)HII_KSPACE_NUM_PIXELS;
+  return 0;
+}
+void prepare_bin_power_spec(){
+  int ct;
+  for (ct=0; ct<ps_num_bins; ct++){
+    ps_p_box[ct] = ps_k_ave[ct] = 0;
+    ps_in_bin_ct[ct] = 0;
+  }
+}
+void run_bin_power_spec(){
+  HII_bin_power_spec(ps_box, ps_k_first_bin_ceil, ps_k_factor, ps_k_max, ps_p_box, ps_k_ave, ps_in_bin_ct);
+}
+void teardown_bin_power_spec(){
+  fftwf_free(ps_box); free(ps_p_box); free(ps_k_ave); free(ps_in_bin_ct);
+}
+
+
+/************************  mod_fread  ************************/
+static float *fread_box;
+static FILE *fread_F;
+
+int setup_mod_fread(double *cells, double *bytes){
+  unsigned long long ct;
+  FILE *F;
+
+  if (!(fread_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS)))
+    return -1;
+  for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+    fread_box[ct] = ct;
+  system("mkdir ../Boxes");
+  if (!(F = fopen(BENCH_FREAD_FILE, "wb")))
+    return -1;
+  if (mod_fwrite(fread_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+    fclose(F);
+    return -1;
+  }
+  fclose(F);
+  if (!(fread_F = fopen(BENCH_FREAD_FILE, "rb")))
+    return -1;
+  // NOTE: after the warm-up the file is in the page cache, so this measures the in-memory read path
+  *cells = HII_TOT_NUM_PIXELS;
+  *bytes = sizeof(float)*(double)HII_TOT_NUM_PIXELS;
+  return 0;
+}
+void prepare_mod_fread(){
+  rewind(fread_F);
+}
+void run_mod_fread(){
+  if (mod_fread(fread_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, fread_F)!=1)
+    fprintf(stderr, "bench_kernels: read error in mod_fread\n");
+}
+void teardown_mod_fread(){
+  if (fread_F) fclose(fread_F);
+  remove(BENCH_FREAD_FILE);
+  free(fread_box);
+}
+
+
+static struct bench_kernel kernels[] = {
+  {"HII_filter", setup_HII_filter, prepare_HII_filter, run_HII_filter, teardown_HII_filter},
+  {"evolveInt", setup_evolveInt, NULL, run_evolveInt, teardown_evolveInt},
+  {"Nion_Spline_density", setup_Nion_Spline_density, NULL, run_Nion_Spline_density, teardown_Nion_Spline_density},
+  {"splint", setup_splint, NULL, run_splint, teardown_splint},
+  {"splined_recombination_rate", setup_splined_recombination_rate, NULL, run_splined_recombination_rate, teardown_splined_recombination_rate},
+  {"update_in_sphere", setup_update_in_sphere, prepare_update_in_sphere, run_update_in_sphere, teardown_update_in_sphere},
+  {"overlap_halo", setup_overlap_halo, NULL, run_overlap_halo, teardown_overlap_halo},
+  {"bin_power_spec", setup_bin_power_spec, prepare_bin_power_spec, run_bin_power_spec, teardown_bin_power_spec},
+  {"mod_fread", setup_mod_fread, prepare_mod_fread, run_mod_fread, teardown_mod_fread},
+};
+#define NUM_KERNELS (int) (sizeof(kernels)/sizeof(kernels[0]))
+
+
+int compare_doubles(const void *a, const void *b){
+  const double *da = (const double *) a;
+  const double *db = (const double *) b;
+
+  return (*da > *db) - (*da < *db);
+}
+
+
+/*
+  Function TIME_KERNEL runs the warm-up and timed repetitions of a kernel and prints
+  one line of statistics.  Returns -1 if the kernel could not be set up.
+*/
+int time_kernel(struct bench_kernel *kernel, int reps){
+  double cells, bytes, t_start, *times, mean, stddev, median;
+  int rep;
+
+  if (kernel->setup(&cells, &bytes) < 0){
+    fprintf(stderr, "bench_kernels: unable to set up kernel %s\n", kernel->name);
+    kernel->teardown();
+    return -1;
+  }
+  if (!(times = (double *) malloc(sizeof(double)*reps))){
+    kernel->teardown();
+    return -1;
+  }
+
+  for (rep=0; rep<BENCH_WARMUP_REPS; rep++){
+    if (kernel->prepare) kernel->prepare();
+    kernel->run();
+  }
+  mean = 0;
+  for (rep=0; rep<reps; rep++){
+    if (kernel->prepare) kernel->prepare();
+    t_start = omp_get_wtime();
+    kernel->run();
+    times[rep] = omp_get_wtime() - t_start;
+    mean += times[rep];
+  }
+  mean /= (double) reps;
+  stddev = 0;
+  for (rep=0; rep<reps; rep++)
+    stddev += pow(times[rep]-mean, 2);
+  stddev = reps > 1 ? sqrt(stddev/(reps-1.0)) : 0;
+  qsort(times, reps, sizeof(double), compare_doubles);
+  median = (reps % 2) ? times[reps/2] : 0.5*(times[reps/2-1] + times[reps/2]);
+
+  fprintf(stdout, "%-28s %5i %12.3f %12.3f %12.3f %10.3f %12.2f %10.3f\n", kernel->name, reps,
+	  1e3*times[0], 1e3*median, 1e3*mean, 1e3*stddev, 1e9*median/cells, bytes/median/1e9);
+  fflush(stdout);
+
+  free(times);
+  kernel->teardown();
+  return 0;
+}
+
+
+int main(int argc, char ** argv){
+  int i, k, reps, arg_start, n_failed=0, selected;
+
+  reps = BENCH_REPS;
+  arg_start = 1;
+  if ( (argc > 2) && !strcmp(argv[1], "-r") ){
+    reps = atoi(argv[2]);
+    arg_start = 3;
+  }
+  if (reps < 1){
+    fprintf(stderr, "USAGE: bench_kernels [-r <repetitions>] [<kernel name> ...]\nAborting...\n");
+    return -1;
+  }
+  for (i=arg_start; i<argc; i++){
+    for (k=0; k<NUM_KERNELS; k++){
+      if (!strcmp(argv[i], kernels[k].name))
+	break;
+    }
+    if (k == NUM_KERNELS){
+      fprintf(stderr, "bench_kernels: unknown kernel %s. Available kernels are:\n", argv[i]);
+      for (k=0; k<NUM_KERNELS; k++)
+	fprintf(stderr, "  %s\n", kernels[k].name);
+      return -1;
+    }
+  }
+
+  omp_set_num_threads(NUMCORES);
+  init_ps();
+  bench_rng = gsl_rng_alloc(gsl_rng_mt19937);
+  gsl_rng_set(bench_rng, RANDOM_SEED);
+
+  fprintf(stdout, "Kernel benchmark DIM=%i, HII_DIM=%i, BOX_LEN=%.0fMpc, NUMCORES=%i, %i warm-up runs\n",
+	  DIM, HII_DIM, BOX_LEN, NUMCORES, BENCH_WARMUP_REPS);
+  fprintf(stdout, "%-28s %5s %12s %12s %12s %10s %12s %10s\n", "kernel", "reps", "min [ms]", "median [ms]",
+	  "mean [ms]", "std [ms]", "ns/cell", "GB/s");
+  for (k=0; k<NUM_KERNELS; k++){
+    // run all kernels, unless a subset was requested
+    selected = (argc == arg_start);
+    for (i=arg_start; i<argc; i++){
+      if (!strcmp(argv[i], kernels[k].name))
+	selected = 1;
+    }
+    if (selected && (time_kernel(&kernels[k], reps) < 0))
+      n_failed++;
+  }
+
+  gsl_rng_free(bench_rng);
+  free_ps();
+  return n_failed ? -1 : 0;
+}
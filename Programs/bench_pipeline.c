@@ -0,0 +1,380 @@
+#include <math.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <glob.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "../Parameter_files/HEAT_PARAMS.H"
+
+/*
+  USAGE: bench_pipeline <record | compare> <reference file>
+
+  Program BENCH_PIPELINE runs the init -> perturb_field -> Ts -> find_HII_bubbles -> delta_T
+  chain, using the same logarithmic redshift stepping as drive_logZscroll_Ts, and records the
+  wall time and peak resident memory of every stage.  At the end of the run, the neutral
+  fraction history and the 21cm power spectra are either written out to <reference file>
+  (record), or compared to a previously recorded <reference file> within the tolerances below
+  (compare).  The program exits with status 0 only if the run passes the comparison; a missing
+  <reference file> is a failure too, checked before the run.
+
+  It is not meant to be called by hand: "make bench" compiles the reduced-size, fixed-seed
+  configurations defined in the Makefile into ../Bench/<config>/Programs/ and runs it from there.
+  The references are not shipped: record them once with "make bench_record" on a trusted build
+  (e.g. the last release), and keep ../Bench/references/ for later comparisons (see INSTALL).
+
+  NOTE: the halo field and lightcone stages of the driver are not part of the benchmark.
+*/
+
+#define BENCH_ZLOW (float) (6) // lowest redshift of the run, as in drive_logZscroll_Ts
+#define BENCH_NF_TOL (float) (0.01) // maximum allowed absolute difference in the global neutral fraction
+#define BENCH_PS_TOL (float) (0.1) // maximum allowed fractional difference in a power spectrum bin
+#define BENCH_PS_KMAX (float) (1.0) // only compare power spectrum bins below this k (in Mpc^-1)
+#define BENCH_PS_NF_MIN (float) (0.01) // don't compare the power spectrum once the IGM is (nearly) ionized
+
+#define BENCH_MAX_Z_STEPS (int) 1000
+#define BENCH_MAX_K_BINS (int) 200
+
+enum { STAGE_INIT, STAGE_PERTURB, STAGE_TS, STAGE_BUBBLES, STAGE_DELTA_T, NUM_STAGES };
+static const char *stage_names[NUM_STAGES] = {"init", "perturb_field", "Ts", "find_HII_bubbles", "delta_T"};
+static double stage_wall[NUM_STAGES]; // total wall time in s
+static long stage_maxrss[NUM_STAGES]; // peak resident set size in kB
+static int stage_calls[NUM_STAGES];
+
+// global neutral fraction and 21cm power spectrum at a given redshift
+struct bench_snapshot{
+  float z, nf;
+  int n_k;
+  float k[BENCH_MAX_K_BINS], ps[BENCH_MAX_K_BINS];
+};
+
+
+/*
+  Function RUN_STAGE executes <cmnd> through the shell, adding its wall time and peak
+  memory to the totals of <stage>.  Returns the exit status of the command, or -1 if the
+  command could not be run or was terminated by a signal.
+*/
+int run_stage(int stage, const char *cmnd){
+  struct timeval t_start, t_end;
+  struct rusage usage;
+  pid_t pid;
+  int status;
+
+  fprintf(stderr, "Now calling: %s\n", cmnd);
+  fflush(NULL);
+  gettimeofday(&t_start, NULL);
+  pid = fork();
+  if (pid < 0){
+    fprintf(stderr, "bench_pipeline: unable to fork for %s\n", cmnd);
+    return -1;
+  }
+  if (pid == 0){
+    execl("/bin/sh", "sh", "-c", cmnd, (char *) NULL);
+    _exit(127);
+  }
+  if (wait4(pid, &status, 0, &usage) < 0){
+    fprintf(stderr, "bench_pipeline: wait failed for %s\n", cmnd);
+    return -1;
+  }
+  gettimeofday(&t_end, NULL);
+
+  stage_wall[stage] += (t_end.tv_sec - t_start.tv_sec) + 1e-6*(t_end.tv_usec - t_start.tv_usec);
+  if (usage.ru_maxrss > stage_maxrss[stage])
+    stage_maxrss[stage] = usage.ru_maxrss;
+  stage_calls[stage]++;
+
+  if (!WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+
+/*
+  Function READ_SNAPSHOT fills <snap> from the delta_T power spectrum file at redshift z.
+  The neutral fraction is taken from the file name, as in extract_delTps.pl.
+  Returns 0 on success, -1 if the file is missing or unreadable.
+*/
+int read_snapshot(float z, struct bench_snapshot *snap){
+  char pattern[500], *nf_str;
+  glob_t g;
+  FILE *F;
+  float k, p, perr;
+
+  if (DIMENSIONAL_T_POWER_SPEC)
+    sprintf(pattern, "../Output_files/Deldel_T_power_spec/ps_z%06.2f_nf*_%i_%.0fMpc*", z, HII_DIM, BOX_LEN);
+  else
+    sprintf(pattern, "../Output_files/Deldel_T_power_spec/Dimensionless/ps_z%06.2f_nf*_%i_%.0fMpc*", z, HII_DIM, BOX_LEN);
+  if ( (glob(pattern, 0, NULL, &g) != 0) || (g.gl_pathc < 1) ){
+    fprintf(stderr, "bench_pipeline: no power spectrum found matching %s\n", pattern);
+    globfree(&g);
+    return -1;
+  }
+
+  snap->z = z;
+  nf_str = strstr(g.gl_pathv[0], "_nf");
+  snap->nf = atof(nf_str + 3);
+  if (!(F = fopen(g.gl_pathv[0], "r"))){
+    fprintf(stderr, "bench_pipeline: unable to open %s\n", g.gl_pathv[0]);
+    globfree(&g);
+    return -1;
+  }
+  snap->n_k = 0;
+  while ( (snap->n_k < BENCH_MAX_K_BINS) && (fscanf(F, "%e %e %e", &k, &p, &perr) == 3) ){
+    snap->k[snap->n_k] = k;
+    snap->ps[snap->n_k] = p;
+    snap->n_k++;
+  }
+  fclose(F);
+  globfree(&g);
+  return 0;
+}
+
+
+int write_reference(const char *filename, struct bench_snapshot *snaps, int n_snaps){
+  FILE *F;
+  int i, j;
+
+  if (!(F = fopen(filename, "w"))){
+    fprintf(stderr, "bench_pipeline: unable to open reference file %s for writting\n", filename);
+    return -1;
+  }
+  fprintf(F, "%i %i %f %li\n", DIM, HII_DIM, BOX_LEN, RANDOM_SEED);
+  fprintf(F, "%i\n", n_snaps);
+  for (i=0; i<n_snaps; i++){
+    fprintf(F, "%f\t%f\t%i\n", snaps[i].z, snaps[i].nf, snaps[i].n_k);
+    for (j=0; j<snaps[i].n_k; j++)
+      fprintf(F, "%e\t%e\n", snaps[i].k[j], snaps[i].ps[j]);
+  }
+  fclose(F);
+  return 0;
+}
+
+
+int read_reference(const char *filename, struct bench_snapshot *snaps, int *n_snaps){
+  FILE *F;
+  int i, j, ref_dim, ref_hii_dim;
+  float ref_box_len;
+  long ref_seed;
+
+  if (!(F = fopen(filename, "r"))){
+    fprintf(stderr, "bench_pipeline: unable to open reference file %s\n", filename);
+    return -1;
+  }
+  if ( (fscanf(F, "%i %i %f %li", &ref_dim, &ref_hii_dim, &ref_box_len, &ref_seed) != 4) || (fscanf(F, "%i", n_snaps) != 1) ||
+       (*n_snaps > BENCH_MAX_Z_STEPS) ){
+    fprintf(stderr, "bench_pipeline: reference file %s is corrupted\n", filename);
+    fclose(F);
+    return -1;
+  }
+  if ( (ref_dim != DIM) || (ref_hii_dim != HII_DIM) || (fabs(ref_box_len-BOX_LEN) > 1e-3) || (ref_seed != RANDOM_SEED) ){
+    fprintf(stderr, "bench_pipeline: reference file %s was recorded for DIM=%i, HII_DIM=%i, BOX_LEN=%.0f, RANDOM_SEED=%li\n",
+	    filename, ref_dim, ref_hii_dim, ref_box_len, ref_seed);
+    fclose(F);
+    return -1;
+  }
+  for (i=0; i<*n_snaps; i++){
+    if ( (fscanf(F, "%f %f %i", &snaps[i].z, &snaps[i].nf, &snaps[i].n_k) != 3) || (snaps[i].n_k > BENCH_MAX_K_BINS) ){
+      fprintf(stderr, "bench_pipeline: reference file %s is corrupted\n", filename);
+      fclose(F);
+      return -1;
+    }
+    for (j=0; j<snaps[i].n_k; j++){
+      if (fscanf(F, "%e %e", &snaps[i].k[j], &snaps[i].ps[j]) != 2){
+	fprintf(stderr, "bench_pipeline: reference file %s is corrupted\n", filename);
+	fclose(F);
+	return -1;
+      }
+    }
+  }
+  fclose(F);
+  return 0;
+}
+
+
+/*
+  Function COMPARE_SNAPSHOTS returns the number of quantities of the run which fall outside
+  of the tolerances with respect to the reference
+*/
+int compare_snapshots(struct bench_snapshot *run, int n_run, struct bench_snapshot *ref, int n_ref){
+  int i, j, n_fail=0;
+  float frac_diff;
+
+  if (n_run != n_ref){
+    fprintf(stderr, "bench_pipeline: the run has %i redshift outputs, the reference has %i\n", n_run, n_ref);
+    return 1;
+  }
+  for (i=0; i<n_run; i++){
+    if (fabs(run[i].z - ref[i].z) > 1e-3){
+      fprintf(stderr, "bench_pipeline: redshift mismatch, z=%.2f in the run vs z=%.2f in the reference\n", run[i].z, ref[i].z);
+      return 1;
+    }
+
+    if (fabs(run[i].nf - ref[i].nf) > BENCH_NF_TOL){
+      fprintf(stderr, "FAIL: z=%06.2f, neutral fraction %f, reference %f\n", run[i].z, run[i].nf, ref[i].nf);
+      n_fail++;
+    }
+
+    if (ref[i].nf < BENCH_PS_NF_MIN)
+      continue;
+    if (run[i].n_k != ref[i].n_k){
+      fprintf(stderr, "FAIL: z=%06.2f, %i power spectrum bins, reference has %i\n", run[i].z, run[i].n_k, ref[i].n_k);
+      n_fail++;
+      continue;
+    }
+    for (j=0; j<run[i].n_k; j++){
+      if (ref[i].k[j] > BENCH_PS_KMAX)
+	break;
+      if (ref[i].ps[j] > 0)
+	frac_diff = fabs(run[i].ps[j] - ref[i].ps[j]) / ref[i].ps[j];
+      else
+	frac_diff = fabs(run[i].ps[j]);
+      if (frac_diff > BENCH_PS_TOL){
+	fprintf(stderr, "FAIL: z=%06.2f, k=%.3e, power %e, reference %e\n", run[i].z, ref[i].k[j], run[i].ps[j], ref[i].ps[j]);
+	n_fail++;
+      }
+    }
+  }
+  return n_fail;
+}
+
+
+void print_stage_report(FILE *F, double total_wall){
+  int stage;
+
+  fprintf(F, "\nBenchmark DIM=%i, HII_DIM=%i, BOX_LEN=%.0fMpc, RANDOM_SEED=%li, NUMCORES=%i\n",
+	  DIM, HII_DIM, BOX_LEN, RANDOM_SEED, NUMCORES);
+  fprintf(F, "%-18s %6s %12s %12s %14s\n", "stage", "calls", "wall [s]", "s/call", "peak RSS [MB]");
+  for (stage=0; stage<NUM_STAGES; stage++){
+    fprintf(F, "%-18s %6i %12.2f %12.3f %14.1f\n", stage_names[stage], stage_calls[stage], stage_wall[stage],
+	    stage_calls[stage] ? stage_wall[stage]/stage_calls[stage] : 0, stage_maxrss[stage]/1024.0);
+  }
+  fprintf(F, "%-18s %6s %12.2f\n", "total", "", total_wall);
+}
+
+
+int main(int argc, char ** argv){
+  float Z;
+  char cmnd[1000];
+  struct bench_snapshot *run_snaps, *ref_snaps;
+  int n_run=0, n_ref=0, n_fail=0, record, status;
+  struct timeval t_start, t_end;
+  double total_wall;
+  FILE *OUT;
+
+  if ( (argc != 3) || (strcmp(argv[1], "record") && strcmp(argv[1], "compare")) ){
+    fprintf(stderr, "USAGE: bench_pipeline <record | compare> <reference file>\nAborting...\n");
+    return -1;
+  }
+  record = !strcmp(argv[1], "record");
+
+  run_snaps = (struct bench_snapshot *) malloc(sizeof(struct bench_snapshot)*BENCH_MAX_Z_STEPS);
+  ref_snaps = (struct bench_snapshot *) malloc(sizeof(struct bench_snapshot)*BENCH_MAX_Z_STEPS);
+  if (!run_snaps || !ref_snaps){
+    fprintf(stderr, "bench_pipeline: Error allocating memory\nAborting...\n");
+    free(run_snaps); free(ref_snaps);
+    return -1;
+  }
+  // there is nothing to compare to without a reference
+  if (!record && (access(argv[2], F_OK) != 0)){
+    fprintf(stderr, "bench_pipeline: ERROR: no reference file %s; record it first on a trusted build (make bench_record)\nAborting...\n", argv[2]);
+    free(run_snaps); free(ref_snaps);
+    return -1;
+  }
+
+  // check the reference before spending time on the run
+  if (!record && (read_reference(argv[2], ref_snaps, &n_ref) < 0)){
+    free(run_snaps); free(ref_snaps);
+    return -1;
+  }
+
+  // start from a clean slate
+  system("mkdir ../Log_files");
+  system("mkdir ../Boxes");
+  system("mkdir ../Output_files");
+  system("mkdir ../Output_files/Deldel_T_power_spec");
+  system("rm -rf ../Boxes/* ../Output_files/Deldel_T_power_spec/* ../Output_files/Ts_outs ../Log_files/*");
+
+  gettimeofday(&t_start, NULL);
+  sprintf(cmnd, "./init");
+  if (run_stage(STAGE_INIT, cmnd) != 0)
+    goto STAGE_FAILED;
+
+  Z = BENCH_ZLOW*1.0001; // match rounding convention from Ts.c
+  if (USE_TS_IN_21CM){
+    sprintf(cmnd, "./perturb_field %.2f", Z);
+    if (run_stage(STAGE_PERTURB, cmnd) != 0)
+      goto STAGE_FAILED;
+    sprintf(cmnd, "./Ts %.2f", Z);
+    if (run_stage(STAGE_TS, cmnd) != 0)
+      goto STAGE_FAILED;
+  }
+
+  while (Z < Z_HEAT_MAX){
+    Z = ((1+Z)*ZPRIME_STEP_FACTOR - 1);
+  }
+  Z = ((1+Z)/ ZPRIME_STEP_FACTOR - 1);
+  while ( (Z >= BENCH_ZLOW) && (n_run < BENCH_MAX_Z_STEPS) ){
+    sprintf(cmnd, "./perturb_field %.2f", Z);
+    if (run_stage(STAGE_PERTURB, cmnd) != 0)
+      goto STAGE_FAILED;
+
+    // find_HII_bubbles returns the neutral fraction (in percent) as its exit status
+    if (INHOMO_RECO)
+      sprintf(cmnd, "./find_HII_bubbles %f %f", Z, (1+Z)*ZPRIME_STEP_FACTOR - 1 );
+    else
+      sprintf(cmnd, "./find_HII_bubbles %f", Z );
+    status = run_stage(STAGE_BUBBLES, cmnd);
+    if ( (status < 0) || (status > 100) )
+      goto STAGE_FAILED;
+
+    if (FIND_BUBBLE_ALGORITHM == 2)
+      sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_nohalos_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
+    else
+      sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_nohalos_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
+    if (run_stage(STAGE_DELTA_T, cmnd) != 0)
+      goto STAGE_FAILED;
+
+    if (read_snapshot(Z, &run_snaps[n_run]) < 0)
+      goto STAGE_FAILED;
+    n_run++;
+
+    Z = ((1+Z)/ZPRIME_STEP_FACTOR - 1);
+  }
+  gettimeofday(&t_end, NULL);
+  total_wall = (t_end.tv_sec - t_start.tv_sec) + 1e-6*(t_end.tv_usec - t_start.tv_usec);
+
+  // print the timing breakdown to the screen and to file
+  print_stage_report(stdout, total_wall);
+  if ( (OUT = fopen("../Output_files/bench_report", "w")) ){
+    print_stage_report(OUT, total_wall);
+    fclose(OUT);
+  }
+
+  if (record){
+    if (write_reference(argv[2], run_snaps, n_run) < 0){
+      free(run_snaps); free(ref_snaps);
+      return -1;
+    }
+    fprintf(stdout, "Recorded %i redshift outputs to %s\nRerun \"make bench\" to compare against it\n", n_run, argv[2]);
+  }
+  else{
+    n_fail = compare_snapshots(run_snaps, n_run, ref_snaps, n_ref);
+    if (n_fail)
+      fprintf(stdout, "FAILED: %i quantities outside of the tolerances of %s\n", n_fail, argv[2]);
+    else
+      fprintf(stdout, "PASSED: %i redshift outputs agree with %s\n", n_run, argv[2]);
+  }
+
+  free(run_snaps); free(ref_snaps);
+  return n_fail ? 1 : 0;
+
+ STAGE_FAILED:
+  fprintf(stderr, "bench_pipeline: stage failed: %s\nAborting...\n", cmnd);
+  free(run_snaps); free(ref_snaps);
+  return -1;
+}
@@ -37,23 +37,17 @@ int main(int argc, char ** argv){
   }
 
   // open file and read-in
-  F=fopen(argv[2], "rb");
+  F=box_fopen(argv[2], "rb");
   if (!F){
     fprintf(stderr, "smooth_field.c: Error open binary file %s for reading\nAborting...\n", argv[2]);
     fftwf_free(box);
     return -1;
   }
   if (format==0){ // box has no fft padding
-    for (i=0; i<DIM; i++){
-      for (j=0; j<DIM; j++){
-	for (k=0; k<DIM; k++){
-	  if (fread((float *)box + R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    fprintf(stderr, "smooth_field.c: Error reading-in binary file %s\nAborting...\n", argv[2]);
-	    fftwf_free(box), fclose(F);
-	    return -1;
-	  }
-	}
-      }
+    if (mod_fread_padded((float *)box, DIM, F)!=1){
+      fprintf(stderr, "smooth_field.c: Error reading-in binary file %s\nAborting...\n", argv[2]);
+      fftwf_free(box), fclose(F);
+      return -1;
     }
   }
   else if (format==1){ // box has fft padding
@@ -84,7 +78,7 @@ int main(int argc, char ** argv){
   
 
   // now sample and print to file
-  F=fopen(argv[3], "wb");
+  F=box_fopen(argv[3], "wb");
   if (!F){
     fprintf(stderr, "smooth_field.c: Error open binary file %s for writting\nAborting...\n", argv[3]);
     fftwf_free(box);
@@ -94,9 +88,9 @@ int main(int argc, char ** argv){
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
-	  if( fwrite( (float *)smoothed_box + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
+	  if( io_account_fwrite( (float *)smoothed_box + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F, __FILE__, __LINE__)!=1){
 	    fprintf(stderr, "smooth_field.c: Error writting binary file %s\nAborting...\n", argv[3]);
-	    fftwf_free(box), fclose(F);
+	    fftwf_free(box), box_fclose(F);
 	    return -1;
 	  }
 	}
@@ -109,6 +103,6 @@ int main(int argc, char ** argv){
    }
   }
 
-   fftwf_free(smoothed_box); fftwf_free(box), fclose(F);
+   fftwf_free(smoothed_box); fftwf_free(box), box_fclose(F);
   return 0;
 }
@@ -0,0 +1,68 @@
+#ifndef _COUNTER_RNG_
+#define _COUNTER_RNG_
+
+#include <stdint.h>
+
+/*
+  Counter-based random numbers for the initial conditions.
+
+  The Gaussian deviates of a k-mode are a pure function of RANDOM_SEED and the mode's wavenumber
+  (n_x, n_y, n_z), in units of 2*pi/BOX_LEN and signed (negative above the Nyquist frequency), so
+  the random field does not depend on the number of threads, on the OpenMP schedule, or on the
+  order in which modes are drawn.  Boxes of the same BOX_LEN and seed but different DIM also share
+  the modes they have in common.
+
+  The generator is Philox4x32-10 (Salmon et al. 2011, "Parallel random numbers: as easy as 1, 2,
+  3"): ten rounds of a keyed bijection of the 128-bit counter (the three wavenumbers and a stream
+  number), keyed by the 64-bit seed.  Its four 32-bit outputs make two 53-bit uniform deviates,
+  turned into two unit Gaussians by the Box-Muller transform.
+*/
+
+#define PHILOX_M0 (uint32_t) (0xD2511F53)
+#define PHILOX_M1 (uint32_t) (0xCD9E8D57)
+#define PHILOX_W0 (uint32_t) (0x9E3779B9) // the golden ratio
+#define PHILOX_W1 (uint32_t) (0xBB67AE85) // sqrt(3)-1
+#define PHILOX_ROUNDS (int) (10)
+
+
+/* Philox4x32-10 of the counter <ctr> with key <key>, into <out> */
+static inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]){
+  uint32_t c0=ctr[0], c1=ctr[1], c2=ctr[2], c3=ctr[3], k0=key[0], k1=key[1];
+  uint64_t p0, p1;
+  int round;
+
+  for (round=0; round<PHILOX_ROUNDS; round++){
+    p0 = (uint64_t)PHILOX_M0 * c0;
+    p1 = (uint64_t)PHILOX_M1 * c2;
+    c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t)p1;
+    c3 = (uint32_t)p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+
+/*
+  Function COUNTER_GAUSSIAN_PAIR sets <a> and <b> to the two unit Gaussian deviates of stream
+  <stream> of mode (n_x, n_y, n_z) (signed wavenumbers) for RANDOM_SEED <seed>.
+*/
+static inline void counter_gaussian_pair(long seed, int n_x, int n_y, int n_z, uint32_t stream, double *a, double *b){
+  uint32_t ctr[4], key[2], out[4];
+  double u1, u2, r;
+
+  ctr[0] = (uint32_t)n_x; ctr[1] = (uint32_t)n_y; ctr[2] = (uint32_t)n_z; ctr[3] = stream;
+  key[0] = (uint32_t)((uint64_t)seed); key[1] = (uint32_t)((uint64_t)seed >> 32);
+  philox4x32(ctr, key, out);
+
+  // uniform deviates in (0,1), never 0 so that the log is finite
+  u1 = ((out[0] >> 5)*67108864.0 + (out[1] >> 6) + 0.5) * (1.0/9007199254740992.0);
+  u2 = ((out[2] >> 5)*67108864.0 + (out[3] >> 6) + 0.5) * (1.0/9007199254740992.0);
+  r = sqrt(-2.0*log(u1));
+  *a = r*cos(2.0*M_PI*u2);
+  *b = r*sin(2.0*M_PI*u2);
+}
+
+#endif
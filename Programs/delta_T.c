@@ -1,6 +1,8 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "../Parameter_files/HEAT_PARAMS.H"
+#include "power_spec_helper_progs.c"
+#include "memory_planner.c"
 
 
 /*
@@ -20,11 +22,14 @@ int main(int argc, char ** argv){
   char filename[1000], psoutputdir[1000], *token;
   float *deltax, REDSHIFT, growth_factor, dDdt, pixel_x_HI, pixel_deltax, *delta_T, *v, H, dummy;
   FILE *F, *LOG;
-  int i,j,k, n_x, n_y, n_z, NUM_BINS, curr_Pop, arg_offset,num_th;
+  memory_plan mem_plan;
+  int i,j,k, n_x, n_y, n_z, NUM_BINS, curr_Pop, arg_offset,num_th, write_status;
   double dvdx, ave, *p_box, *k_ave, max_v_deriv;
-  unsigned long long ct, *in_bin_ct, nonlin_ct, temp_ct;
+  unsigned long long ct, *in_bin_ct, nonlin_ct, temp_ct, n_ps_bins;
+  double *ps_error, ps_attributes[2];
+  const void *ps_columns[4];
   float nf, max, maxi, maxj, maxk, maxdvdx, min, mini, minj, mink, mindvdx;
-  float k_x, k_y, k_z, k_mag, k_sq, k_floor, k_ceil, k_max, k_first_bin_ceil, k_factor;
+  float k_x, k_y, k_z, k_ceil, k_max, k_first_bin_ceil, k_factor;
   float *xH, const_factor, *Ts, T_rad, pixel_Ts_factor, curr_alphaX, curr_MminX;
   double ave_Ts, min_Ts, max_Ts, temp, curr_zetaX;
   int ii;
@@ -91,6 +96,8 @@ int main(int argc, char ** argv){
 
   // get the neutral fraction and HII filter from the filename
   strcpy(filename, argv[2+arg_offset]);
+  if (RUN_ARCHIVE) // the shell could not expand the name of an archived box
+    run_archive_expand(filename);
   //strtok(filename, "f");
   token = strtok(filename, "f");
   nf = atof(strtok(NULL, "_"));
@@ -101,6 +108,11 @@ int main(int argc, char ** argv){
   growth_factor = dicke(REDSHIFT); // normalized to 1 at z=0
 
 
+  // check the boxes we are about to allocate fit in RAM
+  mem_plan = plan_memory(MEM_STAGE_DELTA_T);
+  print_memory_plan(stderr, &mem_plan);
+  print_memory_plan(LOG, &mem_plan);
+
   // allocate memory for xH box and read it in
   xH = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
   if (!xH){
@@ -108,7 +120,7 @@ int main(int argc, char ** argv){
     fprintf(LOG, "delta_T: Error allocating memory for xH box\nAborting...\n");
     fclose(LOG); fftwf_cleanup_threads(); return -1;
   }
-  if (!(F = fopen(argv[2+arg_offset], "rb"))){
+  if (!(F = box_fopen(argv[2+arg_offset], "rb"))){
     fprintf(stderr, "delta_T: unable to open xH box at %s\nAborting...\n", argv[2+arg_offset]);
     fprintf(LOG, "delta_T: unable to open xH box at %s\nAborting...\n", argv[2+arg_offset]);
     free(xH);
@@ -133,7 +145,7 @@ int main(int argc, char ** argv){
     fclose(LOG); fftwf_cleanup_threads(); return -1;
   }
   sprintf(filename, "../Boxes/updated_smoothed_deltax_z%06.2f_%i_%.0fMpc", REDSHIFT, HII_DIM, BOX_LEN);
-  if (!(F = fopen(filename, "rb"))){
+  if (!(F = box_fopen(filename, "rb"))){
     fprintf(stderr, "delta_T: Error openning deltax box for reading at %s\n", filename);
     fprintf(LOG, "delta_T: Error openning deltax box for reading at %s\n", filename);
     free(xH); free(deltax);
@@ -141,17 +153,11 @@ int main(int argc, char ** argv){
   }
   fprintf(stderr, "Reading in deltax box\n");
   fprintf(LOG, "Reading in deltax box\n");
-  for (i=0; i<HII_DIM; i++){
-    for (j=0; j<HII_DIM; j++){
-      for (k=0; k<HII_DIM; k++){
-	if (fread((float *)deltax + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	  fprintf(stderr, "delta_T: Read error occured while reading deltax box.\n");
-	  fprintf(LOG, "delta_T: Read error occured while reading deltax box.\n");
-	  fclose(F); free(xH); free(deltax);
-	  fclose(LOG); fftwf_cleanup_threads(); return -1;
-	}
-      }
-    }
+  if (mod_fread_padded((float *)deltax, HII_DIM, F)!=1){
+    fprintf(stderr, "delta_T: Read error occured while reading deltax box.\n");
+    fprintf(LOG, "delta_T: Read error occured while reading deltax box.\n");
+    fclose(F); free(xH); free(deltax);
+    fclose(LOG); fftwf_cleanup_threads(); return -1;
   }
   fclose(F);
 
@@ -181,23 +187,17 @@ int main(int argc, char ** argv){
   default: sprintf(filename, "../Boxes/updated_vy_z%06.2f_%i_%.0fMpc", REDSHIFT, HII_DIM, BOX_LEN);
   }
   if (T_USE_VELOCITIES){
-    if (!(F=fopen(filename, "rb"))){
+    if (!(F=box_fopen(filename, "rb"))){
       fprintf(stderr, "delta_T: Error opening velocity file at %s\n", filename);
       fprintf(LOG, "delta_T: Error opening velocity file at %s\n", filename);
       free(xH); free(deltax); free(delta_T); free(v);
       fclose(LOG); fftwf_cleanup_threads(); return -1;
     }
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)v + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    fprintf(stderr, "delta_T: Read error occured while reading velocity box.\n");
-	    fprintf(LOG, "delta_T: Read error occured while reading velocity box.\n");
-	    fclose(F); free(xH); free(deltax); free(delta_T); free(v);
-	    fclose(LOG); fftwf_cleanup_threads(); return -1;
-	  }
-	}
-      }
+    if (mod_fread_padded((float *)v, HII_DIM, F)!=1){
+      fprintf(stderr, "delta_T: Read error occured while reading velocity box.\n");
+      fprintf(LOG, "delta_T: Read error occured while reading velocity box.\n");
+      fclose(F); free(xH); free(deltax); free(delta_T); free(v);
+      fclose(LOG); fftwf_cleanup_threads(); return -1;
     }
     fclose(F);
   }
@@ -210,7 +210,7 @@ int main(int argc, char ** argv){
       free(xH); free(deltax); free(delta_T); free(v);
       fclose(LOG); fftwf_cleanup_threads(); return -1;
     }
-    if (!(F = fopen(argv[3+arg_offset], "rb") )){
+    if (!(F = box_fopen(argv[3+arg_offset], "rb") )){
       fprintf(stderr, "delta_T.c: Error openning Ts file %s to read from\nAborting...\n", argv[3+arg_offset]);
       fprintf(LOG, "delta_T.c: Error openning Ts file %s to read from\nAborting...\n", argv[3+arg_offset]);
       free(xH); free(deltax); free(delta_T); free(v); free(Ts);
@@ -292,12 +292,11 @@ int main(int argc, char ** argv){
     // check if we need to correct for velocities
   if (!T_USE_VELOCITIES){ //  we can stop here and print
     sprintf(filename, "../Boxes/delta_T_z%06.2f_nf%f_useTs%i_%i_%.0fMpc", REDSHIFT, nf, USE_TS_IN_21CM, HII_DIM, BOX_LEN);
-    F = fopen(filename, "wb");
     fprintf(stderr, "\nWritting output delta_T box: %s\n", filename);
-    if (mod_fwrite(delta_T, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+    // written in the background (misc.c), while we compute the power spectrum
+    if (async_fwrite_lossy(filename, delta_T, HII_TOT_NUM_PIXELS, HII_D*HII_D, DELTA_T_BOX_ERROR) < 0){
       fprintf(stderr, "delta_T: Write error occured while writting delta_T box.\n");
     }
-    fclose(F);
   }
   else{
     max = -1;
@@ -638,12 +637,10 @@ int main(int argc, char ** argv){
   
   // now write out the delta_T box with velocity correction
   sprintf(filename, "../Boxes/delta_T_v%i_z%06.2f_nf%f_useTs%i_%i_%.0fMpc", VELOCITY_COMPONENT, REDSHIFT, nf, USE_TS_IN_21CM, HII_DIM, BOX_LEN);
-  F = fopen(filename, "wb");
   fprintf(stderr, "Writting output delta_T box: %s\n", filename);
-  if (mod_fwrite(delta_T, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+  if (async_fwrite_lossy(filename, delta_T, HII_TOT_NUM_PIXELS, HII_D*HII_D, DELTA_T_BOX_ERROR) < 0){
     fprintf(stderr, "delta_T: Write error occured while writting delta_T box.\n");
   }
-  fclose(F);
 }
 
 // deallocate what we aren't using anymore 
@@ -660,11 +657,9 @@ int main(int argc, char ** argv){
   // initialize arrays
   // ghetto counting (lookup how to do logs of arbitrary bases in c...)
   NUM_BINS = 0;
-  k_floor = 0;
   k_ceil = k_first_bin_ceil;
   while (k_ceil < k_max){
     NUM_BINS++;
-    k_floor=k_ceil;
     k_ceil*=k_factor;
   }
 
@@ -710,45 +705,7 @@ int main(int argc, char ** argv){
   fftwf_cleanup();
 
   // now construct the power spectrum file
-  for (n_x=0; n_x<HII_DIM; n_x++){
-    if (n_x>HII_MIDDLE)
-      k_x =(n_x-HII_DIM) * DELTA_K;  // wrap around for FFT convention
-    else
-      k_x = n_x * DELTA_K;
-
-    for (n_y=0; n_y<HII_DIM; n_y++){
-      if (n_y>HII_MIDDLE)
-	k_y =(n_y-HII_DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
-
-      for (n_z=0; n_z<=HII_MIDDLE; n_z++){ 
-	k_z = n_z * DELTA_K;
-	
-	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
-
-	// now go through the k bins and update
-	ct = 0;
-	k_floor = 0;
-	k_ceil = k_first_bin_ceil;
-	while (k_ceil < k_max){
-	  // check if we fal in this bin
-	  if ((k_mag>=k_floor) && (k_mag < k_ceil)){
-	    in_bin_ct[ct]++;
-	    p_box[ct] += pow(k_mag,3)*pow(cabs(deldel_T[HII_C_INDEX(n_x, n_y, n_z)]), 2)/(2.0*PI*PI*VOLUME);
-	    // note the 1/VOLUME factor, which turns this into a power density in k-space
-
-	    k_ave[ct] += k_mag;
-	    break;
-	  }
-
-	  ct++;
-	  k_floor=k_ceil;
-	  k_ceil*=k_factor;
-	}
-      }
-    }
-  } // end looping through k box
+  HII_bin_power_spec(deldel_T, k_first_bin_ceil, k_factor, k_max, p_box, k_ave, in_bin_ct);
 
 
   if (DIMENSIONAL_T_POWER_SPEC)
@@ -765,7 +722,7 @@ int main(int argc, char ** argv){
   else{
     sprintf(filename, "%s/ps_z%06.2f_nf%f_useTs%i_aveTb%06.2f_%i_%.0fMpc", psoutputdir, REDSHIFT, nf, USE_TS_IN_21CM, ave, HII_DIM, BOX_LEN);
   }
-  F = fopen(filename, "w");
+  F = box_fopen(filename, "w");
   if (!F){
     fprintf(stderr, "delta_T.c: Couldn't open file %s for writting!\n", filename);
     fprintf(LOG, "delta_T.c: Couldn't open file %s for writting!\n", filename);
@@ -775,12 +732,45 @@ int main(int argc, char ** argv){
     if (in_bin_ct[ct]>0)
       fprintf(F, "%e\t%e\t%e\n", k_ave[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0)/sqrt(in_bin_ct[ct]+0.0));
   }
-  fclose(F); free(p_box); free(k_ave); free(in_bin_ct); fftwf_free(deldel_T);
+  box_fclose(F);
+
+  // and append them to the binary power spectrum table of all redshifts (see stat_table.c),
+  // packing the non-empty bins to the front of the arrays
+  ps_error = (double *)malloc(sizeof(double)*NUM_BINS);
+  n_ps_bins = 0;
+  for (ct=1; ps_error && (ct<NUM_BINS); ct++){
+    if (in_bin_ct[ct]>0){
+      ps_error[n_ps_bins] = p_box[ct]/(in_bin_ct[ct]+0.0)/sqrt(in_bin_ct[ct]+0.0);
+      k_ave[n_ps_bins] = k_ave[ct]/(in_bin_ct[ct]+0.0);
+      p_box[n_ps_bins] = p_box[ct]/(in_bin_ct[ct]+0.0);
+      in_bin_ct[n_ps_bins++] = in_bin_ct[ct];
+    }
+  }
+  if (T_USE_VELOCITIES){
+    sprintf(filename, "%s/ps_useTs%i_%i_%.0fMpc_v%i.tbl", psoutputdir, USE_TS_IN_21CM, HII_DIM, BOX_LEN, VELOCITY_COMPONENT);
+  }
+  else{
+    sprintf(filename, "%s/ps_useTs%i_%i_%.0fMpc.tbl", psoutputdir, USE_TS_IN_21CM, HII_DIM, BOX_LEN);
+  }
+  ps_attributes[0] = nf;
+  ps_attributes[1] = ave;
+  ps_columns[0] = k_ave; ps_columns[1] = p_box; ps_columns[2] = ps_error; ps_columns[3] = in_bin_ct;
+  if (!ps_error || (stat_table_append(filename, "k:f8,power:f8,error:f8,n_modes:i8", "nf,aveTb", REDSHIFT, ps_attributes, n_ps_bins, ps_columns) != 0)){
+    fprintf(stderr, "delta_T.c: Couldn't append the power spectrum to %s\n", filename);
+    fprintf(LOG, "delta_T.c: Couldn't append the power spectrum to %s\n", filename);
+  }
+  free(ps_error); free(p_box); free(k_ave); free(in_bin_ct); fftwf_free(deldel_T);
 
   /****** END POWER SPECTRUM STUFF   ************/
 
 
+  // make sure the delta_T box is on disk
+  if ((write_status = async_write_flush()) != 0){
+    fprintf(stderr, "delta_T: Write error occured while writting delta_T box.\n");
+    fprintf(LOG, "delta_T: Write error occured while writting delta_T box.\n");
+  }
+
   // deallocate
   free(delta_T); fclose(LOG);
-  fftwf_cleanup_threads(); return 0;
+  fftwf_cleanup_threads(); return write_status ? -1 : 0;
 }
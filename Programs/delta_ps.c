@@ -42,7 +42,7 @@ int main(int argc, char ** argv){
     fprintf(stderr, "delta_T: Error allocating memory for deltax box\nAborting...\n");
     fftwf_cleanup_threads(); return -1;
   }
-  F = fopen(argv[1], "rb");
+  F = box_fopen(argv[1], "rb");
   switch (FORMAT){
     // FFT format
   case 1:
@@ -57,14 +57,14 @@ int main(int argc, char ** argv){
     // unpaded format
   case 0:
     fprintf(stderr, "Reading in unpadded box\n");
+    if (mod_fread_padded((float *)deltax, HII_DIM, F)!=1){
+      fprintf(stderr, "init.c: Read error occured!\n");
+      fftwf_free(deltax);
+      fftwf_cleanup_threads(); return -1;
+    }
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)deltax + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    fprintf(stderr, "init.c: Read error occured!\n");
-	    fftwf_free(deltax);
-	    fftwf_cleanup_threads(); return -1;	    
-	  }
       	  ave += *((float *)deltax + HII_R_FFT_INDEX(i,j,k));
 	}
       }
@@ -181,7 +181,7 @@ int main(int argc, char ** argv){
   fftwf_free(deltax);
 
   // now lets print out the k bins
-  F = fopen(argv[2], "w");
+  F = box_fopen(argv[2], "w");
   if (!F){
     fprintf(stderr, "delta_T.c: Couldn't open file %s for writting!\n", filename);
     fftwf_cleanup_threads(); return -1;
@@ -189,7 +189,7 @@ int main(int argc, char ** argv){
   for (ct=1; ct<NUM_BINS; ct++){
     fprintf(F, "%e\t%e\t%e\n", k_ave[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0)/sqrt(in_bin_ct[ct]+0.0));
   }
-  fclose(F);
+  box_fclose(F);
 
   /****** END POWER SPECTRUM STUFF   ************/
 
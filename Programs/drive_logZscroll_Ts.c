@@ -8,6 +8,8 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "../Parameter_files/HEAT_PARAMS.H"
+#include "memory_planner.c"
+#include "stage_scheduler.c"
 
 /*
   Program DRIVE_ZSCROLL.C scrolls through the redshifts defined in ANAL_PARAMS.H creating halo, velocity, density, and ionization fields
@@ -16,13 +18,30 @@
 #define ZLOW (float) (6)
 #define ZHIGH  Z_HEAT_MAX
 
+/* writes the boxes matching <pattern> to <filelist>, for redshift_interpolate_boxes */
+static int list_boxes(const char *pattern, const char *filelist){
+  char cmnd[1000];
+  FILE *F;
+
+  if (!RUN_ARCHIVE){
+    sprintf(cmnd, "ls %s > %s", pattern, filelist);
+    return system(cmnd);
+  }
+  if (!(F = fopen(filelist, "w")))
+    return -1;
+  run_archive_list(pattern, F);
+  return fclose(F);
+}
+
 int main(int argc, char ** argv){
   //float Z, M, M_MIN, nf;
-  float Z, M, nf;
-  char cmnd[1000];
+  float Z, M;
+  char cmnd[1000], args[500], pf_low_args[500];
   FILE *LOG;
   time_t start_time, curr_time;
-  int status;
+  int stage, task, init_task, pf_low_task, pf_task, Ts_task, halos_task, bubbles_task, prev_bubbles_task;
+  memory_plan mem_plan;
+  static stage_graph graph; // static, as it is too large for the stack
 
 
 
@@ -48,6 +67,10 @@ int main(int argc, char ** argv){
   system("rm ../Boxes/Nrec_*");
   system("rm ../Boxes/z_first*");
   system("rm ../Output_files/Deldel_T_power_spec/*");  
+  if (RUN_ARCHIVE){
+    sprintf(cmnd, "rm %s", RUN_ARCHIVE_FILE);
+    system(cmnd);
+  }
 
   init_ps();
 
@@ -59,28 +82,31 @@ int main(int argc, char ** argv){
     return -1;
   }
 
+  // print the memory needed by each stage, before committing to the run
+  for (stage=0; stage<MEM_NUM_STAGES; stage++){
+    if (!USE_HALO_FIELD && ((stage == MEM_STAGE_FIND_HALOS) || (stage == MEM_STAGE_UPDATE_HALO_POS)))
+      continue;
+    mem_plan = plan_memory(stage);
+    print_memory_plan(stderr, &mem_plan);
+    print_memory_plan(LOG, &mem_plan);
+  }
 
-  fprintf(stderr, "Calling init to set up the initial conditions\n");
-  fprintf(LOG, "Calling init to set up the initial conditions\n");
-  system("./init"); // you only need this call once per realization
+  // build the graph of program calls; independent calls (e.g. perturb_field at different
+  // redshifts, delta_T at z while find_HII_bubbles runs at the next z) are run concurrently
+  init_task = add_stage(&graph, "init", ""); // reuses the boxes of this realization if already made (see ic_cache.c)
 
   Z = ZLOW*1.0001; // match rounding convention from Ts.c
 
    // call Ts on the lowest redshift
+  pf_low_task = Ts_task = -1;
   if (USE_TS_IN_21CM){
-    sprintf(cmnd, "./perturb_field %.2f", Z);
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
-    
-    sprintf(cmnd, "./Ts %.2f", Z);
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
+    sprintf(pf_low_args, "%.2f", Z);
+    pf_low_task = add_stage(&graph, "perturb_field", pf_low_args);
+    add_dependency(&graph, pf_low_task, init_task);
+
+    sprintf(args, "%.2f", Z);
+    Ts_task = add_stage(&graph, "Ts", args);
+    add_dependency(&graph, Ts_task, pf_low_task);
   }
 
 
@@ -89,115 +115,107 @@ int main(int argc, char ** argv){
     Z = ((1+Z)*ZPRIME_STEP_FACTOR - 1);
   }
   Z = ((1+Z)/ ZPRIME_STEP_FACTOR - 1);
+  prev_bubbles_task = -1;
   while (Z >= ZLOW){
 
     //set the minimum source mass
     //M_MIN = get_M_min_ion(Z);
 
     // if USE_HALO_FIELD is turned on in ANAL_PARAMS.H, run the halo finder
+    halos_task = -1;
     if (USE_HALO_FIELD){
       //  the following only depend on redshift, not ionization field
       // find halos
-      sprintf(cmnd, "./find_halos %.2f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
-
+      sprintf(args, "%.2f", Z);
+      task = add_stage(&graph, "find_halos", args);
+      add_dependency(&graph, task, init_task);
 
       // shift halos accordig to their linear velocities
-      sprintf(cmnd, "./update_halo_pos %.2f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
+      halos_task = add_stage(&graph, "update_halo_pos", args);
+      add_dependency(&graph, halos_task, task);
     }
 
     // shift density field and update velocity field
-    sprintf(cmnd, "./perturb_field %.2f", Z);
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
+    sprintf(args, "%.2f", Z);
+    if ((pf_low_task >= 0) && !strcmp(args, pf_low_args))
+      pf_task = pf_low_task; // already done for Ts
+    else{
+      pf_task = add_stage(&graph, "perturb_field", args);
+      add_dependency(&graph, pf_task, init_task);
+    }
     // end of solely redshift dependent things, now do ionization stuff
 
 
     // if it is the lowest redshift, let's call Ts.c
     if (USE_TS_IN_21CM && (Z > Z_HEAT_MAX) ) { // NEW CONDITIONAL
       //    if (USE_TS_IN_21CM && (fabs(Z-ZLOW)/Z < 0.0002) ){
-      sprintf(cmnd, "./Ts %.2f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
+      sprintf(args, "%.2f", Z);
+      task = add_stage(&graph, "Ts", args);
+      add_dependency(&graph, task, pf_task);
+      add_dependency(&graph, task, Ts_task);
+      Ts_task = task;
     } // this will create all of the higher z Ts files in Boxes, provided Ts_verbose is turned on
     // in HEAT_PARAMS.H
 
 
     // find bubbles
     if (INHOMO_RECO)
-      sprintf(cmnd, "./find_HII_bubbles %f %f", Z, (1+Z)*ZPRIME_STEP_FACTOR - 1 );
+      sprintf(args, "%f %f", Z, (1+Z)*ZPRIME_STEP_FACTOR - 1 );
     else
-      sprintf(cmnd, "./find_HII_bubbles %f", Z );
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    status = system(cmnd);
-    nf = WEXITSTATUS(status) / 100.0;
-    if (nf < 0){
-      fprintf(stderr, "find_HII_bubbles exited...\nAborting run...\n");
-      fprintf(LOG,  "find_HII_bubbles exited...\nAborting run...\n");
-      return -1;
-    }
+      sprintf(args, "%f", Z );
+    bubbles_task = add_stage(&graph, "find_HII_bubbles", args);
+    add_dependency(&graph, bubbles_task, pf_task);
+    add_dependency(&graph, bubbles_task, Ts_task);
+    add_dependency(&graph, bubbles_task, halos_task);
+    if (INHOMO_RECO) // needs the recombinations from the previous redshift
+      add_dependency(&graph, bubbles_task, prev_bubbles_task);
+    prev_bubbles_task = bubbles_task;
 
 
     // do temperature map
     switch(FIND_BUBBLE_ALGORITHM){
     case 2:
       if (USE_HALO_FIELD)
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/xH_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
       else
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_nohalos_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/xH_nohalos_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
       break;
     default:
       if (USE_HALO_FIELD)
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/sphere_xH_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
       else
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_nohalos_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/sphere_xH_nohalos_z%06.2f_nf*_%i_%.0fMpc ../Boxes/Ts_z%06.2f_*_%.0fMpc", Z, Z, HII_DIM, BOX_LEN, Z, BOX_LEN);
       break;
     }
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
-
-    fprintf(stderr, "*************************************\n");
-    fflush(NULL);
+    task = add_stage(&graph, "delta_T", args);
+    add_dependency(&graph, task, bubbles_task);
 
     // update the redshift value according to the logarithmic stepping in the Ts.c routine
     Z = ((1+Z)/ZPRIME_STEP_FACTOR - 1);
   }
 
+  if (run_stage_graph(&graph, NUMCORES, LOG) != 0){
+    fprintf(stderr, "Aborting run...\n");
+    fprintf(LOG,  "Aborting run...\n");
+    fclose(LOG);
+    return -1;
+  }
+  time(&curr_time);
+
   
   // Create lightcone boxes from the coeval cubes
-  sprintf(cmnd, "ls ../Boxes/xH_*%i_%.0fMpc > ../Redshift_interpolate_filelists/xH_%i_%.0fMpc", 
-	  HII_DIM, BOX_LEN, HII_DIM, BOX_LEN);
-  system(cmnd);
+  sprintf(args, "../Boxes/xH_*%i_%.0fMpc", HII_DIM, BOX_LEN);
+  sprintf(cmnd, "../Redshift_interpolate_filelists/xH_%i_%.0fMpc", HII_DIM, BOX_LEN);
+  list_boxes(args, cmnd);
   sprintf(cmnd, "./redshift_interpolate_boxes 0 ../Redshift_interpolate_filelists/xH_%i_%.0fMpc", HII_DIM, BOX_LEN);
   system(cmnd);
   fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
   fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
   fflush(NULL);
 
-  sprintf(cmnd, "ls ../Boxes/delta_T_*%i_%.0fMpc > ../Redshift_interpolate_filelists/delta_T_%i_%.0fMpc", 
-	  HII_DIM, BOX_LEN, HII_DIM, BOX_LEN);
-  system(cmnd);
+  sprintf(args, "../Boxes/delta_T_*%i_%.0fMpc", HII_DIM, BOX_LEN);
+  sprintf(cmnd, "../Redshift_interpolate_filelists/delta_T_%i_%.0fMpc", HII_DIM, BOX_LEN);
+  list_boxes(args, cmnd);
   sprintf(cmnd, "./redshift_interpolate_boxes 0 ../Redshift_interpolate_filelists/delta_T_%i_%.0fMpc", HII_DIM, BOX_LEN);
   system(cmnd);
   fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
@@ -205,9 +223,9 @@ int main(int argc, char ** argv){
   fflush(NULL);
 
   if (INHOMO_RECO){
-    sprintf(cmnd, "ls ../Boxes/Nrec_*%i_%.0fMpc > ../Redshift_interpolate_filelists/Nrec_%i_%.0fMpc", 
-	    HII_DIM, BOX_LEN, HII_DIM, BOX_LEN);
-    system(cmnd);
+    sprintf(args, "../Boxes/Nrec_*%i_%.0fMpc", HII_DIM, BOX_LEN);
+    sprintf(cmnd, "../Redshift_interpolate_filelists/Nrec_%i_%.0fMpc", HII_DIM, BOX_LEN);
+    list_boxes(args, cmnd);
     sprintf(cmnd, "./redshift_interpolate_boxes 0 ../Redshift_interpolate_filelists/Nrec_%i_%.0fMpc", HII_DIM, BOX_LEN);
     system(cmnd);
     fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
@@ -215,6 +233,8 @@ int main(int argc, char ** argv){
     fflush(NULL);
   }
 
+  if (RUN_ARCHIVE) // the script reads the power spectra from disk
+    run_archive_extract("../Output_files/Deldel_T_power_spec/ps_z0*");
   sprintf(cmnd, "./extract_delTps.pl 0.1 ../Output_files/Deldel_T_power_spec/ps_z0* > Power_k0.1");
   system(cmnd);
   fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
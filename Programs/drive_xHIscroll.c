@@ -61,7 +61,7 @@ int main(int argc, char ** argv){
 
   fprintf(stderr, "Calling init to set up the initial conditions\n");
   fprintf(LOG, "Calling init to set up the initial conditions\n");
-  system("./init"); // you only need this call once per realization
+  system("./init"); // reuses the boxes of this realization if already made (see ic_cache.c)
 
   fprintf(stderr, "*************************************\n");
 
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "../Parameter_files/INIT_PARAMS.H"
+#include "stage_scheduler.c"
 
 /*
   Program DRIVE_ZSCROLL_NOTS.C scrolls through the redshifts defined below,
@@ -23,9 +24,11 @@
 
 int main(int argc, char ** argv){
   float Z, M, M_MIN;
-  char cmnd[1000];
+  char args[500];
   FILE *LOG;
-  time_t start_time, curr_time;
+  time_t start_time;
+  int task, init_task, pf_task, halos_task, bubbles_task, prev_bubbles_task;
+  static stage_graph graph; // static, as it is too large for the stack
 
   time(&start_time);
 
@@ -49,57 +52,46 @@ int main(int argc, char ** argv){
     return -1;
   }
 
-  fprintf(stderr, "Calling init to set up the initial conditions\n");
-  fprintf(LOG, "Calling init to set up the initial conditions\n");
-  system("./init"); // you only need this call once per realization
+  // build the graph of program calls; independent calls are run concurrently
+  init_task = add_stage(&graph, "init", ""); // reuses the boxes of this realization if already made (see ic_cache.c)
 
   Z = ZSTART;
+  prev_bubbles_task = -1;
   while (Z > (ZEND-0.0001)){
-    fprintf(stderr, "*************************************\n");
-
     M_MIN = get_M_min_ion(Z);
 
     // if USE_HALO_FIELD is turned on in ANAL_PARAMS.H, run the halo finder
+    halos_task = -1;
     if (USE_HALO_FIELD){
       //  the following only depend on redshift, not ionization field
       // find halos
-      sprintf(cmnd, "./find_halos %f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
-
+      sprintf(args, "%f", Z);
+      task = add_stage(&graph, "find_halos", args);
+      add_dependency(&graph, task, init_task);
 
       // shift halos accordig to their linear velocities
-      sprintf(cmnd, "./update_halo_pos %f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
+      halos_task = add_stage(&graph, "update_halo_pos", args);
+      add_dependency(&graph, halos_task, task);
     }
 
     // shift density field and update velocity field
-    sprintf(cmnd, "./perturb_field %f", Z);
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
+    sprintf(args, "%f", Z);
+    pf_task = add_stage(&graph, "perturb_field", args);
+    add_dependency(&graph, pf_task, init_task);
     // end of solely redshift dependent things, now do ionization stuff
 
 
     // find bubbles
     if (INHOMO_RECO)
-      sprintf(cmnd, "./find_HII_bubbles %f %f", Z, Z-ZSTEP);
+      sprintf(args, "%f %f", Z, Z-ZSTEP);
     else
-      sprintf(cmnd, "./find_HII_bubbles %f", Z);
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
+      sprintf(args, "%f", Z);
+    bubbles_task = add_stage(&graph, "find_HII_bubbles", args);
+    add_dependency(&graph, bubbles_task, pf_task);
+    add_dependency(&graph, bubbles_task, halos_task);
+    if (INHOMO_RECO) // needs the recombinations from the previous redshift
+      add_dependency(&graph, bubbles_task, prev_bubbles_task);
+    prev_bubbles_task = bubbles_task;
 
     /*
     // generate size distributions, first ionized bubbles
@@ -150,30 +142,33 @@ int main(int argc, char ** argv){
       if (USE_HALO_FIELD)
 	// New in v1.4: These filenames are just a stopgap to avoid error. I have to modify this part using proper parameters.
 	//sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_z%06.2f_nf*_eff%.1f_effPLindex%.1f_HIIfilter%i_Mmin%.1e_RHIImax%.0f_%i_%.0fMpc", Z, Z,HII_EFF_FACTOR, EFF_FACTOR_PL_INDEX, HII_FILTER, M_MIN, R_BUBBLE_MAX, HII_DIM, BOX_LEN);
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/xH_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
       else
 	//sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_nohalos_z%06.2f_nf*_eff%.1f_effPLindex%.1f_HIIfilter%i_Mmin%.1e_RHIImax%.0f_%i_%.0fMpc", Z, Z,HII_EFF_FACTOR, EFF_FACTOR_PL_INDEX, HII_FILTER, M_MIN, R_BUBBLE_MAX, HII_DIM, BOX_LEN);
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/xH_nohalos_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/xH_nohalos_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
       break;
     default:
       if (USE_HALO_FIELD)
 	//sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_z%06.2f_nf*_eff%.1f_effPLindex%.1f_HIIfilter%i_Mmin%.1e_RHIImax%.0f_%i_%.0fMpc", Z, Z,HII_EFF_FACTOR, EFF_FACTOR_PL_INDEX, HII_FILTER, M_MIN, R_BUBBLE_MAX, HII_DIM, BOX_LEN);
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/sphere_xH_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
       else
 	//sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_nohalos_z%06.2f_nf*_eff%.1f_effPLindex%.1f_HIIfilter%i_Mmin%.1e_RHIImax%.0f_%i_%.0fMpc", Z, Z,HII_EFF_FACTOR, EFF_FACTOR_PL_INDEX, HII_FILTER, M_MIN, R_BUBBLE_MAX, HII_DIM, BOX_LEN);
-	sprintf(cmnd, "./delta_T %06.2f ../Boxes/sphere_xH_nohalos_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
+	sprintf(args, "%06.2f ../Boxes/sphere_xH_nohalos_z%06.2f_nf*_%i_%.0fMpc", Z, Z, HII_DIM, BOX_LEN);
     }
-    time(&curr_time);
-    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-    fflush(NULL);
-    system(cmnd);
+    task = add_stage(&graph, "delta_T", args);
+    add_dependency(&graph, task, bubbles_task);
 
-    fprintf(stderr, "*************************************\n");
-    fflush(NULL);
     Z += ZSTEP;
   }
 
+  if (run_stage_graph(&graph, NUMCORES, LOG) != 0){
+    fprintf(stderr, "Aborting run...\n");
+    fprintf(LOG,  "Aborting run...\n");
+    fclose(LOG);
+    return -1;
+  }
+
+
   fclose(LOG);
   return 0;
 }
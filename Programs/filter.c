@@ -15,12 +15,34 @@
   The function returns the filtered k field, <box>.
 */
 
+/*
+  Function FILTER_WINDOW returns the factor by which filter type <filter_type> multiplies the
+  mode k of a field filtered on the scale R, given kR = k*R (1 for undefined filter types).
+*/
+double filter_window(int filter_type, float kR){
+  if (filter_type == 0){ // real space top-hat
+    if (kR > 1e-4)
+      return 3.0 * (sin(kR)/pow(kR, 3) - cos(kR)/pow(kR, 2));
+  }
+  else if (filter_type == 1){ // k-space top hat
+    kR *= 0.413566994; // equates integrated volume to the real space top-hat (9pi/2)^(-1/3)
+    if (kR > 1)
+      return 0;
+  }
+  else if (filter_type == 2){ // gaussian
+    kR *= 0.643; // equates integrated volume to the real space top-hat
+    return pow(E, -kR*kR/2.0);
+  }
+  return 1;
+}
+
 void filter(fftwf_complex *box, int filter_type, float R){
   int n_x, n_z, n_y;
   float k_x, k_y, k_z, k_mag, kR;
+  double window;
 
   // loop through k-box
-#pragma omp parallel shared(box, filter_type, R) private(k_x, k_y, k_z, k_mag, kR, n_x, n_z, n_y)
+#pragma omp parallel shared(box, filter_type, R) private(k_x, k_y, k_z, k_mag, kR, window, n_x, n_z, n_y)
 {
 
 #pragma omp for 
@@ -37,23 +59,13 @@ void filter(fftwf_complex *box, int filter_type, float R){
 	
 	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
 
-	kR = k_mag*R; // real space top-hat
-	if (filter_type == 0){ // real space top-hat
-	  if (kR > 1e-4){
-	    box[C_INDEX(n_x, n_y, n_z)] *= 3.0 * (sin(kR)/pow(kR, 3) - cos(kR)/pow(kR, 2));
-	  }
-	}
-	else if (filter_type == 1){ // k-space top hat
-	  kR *= 0.413566994; // equates integrated volume to the real space top-hat (9pi/2)^(-1/3)
-	  if (kR > 1){
-	    box[C_INDEX(n_x, n_y, n_z)] = 0;
-	  }
-	}
-	else if (filter_type == 2){ // gaussian
-	  kR *= 0.643; // equates integrated volume to the real space top-hat
-	  box[C_INDEX(n_x, n_y, n_z)] *= pow(E, -kR*kR/2.0);
-	}
-	else{
+	kR = k_mag*R;
+	window = filter_window(filter_type, kR);
+	if (window == 0)
+	  box[C_INDEX(n_x, n_y, n_z)] = 0;
+	else if (window != 1)
+	  box[C_INDEX(n_x, n_y, n_z)] *= window;
+	if ((filter_type < 0) || (filter_type > 2)){
 	  if ( (n_x==0) && (n_y==0) && (n_z==0) )
 	    fprintf(stderr, "filter.c: Warning, filter type %i is undefined\nBox is unfiltered\n", filter_type);
 	}
@@ -27,7 +27,7 @@ float dgausdx(float x, float mean, float sigma){
 int main(int argc, char ** argv){
   fftwf_plan plan;
   fftwf_complex *box;
-  float M, *delta_m, floor, ciel, del, R;
+  float M, *delta_m, *in_box, floor, ciel, del, R;
   double MAX, MIN;
   unsigned long long index, ct, *in_bin_ct;
   FILE *F;
@@ -66,7 +66,7 @@ int main(int argc, char ** argv){
     fprintf(stderr, "delta_T: Error allocating memory for box box\nAborting...\n");
     return -1;
   }
-  F = fopen(argv[3], "rb");
+  F = box_fopen(argv[3], "rb");
   fprintf(stderr, "Reading in box box of HII_DIM=%i\n", HII_DIM);
   switch (format){
     // my format
@@ -94,14 +94,21 @@ int main(int argc, char ** argv){
 
     // Hy format
   case 0:
+    // read the whole (unpadded) box with mod_fread, so that it can be in any box format
+    if (!(in_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
+      fprintf(stderr, "filter_den_hist.c: Error allocating memory for box\nAborting...\n");
+      fftwf_free(box); fclose(F);
+      return -1;
+    }
+    if (mod_fread(in_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+      fprintf(stderr, "filter_den_hist.c: Read error occured!\n");
+      free(in_box); fftwf_free(box); fclose(F);
+      return -1;
+    }
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)box + HII_R_FFT_INDEX(k,j,i), sizeof(float), 1, F)!=1){
-	    fprintf(stderr, "init.c: Read error occured!\n");
-	    fftwf_free(box); fclose(F);
-	    return -1;	    
-	  }
+	  *((float *)box + HII_R_FFT_INDEX(k,j,i)) = in_box[HII_R_INDEX(i,j,k)];
 	  	  *((float *)box + HII_R_FFT_INDEX(k,j,i)) += 1; // convert to Ddelta
 
 	  //	  *((float *)box + HII_R_FFT_INDEX(k,j,i)) *= *((float *)box + HII_R_FFT_INDEX(k,j,i));
@@ -113,6 +120,7 @@ int main(int argc, char ** argv){
 	}
       }
     }
+    free(in_box);
     break;
 
   default:
@@ -124,7 +132,7 @@ int main(int argc, char ** argv){
 
 
   // output file
-  F = fopen(argv[4], "w");
+  F = box_fopen(argv[4], "w");
   if (!F){
     fprintf(stderr, "Unable to open file: %s for writing\nAborting...\n", argv[4]);
     fftwf_free(box);
@@ -135,7 +143,7 @@ int main(int argc, char ** argv){
   delta_m = (float *)malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
   if (!delta_m){
     fprintf(stderr, "Filter_den_hist.c: Error allocating memory for histogram array\nAborting...\n");
-    fftwf_free(box); fclose(F);
+    fftwf_free(box); box_fclose(F);
     return -1;
   }
 
@@ -252,7 +260,7 @@ int main(int argc, char ** argv){
   }
  
   // deallocate memory
-  fclose(F);
+  box_fclose(F);
   free(delta_m);
   fftwf_free(box);
   free(p_box); free(bin_ave); free(in_bin_ct);
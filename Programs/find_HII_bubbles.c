@@ -1,5 +1,7 @@
 #include "bubble_helper_progs.c"
 #include "heating_helper_progs.c"
+#include "memory_planner.c"
+#include "halo_catalog.c"
 
 /*
   USAGE: find_HII_bubbles [-p <num of processors>] <redshift> [<previous redshift>]
@@ -164,12 +166,14 @@ int parse_arguments(int argc, char ** argv, int * num_th, int * arg_offset, floa
 int main(int argc, char ** argv){
   char filename[1000], error_message[1000];
   FILE *F = NULL, *pPipe = NULL;
-  float REDSHIFT, PREV_REDSHIFT, mass, R, xf, yf, zf, growth_factor, pixel_mass, cell_length_factor, massofscaleR;
+  memory_plan mem_plan;
+  float REDSHIFT, PREV_REDSHIFT, mass, R, growth_factor, pixel_mass, cell_length_factor, massofscaleR;
   float ave_M_coll_cell, ave_N_min_cell, ION_EFF_FACTOR, M_MIN;
-  int x,y,z, N_halos_in_cell, LAST_FILTER_STEP, num_th, arg_offset, i=0,j,k;
-  unsigned long long ct, ion_ct, sample_ct;
+  int x,y,z, N_halos_in_cell, LAST_FILTER_STEP, num_th, arg_offset, i=0,j,k, status=0;
+  unsigned long long ct, ion_ct, sample_ct, halo_ct;
+  halo_catalog halos;
   float f_coll_crit, pixel_volume,  density_over_mean, erfc_num, erfc_denom, erfc_denom_cell, res_xH, Splined_Fcoll;
-  float *xH=NULL, TVIR_MIN, MFP, xHI_from_xrays, std_xrays, *z_re=NULL, *Gamma12=NULL, *mfp=NULL;
+  float *xH=NULL, TVIR_MIN, MFP, xHI_from_xrays, std_xrays, *z_re=NULL, *Gamma12=NULL, *mfp=NULL, *Nrec_buffer=NULL;
   fftwf_complex *M_coll_unfiltered=NULL, *M_coll_filtered=NULL, *deltax_unfiltered=NULL, *deltax_filtered=NULL, *xe_unfiltered=NULL, *xe_filtered=NULL;
   fftwf_complex *N_rec_unfiltered=NULL, *N_rec_filtered=NULL;
   fftwf_plan plan;
@@ -230,6 +234,11 @@ int main(int argc, char ** argv){
     cell_length_factor = 1;
   }
   init_ps();
+
+  // check the boxes we are about to allocate fit in RAM
+  mem_plan = plan_memory(MEM_STAGE_FIND_HII_BUBBLES);
+  print_memory_plan(stderr, &mem_plan);
+
   Fcoll = (float *) malloc(sizeof(float)*HII_TOT_FFT_NUM_PIXELS);
   if (INHOMO_RECO) {  init_MHR();}
   if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
@@ -318,19 +327,18 @@ int main(int argc, char ** argv){
 		else {
 		  sprintf(filename, "../Boxes/Ts_evolution/xeneutral_zprime%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", REDSHIFT, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN); 
 		}
-	if (!(F = fopen(filename, "rb"))){
+	if (!(F = box_fopen(filename, "rb"))){
 	  fprintf(stderr, "find_HII_bubbles: Unable to open x_e file at %s\nAborting...\n", filename);
 	  fprintf(LOG, "find_HII_bubbles: Unable to open x_e file at %s\nAborting...\n", filename);
 	  fclose(LOG); fftwf_free(xH); fftwf_cleanup_threads();
       free(Fcoll);
 	  free_ps();  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {destroy_21cmMC_arrays();} return -1;
 	}
+	if (mod_fread(xH, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+	  strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading xe box.\nAborting...\n");
+	  goto CLEANUP;
+	}
 	for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++){
-	  if (fread(&xH[ct], sizeof(float), 1, F)!=1){
-	    strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading xe box.\nAborting...\n");
-	    goto CLEANUP;
-	  }
-
 	  xH[ct] = 1-xH[ct]; // convert from x_e to xH
 	  if (xH[ct]<0) xH[ct] = 0; //  should not happen....
 	  global_xH += xH[ct];
@@ -379,14 +387,14 @@ int main(int argc, char ** argv){
           sprintf(filename, "../Boxes/sphere_xH_nohalos_z%06.2f_nf%f_eff%.1f_effPLindex0_HIIfilter%i_Mmin%.1e_RHIImax%.0f_%i_%.0fMpc", REDSHIFT, global_xH, ION_EFF_FACTOR, HII_FILTER, M_MIN, MFP, HII_DIM, BOX_LEN);
 	  }
       }
-      F = fopen(filename, "wb");
+      F = box_fopen(filename, "wb");
       fprintf(LOG, "Neutral fraction is %f\nNow writting xH box at %s\n", global_xH, filename);
       fprintf(stderr, "Neutral fraction is %f\nNow writting xH box at %s\n", global_xH, filename);
-      if (mod_fwrite(xH, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+      if ((SPARSE_XH_BOXES ? sparse_fwrite(xH, HII_TOT_NUM_PIXELS, F) : mod_fwrite(xH, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F))!=1){
 	fprintf(stderr, "find_HII_bubbles.c: Write error occured while writting xH box.\n");
 	fprintf(LOG, "find_HII_bubbles.c: Write error occured while writting xH box.\n");
       }
-      free_ps(); fclose(F); F = NULL; fclose(LOG); fftwf_free(xH); fftwf_cleanup_threads();
+      free_ps(); box_fclose(F); F = NULL; fclose(LOG); fftwf_free(xH); fftwf_cleanup_threads();
 	  free(Fcoll);
       if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {destroy_21cmMC_arrays();} return (int) (global_xH * 100);
     }
@@ -413,21 +421,15 @@ int main(int argc, char ** argv){
 	  else {
 		sprintf(filename, "../Boxes/Ts_evolution/xeneutral_zprime%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", REDSHIFT, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN); 
 	  }
-      if (!(F = fopen(filename, "rb"))){
+      if (!(F = box_fopen(filename, "rb"))){
 	strcpy(error_message, "find_HII_bubbles.c: Unable to open x_e file at ");
 	strcat(error_message, filename);
 	strcat(error_message, "\nAborting...\n");
 	goto CLEANUP;
       }
-      for (i=0; i<HII_DIM; i++){
-	for (j=0; j<HII_DIM; j++){
-	  for (k=0; k<HII_DIM; k++){
-	    if (fread((float *)xe_unfiltered + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	      strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading xe box.\nAborting...\n");
-	      goto CLEANUP;
-	    }
-	  }
-	}
+      if (mod_fread_padded((float *)xe_unfiltered, HII_DIM, F)!=1){
+	strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading xe box.\nAborting...\n");
+	goto CLEANUP;
       }
       fclose(F);
 	  F = NULL;
@@ -445,23 +447,24 @@ int main(int argc, char ** argv){
       }
       for (ct=0; ct<HII_TOT_FFT_NUM_PIXELS; ct++){    *((float *)M_coll_unfiltered + ct) = 0;  }
       
-      // read in the halo list
-      sprintf(filename, "../Output_files/Halo_lists/updated_halos_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-      F = fopen(filename, "r");
-      if (!F){
-	strcpy(error_message, "find_HII_bubbles.c: Unable to open halo list file: ");
+      // read in all halos above our threshold (a leading part of the mass-sorted catalogue)
+      sprintf(filename, "../Output_files/Halo_lists/updated_halo_catalog_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
+      if (read_halo_catalog(filename, M_MIN, 1, &halos) < 0){
+	strcpy(error_message, "find_HII_bubbles.c: Unable to read halo catalogue: ");
 	strcat(error_message, filename);
 	strcat(error_message, "\nAborting...\n");
 	goto CLEANUP;
       }
-      // now read in all halos above our threshold into the smoothed halo field
-      if(HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
-          fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-          while (!feof(F) && (mass>=M_MIN)){
-            x = xf*HII_DIM;
-            y = yf*HII_DIM;
-            z = zf*HII_DIM;
-
+      // now add them into the smoothed halo field, cell by cell of the catalogue's spatial index
+      // (in decreasing mass within a cell), so that consecutive halos update neighbouring cells
+      for (ct=0; ct<halos.n; ct++){
+        halo_ct = halos.cell_halo[ct];
+        mass = halos.mass[halo_ct];
+        x = halos.x[halo_ct]*HII_DIM;
+        y = halos.y[halo_ct]*HII_DIM;
+        z = halos.z[halo_ct]*HII_DIM;
+
+        if(HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
             if (ALPHA_STAR > 0. && mass > Mlim_Fstar)
                 Fstar = 1./F_STAR10;
             else if (ALPHA_STAR < 0. && mass < Mlim_Fstar)
@@ -477,23 +480,11 @@ int main(int argc, char ** argv){
                 Fesc = pow(mass/1e10,ALPHA_ESC);
 
             *((float *)M_coll_unfiltered + HII_R_FFT_INDEX(x, y, z)) += mass * Fstar * Fesc * exp(-M_TURN/mass);
-            fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-          }    
-          fclose(F);
-          F = NULL;
-      }    
-      else {
-          fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-          while (!feof(F) && (mass>=M_MIN)){
-            x = xf*HII_DIM;
-            y = yf*HII_DIM;
-            z = zf*HII_DIM;
+        }
+        else
             *((float *)M_coll_unfiltered + HII_R_FFT_INDEX(x, y, z)) += mass;
-            fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-          }    
-          fclose(F);
-          F = NULL;
-      }    
+      }
+      free_halo_catalog(&halos);
     } // end of the USE_HALO_FIELD option
 
     
@@ -508,22 +499,16 @@ int main(int argc, char ** argv){
     fprintf(LOG, "Reading in deltax box\n");
   
     sprintf(filename, "../Boxes/updated_smoothed_deltax_z%06.2f_%i_%.0fMpc", REDSHIFT, HII_DIM, BOX_LEN);
-    F = fopen(filename, "rb");
+    F = box_fopen(filename, "rb");
     if (!F){
       strcpy(error_message, "find_HII_bubbles.c: Unable to open file: ");
       strcat(error_message, filename);
       strcat(error_message, "\nAborting...\n");
       goto CLEANUP;
     }
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)deltax_unfiltered + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading deltax box.\n");
-	    goto CLEANUP;
-	  }
-	}
-      }
+    if (mod_fread_padded((float *)deltax_unfiltered, HII_DIM, F)!=1){
+      strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading deltax box.\n");
+      goto CLEANUP;
     }
     fclose(F);
     F = NULL;
@@ -539,7 +524,7 @@ int main(int argc, char ** argv){
 	goto CLEANUP;
       }
       sprintf(filename, "../Boxes/z_first_ionization_z%06.2f_HIIfilter%i_RHIImax%.0f_%i_%.0fMpc",  PREV_REDSHIFT, HII_FILTER, MFP, HII_DIM, BOX_LEN);
-      if (F=fopen(filename, "rb")){  // this is the first call for this run, i.e. at the highest redshift
+      if (F=box_fopen(filename, "rb")){  // this is the first call for this run, i.e. at the highest redshift
 	//check if some read error occurs
 	if (mod_fread(z_re, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
 	  strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading z_re box!\n");
@@ -551,17 +536,11 @@ int main(int argc, char ** argv){
 	  z_re[ct] = -1.0;
       }
       sprintf(filename, "../Boxes/Nrec_z%06.2f_HIIfilter%i_RHIImax%.0f_%i_%.0fMpc", PREV_REDSHIFT, HII_FILTER, MFP, HII_DIM, BOX_LEN);
-      if (F=fopen(filename, "rb")){ // we had prvious boxes
+      if (F=box_fopen(filename, "rb")){ // we had prvious boxes
 	//check if some read error occurs
-	for (i=0; i<HII_DIM; i++){
-	  for (j=0; j<HII_DIM; j++){
-	    for (k=0; k<HII_DIM; k++){
-	      if (fread((float *)N_rec_unfiltered + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-		strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading N_rec box!\n");
-		goto CLEANUP;
-	      }
-	    }
-	  }
+	if (mod_fread_padded((float *)N_rec_unfiltered, HII_DIM, F)!=1){
+	  strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading N_rec box!\n");
+	  goto CLEANUP;
 	}
       }
       else{
@@ -964,54 +943,36 @@ int main(int argc, char ** argv){
     if (INHOMO_RECO){
       // N_rec box
       sprintf(filename, "../Boxes/Nrec_z%06.2f_HIIfilter%i_RHIImax%.0f_%i_%.0fMpc", REDSHIFT,HII_FILTER, MFP, HII_DIM, BOX_LEN);
-      if (!(F = fopen(filename, "wb"))){
-	sprintf(error_message, "find_HII_bubbles: ERROR: unable to open file for writting Nrec box!\n");
+      // the boxes are handed to the write-behind queue (misc.c) and written while we carry on
+      if (!(Nrec_buffer = (float *) async_write_buffer(filename, sizeof(float)*HII_TOT_NUM_PIXELS))){
+	sprintf(error_message, "find_HII_bubbles: ERROR: unable to queue Nrec box for writting!\n");
 	goto CLEANUP;
       }
-      else{
-	for (i=0; i<HII_DIM; i++){
-	  for (j=0; j<HII_DIM; j++){
-	    for (k=0; k<HII_DIM; k++){
-	      if(fwrite((float *)N_rec_unfiltered + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-		sprintf(error_message, "find_HII_bubbles.c: Write error occured while writting N_rec box.\n");
-		goto CLEANUP;
-	      }
-	    }
+      for (i=0; i<HII_DIM; i++){
+	for (j=0; j<HII_DIM; j++){
+	  for (k=0; k<HII_DIM; k++){
+	    Nrec_buffer[HII_R_INDEX(i,j,k)] = *((float *)N_rec_unfiltered + HII_R_FFT_INDEX(i,j,k));
 	  }
 	}
-	fclose(F);
-    F = NULL;
+      }
+      if (async_write_submit() != 0){
+	sprintf(error_message, "find_HII_bubbles: ERROR: unable to queue Nrec box for writting!\n");
+	goto CLEANUP;
       }
     
       // Write z_re in the box
       sprintf(filename, "../Boxes/z_first_ionization_z%06.2f_HIIfilter%i_RHIImax%.0f_%i_%.0fMpc", REDSHIFT, HII_FILTER, MFP, HII_DIM, BOX_LEN);
-      if (!(F = fopen(filename, "wb"))){
-	sprintf(error_message, "find_HII_bubbles: ERROR: unable to open file for writting z_re box!\n");
+      if (async_fwrite(filename, z_re, sizeof(float)*HII_TOT_NUM_PIXELS) < 0){
+	sprintf(error_message, "find_HII_bubbles: ERROR: unable to queue z_re box for writting!\n");
 	goto CLEANUP;
       }
-      else{
-	if (mod_fwrite(z_re, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-	  sprintf(error_message, "find_HII_bubbles: ERROR: unable to open file for writting z_re box!\n");
-	  goto CLEANUP;
-	}
-	fclose(F);
-	F = NULL;
-      }
 
       // Gamma12 box
       sprintf(filename, "../Boxes/Gamma12aveHII_z%06.2f_HIIfilter%i_RHIImax%.0f_%i_%.0fMpc", REDSHIFT, HII_FILTER, MFP, HII_DIM, BOX_LEN);
-      if (!(F = fopen(filename, "wb"))){
-	sprintf(error_message, "find_HII_bubbles: ERROR: unable to open file for writting gamma box!\n");
+      if (async_fwrite_lossy(filename, Gamma12, HII_TOT_NUM_PIXELS, HII_D*HII_D, GAMMA12_BOX_ERROR) < 0){
+	sprintf(error_message, "find_HII_bubbles: ERROR: unable to queue gamma box for writting!\n");
 	goto CLEANUP;
       }
-      else{
-	if (mod_fwrite(Gamma12, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-	  sprintf(error_message, "find_HII_bubbles.c: Write error occured while writting gamma box.\n");
-	  goto CLEANUP;
-	}
-	fclose(F);
-	F = NULL;
-      }
     }
 
     
@@ -1045,22 +1006,23 @@ int main(int argc, char ** argv){
         sprintf(filename, "../Boxes/sphere_xH_nohalos_z%06.2f_nf%f_eff%.1f_effPLindex0_HIIfilter%i_Mmin%.1e_RHIImax%.0f_%i_%.0fMpc", REDSHIFT, global_xH, ION_EFF_FACTOR, HII_FILTER, M_MIN, MFP, HII_DIM, BOX_LEN);
 	  }
     }
-    if (!(F = fopen(filename, "wb"))){
-        fprintf(stderr, "find_HII_bubbles: ERROR: unable to open file %s for writting!\n", filename);
-        fprintf(LOG, "find_HII_bubbles: ERROR: unable to open file %s for writting!\n", filename);
+    fprintf(LOG, "Neutral fraction is %f\nNow writting xH box at %s\n", global_xH, filename);
+    fprintf(stderr, "Neutral fraction is %f\nNow writting xH box at %s\n", global_xH, filename);
+    fflush(LOG);
+    if ((SPARSE_XH_BOXES ? async_fwrite_sparse(filename, xH, HII_TOT_NUM_PIXELS) :
+	 async_fwrite(filename, xH, sizeof(float)*HII_TOT_NUM_PIXELS)) < 0){
+        fprintf(stderr, "find_HII_bubbles: ERROR: unable to queue %s for writting!\n", filename);
+        fprintf(LOG, "find_HII_bubbles: ERROR: unable to queue %s for writting!\n", filename);
         global_xH = -1;
+        status = -1;
     }
-    else {
-        fprintf(LOG, "Neutral fraction is %f\nNow writting xH box at %s\n", global_xH, filename);
-        fprintf(stderr, "Neutral fraction is %f\nNow writting xH box at %s\n", global_xH, filename);
-        fflush(LOG);
-        if (mod_fwrite(xH, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-            fprintf(stderr, "find_HII_bubbles.c: Write error occured while writting xH box.\n");
-            fprintf(LOG, "find_HII_bubbles.c: Write error occured while writting xH box.\n");
-            global_xH = -1;
-        }
-        fclose(F);
-	    F = NULL;
+
+    // stage exit: wait for everything queued above to reach the disk
+    if (async_write_flush()){
+        fprintf(stderr, "find_HII_bubbles.c: Write error occured while writting the output boxes.\n");
+        fprintf(LOG, "find_HII_bubbles.c: Write error occured while writting the output boxes.\n");
+        global_xH = -1;
+        status = -1;
     }
   
 
@@ -1085,5 +1047,5 @@ int main(int argc, char ** argv){
       fftwf_free(N_rec_filtered);
       if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {destroy_21cmMC_arrays();}
       
-      return 0;
+      return status;
 }
@@ -1,6 +1,8 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "filter.c"
+#include "halo_helper_progs.c"
+#include "halo_catalog.c"
 
 FILE *LOG;
 
@@ -10,9 +12,10 @@ FILE *LOG;
   Program FIND_HALOS takes in a k_space box of the linear overdensity field
   and filters it on decreasing scales in order to find virialized halos.  
   Virialized halos are defined according to the linear critical overdensity.
-  FIND_HALOS outputs a list of virialized halos, <halos_N_LMpc>, where
-  N^3 is the spacial resolution and L is the comoving length of the box.
-  The columns in <halos_N_LMpc> contains each halo's:
+  FIND_HALOS outputs a catalogue of virialized halos, <halo_catalog_N_LMpc>, where
+  N^3 is the spacial resolution and L is the comoving length of the box
+  (see halo_catalog.c; with ASCII_HALO_LISTS also the text list <halos_N_LMpc>).
+  The columns of the catalogue contain each halo's:
   mass (in M_sun)
   x location (in box size, [0 to 1) )
   y location (in box size, [0 to 1) )
@@ -25,223 +28,66 @@ FILE *LOG;
 */
 
 
-/*
-  Funtion OVERLAP_HALO checks if the would be halo with radius R
-  and centered on (x,y,z) overlaps with a preesisting halo
-*/
-int overlap_halo(char * in_halo, float R, int x, int y, int z){
-  int x_curr, y_curr, z_curr, x_min, x_max, y_min, y_max, z_min, z_max, R_index;
-  float Rsq_curr_index, xsq, xplussq, xminsq, ysq, yplussq, yminsq, zsq, zplussq, zminsq;
-  int x_index, y_index, z_index;
+// the halos found so far, in order of decreasing mass
+static float *halo_mass=NULL, *halo_x=NULL, *halo_y=NULL, *halo_z=NULL;
+static unsigned long long n_halos=0, halo_capacity=0;
 
-    fprintf(LOG, "begin overlap halo (%i, %i, %i), clock=%.2f\n", x,y,z,(double)clock()/CLOCKS_PER_SEC);
-    fflush(LOG);
-
-  // scale R to a effective overlap size, using R_OVERLAP_FACTOR
-  R *= R_OVERLAP_FACTOR;
-
-  // convert R to index units
-  R_index = ceil(R/BOX_LEN*DIM);
-  Rsq_curr_index = pow(R/BOX_LEN*DIM, 2); // convert to index
-
-  // set parameter range
-  x_min = x-R_index;
-  x_max = x+R_index;
-  y_min = y-R_index;
-  y_max = y+R_index;
-  z_min = z-R_index;
-  z_max = z+R_index;
-
-  //    printf("min %i, %i, %i\n", x_min, y_min, z_min);
-  //printf("max %i, %i, %i\n", x_max, y_max, z_max);
-  for (x_curr=x_min; x_curr<=x_max; x_curr++){
-    for (y_curr=y_min; y_curr<=y_max; y_curr++){
-      for (z_curr=z_min; z_curr<=z_max; z_curr++){
-	x_index = x_curr;
-	y_index = y_curr;
-	z_index = z_curr;
-	// adjust if we are outside of the box
-	if (x_index<0) {x_index += DIM;}
-	else if (x_index>=DIM) {x_index -= DIM;}
-	if (y_index<0) {y_index += DIM;}
-	else if (y_index>=DIM) {y_index -= DIM;}
-	if (z_index<0) {z_index += DIM;}
-	else if (z_index>=DIM) {z_index -= DIM;}
-
-	// remember to check all reflections
-	xsq = pow(x-x_index, 2);
-	ysq = pow(y-y_index, 2);
-	zsq = pow(z-z_index, 2);
-	xplussq = pow(x-x_index+DIM, 2);
-	yplussq = pow(y-y_index+DIM, 2);
-	zplussq = pow(z-z_index+DIM, 2);
-	xminsq = pow(x-x_index-DIM, 2);
-	yminsq = pow(y-y_index-DIM, 2);
-	zminsq = pow(z-z_index-DIM, 2);
-	if ( in_halo[R_INDEX(x_index, y_index, z_index)] && 
-	     ( (Rsq_curr_index > (xsq + ysq + zsq)) || // AND pixel is within this halo
-	       (Rsq_curr_index > (xsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + ysq + zminsq)) || 
-			   
-	       (Rsq_curr_index > (xsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xplussq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xminsq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zminsq))
-	       ) ){
-	    
-	  // this pixel already belongs to a halo, and would want to become part of this halo as well
-	  return 1;
-	}
-      }
+int add_halo(float M, float x, float y, float z){
+  if (n_halos == halo_capacity){
+    halo_capacity = halo_capacity ? 2*halo_capacity : 1024;
+    if (!(halo_mass = (float *) realloc(halo_mass, sizeof(float)*halo_capacity)) ||
+	!(halo_x = (float *) realloc(halo_x, sizeof(float)*halo_capacity)) ||
+	!(halo_y = (float *) realloc(halo_y, sizeof(float)*halo_capacity)) ||
+	!(halo_z = (float *) realloc(halo_z, sizeof(float)*halo_capacity))){
+      fprintf(stderr, "find_halos.c: Error allocating memory for %llu halos\nAborting...\n", halo_capacity);
+      return -1;
     }
   }
-
+  halo_mass[n_halos] = M;
+  halo_x[n_halos] = x;
+  halo_y[n_halos] = y;
+  halo_z[n_halos] = z;
+  n_halos++;
   return 0;
 }
 
 
-/*
-  Funtion UPDATE_IN_HALO takes in a box <in_halo> and flags all points
-  which fall within radius R of (x,y,z).
-*/
-void update_in_halo(char * in_halo, float R, int x, int y, int z){
-  int x_curr, y_curr, z_curr, x_min, x_max, y_min, y_max, z_min, z_max, R_index;
-  float Rsq_curr_index, xsq, xplussq, xminsq, ysq, yplussq, yminsq, zsq, zplussq, zminsq;
-  int x_index, y_index, z_index;
+// the rows of the FgtrM and dN/dlnM histograms, for their binary tables (see stat_table.c)
+#define HIST_COLUMNS (int) (6)
+static double *hist_column[2][HIST_COLUMNS];
+static unsigned long long n_hist_rows=0;
 
-    fprintf(LOG, "begin update halo (%i, %i, %i), clock=%.2f\n", x,y,z,(double)clock()/CLOCKS_PER_SEC);
-    fflush(LOG);
+int add_hist_rows(const double *fgtrm_row, const double *dndlnm_row){
+  int col;
 
-  // convert R to index units
-  R_index = ceil(R/BOX_LEN*DIM);
-  Rsq_curr_index = pow(R/BOX_LEN*DIM, 2); // convert to index
-
-  // set parameter range
-  x_min = x-R_index;
-  x_max = x+R_index;
-  y_min = y-R_index;
-  y_max = y+R_index;
-  z_min = z-R_index;
-  z_max = z+R_index;
-
-  //printf("min %i, %i, %i\n", x_min, y_min, z_min);
-  //printf("max %i, %i, %i\n", x_max, y_max, z_max);
-  for (x_curr=x_min; x_curr<=x_max; x_curr++){
-    for (y_curr=y_min; y_curr<=y_max; y_curr++){
-      for (z_curr=z_min; z_curr<=z_max; z_curr++){
-	x_index = x_curr;
-	y_index = y_curr;
-	z_index = z_curr;
-	// adjust if we are outside of the box
-	if (x_index<0) {x_index += DIM;}
-	else if (x_index>=DIM) {x_index -= DIM;}
-	if (y_index<0) {y_index += DIM;}
-	else if (y_index>=DIM) {y_index -= DIM;}
-	if (z_index<0) {z_index += DIM;}
-	else if (z_index>=DIM) {z_index -= DIM;}
-
-	// now check
-	if (!in_halo[R_INDEX(x_index, y_index, z_index)]){ // untaken pixel (not part of other halo)
-	  // remember to check all reflections
-	  xsq = pow(x-x_index, 2);
-	  ysq = pow(y-y_index, 2);
-	  zsq = pow(z-z_index, 2);
-	  xplussq = pow(x-x_index+DIM, 2);
-	  yplussq = pow(y-y_index+DIM, 2);
-	  zplussq = pow(z-z_index+DIM, 2);
-	  xminsq = pow(x-x_index-DIM, 2);
-	  yminsq = pow(y-y_index-DIM, 2);
-	  zminsq = pow(z-z_index-DIM, 2);
-	  if ( (Rsq_curr_index > (xsq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xplussq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xminsq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zminsq))
-	     ){
-	    
-	    // we are within the sphere defined by R, so change flag in in_halo array
-	    in_halo[R_INDEX(x_index, y_index, z_index)] = 1;
-	    //	    printf("%i, %i, %i\n", x_index, y_index, z_index);
-	  }
-	}
-      }
+  for (col=0; col<HIST_COLUMNS; col++){
+    if (!(hist_column[0][col] = (double *) realloc(hist_column[0][col], sizeof(double)*(n_hist_rows+1))) ||
+	!(hist_column[1][col] = (double *) realloc(hist_column[1][col], sizeof(double)*(n_hist_rows+1)))){
+      fprintf(stderr, "find_halos.c: Error allocating memory for the histograms\n");
+      return -1;
     }
+    hist_column[0][col][n_hist_rows] = fgtrm_row[col];
+    hist_column[1][col][n_hist_rows] = dndlnm_row[col];
   }
+  n_hist_rows++;
+  return 0;
 }
 
 
-
 int main(int argc, char ** argv){
   fftwf_complex *box;
+  const fftwf_complex *deltak_shared = NULL;
+  double fgtrm_row[HIST_COLUMNS], dndlnm_row[HIST_COLUMNS];
   fftwf_plan plan;
-  FILE *IN, *OUT, *F;
+  FILE *IN, *F;
   float growth_factor, R, delta_m, dm, dlnm, M, Delta_R, delta_crit, REDSHIFT;
   double fgrtm, dfgrtm;
   unsigned long long ct;
-  char filename[80], *in_halo, *forbidden;
-  int x,y,z,dn, n;
-  float R_temp, x_temp, y_temp, z_temp, dummy, M_MIN;
+  char filename[80];
+  bitset_word *in_halo, *forbidden;
+  int x,y,z,dn, n, status=0;
+  float R_temp, M_MIN;
+  unsigned long long halo_ct;
 
   /************  BEGIN INITIALIZATION ****************************/
   if (argc != 2){
@@ -264,9 +110,10 @@ int main(int argc, char ** argv){
   //set the minimum source mass
   M_MIN = M_TURNOVER/3.;
 
-  // open log file
+  // open log file, one per redshift so that concurrent runs (see stage_scheduler.c) don't share it
   system("mkdir ../Log_files");
-  LOG = fopen("../Log_files/zscroll_log_file", "w");
+  sprintf(filename, "../Log_files/find_halos_log_file_z%.2f", REDSHIFT);
+  LOG = fopen(filename, "w");
   if (!LOG){
     fprintf(stderr, "find_halos.c: Unable to open log file\n Aborting...\n");
     return -1;
@@ -279,18 +126,15 @@ int main(int argc, char ** argv){
     return -1;
   }
 
-  // allocate memory for the boolean in_halo box
-  in_halo = (char *) malloc(sizeof(char)*TOT_NUM_PIXELS);
+  // allocate memory for the boolean in_halo box (one bit per cell, see bitset.c)
+  in_halo = bitset_alloc(TOT_NUM_PIXELS);
   if (!in_halo){
     fprintf(stderr, "find_halos.c: Error allocating memory for in_halo box\nAborting...\n");
     fftwf_free(box);
     return -1;
   }
-  // initialize
-  memset(in_halo, 0, sizeof(char)*TOT_NUM_PIXELS);
-
   if (OPTIMIZE){
-    forbidden = (char *) malloc(sizeof(char)*TOT_NUM_PIXELS);
+    forbidden = bitset_alloc(TOT_NUM_PIXELS);
     if (!forbidden){
       fprintf(stderr, "find_halos.c: Error allocating memory for forbidden box\nAborting...\n");
       fftwf_free(box);
@@ -308,6 +152,15 @@ int main(int argc, char ** argv){
     free(in_halo);
     return -1;
   }
+  // the box is needed afresh for every R; with SHM_BOX_STORE, copy it from the node's shared copy
+  // (see shm_store.c) instead of reading it again
+  if (SHM_BOX_STORE && !(deltak_shared = (const fftwf_complex *) shm_box_attach(filename, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS))){
+    fprintf(stderr, "find_halos.c: Unable to attach to the shared copy of %s\nAborting...\n", filename);
+    fftwf_free(box);
+    fclose(IN);
+    free(in_halo);
+    return -1;
+  }
 
   // remove conflicting files
   sprintf(filename, "../Output_files/FgtrM_files/hist_halos_z%.2f_%i_%.0fMpc_b%.3f_c%.3f", REDSHIFT, DIM, BOX_LEN, SHETH_b, SHETH_c);
@@ -315,16 +168,6 @@ int main(int argc, char ** argv){
   sprintf(filename, "rm ../Output_files/DNDLNM_files/hist_halos_z%.2f_%i_%.0fMpc_b%.3f_c%.3f", REDSHIFT, DIM, BOX_LEN,  SHETH_b, SHETH_c);
   system(filename);
 
-  // open the output files
-  sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-  OUT = fopen(filename, "w");
-  if (!OUT){
-    fprintf(stderr, "Unable to open file %s for writting!\n", filename);
-    fftwf_free(box);
-    free(in_halo);
-    fclose(IN);
-    return -1;
-  }
   /************  END INITIALIZATION ****************************/
 
   // lets filter it now
@@ -356,11 +199,12 @@ int main(int argc, char ** argv){
     fflush(LOG);
     // read in the box
     rewind(IN);
-    if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
+    if (SHM_BOX_STORE)
+      memcpy(box, deltak_shared, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+    else if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
       fprintf(stderr, "find_halos.c: Read error occured!\n");
       fftwf_free(box);
       fclose(IN);
-      fclose(OUT);
       free(in_halo);
       return -1;
     }
@@ -391,17 +235,12 @@ int main(int argc, char ** argv){
     if (OPTIMIZE && (M > OPTIMIZE_MIN_MASS)){
       fprintf(LOG, "begin initialization of forbidden, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
       fflush(LOG);
-      memset(forbidden, 0, sizeof(char)*TOT_NUM_PIXELS);
+      bitset_clear(forbidden, TOT_NUM_PIXELS);
       // now go through the list of existing halos and paint on the no-go region onto <forbidden>
-      sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-      F = fopen(filename, "r");
-	fscanf(F, "%e %f %f %f", &dummy, &x_temp, &y_temp, &z_temp);
-      while (!feof(F)){
-	R_temp = MtoR(dummy);
-	update_in_halo(forbidden, R_temp+R_OVERLAP_FACTOR*R, rint(x_temp*DIM), rint(y_temp*DIM), rint(z_temp*DIM));
-	fscanf(F, "%e %f %f %f", &dummy, &x_temp, &y_temp, &z_temp);
+      for (halo_ct=0; halo_ct<n_halos; halo_ct++){
+	R_temp = MtoR(halo_mass[halo_ct]);
+	update_in_halo(forbidden, R_temp+R_OVERLAP_FACTOR*R, rint(halo_x[halo_ct]*DIM), rint(halo_y[halo_ct]*DIM), rint(halo_z[halo_ct]*DIM));
       }
-      fclose(F);
       fprintf(LOG, "end initialization of forbidden, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
       fflush(LOG);
     }
@@ -416,10 +255,13 @@ int main(int argc, char ** argv){
 	  // if not within a larger halo, and radii don't overlap print out stats, and update in_halo box
 	  /*********  BEGIN OPTIMIZATION **********/
 	  if (OPTIMIZE && (M > OPTIMIZE_MIN_MASS)){
-	    if ( (delta_m > delta_crit) && !forbidden[R_INDEX(x,y,z)]){
+	    if ( (delta_m > delta_crit) && !BITSET_TEST(forbidden, R_INDEX(x,y,z))){
 	    fprintf(stderr, "Found halo #%i, delta_m = %.3f at (x,y,z) = (%i,%i,%i)\n", n+1, delta_m, x,y,z);
-	    fprintf(OUT, "%e\t%f\t%f\t%f\n", M, x/(DIM+0.0), y/(DIM+0.0), z/(DIM+0.0));
-	    fflush(NULL);
+	    if (add_halo(M, x/(DIM+0.0), y/(DIM+0.0), z/(DIM+0.0)) < 0){
+	      fftwf_free(box); fclose(IN); free(in_halo);
+	      if (OPTIMIZE) free(forbidden);
+	      return -1;
+	    }
 	    update_in_halo(in_halo, R, x,y,z); // flag the pixels contained within this halo
 	    update_in_halo(forbidden, (1+R_OVERLAP_FACTOR)*R, x,y,z); // flag the pixels contained within this halo
 	    dn++; // keep track of the number of halos
@@ -428,10 +270,13 @@ int main(int argc, char ** argv){
 	  }
 	  /*********  END OPTIMIZATION **********/
 
-	  else if ((delta_m > delta_crit) && !in_halo[R_INDEX(x,y,z)] && !overlap_halo(in_halo, R, x,y,z)){ // we found us a "new" halo!
+	  else if ((delta_m > delta_crit) && !BITSET_TEST(in_halo, R_INDEX(x,y,z)) && !overlap_halo(in_halo, R, x,y,z)){ // we found us a "new" halo!
 	    fprintf(stderr, "Found halo #%i, delta_m = %.3f at (x,y,z) = (%i,%i,%i)\n", n+1, delta_m, x,y,z);
-	    fprintf(OUT, "%e\t%f\t%f\t%f\n", M, x/(DIM+0.0), y/(DIM+0.0), z/(DIM+0.0));
-	    fflush(NULL);
+	    if (add_halo(M, x/(DIM+0.0), y/(DIM+0.0), z/(DIM+0.0)) < 0){
+	      fftwf_free(box); fclose(IN); free(in_halo);
+	      if (OPTIMIZE) free(forbidden);
+	      return -1;
+	    }
 	    update_in_halo(in_halo, R, x,y,z); // flag the pixels contained within this halo
 	    dn++; // keep track of the number of halos
 	    n++;
@@ -445,8 +290,11 @@ int main(int argc, char ** argv){
       fgrtm += M/(RHOcrit*OMm)*dn/VOLUME;
       dfgrtm += pow(M/(RHOcrit*OMm)*sqrt(dn)/VOLUME, 2);
       sprintf(filename, "../Output_files/FgtrM_files/hist_halos_z%.2f_%i_%.0fMpc_b%.3f_c%.3f", REDSHIFT, DIM, BOX_LEN, SHETH_b, SHETH_c);
+      fgtrm_row[0] = M; fgtrm_row[1] = fgrtm; fgtrm_row[2] = sqrt(dfgrtm);
+      fgtrm_row[3] = FgtrM(REDSHIFT, M); fgtrm_row[4] = FgtrM_st(REDSHIFT, M);
+      fgtrm_row[5] = FgtrM_bias(REDSHIFT, M, 0, sigma_z0(RtoM(L_FACTOR*BOX_LEN)));
       F = fopen(filename, "a");
-      fprintf(F, "%e\t%e\t%e\t%e\t%e\t%e\n", M, fgrtm, sqrt(dfgrtm), FgtrM(REDSHIFT, M), FgtrM_st(REDSHIFT, M), FgtrM_bias(REDSHIFT, M, 0, sigma_z0(RtoM(L_FACTOR*BOX_LEN))) );
+      fprintf(F, "%e\t%e\t%e\t%e\t%e\t%e\n", fgtrm_row[0], fgtrm_row[1], fgtrm_row[2], fgtrm_row[3], fgtrm_row[4], fgtrm_row[5]);
       fclose(F);
 
       // and the dndlnm files
@@ -454,30 +302,61 @@ int main(int argc, char ** argv){
       F = fopen(filename, "a");
       //dm = RtoM(DELTA_R_FACTOR*R)-M;
       dlnm = log(RtoM(DELTA_R_FACTOR*R)) - log(M);
-      fprintf(F, "%e\t%e\t%e\t%e\t%e\t%e\n", M, dn/VOLUME/dlnm, sqrt(dn)/VOLUME/dlnm, M*dNdM(REDSHIFT, M), M*dNdM_st(REDSHIFT, M), M*dnbiasdM(M, REDSHIFT, RtoM(L_FACTOR*BOX_LEN), 0) );
+      dndlnm_row[0] = M; dndlnm_row[1] = dn/VOLUME/dlnm; dndlnm_row[2] = sqrt(dn)/VOLUME/dlnm;
+      dndlnm_row[3] = M*dNdM(REDSHIFT, M); dndlnm_row[4] = M*dNdM_st(REDSHIFT, M);
+      dndlnm_row[5] = M*dnbiasdM(M, REDSHIFT, RtoM(L_FACTOR*BOX_LEN), 0);
+      fprintf(F, "%e\t%e\t%e\t%e\t%e\t%e\n", dndlnm_row[0], dndlnm_row[1], dndlnm_row[2], dndlnm_row[3], dndlnm_row[4], dndlnm_row[5]);
       //      fprintf(F, "%e\t%e\t%e\t%e\t%e\t%e\n", M, M*dn/VOLUME/dm, M/dm/VOLUME*sqrt(dn), M*dNdM(REDSHIFT, M), M*dNdM_st(REDSHIFT, M), M*dnbiasdM(M, REDSHIFT, RtoM(BOX_LEN), 0) );
       fclose(F);
+      if (add_hist_rows(fgtrm_row, dndlnm_row) < 0)
+	status = -1;
     }
 
     R /= DELTA_R_FACTOR;
   }
 
 
+  // write out the halos
+  sprintf(filename, "../Output_files/Halo_lists/halo_catalog_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
+  fprintf(stderr, "Now writting %llu halos to %s\n", n_halos, filename);
+  if (write_halo_catalog(filename, n_halos, halo_mass, halo_x, halo_y, halo_z, REDSHIFT) < 0)
+    status = -1;
+  if (ASCII_HALO_LISTS){
+    sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
+    if (write_halo_list(filename, n_halos, halo_mass, halo_x, halo_y, halo_z) < 0)
+      status = -1;
+  }
+  free(halo_mass); free(halo_x); free(halo_y); free(halo_z);
+
+  // append this redshift's histograms to the binary tables of all redshifts
+  sprintf(filename, "../Output_files/FgtrM_files/hist_halos_%i_%.0fMpc_b%.3f_c%.3f.tbl", DIM, BOX_LEN, SHETH_b, SHETH_c);
+  if (stat_table_append(filename, "M:f8,FgtrM:f8,FgtrM_error:f8,FgtrM_ps:f8,FgtrM_st:f8,FgtrM_bias:f8", "",
+			REDSHIFT, NULL, n_hist_rows, (const void * const *)hist_column[0]) != 0)
+    status = -1;
+  sprintf(filename, "../Output_files/DNDLNM_files/hist_halos_%i_%.0fMpc_b%.3f_c%.3f.tbl", DIM, BOX_LEN, SHETH_b, SHETH_c);
+  if (stat_table_append(filename, "M:f8,dndlnM:f8,dndlnM_error:f8,dndlnM_ps:f8,dndlnM_st:f8,dndlnM_bias:f8", "",
+			REDSHIFT, NULL, n_hist_rows, (const void * const *)hist_column[1]) != 0)
+    status = -1;
+  for (x=0; x<HIST_COLUMNS; x++){
+    free(hist_column[0][x]); free(hist_column[1][x]);
+  }
+
   // deallocate 
-  fclose(OUT);
   fclose(IN);
+  if (SHM_BOX_STORE)
+    shm_box_detach(deltak_shared);
   fclose(LOG);
   fftwf_free(box);
 
   /*
   // print in_halo box
   sprintf(filename, "../Boxes/in_halo_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-  OUT = fopen(filename, "wb");
+  F = fopen(filename, "wb");
   fprintf(stderr, "Now writting in_halo box at %s\n", filename);
-  if (mod_fwrite(in_halo, sizeof(char)*TOT_NUM_PIXELS, 1, OUT)!=1){
+  if (mod_fwrite(in_halo, sizeof(bitset_word)*BITSET_WORDS(TOT_NUM_PIXELS), 1, F)!=1){
     fprintf(stderr, "find_halos.c: Write error occured while writting in_halo box.\n");
   }
-  fclose(OUT);
+  fclose(F);
   */
 
   free(in_halo);
@@ -485,5 +364,5 @@ int main(int argc, char ** argv){
   if (OPTIMIZE)
     free(forbidden);
 
-  return 0;
+  return status;
 }
@@ -21,9 +21,10 @@
 
 
 int main (int argc, char ** argv){
-  char *in_bubble, filename[100];
+  char filename[100];
+  bitset_word *in_bubble;
   FILE *F, *LOG;
-  float REDSHIFT, r_mag, r_x, r_y, r_z, bin_floor, R, MAX, dpdR, P, *dist, nf, xH;
+  float REDSHIFT, r_mag, r_x, r_y, r_z, bin_floor, R, MAX, dpdR, P, *dist, nf, xH, *xH_box;
   int REGION_FLAG, x_0,y_0,z_0, x_curr, y_curr,z_curr, wrap,j,k;
   unsigned long long i, bin_ct;
   gsl_rng * r;
@@ -55,38 +56,37 @@ int main (int argc, char ** argv){
 
 
   // read in the bubble box
-  // allocate memory for the boolean in_bubble
-  in_bubble = (char *) malloc(sizeof(char)*HII_TOT_NUM_PIXELS);
+  // allocate memory for the boolean in_bubble (one bit per cell, see bitset.c)
+  in_bubble = bitset_alloc(HII_TOT_NUM_PIXELS);
   if (!in_bubble){
     fprintf(stderr, "gen_size_distr: Error allocating memory for in_bubble box\nAborting...\n");
     gsl_rng_free (r); return -1;
   }
-  F = fopen(argv[3], "rb");
+  F = box_fopen(argv[3], "rb");
   if (!F){
     fprintf(stderr, "gen_size_distr: Error opening file %s for reading\nAborting...\n", argv[3]);
     free(in_bubble);
     gsl_rng_free (r); return -1;
   }
   fprintf(stderr, "Reading in xH box\n");
+  xH_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+  if (!xH_box || (mod_fread(xH_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1)){
+    fprintf(stderr, "delta_T: Read error occured while reading neutral_fraction box.\n");
+    fclose(F); free(in_bubble); free(xH_box);
+    gsl_rng_free (r); return -1;
+  }
   nf = 0;
   for (i=0; i<HII_DIM; i++){
     for (j=0; j<HII_DIM; j++){
       for (k=0; k<HII_DIM; k++){
-        if (fread(&xH, sizeof(float), 1, F)!=1){
-          fprintf(stderr, "delta_T: Read error occured while reading neutral_fraction box.\n");
-	  fclose(F); free(in_bubble);
-	  gsl_rng_free (r); return -1;
-        }
-
+	xH = xH_box[HII_R_INDEX(i,j,k)];
 	nf += xH;
 	if (xH < VOXEL_NF_CUTOFF)
-	  in_bubble[HII_R_INDEX(i,j,k)] = 1;
-	else
-	  in_bubble[HII_R_INDEX(i,j,k)] = 0;    
+	  BITSET_SET(in_bubble, HII_R_INDEX(i,j,k));
       }
     }
   }
-  fclose(F);
+  fclose(F); free(xH_box);
   nf /= (double)HII_TOT_NUM_PIXELS;
 
   // check if the ionization field is fully neutral or ionized. if so calling this function is retarded
@@ -117,7 +117,7 @@ int main (int argc, char ** argv){
     else
       sprintf(filename, "../Output_files/Size_distributions/ionized_no_halos_nf%f_z%06.2f_%i_%.0fMpc", nf, REDSHIFT, HII_DIM, BOX_LEN);
   }
-  F=fopen(filename, "w");
+  F=box_fopen(filename, "w");
   if (!F){
     fprintf(stderr, "gen_size_distr: Error opening output file\nAborting...\n");
     free(in_bubble);
@@ -135,8 +135,8 @@ int main (int argc, char ** argv){
     x_0 = gsl_rng_uniform (r)*HII_DIM;
     y_0 = gsl_rng_uniform (r)*HII_DIM;
     z_0 = gsl_rng_uniform (r)*HII_DIM;
-    if ( ((REGION_FLAG==0) && !in_bubble[HII_R_INDEX(x_0, y_0, z_0)] ) ||
-	 ((REGION_FLAG==1) && in_bubble[HII_R_INDEX(x_0, y_0, z_0)] ) ){
+    if ( ((REGION_FLAG==0) && !BITSET_TEST(in_bubble, HII_R_INDEX(x_0, y_0, z_0)) ) ||
+	 ((REGION_FLAG==1) && BITSET_TEST(in_bubble, HII_R_INDEX(x_0, y_0, z_0)) ) ){
       // we are not in the desired phase, try again
       i--;
       continue;
@@ -169,7 +169,7 @@ int main (int argc, char ** argv){
       while (z_curr < 0){ z_curr += HII_DIM; wrap=1;}
 
       // check if we crossed a boundary
-      if ( in_bubble[HII_R_INDEX(x_0, y_0, z_0)] != in_bubble[HII_R_INDEX(x_curr, y_curr, z_curr)] ){ // got it!
+      if ( BITSET_TEST(in_bubble, HII_R_INDEX(x_0, y_0, z_0)) != BITSET_TEST(in_bubble, HII_R_INDEX(x_curr, y_curr, z_curr)) ){ // got it!
 	//	fprintf(stderr, "Got it at d=%.3f Mpc, (%i, %i, %i)\n", r_mag*BOX_LEN, x_curr, y_curr, z_curr);
 	//fprintf(LOG, "Got it at d=%.3f Mpc, (%i, %i, %i)\n", r_mag*BOX_LEN, x_curr, y_curr, z_curr);
        	dist[i] = r_mag*BOX_LEN;
@@ -219,7 +219,7 @@ int main (int argc, char ** argv){
   free(in_bubble);
   free(dist);
   fclose(LOG);
-  fclose(F);
+  box_fclose(F);
 
   gsl_rng_free (r); return 0;
 }
@@ -0,0 +1,273 @@
+#ifndef _HALO_CATALOG_
+#define _HALO_CATALOG_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+/*
+  Binary halo catalogues.
+
+  A catalogue holds the halos of one redshift as struct-of-arrays columns, sorted by decreasing
+  mass, so that all halos above a mass threshold are a prefix of every column and can be read
+  without touching the rest of the file.  The file layout is:
+
+    HALO_CATALOG_MAGIC (8 bytes)
+    header: number of halos, index_dim, DIM (unsigned long long), redshift, BOX_LEN (float)
+    mass[n]   (M_sun, decreasing)
+    x[n], y[n], z[n]   (box units, [0 to 1) )
+    cell_start[index_dim^3 + 1]   (unsigned long long)
+    cell_halo[n]   (unsigned long long)
+
+  The last two columns are a spatial index over an index_dim^3 grid: the halos whose centres lie
+  in cell (i,j,k) are cell_halo[cell_start[c]] ... cell_halo[cell_start[c+1]-1], with
+  c = k + index_dim*(j + index_dim*i), in order of decreasing mass.  update_halo_pos and
+  find_HII_bubbles visit the halos in this order (cell_halo[0] ... cell_halo[n-1]), so that
+  consecutive halos access neighbouring cells of their grids.
+*/
+
+#define HALO_CATALOG_MAGIC "21cmHC1"
+#ifndef HALO_CATALOG_INDEX_DIM
+#define HALO_CATALOG_INDEX_DIM (int) (32) // cells per side of the spatial index
+#endif
+
+typedef struct {
+  unsigned long long n, index_dim;
+  float redshift, box_len;
+  float *mass, *x, *y, *z;
+  unsigned long long *cell_start, *cell_halo; // NULL unless the index was loaded
+} halo_catalog;
+
+int write_halo_catalog(const char *, unsigned long long, const float *, const float *, const float *, const float *, float);
+int read_halo_catalog(const char *, float, int, halo_catalog *);
+unsigned long long halo_catalog_cell(const halo_catalog *, int, int, int, const unsigned long long **);
+void free_halo_catalog(halo_catalog *);
+int write_halo_list(const char *, unsigned long long, const float *, const float *, const float *, const float *);
+
+
+/* the index cell of a position in box units */
+static unsigned long long halo_catalog_cell_index(float x, float y, float z, unsigned long long index_dim){
+  unsigned long long i = x*index_dim, j = y*index_dim, k = z*index_dim;
+
+  if (i >= index_dim) i = index_dim-1;
+  if (j >= index_dim) j = index_dim-1;
+  if (k >= index_dim) k = index_dim-1;
+  return k + index_dim*(j + index_dim*i);
+}
+
+
+static const float *halo_catalog_sort_mass;
+static int halo_catalog_compare(const void *a, const void *b){
+  unsigned long long i = *(const unsigned long long *)a, j = *(const unsigned long long *)b;
+
+  if (halo_catalog_sort_mass[i] > halo_catalog_sort_mass[j]) return -1;
+  if (halo_catalog_sort_mass[i] < halo_catalog_sort_mass[j]) return 1;
+  return (i > j) - (i < j); // keep the original order of equal masses
+}
+
+
+/*
+  Function WRITE_HALO_CATALOG writes the n halos with masses <mass> and positions <x,y,z> (box
+  units) to <filename>, sorted by decreasing mass and with a HALO_CATALOG_INDEX_DIM^3 spatial index.
+  Returns 0 on success, -1 otherwise.
+*/
+int write_halo_catalog(const char *filename, unsigned long long n, const float *mass,
+		       const float *x, const float *y, const float *z, float redshift){
+  unsigned long long header[3], ct, c, n_cells, *order, *cell_start, *cell_halo;
+  float info[2], *column;
+  const float *columns[4];
+  char magic[sizeof(HALO_CATALOG_MAGIC)] = HALO_CATALOG_MAGIC;
+  int col, status = 0;
+  FILE *F;
+
+  n_cells = (unsigned long long)HALO_CATALOG_INDEX_DIM*HALO_CATALOG_INDEX_DIM*HALO_CATALOG_INDEX_DIM;
+  order = (unsigned long long *) malloc(sizeof(unsigned long long)*(n+1));
+  cell_halo = (unsigned long long *) malloc(sizeof(unsigned long long)*(n+1));
+  cell_start = (unsigned long long *) calloc(n_cells+1, sizeof(unsigned long long));
+  column = (float *) malloc(sizeof(float)*(n+1));
+  if (!order || !cell_halo || !cell_start || !column){
+    fprintf(stderr, "write_halo_catalog: Error allocating memory for %llu halos\n", n);
+    free(order); free(cell_halo); free(cell_start); free(column);
+    return -1;
+  }
+
+  // sort by decreasing mass
+  for (ct=0; ct<n; ct++)
+    order[ct] = ct;
+  halo_catalog_sort_mass = mass;
+  qsort(order, n, sizeof(unsigned long long), halo_catalog_compare);
+
+  // counting sort of the (sorted) halos into the index cells
+  for (ct=0; ct<n; ct++)
+    cell_start[halo_catalog_cell_index(x[order[ct]], y[order[ct]], z[order[ct]], HALO_CATALOG_INDEX_DIM) + 1]++;
+  for (c=0; c<n_cells; c++)
+    cell_start[c+1] += cell_start[c];
+  for (ct=0; ct<n; ct++){
+    c = halo_catalog_cell_index(x[order[ct]], y[order[ct]], z[order[ct]], HALO_CATALOG_INDEX_DIM);
+    cell_halo[cell_start[c]++] = ct;
+  }
+  for (c=n_cells; c>0; c--)
+    cell_start[c] = cell_start[c-1];
+  cell_start[0] = 0;
+
+  F = fopen(filename, "wb");
+  if (!F){
+    fprintf(stderr, "write_halo_catalog: Unable to open file %s for writting\n", filename);
+    free(order); free(cell_halo); free(cell_start); free(column);
+    return -1;
+  }
+  header[0] = n;
+  header[1] = HALO_CATALOG_INDEX_DIM;
+  header[2] = DIM;
+  info[0] = redshift;
+  info[1] = BOX_LEN;
+  if ((fwrite(magic, sizeof(magic), 1, F) != 1) || (fwrite(header, sizeof(header), 1, F) != 1) ||
+      (fwrite(info, sizeof(info), 1, F) != 1))
+    status = -1;
+  columns[0] = mass; columns[1] = x; columns[2] = y; columns[3] = z;
+  for (col=0; (col<4) && !status; col++){
+    for (ct=0; ct<n; ct++)
+      column[ct] = columns[col][order[ct]];
+    if (io_account_fwrite(column, sizeof(float), n, F, __FILE__, __LINE__) != n)
+      status = -1;
+  }
+  if (!status && ((io_account_fwrite(cell_start, sizeof(unsigned long long), n_cells+1, F, __FILE__, __LINE__) != n_cells+1) ||
+		  (io_account_fwrite(cell_halo, sizeof(unsigned long long), n, F, __FILE__, __LINE__) != n)))
+    status = -1;
+  if (fclose(F) != 0)
+    status = -1;
+  if (status)
+    fprintf(stderr, "write_halo_catalog: Write error occured while writting %s\n", filename);
+
+  free(order); free(cell_halo); free(cell_start); free(column);
+  return status;
+}
+
+
+/*
+  Function READ_HALO_CATALOG reads the halos of mass >= M_min from the catalogue <filename> into
+  <cat> (M_min <= 0 reads them all).  Only the leading part of each column is read.  If
+  <with_index> is set, the spatial index is also loaded, restricted to the halos read.
+  Returns 0 on success, -1 otherwise; free the catalogue with free_halo_catalog().
+*/
+int read_halo_catalog(const char *filename, float M_min, int with_index, halo_catalog *cat){
+  unsigned long long header[3], lo, hi, mid, n_cells, c, ct, kept;
+  float info[2], m, **column[4];
+  char magic[sizeof(HALO_CATALOG_MAGIC)];
+  off_t data_start;
+  int col;
+  FILE *F;
+
+  memset(cat, 0, sizeof(halo_catalog));
+  F = fopen(filename, "rb");
+  if (!F){
+    fprintf(stderr, "read_halo_catalog: Unable to open file %s for reading\n", filename);
+    return -1;
+  }
+  if ((fread(magic, sizeof(magic), 1, F) != 1) || memcmp(magic, HALO_CATALOG_MAGIC, sizeof(magic)) ||
+      (fread(header, sizeof(header), 1, F) != 1) || (fread(info, sizeof(info), 1, F) != 1)){
+    fprintf(stderr, "read_halo_catalog: %s is not a halo catalogue\n", filename);
+    fclose(F);
+    return -1;
+  }
+  data_start = ftello(F);
+  cat->index_dim = header[1];
+  cat->redshift = info[0];
+  cat->box_len = info[1];
+
+  // binary search for the number of halos with mass >= M_min
+  lo = (M_min > 0) ? 0 : header[0];
+  hi = header[0];
+  while (lo < hi){
+    mid = lo + (hi-lo)/2;
+    if ((fseeko(F, data_start + sizeof(float)*mid, SEEK_SET) != 0) || (io_account_fread(&m, sizeof(float), 1, F, __FILE__, __LINE__) != 1)){
+      fprintf(stderr, "read_halo_catalog: Read error occured while reading %s\n", filename);
+      fclose(F);
+      return -1;
+    }
+    if (m >= M_min)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  cat->n = lo;
+
+  column[0] = &cat->mass; column[1] = &cat->x; column[2] = &cat->y; column[3] = &cat->z;
+  for (col=0; col<4; col++){
+    *column[col] = (float *) malloc(sizeof(float)*(cat->n+1));
+    if (!*column[col] || (fseeko(F, data_start + sizeof(float)*header[0]*col, SEEK_SET) != 0) ||
+	(io_account_fread(*column[col], sizeof(float), cat->n, F, __FILE__, __LINE__) != cat->n)){
+      fprintf(stderr, "read_halo_catalog: Read error occured while reading %s\n", filename);
+      fclose(F);
+      free_halo_catalog(cat);
+      return -1;
+    }
+  }
+
+  if (with_index){
+    n_cells = header[1]*header[1]*header[1];
+    cat->cell_start = (unsigned long long *) malloc(sizeof(unsigned long long)*(n_cells+1));
+    cat->cell_halo = (unsigned long long *) malloc(sizeof(unsigned long long)*(header[0]+1));
+    if (!cat->cell_start || !cat->cell_halo || (fseeko(F, data_start + sizeof(float)*header[0]*4, SEEK_SET) != 0) ||
+	(io_account_fread(cat->cell_start, sizeof(unsigned long long), n_cells+1, F, __FILE__, __LINE__) != n_cells+1) ||
+	(io_account_fread(cat->cell_halo, sizeof(unsigned long long), header[0], F, __FILE__, __LINE__) != header[0])){
+      fprintf(stderr, "read_halo_catalog: Read error occured while reading the index of %s\n", filename);
+      fclose(F);
+      free_halo_catalog(cat);
+      return -1;
+    }
+    // drop the halos that were not read; within a cell they are the trailing (lightest) ones
+    kept = 0;
+    for (c=0; c<n_cells; c++){
+      ct = cat->cell_start[c];
+      cat->cell_start[c] = kept;
+      for (; (ct < cat->cell_start[c+1]) && (cat->cell_halo[ct] < cat->n); ct++)
+	cat->cell_halo[kept++] = cat->cell_halo[ct];
+    }
+    cat->cell_start[n_cells] = kept;
+  }
+
+  fclose(F);
+  return 0;
+}
+
+
+/* returns the number of halos of <cat> in index cell (i,j,k), whose indices are in *halos */
+unsigned long long halo_catalog_cell(const halo_catalog *cat, int i, int j, int k, const unsigned long long **halos){
+  unsigned long long c = k + cat->index_dim*(j + cat->index_dim*(unsigned long long)i);
+
+  *halos = cat->cell_halo + cat->cell_start[c];
+  return cat->cell_start[c+1] - cat->cell_start[c];
+}
+
+
+/*
+  Function WRITE_HALO_LIST writes the n halos, in the given order, as the old ASCII halo list
+  (mass, x, y, z per line; see ASCII_HALO_LISTS in ANAL_PARAMS.H).  Returns 0 on success, -1 otherwise.
+*/
+int write_halo_list(const char *filename, unsigned long long n, const float *mass,
+		    const float *x, const float *y, const float *z){
+  unsigned long long ct;
+  FILE *F;
+
+  F = fopen(filename, "w");
+  if (!F){
+    fprintf(stderr, "write_halo_list: Unable to open file %s for writting\n", filename);
+    return -1;
+  }
+  for (ct=0; ct<n; ct++)
+    fprintf(F, "%e\t%f\t%f\t%f\n", mass[ct], x[ct], y[ct], z[ct]);
+  if (ferror(F) | fclose(F)){
+    fprintf(stderr, "write_halo_list: Write error occured while writting %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+
+void free_halo_catalog(halo_catalog *cat){
+  free(cat->mass); free(cat->x); free(cat->y); free(cat->z);
+  free(cat->cell_start); free(cat->cell_halo);
+  memset(cat, 0, sizeof(halo_catalog));
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _HALO_HELPERS_
+#define _HALO_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+FILE *LOG;
+
+/*
+  Funtion OVERLAP_HALO checks if the would be halo with radius R
+  and centered on (x,y,z) overlaps with a preesisting halo
+  (i.e. if any pixel of <in_halo> within R_OVERLAP_FACTOR*R is already flagged)
+*/
+int overlap_halo(bitset_word * in_halo, float R, int x, int y, int z){
+  int R_index;
+  float Rsq_curr_index;
+
+    fprintf(LOG, "begin overlap halo (%i, %i, %i), clock=%.2f\n", x,y,z,(double)clock()/CLOCKS_PER_SEC);
+    fflush(LOG);
+
+  // scale R to a effective overlap size, using R_OVERLAP_FACTOR
+  R *= R_OVERLAP_FACTOR;
+
+  // convert R to index units
+  R_index = ceil(R/BOX_LEN*DIM);
+  Rsq_curr_index = pow(R/BOX_LEN*DIM, 2); // convert to index
+
+  // pixels count if any of their periodic images is within R (see bitset.c)
+  return bitset_sphere_any(in_halo, DIM, Rsq_curr_index, R_index, x, y, z);
+}
+
+
+/*
+  Funtion UPDATE_IN_HALO takes in a box <in_halo> and flags all points
+  which fall within radius R of (x,y,z).
+*/
+void update_in_halo(bitset_word * in_halo, float R, int x, int y, int z){
+  int R_index;
+  float Rsq_curr_index;
+
+    fprintf(LOG, "begin update halo (%i, %i, %i), clock=%.2f\n", x,y,z,(double)clock()/CLOCKS_PER_SEC);
+    fflush(LOG);
+
+  // convert R to index units
+  R_index = ceil(R/BOX_LEN*DIM);
+  Rsq_curr_index = pow(R/BOX_LEN*DIM, 2); // convert to index
+
+  bitset_paint_sphere(in_halo, DIM, Rsq_curr_index, R_index, x, y, z);
+}
+
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _IC_CACHE_
+#define _IC_CACHE_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+/*
+  Cache of the initial conditions in ../Boxes.
+
+  init records which realization the boxes in ../Boxes were made for in a small text file,
+  ../Boxes/init_cache_<DIM>_<HII_DIM>_<BOX_LEN>Mpc: its first line is the key, every parameter the boxes depend on (the seed and
+  generator options, DIM, HII_DIM, BOX_LEN, the filter scale and the cosmology and power spectrum
+  of COSMOLOGY.H), and each further line names a box that was completely written.
+  When init is called again with the same key, it reuses those boxes and makes only the missing
+  ones (e.g. the 2LPT velocities, after SECOND_ORDER_LPT_CORRECTIONS is switched on), from the
+  stored k-space density; with a different key, or no deltak box, it makes them all again.
+  Set IC_CACHE (INIT_PARAMS.H) to 0 to always make them all.
+*/
+
+#define IC_DELTAK (int) (0)
+#define IC_SMOOTHED_DELTAX (int) (1)
+#define IC_DELTAX (int) (2)
+#define IC_VELOCITY (int) (3) // + component
+#define IC_VELOCITY_2LPT (int) (6) // + component
+#define IC_NUM_PRODUCTS (int) (9)
+
+static const char *IC_PRODUCT_NAMES[] = {"deltak_z0.00", "smoothed_deltax_z0.00", "deltax_z0.00",
+					 "vxoverddot", "vyoverddot", "vzoverddot",
+					 "vxoverddot_2LPT", "vyoverddot_2LPT", "vzoverddot_2LPT"};
+
+#define IC_CACHE_KEY_LENGTH (int) (1024)
+
+
+/* the file name of product p, in ../Boxes */
+void ic_product_filename(int p, char *filename){
+  sprintf(filename, "../Boxes/%s_%i_%.0fMpc", IC_PRODUCT_NAMES[p],
+	  ((p == IC_DELTAK) || (p == IC_DELTAX)) ? DIM : HII_DIM, BOX_LEN);
+}
+
+static void ic_cache_filename(char *filename){
+  sprintf(filename, "../Boxes/init_cache_%i_%i_%.0fMpc", DIM, HII_DIM, BOX_LEN);
+}
+
+/* the key of the current parameters (the GSL generators depend on the number of threads as well) */
+static void ic_cache_key(char *key){
+  snprintf(key, IC_CACHE_KEY_LENGTH,
+	   "RANDOM_SEED=%li COUNTER_RNG=%i NUMCORES=%i FIXED_AMPLITUDE_ICS=%i PAIRED_ICS=%i "
+	   "KSPACE_DOWNSAMPLE=%i INIT_DOWNSAMPLE_WINDOW=%i DIM=%i HII_DIM=%i BOX_LEN=%.9g L_FACTOR=%.9g "
+	   "POWER_SPECTRUM=%i P_CUTOFF=%i M_WDM=%.9g g_x=%.9g SIGMA8=%.9g hlittle=%.9g OMm=%.9g OMl=%.9g "
+	   "OMb=%.9g OMn=%.9g OMk=%.9g OMr=%.9g OMtot=%.9g Y_He=%.9g POWER_INDEX=%.9g wl=%.9g N_nu=%.9g "
+	   "BODE_e=%.9g BODE_n=%.9g BODE_v=%.9g",
+	   (long)RANDOM_SEED, COUNTER_RNG, COUNTER_RNG ? 0 : NUMCORES, FIXED_AMPLITUDE_ICS, PAIRED_ICS,
+	   KSPACE_DOWNSAMPLE, INIT_DOWNSAMPLE_WINDOW, DIM, HII_DIM, (double)BOX_LEN, (double)L_FACTOR,
+	   (int)POWER_SPECTRUM, P_CUTOFF, (double)M_WDM, (double)g_x, (double)SIGMA8, (double)hlittle,
+	   (double)OMm, (double)OMl, (double)OMb, (double)OMn, (double)OMk, (double)OMr, (double)OMtot,
+	   (double)Y_He, (double)POWER_INDEX, (double)wl, (double)N_nu,
+	   (double)BODE_e, (double)BODE_n, (double)BODE_v);
+}
+
+
+/*
+  Function IC_CACHE_CHECK sets need[p] for each product p that has to be made, and returns how
+  many there are.  If the deltak box has to be made, they all do.
+*/
+int ic_cache_check(int *need){
+  char filename[300], key[IC_CACHE_KEY_LENGTH], line[IC_CACHE_KEY_LENGTH+2];
+  int p, n, have[IC_NUM_PRODUCTS];
+  FILE *F;
+
+  for (p=0; p<IC_NUM_PRODUCTS; p++)
+    have[p] = 0;
+
+  ic_cache_filename(filename);
+  if (IC_CACHE && (F = fopen(filename, "r"))){
+    ic_cache_key(key);
+    if (fgets(line, sizeof(line), F))
+      line[strcspn(line, "\n")] = 0;
+    else
+      line[0] = 0;
+    if (!strcmp(line, key)){
+      while (fgets(line, sizeof(line), F)){
+	line[strcspn(line, "\n")] = 0;
+	for (p=0; p<IC_NUM_PRODUCTS; p++){
+	  if (!strcmp(line, IC_PRODUCT_NAMES[p])){
+	    ic_product_filename(p, filename);
+	    have[p] = (access(filename, R_OK) == 0);
+	  }
+	}
+      }
+    }
+    fclose(F);
+  }
+
+  for (p=0, n=0; p<IC_NUM_PRODUCTS; p++){
+    need[p] = !have[IC_DELTAK] || !have[p];
+    if ((p >= IC_VELOCITY_2LPT) && !SECOND_ORDER_LPT_CORRECTIONS)
+      need[p] = 0;
+    n += need[p];
+  }
+  return n;
+}
+
+/*
+  Function IC_CACHE_BEGIN starts a new record if every product is to be made (need[IC_DELTAK]),
+  so that the boxes of the previous realization are no longer reused.
+*/
+void ic_cache_begin(int *need){
+  char filename[300], key[IC_CACHE_KEY_LENGTH];
+  FILE *F;
+
+  if (!need[IC_DELTAK])
+    return;
+  ic_cache_filename(filename);
+  if (!(F = fopen(filename, "w"))){
+    fprintf(stderr, "ic_cache: WARNING: unable to write %s; the boxes will not be reused\n", filename);
+    return;
+  }
+  ic_cache_key(key);
+  fprintf(F, "%s\n", key);
+  fclose(F);
+}
+
+/* records that product p has been written */
+void ic_cache_mark(int p){
+  char filename[300];
+  FILE *F;
+
+  ic_cache_filename(filename);
+  if ((F = fopen(filename, "a"))){
+    fprintf(F, "%s\n", IC_PRODUCT_NAMES[p]);
+    fclose(F);
+  }
+}
+
+#endif
@@ -1,6 +1,13 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "filter.c"
+#include "memory_planner.c"
+#include "counter_rng.c"
+#include "ooc_fft.c"
+#include "ic_cache.c"
+#if USE_MPI
+#include "mpi_slabs.c"
+#endif
 
 /*
   Generates the initial conditions:
@@ -9,6 +16,8 @@
   velocity fields, and smoothed density field (HII_DIM^3).
   See INIT_PARAMS.H and ANAL_PARAMS.H to set the appropriate parameters.
   Output is written to ../Boxes
+  (init -zoom <X> <Y> <Z> <SIDE> <REFINEMENT> makes those of a sub-volume at a higher
+  resolution instead, see init_zoom)
 
   Author: Andrei Mesinger
   Date: 9/29/06
@@ -62,238 +71,254 @@ void adj_complex_conj(fftwf_complex *box){
   } // end loop over remaining j
 }
 
+/*
+  Function WAVENUMBER_MODE returns a random draw of the k-space density mode of signed
+  wavenumber (i, j, n_z), in units of DELTA_K, with the variance VOLUME*P(k) (see
+  FIXED_AMPLITUDE_ICS and PAIRED_ICS), using the thread's generator <r> unless COUNTER_RNG is
+  set.  With COUNTER_RNG it is the same for every DIM that has the mode.  The complex conjugate
+  relations of a real field are not applied.
+*/
+fftwf_complex wavenumber_mode(int i, int j, int n_z, gsl_rng *r){
+  fftwf_complex mode;
+  float k_x, k_y, k_z, k_mag, p, a, b;
+  double gauss_a, gauss_b;
+
+  // convert index to numerical value for this component of the k-mode: k = (2*pi/L) * n
+  k_x = i * DELTA_K;
+  k_y = j * DELTA_K;
+  k_z = n_z * DELTA_K;
+
+  // now get the power spectrum; remember, only the magnitude of k counts (due to issotropy)
+  // this could be used to speed-up later maybe
+  k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
+  p = power_in_k(k_mag);
+
+  // ok, now we can draw the values of the real and imaginary part
+  // of our k entry from a Gaussian distribution
+  if (COUNTER_RNG){
+    counter_gaussian_pair(RANDOM_SEED, i, j, n_z, 0, &gauss_a, &gauss_b);
+    a = gauss_a;
+    b = gauss_b;
+  }
+  else{
+    a = gsl_ran_ugaussian(r);
+    b = gsl_ran_ugaussian(r);
+  }
+  if (FIXED_AMPLITUDE_ICS && ((a != 0) || (b != 0))) // keep the phase, set |delta_k|^2 to its mean
+    mode = sqrt(VOLUME*p) * (a + b*I) / sqrt(a*a + b*b);
+  else
+    mode = sqrt(VOLUME*p/2.0) * (a + b*I);
+  if (PAIRED_ICS) // the partner realization, shifted in phase by pi
+    mode *= -1;
+  return mode;
+}
+
+/* the mode (n_x, n_y, n_z) of the DIM^3 k-space box (n_x, n_y wrapped around above MIDDLE), as above */
+fftwf_complex gaussian_mode(int n_x, int n_y, int n_z, gsl_rng *r){
+  return wavenumber_mode((n_x>MIDDLE) ? n_x-DIM : n_x, (n_y>MIDDLE) ? n_y-DIM : n_y, n_z, r);
+}
+
 void gsl_rng_free_threaded (gsl_rng **r, int num_th){
   int i;
   for (i=0; i<num_th; i++)
     gsl_rng_free (r[i]);
 }
 
-/* MAIN PROGRAM */
-int main(int argc, char ** argv){
-  fftwf_complex *box;
-  fftwf_plan plan;
+
+/*****  The pristine k-space density field, from which every product is derived  *****/
+// Unless the memory plan says otherwise, a copy is kept in memory (in full precision, or with
+// bfloat16 components under MEM_DELTAK_BF16), so the deltak box written to ../Boxes is an output
+// only.  Under MEM_DELTAK_REREAD it is read back from that file each time instead.
+static fftwf_complex *deltak_copy = NULL;
+static unsigned short *deltak_copy_bf16 = NULL;
+static FILE *deltak_file = NULL;
+
+/*
+  Function KEEP_DELTAK keeps the k-space density field <box> for load_deltak, as the
+  <strategies> of the memory plan allow.  Returns 0 on success, -1 on failure.
+*/
+int keep_deltak(fftwf_complex *box, int strategies){
   unsigned long long ct;
-  int n_x, n_y, n_z, i, j, k, thread_num;
-  float k_x, k_y, k_z, k_mag, p, a, b, k_sq, *smoothed_box;
-  double pixel_deltax;
-  FILE *OUT, *IN;
-  float f_pixel_factor;
-  char filename[80];
-  gsl_rng * r[NUMCORES];
-  time_t start_time, curr_time;
-  int NUM_RNG_THREADS;
+  unsigned int bits;
+  float *f = (float *)box;
 
-  /************  INITIALIZATION **********************/
+  if (strategies & MEM_DELTAK_REREAD)
+    return 0;
 
-  time(&start_time);
-  // initialize power spectrum functions
-  init_ps();
-  system("mkdir ../Boxes");
+  if (strategies & MEM_DELTAK_BF16){
+    if (!(deltak_copy_bf16 = (unsigned short *) malloc(sizeof(unsigned short)*2llu*KSPACE_NUM_PIXELS))){
+      fprintf(stderr, "init.c: Error allocating memory for the resident k-space density box\n");
+      return -1;
+    }
+#pragma omp parallel for private(bits)
+    for (ct=0; ct<2llu*KSPACE_NUM_PIXELS; ct++){
+      memcpy(&bits, f+ct, sizeof(bits));
+      deltak_copy_bf16[ct] = (bits + 0x7FFFu + ((bits >> 16) & 1u)) >> 16; // rounded to nearest even
+    }
+    return 0;
+  }
 
-  // initialize and allocate thread info
-  if (fftwf_init_threads()==0){
-    fprintf(stderr, "init: ERROR: problem initializing fftwf threads\nAborting\n.");
+  if (!(deltak_copy = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS))){
+    fprintf(stderr, "init.c: Error allocating memory for the resident k-space density box\n");
     return -1;
   }
-  fftwf_plan_with_nthreads(NUMCORES); // use all processors for init
-  if (NUMCORES < NUM_HIGH_LEVEL_RNG)
-    NUM_RNG_THREADS = NUMCORES;
-  else
-    NUM_RNG_THREADS = NUM_HIGH_LEVEL_RNG;
-  omp_set_num_threads(NUM_RNG_THREADS);
+  memcpy(deltak_copy, box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+  return 0;
+}
 
-  // seed the random number generators
-  fprintf(stderr, "Creating Gaussian random field.\n");
-  for (thread_num = 0; thread_num < NUM_RNG_THREADS; thread_num++){
-    switch (thread_num){
-    case 0:
-      r[thread_num] = gsl_rng_alloc(gsl_rng_mt19937);
-      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
-      fprintf(stderr, "Thread #%i will use a Mersenne Twister RNG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
-      break;
-    case 1:
-      r[thread_num] = gsl_rng_alloc(gsl_rng_ranlux389);
-      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
-      fprintf(stderr, "Thread #%i will use a ranlux389 RNG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
-      break;
-    case 2:
-      r[thread_num] = gsl_rng_alloc(gsl_rng_cmrg);
-      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
-      fprintf(stderr, "Thread #%i will use a CMRG by L'Ecuyer seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
-      break;
-    case 3:
-      r[thread_num] = gsl_rng_alloc(gsl_rng_mrg);
-      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
-      fprintf(stderr, "Thread #%i will use a 5th order MRG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
-      break;
-    case 4:
-      r[thread_num] = gsl_rng_alloc(gsl_rng_taus);
-      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
-      fprintf(stderr, "Thread #%i will use a Tausworthe RNG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
-      break;
-    } // end switch
-  }
+/*
+  Function LOAD_DELTAK copies the k-space density field into <box>.
+  Returns 0 on success, -1 on failure.
+*/
+int load_deltak(fftwf_complex *box){
+  char filename[80];
+  unsigned long long ct;
+  unsigned int bits;
+  float *f = (float *)box;
 
-  // allocate array for the k-space and real-space boxes
-  box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
-  if (!box){
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); fprintf(stderr, "Init.c: Error allocating memory for box.\nAborting...\n");
-    fftwf_cleanup_threads();
-    free_ps(); return -1;
+  if (deltak_copy){
+    memcpy(box, deltak_copy, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+    return 0;
   }
-
-  // now allocate memory for the lower-resolution box
-  // use HII_DIM from ANAL_PARAMS
-  smoothed_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-  if (!smoothed_box){
-    fprintf(stderr, "Init.c: Error allocating memory for low-res box.\nAborting...\n");
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); fftwf_free(box);    fftwf_cleanup_threads();
-    free_ps(); return -1;
+  if (deltak_copy_bf16){
+#pragma omp parallel for private(bits)
+    for (ct=0; ct<2llu*KSPACE_NUM_PIXELS; ct++){
+      bits = ((unsigned int)deltak_copy_bf16[ct]) << 16;
+      memcpy(f+ct, &bits, sizeof(bits));
+    }
+    return 0;
   }
 
-  // find factor of HII pixel size / deltax pixel size
-  f_pixel_factor = DIM/(float)HII_DIM;
-  /************  END INITIALIZATION ******************/
-
+  if (!deltak_file){
+    sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+    if (!(deltak_file = fopen(filename, "rb"))){
+      fprintf(stderr, "Couldn't open file %s for reading\nAborting...\n", filename);
+      return -1;
+    }
+  }
+  rewind(deltak_file);
+  if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, deltak_file)!=1){
+    fprintf(stderr, "init.c: Read error occured!\n");
+    return -1;
+  }
+  return 0;
+}
 
-  /************ CREATE K-SPACE GAUSSIAN RANDOM FIELD ***********/
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_mag, p, a,b)
-  { // need to find a parallel random number generator
-    //    fprintf(stderr, "Hello from thread #%i\n", omp_get_thread_num());
-#pragma omp for
-  for (n_x=0; n_x<DIM; n_x++){
-    // convert index to numerical value for this component of the k-mode: k = (2*pi/L) * n
-    if (n_x>MIDDLE)
-      k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
-    else
-      k_x = n_x * DELTA_K;
+void free_deltak(void){
+  if (deltak_copy) fftwf_free(deltak_copy);
+  if (deltak_copy_bf16) free(deltak_copy_bf16);
+  if (deltak_file) fclose(deltak_file);
+  deltak_copy = NULL; deltak_copy_bf16 = NULL; deltak_file = NULL;
+}
 
-    for (n_y=0; n_y<DIM; n_y++){
-      // convert index to numerical value for this component of the k-mode: k = (2*pi/L) * n
-      if (n_y>MIDDLE)
-	k_y =(n_y-DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
 
-      // since physical space field is real, only half contains independent modes
-      for (n_z=0; n_z<=MIDDLE; n_z++){ 
-	// convert index to numerical value for this component of the k-mode: k = (2*pi/L) * n
-	k_z = n_z * DELTA_K;
-	
-	// now get the power spectrum; remember, only the magnitude of k counts (due to issotropy)
-	// this could be used to speed-up later maybe
-	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
-	p = power_in_k(k_mag);
+/*
+  Function LOW_RES_BOX sets the HII_DIM^3 box <smoothed_box> to the field of the DIM^3 k-space
+  box <box> (which it overwrites), smoothed on the scale of an HII_DIM cell.
+  By default the box is filtered with a real-space top-hat, transformed with a DIM^3 FFT and
+  sampled.  With KSPACE_DOWNSAMPLE, it is windowed (INIT_DOWNSAMPLE_WINDOW), truncated to the
+  modes an HII_DIM box holds, and transformed with an HII_DIM^3 FFT.  The Nyquist planes of the
+  HII_DIM box, whose modes alias, are set to zero.
+  Returns 0 on success, -1 on failure.
+*/
+int low_res_box(fftwf_complex *box, float *smoothed_box){
+  fftwf_complex *hii_box;
+  fftwf_plan plan;
+  float f_pixel_factor = DIM/(float)HII_DIM;
+  int i, j, k, n_x, n_y;
 
-	// ok, now we can draw the values of the real and imaginary part
-	// of our k entry from a Gaussian distribution
-	a = gsl_ran_ugaussian(r[omp_get_thread_num()]);
-	b = gsl_ran_ugaussian(r[omp_get_thread_num()]);
-	box[C_INDEX(n_x, n_y, n_z)] = sqrt(VOLUME*p/2.0) * (a + b*I);
+  if (!KSPACE_DOWNSAMPLE){
+    fprintf(stderr, "Filtering the high res box\n");
+    if (DIM != HII_DIM)
+      filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
+    fprintf(stderr, "Now doing the FFT to get real-space field\n");
+    plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
+    fftwf_execute(plan);
+    fftwf_destroy_plan(plan);
+    fprintf(stderr, "Sampling...\n");
+    // now sample the filtered box to lower res
+    for (i=0; i<HII_DIM; i++){
+      for (j=0; j<HII_DIM; j++){
+	for (k=0; k<HII_DIM; k++){
+	  smoothed_box[HII_R_INDEX(i,j,k)] =
+	    *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
+					 (unsigned long long)(j*f_pixel_factor+0.5),
+					 (unsigned long long)(k*f_pixel_factor+0.5)));
+	}
       }
     }
-    //    fprintf(stderr, "%i ", n_x);
+    return 0;
   }
-} // end omp parallel
 
-  // no need to worry about RNG correlated streams, so use all processors now
-  omp_set_num_threads(NUMCORES);
-
-  /*****  Adjust the complex conjugate relations for a real array  *****/
-  adj_complex_conj(box);
-
-  /***** Write out the k-box *****/
-  fprintf(stderr, "\nWritting k-space box...\n");
-  sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
-  if (!(OUT=fopen(filename, "wb"))){
-    fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
+  hii_box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  if (!hii_box){
+    fprintf(stderr, "init.c: Error allocating memory for the low-res k-space box\n");
+    return -1;
   }
-  else if (mod_fwrite(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, OUT)!=1){
-    fprintf(stderr, "init.c: Write error occured writting deltak box!\n");
+  if ((DIM != HII_DIM) && (INIT_DOWNSAMPLE_WINDOW >= 0)){
+    fprintf(stderr, "Filtering the high res box\n");
+    filter(box, INIT_DOWNSAMPLE_WINDOW, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
   }
-  fclose(OUT);
-
-
-  /*** Let's also create a lower-resolution version of the density field  ***/
-  time(&start_time);
-  fprintf(stderr, "Filtering and sampling the density box to get low-res version...\n");
-
-  if (DIM != HII_DIM)
-    filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-  // FFT back to real space
-  time(&curr_time);
-  fprintf(stderr, "End filtering which took %g min. Preparing to FFT\n", difftime(curr_time, start_time)/60.0);
-  time(&start_time);
-  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
+  fprintf(stderr, "Truncating to the low-res k-space box and doing its FFT\n");
+#pragma omp parallel shared(box, hii_box) private(i, j, k, n_x, n_y)
+  {
+#pragma omp for
+  for (i=0; i<HII_DIM; i++){
+    n_x = (i < HII_MIDDLE) ? i : i - HII_DIM + DIM; // the same wavenumber in the DIM box
+    for (j=0; j<HII_DIM; j++){
+      n_y = (j < HII_MIDDLE) ? j : j - HII_DIM + DIM;
+      for (k=0; k<=HII_MIDDLE; k++){
+	if ((i == HII_MIDDLE) || (j == HII_MIDDLE) || (k == HII_MIDDLE))
+	  hii_box[HII_C_INDEX(i,j,k)] = 0;
+	else
+	  hii_box[HII_C_INDEX(i,j,k)] = box[C_INDEX(n_x,n_y,k)];
+      }
+    }
+  }
+  }
+  plan = fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, (fftwf_complex *)hii_box, (float *)hii_box, FFTW_ESTIMATE);
   fftwf_execute(plan);
-  time(&curr_time);
-  fprintf(stderr, "End FFT  which took %g min.\n", difftime(curr_time, start_time)/60.0);
-  time(&start_time);
-  // now sample the filtered box
+  fftwf_destroy_plan(plan);
   for (i=0; i<HII_DIM; i++){
     for (j=0; j<HII_DIM; j++){
       for (k=0; k<HII_DIM; k++){
-	smoothed_box[HII_R_INDEX(i,j,k)] = 
-	*((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)))/VOLUME;
+	smoothed_box[HII_R_INDEX(i,j,k)] = *((float *)hii_box + HII_R_FFT_INDEX(i,j,k));
       }
     }
   }
-  // now write the box
-  sprintf(filename, "../Boxes/smoothed_deltax_z0.00_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  OUT=fopen(filename, "wb");
-  if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-    fprintf(stderr, "init.c: Write error occured writting smoothed deltax box!\n");
-  }
-  fclose(OUT);
+  fftwf_free(hii_box);
+  return 0;
+}
 
 
-  /******* PERFORM INVERSE FOURIER TRANSFORM *****************/
-  fprintf(stderr, "Getting and writting real-space box...\n");
-  sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
-  IN = fopen(filename, "rb");
-  if (!IN){
-    fprintf(stderr, "Couldn't open file %s for reading\nAborting...\n", filename);
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-    free_ps(); return -1;
-  }
-  if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-    fprintf(stderr, "init.c: Read error occured!\n");
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-    free_ps(); return -1;
-  }
-  // add the 1/VOLUME factor when converting from k space to real space
-  for (ct=0; ct<KSPACE_NUM_PIXELS; ct++){
-     box[ct] /= VOLUME;
-  }
-  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
-  fftwf_execute(plan);
-  fftwf_destroy_plan(plan);
-  fftwf_cleanup();
+/*
+  Function LOW_RES_VELOCITIES sets the three velocity/dD/dt components k_m I/k^2/<volume> of the
+  DIM^3 k-space field in <box> and queues their HII_DIM^3 boxes, smoothed as low_res_box does,
+  for the files of <product> + m (see ic_cache.c).  <box> holds three DIM^3 k-space boxes in a
+  row (MEM_SEQUENTIAL_VELOCITIES unset), and the field is in the first.  The components are set,
+  and filtered, in one sweep over its modes, and transformed with one batched FFT.  The
+  write-behind thread (misc.c) writes each box while the next one is sampled; call
+  async_write_flush before counting on the files.  Returns 0 on success, -1 on failure.
+*/
+int low_res_velocities(fftwf_complex *box, float volume, int product){
+  fftwf_complex *hii_box = NULL, mode;
+  fftwf_plan plan;
+  fftwf_iodim64 dims[3], batch;
+  float k_x, k_y, k_z, k_sq, k_mag, R = L_FACTOR*BOX_LEN/(HII_DIM+0.0), *out;
+  float f_pixel_factor = DIM/(float)HII_DIM;
+  double window;
+  unsigned long long ct;
+  char filename[300];
+  int n[3] = {DIM, DIM, DIM}, hii_n[3] = {HII_DIM, HII_DIM, HII_DIM}, filter_type, i, j, k, m, n_x, n_y, n_z;
 
-  /***** Write the real space field *****/
-  sprintf(filename, "../Boxes/deltax_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
-  if (!(OUT=fopen(filename, "wb"))){
-    fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
-  }
-  else if (mod_fwrite(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, OUT)!=1){
-    fprintf(stderr, "init.c: Write error occured writting deltax box!\n");
-  }
-  fclose(OUT);
+  // the filter low_res_box applies
+  if (!KSPACE_DOWNSAMPLE)
+    filter_type = (DIM != HII_DIM) ? 0 : -1;
+  else
+    filter_type = ((DIM != HII_DIM) && (INIT_DOWNSAMPLE_WINDOW >= 0)) ? INIT_DOWNSAMPLE_WINDOW : -1;
 
-  /*** Now let's set the velocity field/dD/dt (in comoving Mpc) ***/
-  /**** first x component ****/
-  fprintf(stderr, "Setting x velocity field...\n");
-  // read in the box
-  rewind(IN);
-  if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-    fprintf(stderr, "init.c: Read error occured!\n");
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-    free_ps(); return -1;
-  }
-  // set velocities/dD/dt
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
+  fprintf(stderr, "Setting and filtering the three components\n");
+#pragma omp parallel shared(box, volume, filter_type, R) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq, k_mag, window, ct, mode, m)
   {
 #pragma omp for
   for (n_x=0; n_x<DIM; n_x++){
@@ -308,66 +333,129 @@ int main(int argc, char ** argv){
       else
 	k_y = n_y * DELTA_K;
 
-      for (n_z=0; n_z<=MIDDLE; n_z++){ 
+      for (n_z=0; n_z<=MIDDLE; n_z++){
 	k_z = n_z * DELTA_K;
-	
-	k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
 
-	// now set the velocities
-	if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	  box[0] = 0;
-	}
-	else{
-	  box[C_INDEX(n_x,n_y,n_z)] *= k_x*I/k_sq/VOLUME;
-	  // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
+	k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
+	float k[] = {k_x, k_y, k_z};
+	k_mag = sqrt(k_sq);
+	window = (filter_type >= 0) ? filter_window(filter_type, k_mag*R) : 1;
+
+	ct = C_INDEX(n_x,n_y,n_z);
+	mode = box[ct];
+	for (m=0; m<3; m++){
+	  if ((n_x==0) && (n_y==0) && (n_z==0)) // DC mode
+	    box[m*KSPACE_NUM_PIXELS + ct] = 0;
+	  else
+	    box[m*KSPACE_NUM_PIXELS + ct] = mode * (k[m]*I/k_sq/volume);
+	  if (window == 0)
+	    box[m*KSPACE_NUM_PIXELS + ct] = 0;
+	  else if (window != 1)
+	    box[m*KSPACE_NUM_PIXELS + ct] *= window;
 	}
       }
     }
-    //    fprintf(stderr, "%i ", n_x);
-      //printf("%i, (%f+%f*I)\n", n_x, creal(v_y[C_INDEX(n_x,0,0)]), cimag(v_y[C_INDEX(n_x,0,0)]));
   }
   }
-  fprintf(stderr, "Filtering the high res box\n");
-  if (DIM != HII_DIM)
-    filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-  fprintf(stderr, "Now doing the FFT to get real-space field\n");
-  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
-  fftwf_execute(plan);
-  fprintf(stderr, "Sampling...\n");  
-  // now sample to lower res
-  // now sample the filtered box
-  fprintf(stderr, "Sampling...\n");
-  for (i=0; i<HII_DIM; i++){
-    for (j=0; j<HII_DIM; j++){
-      for (k=0; k<HII_DIM; k++){
-	smoothed_box[HII_R_INDEX(i,j,k)] = 
-	  *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)));
-      }
+
+  if (!KSPACE_DOWNSAMPLE){
+    fprintf(stderr, "Now doing the batched FFT to get the real-space fields\n");
+    if (TOT_FFT_NUM_PIXELS < (1llu<<31))
+      plan = fftwf_plan_many_dft_c2r(3, n, 3, box, NULL, 1, KSPACE_NUM_PIXELS,
+				     (float *)box, NULL, 1, TOT_FFT_NUM_PIXELS, FFTW_ESTIMATE);
+    else{ // the boxes are too far apart for the int distances of fftwf_plan_many_dft_c2r
+      for (i=0; i<3; i++)
+	dims[i].n = DIM;
+      dims[2].is = 1;  dims[1].is = MIDDLE+1;  dims[0].is = D*(MID+1llu);
+      dims[2].os = 1;  dims[1].os = 2*(MIDDLE+1);  dims[0].os = 2*D*(MID+1llu);
+      batch.n = 3;  batch.is = KSPACE_NUM_PIXELS;  batch.os = TOT_FFT_NUM_PIXELS;
+      plan = fftwf_plan_guru64_dft_c2r(3, dims, 1, &batch, box, (float *)box, FFTW_ESTIMATE);
     }
   }
-  // write out file
-  fprintf(stderr, "Done\n\nNow write out files\n");
-  sprintf(filename, "../Boxes/vxoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  OUT=fopen(filename, "wb");
-  if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-    fprintf(stderr, "init.c: Write error occured writting v_x box!\n");
+  else{
+    hii_box = (fftwf_complex *) fftwf_malloc(3*sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+    if (!hii_box){
+      fprintf(stderr, "init.c: Error allocating memory for the low-res k-space boxes\n");
+      return -1;
+    }
+    fprintf(stderr, "Truncating to the low-res k-space boxes and doing their batched FFT\n");
+#pragma omp parallel shared(box, hii_box) private(i, j, k, n_x, n_y, m)
+    {
+#pragma omp for
+    for (i=0; i<HII_DIM; i++){
+      n_x = (i < HII_MIDDLE) ? i : i - HII_DIM + DIM; // the same wavenumber in the DIM box
+      for (j=0; j<HII_DIM; j++){
+	n_y = (j < HII_MIDDLE) ? j : j - HII_DIM + DIM;
+	for (k=0; k<=HII_MIDDLE; k++){
+	  for (m=0; m<3; m++){
+	    if ((i == HII_MIDDLE) || (j == HII_MIDDLE) || (k == HII_MIDDLE))
+	      hii_box[m*HII_KSPACE_NUM_PIXELS + HII_C_INDEX(i,j,k)] = 0;
+	    else
+	      hii_box[m*HII_KSPACE_NUM_PIXELS + HII_C_INDEX(i,j,k)] = box[m*KSPACE_NUM_PIXELS + C_INDEX(n_x,n_y,k)];
+	  }
+	}
+      }
+    }
+    }
+    plan = fftwf_plan_many_dft_c2r(3, hii_n, 3, hii_box, NULL, 1, HII_KSPACE_NUM_PIXELS,
+				   (float *)hii_box, NULL, 1, HII_TOT_FFT_NUM_PIXELS, FFTW_ESTIMATE);
   }
-  fclose(OUT);
+  fftwf_execute(plan);
+  fftwf_destroy_plan(plan);
 
-  
-  /**** y component ****/
-  fprintf(stderr, "Setting y velocity field...\n");
-  // read in the box
-  rewind(IN);
-  if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-    fprintf(stderr, "init.c: Read error occured!\n");
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-    free_ps(); return -1;
+  // sample each component into a write-behind buffer, written while the next is sampled
+  fprintf(stderr, "Sampling and writting...\n");
+  for (m=0; m<3; m++){
+    ic_product_filename(product+m, filename);
+    if (!(out = (float *) async_write_buffer(filename, sizeof(float)*HII_TOT_NUM_PIXELS))){
+      if (hii_box) fftwf_free(hii_box);
+      return -1;
+    }
+#pragma omp parallel for private(j, k)
+    for (i=0; i<HII_DIM; i++){
+      for (j=0; j<HII_DIM; j++){
+	for (k=0; k<HII_DIM; k++){
+	  if (!KSPACE_DOWNSAMPLE)
+	    out[HII_R_INDEX(i,j,k)] = *((float *)(box + m*KSPACE_NUM_PIXELS) +
+					R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
+						    (unsigned long long)(j*f_pixel_factor+0.5),
+						    (unsigned long long)(k*f_pixel_factor+0.5)));
+	  else
+	    out[HII_R_INDEX(i,j,k)] = *((float *)(hii_box + m*HII_KSPACE_NUM_PIXELS) + HII_R_FFT_INDEX(i,j,k));
+	}
+      }
+    }
+    if (async_write_submit() != 0){
+      if (hii_box) fftwf_free(hii_box);
+      return -1;
+    }
   }
-  // set velocities/dD/dt
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
+
+  if (hii_box) fftwf_free(hii_box);
+  return 0;
+}
+
+
+/*****  2LPT (see the 2LPT part of main)  *****/
+#define LPT_SOURCE_SET (int) (0)
+#define LPT_SOURCE_ADD (int) (1)
+#define LPT_SOURCE_SUBTRACT (int) (2)
+
+/*
+  Function LPT_PHI_1 loads the k-space density field into <phi> and transforms it into
+  the real-space second derivative phi_1[i,j] (eq. D13b of Scoccimarro 1998).
+  Returns 0 on success, -1 on a read error.
+*/
+int lpt_phi_1(fftwf_complex *phi, int i, int j){
+  fftwf_plan plan;
+  int n_x, n_y, n_z;
+  float k_x, k_y, k_z, k_sq;
+
+  fprintf(stderr, "Computing phi_1[%d, %d]...\n", i, j);
+  if (load_deltak(phi) != 0)
+    return -1;
+
+#pragma omp parallel shared(phi, i, j) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
   {
 #pragma omp for
   for (n_x=0; n_x<DIM; n_x++){
@@ -382,540 +470,1456 @@ int main(int argc, char ** argv){
       else
 	k_y = n_y * DELTA_K;
 
-      for (n_z=0; n_z<=MIDDLE; n_z++){ 
+      for (n_z=0; n_z<=MIDDLE; n_z++){
 	k_z = n_z * DELTA_K;
-	
+
 	k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
+	float k[] = {k_x, k_y, k_z};
 
-	// now set the velocities
 	if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	  box[0] = 0;
+	  phi[0] = 0;
 	}
 	else{
-	  box[C_INDEX(n_x,n_y,n_z)] *= k_y*I/k_sq/VOLUME;
+	  phi[C_INDEX(n_x,n_y,n_z)] *= -k[i]*k[j]/k_sq/VOLUME;
 	  // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
 	}
       }
     }
   }
-  //    fprintf(stderr, "%i ", n_x);
-      //printf("%i, (%f+%f*I)\n", n_x, creal(v_y[HII_C_INDEX(n_x,0,0)]), cimag(v_y[HII_C_INDEX(n_x,0,0)]));
   }
-  fprintf(stderr, "Filtering the high res box\n");
-  if (DIM != HII_DIM)
-    filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-  fprintf(stderr, "Now doing the FFT to get real-space field\n");
-  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
+
+  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)phi, (float *)phi, FFTW_ESTIMATE);
   fftwf_execute(plan);
-  fprintf(stderr, "Sampling...\n");
-  // now sample to lower res
-  // now sample the filtered box
-  for (i=0; i<HII_DIM; i++){
-    for (j=0; j<HII_DIM; j++){
-      for (k=0; k<HII_DIM; k++){
-	smoothed_box[HII_R_INDEX(i,j,k)] = 
-	  *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)));
+  fftwf_destroy_plan(plan);
+  return 0;
+}
+
+/*
+  Function LPT_SOURCE_ADD sets (<op>=LPT_SOURCE_SET), adds to (LPT_SOURCE_ADD) or subtracts from
+  (LPT_SOURCE_SUBTRACT) the real-space box <source> the product a*b, cell by cell (just a if b
+  is NULL).  All boxes are in the padded FFT layout.
+*/
+void lpt_source_add(fftwf_complex *source, fftwf_complex *a, fftwf_complex *b, int op){
+  float *s, *fa, *fb;
+  unsigned long long ct;
+  int i, j, k;
+
+#pragma omp parallel shared(source, a, b, op) private(i, j, k, ct, s, fa, fb)
+  {
+#pragma omp for
+  for (i=0; i<DIM; i++){
+    for (j=0; j<DIM; j++){
+      ct = R_FFT_INDEX(i,j,0);
+      s = (float *)source + ct;
+      fa = (float *)a + ct;
+      fb = b ? (float *)b + ct : NULL;
+      if (!fb){
+	for (k=0; k<DIM; k++)
+	  s[k] += fa[k];
+      }
+      else if (op == LPT_SOURCE_SET){
+	for (k=0; k<DIM; k++)
+	  s[k] = fa[k]*fb[k];
+      }
+      else if (op == LPT_SOURCE_ADD){
+	for (k=0; k<DIM; k++)
+	  s[k] += fa[k]*fb[k];
+      }
+      else{
+	for (k=0; k<DIM; k++)
+	  s[k] -= fa[k]*fb[k];
       }
     }
   }
-  // write out file
-  fprintf(stderr, "Done\n\nNow write out files\n");
-  sprintf(filename, "../Boxes/vyoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  OUT=fopen(filename, "wb");
-  if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-    fprintf(stderr, "init.c: Write error occured writting v_y box!\n");
   }
-  fclose(OUT);
+}
 
+/*****  Out-of-core initial conditions (MEM_OUT_OF_CORE_FFT)  *****/
+// When not even the k-space box fits in RAM, the boxes are made slab by slab through files
+// (see ooc_fft.c): the k-space density is drawn straight into the deltak file, which every
+// product is then transformed from, and the 2LPT source term is accumulated in scratch files
+// in OOC_SCRATCH_DIR.  Only the HII_DIM boxes, a pencil buffer and a few slabs are resident.
+// The modes are drawn out of order, so this needs COUNTER_RNG.
 
-  /**** z component ****/
-  fprintf(stderr, "Setting z velocity field...\n");
-  // read in the box
-  rewind(IN);
-  if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-    fprintf(stderr, "init.c: Read error occured!\n");
-    gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-    free_ps(); return -1;
-  }
-  // set velocities/dD/dt
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
-  {
-#pragma omp for
-  for (n_x=0; n_x<DIM; n_x++){
-    if (n_x>MIDDLE)
-      k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
+/* the mode (n_x, n_y, n_z) of a dim^3 k-space box, by wavenumber_mode */
+#define DIM_MODE(dim, n_x, n_y, n_z) wavenumber_mode(((n_x)>(dim)/2) ? (n_x)-(dim) : (n_x), ((n_y)>(dim)/2) ? (n_y)-(dim) : (n_y), n_z, NULL)
+
+/*
+  Function HERMITIAN_MODE_DIM returns the mode (n_x, n_y, n_z) of a dim^3 k-space box as drawn
+  and then set by adj_complex_conj, drawing its conjugate partner instead where that sets it.
+*/
+fftwf_complex hermitian_mode_dim(int dim, int n_x, int n_y, int n_z){
+  int mid = dim/2;
+
+  if ((n_z != 0) && (n_z != mid))
+    return DIM_MODE(dim, n_x, n_y, n_z);
+
+  if (((n_x == 0) || (n_x == mid)) && ((n_y == 0) || (n_y == mid))){ // corners
+    if ((n_x == 0) && (n_y == 0) && (n_z == 0))
+      return 0;
+    return crealf(DIM_MODE(dim, n_x, n_y, n_z));
+  }
+  if ((n_x >= 1) && (n_x < mid))
+    return conjf(DIM_MODE(dim, dim-n_x, (dim-n_y)%dim, n_z));
+  if (((n_x == 0) || (n_x == mid)) && (n_y >= 1) && (n_y < mid))
+    return conjf(DIM_MODE(dim, n_x, dim-n_y, n_z));
+  return DIM_MODE(dim, n_x, n_y, n_z);
+}
+
+/* the mode (n_x, n_y, n_z) of the DIM^3 k-space box, as above */
+fftwf_complex hermitian_mode(int n_x, int n_y, int n_z){
+  return hermitian_mode_dim(DIM, n_x, n_y, n_z);
+}
+
+/*
+  The modes of a field derived from the k-space density, set row by row as ooc_c2r reads it:
+  i<0 gives the density, j<0 the velocity k_i I/k^2 and otherwise the second derivative of the
+  potential -k_i k_j/k^2, each times <scale> and then filtered with <filter_type> (if >= 0) on
+  the scale of an HII_DIM cell.
+*/
+typedef struct {
+  int i, j, filter_type;
+  float scale;
+} ooc_kernel;
+
+void ooc_set_modes(fftwf_complex *row, int n_x, int n_y, void *arg){
+  ooc_kernel *kernel = (ooc_kernel *)arg;
+  float k[3], k_sq, R = L_FACTOR*BOX_LEN/(HII_DIM+0.0);
+  int n_z;
+
+  k[0] = ((n_x>MIDDLE) ? n_x-DIM : n_x) * DELTA_K;
+  k[1] = ((n_y>MIDDLE) ? n_y-DIM : n_y) * DELTA_K;
+  for (n_z=0; n_z<=MIDDLE; n_z++){
+    k[2] = n_z * DELTA_K;
+    k_sq = k[0]*k[0] + k[1]*k[1] + k[2]*k[2];
+
+    if (kernel->i < 0)
+      row[n_z] *= kernel->scale;
+    else if ((n_x==0) && (n_y==0) && (n_z==0)) // DC mode
+      row[n_z] = 0;
+    else if (kernel->j < 0)
+      row[n_z] *= k[kernel->i]*I/k_sq*kernel->scale;
     else
-      k_x = n_x * DELTA_K;
+      row[n_z] *= -k[kernel->i]*k[kernel->j]/k_sq*kernel->scale;
 
-    for (n_y=0; n_y<DIM; n_y++){
-      if (n_y>MIDDLE)
-	k_y =(n_y-DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
+    if (kernel->filter_type >= 0)
+      row[n_z] *= filter_window(kernel->filter_type, sqrt(k_sq)*R);
+  }
+}
 
-      for (n_z=0; n_z<=MIDDLE; n_z++){ 
-	k_z = n_z * DELTA_K;
-	
-	k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
+/* samples the real-space slab x into the HII_DIM box arg, as low_res_box does */
+int ooc_sample_slab(float *slab, int x, void *arg){
+  float *smoothed_box = (float *)arg, f_pixel_factor = DIM/(float)HII_DIM;
+  int i, j, k;
 
-	// now set the velocities
-	if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	  box[0] = 0;
-	}
-	else{
-	  box[C_INDEX(n_x,n_y,n_z)] *= k_z*I/k_sq/VOLUME;
-	  // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
-	}
+  for (i=0; i<HII_DIM; i++){
+    if ((int)(i*f_pixel_factor+0.5) != x)
+      continue;
+    for (j=0; j<HII_DIM; j++){
+      for (k=0; k<HII_DIM; k++){
+	smoothed_box[HII_R_INDEX(i,j,k)] =
+	  slab[(unsigned long long)(k*f_pixel_factor+0.5) + 2llu*(MID+1llu)*(unsigned long long)(j*f_pixel_factor+0.5)];
       }
     }
-    //fprintf(stderr, "%i ", n_x);
   }
+  return 0;
+}
+
+/* writes the real-space slab x (padded, like the in-memory boxes) to the file descriptor arg */
+int ooc_write_slab(float *slab, int x, void *arg){
+  if (parallel_io_all(*(int *)arg, (unsigned char *)slab, OOC_SLAB_BYTES, (off_t)(x*OOC_SLAB_BYTES), 1) != 0){
+    fprintf(stderr, "init.c: Write error occured writting an out-of-core slab!\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Function OOC_LOW_RES_BOX is low_res_box for the k-space file k_fd, with the modes set by
+  <kernel>: it sets the HII_DIM^3 box <smoothed_box>, using the scratch file scratch_fd.
+  Returns 0 on success, -1 on failure.
+*/
+int ooc_low_res_box(int k_fd, int scratch_fd, ooc_kernel kernel, float *smoothed_box){
+  fftwf_complex *hii_box, *slab;
+  fftwf_plan plan;
+  int i, j, k, n_x, n_y;
+
+  if (!KSPACE_DOWNSAMPLE){
+    kernel.filter_type = (DIM != HII_DIM) ? 0 : -1;
+    fprintf(stderr, "Filtering, transforming and sampling the high res box slab by slab\n");
+    return ooc_c2r(k_fd, scratch_fd, ooc_set_modes, &kernel, ooc_sample_slab, smoothed_box);
   }
-  fprintf(stderr, "Filtering the high res box\n");
-  if (DIM != HII_DIM)
-    filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-  fprintf(stderr, "Now doing the FFT to get real-space field\n");
-  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
+
+  // the HII_DIM box only needs the x-slabs of the wavenumbers it holds
+  kernel.filter_type = (DIM != HII_DIM) ? INIT_DOWNSAMPLE_WINDOW : -1;
+  hii_box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  slab = (fftwf_complex *) fftwf_malloc(OOC_SLAB_BYTES);
+  if (!hii_box || !slab){
+    fprintf(stderr, "init.c: Error allocating memory for the low-res k-space box\n");
+    if (hii_box) fftwf_free(hii_box);
+    if (slab) fftwf_free(slab);
+    return -1;
+  }
+  fprintf(stderr, "Truncating to the low-res k-space box slab by slab and doing its FFT\n");
+  for (i=0; i<HII_DIM; i++){
+    n_x = (i < HII_MIDDLE) ? i : i - HII_DIM + DIM; // the same wavenumber in the DIM box
+    if ((i != HII_MIDDLE) &&
+	(parallel_io_all(k_fd, (unsigned char *)slab, OOC_SLAB_BYTES, (off_t)(n_x*OOC_SLAB_BYTES), 0) != 0)){
+      fprintf(stderr, "init.c: Read error occured!\n");
+      fftwf_free(hii_box); fftwf_free(slab);
+      return -1;
+    }
+#pragma omp parallel for private(k, n_y)
+    for (j=0; j<HII_DIM; j++){
+      n_y = (j < HII_MIDDLE) ? j : j - HII_DIM + DIM;
+      if ((i != HII_MIDDLE) && (j != HII_MIDDLE))
+	ooc_set_modes(slab + n_y*(MID+1llu), n_x, n_y, &kernel);
+      for (k=0; k<=HII_MIDDLE; k++){
+	if ((i == HII_MIDDLE) || (j == HII_MIDDLE) || (k == HII_MIDDLE))
+	  hii_box[HII_C_INDEX(i,j,k)] = 0;
+	else
+	  hii_box[HII_C_INDEX(i,j,k)] = slab[n_y*(MID+1llu) + k];
+      }
+    }
+  }
+  fftwf_free(slab);
+  plan = fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, (fftwf_complex *)hii_box, (float *)hii_box, FFTW_ESTIMATE);
   fftwf_execute(plan);
   fftwf_destroy_plan(plan);
-  fftwf_cleanup();
-  fprintf(stderr, "Sampling...\n");  
-  // now sample to lower res
-  // now sample the filtered box
   for (i=0; i<HII_DIM; i++){
     for (j=0; j<HII_DIM; j++){
       for (k=0; k<HII_DIM; k++){
-	smoothed_box[HII_R_INDEX(i,j,k)] = 
-	  *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)));
+	smoothed_box[HII_R_INDEX(i,j,k)] = *((float *)hii_box + HII_R_FFT_INDEX(i,j,k));
       }
     }
   }
-  // write out file
-  fprintf(stderr, "Done\n\nNow write out files\n");
-  sprintf(filename, "../Boxes/vzoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  OUT=fopen(filename, "wb");
-  if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-    fprintf(stderr, "init.c: Write error occured writting v_z box!\n");
+  fftwf_free(hii_box);
+  return 0;
+}
+
+/*
+  The 2LPT source term, accumulated slab by slab from the second derivatives phi_1[l,m] as
+  ooc_c2r hands them over (the same sequence of terms as the 2LPT part of main): term 0 stores
+  phi_1[0,0] in the file a_fd, term 1 sets the source (file s_fd) to phi_1[0,0] phi_1[1,1] and
+  adds phi_1[1,1] to a_fd, term 2 adds (phi_1[0,0] + phi_1[1,1]) phi_1[2,2] and the last three
+  subtract the squares of the off-diagonal derivatives.
+*/
+typedef struct {
+  int term, a_fd, s_fd;
+  float *a, *s; // slab buffers
+} ooc_lpt_source;
+
+int ooc_lpt_term(float *slab, int x, void *arg){
+  ooc_lpt_source *src = (ooc_lpt_source *)arg;
+  off_t offset = (off_t)(x*OOC_SLAB_BYTES);
+  unsigned long long ct;
+
+  if (((src->term == 1) || (src->term == 2)) &&
+      (parallel_io_all(src->a_fd, (unsigned char *)src->a, OOC_SLAB_BYTES, offset, 0) != 0))
+    return -1;
+  if ((src->term >= 2) &&
+      (parallel_io_all(src->s_fd, (unsigned char *)src->s, OOC_SLAB_BYTES, offset, 0) != 0))
+    return -1;
+
+#pragma omp parallel for
+  for (ct=0; ct<2llu*OOC_SLAB_COMPLEX; ct++){
+    if (src->term == 0)
+      src->a[ct] = slab[ct];
+    else if (src->term == 1){
+      src->s[ct] = src->a[ct]*slab[ct];
+      src->a[ct] += slab[ct];
+    }
+    else if (src->term == 2)
+      src->s[ct] += src->a[ct]*slab[ct];
+    else
+      src->s[ct] -= slab[ct]*slab[ct];
   }
+
+  if ((src->term <= 1) &&
+      (parallel_io_all(src->a_fd, (unsigned char *)src->a, OOC_SLAB_BYTES, offset, 1) != 0))
+    return -1;
+  if ((src->term >= 1) &&
+      (parallel_io_all(src->s_fd, (unsigned char *)src->s, OOC_SLAB_BYTES, offset, 1) != 0))
+    return -1;
+  return 0;
+}
+
+/* reads slab x of the 2LPT source term into slab, normalised for the forward FFT */
+int ooc_lpt_source_slab(float *slab, int x, void *arg){
+  ooc_lpt_source *src = (ooc_lpt_source *)arg;
+  unsigned long long ct;
+
+  if (parallel_io_all(src->s_fd, (unsigned char *)slab, OOC_SLAB_BYTES, (off_t)(x*OOC_SLAB_BYTES), 0) != 0)
+    return -1;
+  for (ct=0; ct<2llu*OOC_SLAB_COMPLEX; ct++)
+    slab[ct] /= TOT_NUM_PIXELS;
+  return 0;
+}
+
+/* writes the HII_DIM box <smoothed_box> to ../Boxes/<name> */
+void ooc_write_HII_box(float *smoothed_box, const char *name){
+  char filename[300];
+  FILE *OUT;
+
+  sprintf(filename, "../Boxes/%s_%i_%.0fMpc", name, HII_DIM, BOX_LEN);
+  if (!(OUT=fopen(filename, "wb"))){
+    fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
+    return;
+  }
+  if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1)
+    fprintf(stderr, "init.c: Write error occured writting %s box!\n", name);
   fclose(OUT);
+}
 
+/*
+  Function INIT_OUT_OF_CORE makes all the initial conditions out of core (see above).
+  The DIM^3 deltak and deltax boxes are written uncompressed, as the transforms read them
+  in place.  Returns 0 on success, -1 on failure.
+*/
+int init_out_of_core(){
+  static const int LPT_TERMS[6][2] = {{0,0}, {1,1}, {2,2}, {1,0}, {2,0}, {2,1}};
+  static const char *VELOCITY_NAMES[3] = {"vxoverddot", "vyoverddot", "vzoverddot"};
+  static const char *VELOCITY_2LPT_NAMES[3] = {"vxoverddot_2LPT", "vyoverddot_2LPT", "vzoverddot_2LPT"};
+  ooc_kernel kernel;
+  ooc_lpt_source src;
+  fftwf_complex *slab;
+  float *smoothed_box;
+  unsigned long long ct;
+  char filename[80];
+  int k_fd, x_fd, scratch_fd, n_x, n_y, n_z, m, status;
 
-/* *************************************************** *
- *              BEGIN 2LPT PART                        *
- * *************************************************** */
+  if (!COUNTER_RNG){
+    fprintf(stderr, "init.c: ERROR: the out-of-core initial conditions need COUNTER_RNG\n");
+    return -1;
+  }
+  fprintf(stderr, "Making the initial conditions out of core, with %.1f GB of scratch files in %s\n",
+	  (SECOND_ORDER_LPT_CORRECTIONS ? 3 : 1)*D*OOC_SLAB_BYTES/BYTES_PER_GB, OOC_SCRATCH_DIR);
 
-  // Generation of the second order Lagrangian perturbation theory (2LPT) corrections to
-  // the ZA
-  // reference: Scoccimarro R., 1998, MNRAS, 299, 1097-1118 Appendix D
- 
-  // Parameter set in ANAL_PARAMS.H
-  if(SECOND_ORDER_LPT_CORRECTIONS){
-    fprintf(stderr, "Begin 2LPT part\n");	
-    // use six supplementary boxes to store the gradients of phi_1 (eq. D13b)
-    // Allocating the boxes
-#define PHI_INDEX(i, j) ((int) ((i) - (j)) + 3*((j)) - ((int)(j))/2  )
-    // ij -> INDEX
-    // 00 -> 0
-    // 11 -> 3
-    // 22 -> 5
-    // 10 -> 1
-    // 20 -> 2
-    // 21 -> 4
-
-    fftwf_complex *phi_1[6];
-   
-    for(i = 0; i < 3; ++i){
-      for(j = 0; j <= i; ++j){
-        fprintf(stderr, "Initialization phi_1[%d, %d] = phi_1[%d]\n", i, j, PHI_INDEX(i, j));
-        phi_1[PHI_INDEX(i, j)] = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);        
-
-        if (!phi_1[PHI_INDEX(i, j)]){
-          gsl_rng_free_threaded (r, NUM_RNG_THREADS); fprintf(stderr, "Init.c: Error allocating memory for phi_1[%d, %d].\nAborting...\n", i, j);
-          fftwf_cleanup_threads();
-          free_ps(); return -1;
-        }
-      }
-    }
-
-    
-    for(i = 0; i < 3; ++i){
-      for(j = 0; j <= i; ++j){
-
-        fprintf(stderr, "Computing phi_1[%d, %d]...\n", i, j);
-        // read in the box
-        rewind(IN);
-        if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-          fprintf(stderr, "init.c: Read error occured!\n");
-          gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-          
-          for(i = 0; i < 3; ++i){
-            for(j = 0; j <= i; ++j){
-              fftwf_free(phi_1[PHI_INDEX(i,j)]);        
-            }
-          }
-          free_ps(); return -1;
-        }
-
-
-        // generate the phi_1 boxes in Fourier transform
-#pragma omp parallel shared(phi_1, box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
-        {
+  smoothed_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+  slab = (fftwf_complex *) fftwf_malloc(OOC_SLAB_BYTES);
+  sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+  k_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  scratch_fd = ooc_scratch_open("c2r");
+  if (!smoothed_box || !slab || (k_fd < 0) || (scratch_fd < 0)){
+    fprintf(stderr, "init.c: Error setting up the out-of-core boxes\n");
+    if (smoothed_box) free(smoothed_box);
+    if (slab) fftwf_free(slab);
+    if (k_fd >= 0) close(k_fd);
+    if (scratch_fd >= 0) close(scratch_fd);
+    return -1;
+  }
+
+  /***** Draw the k-space density straight into the deltak file *****/
+  fprintf(stderr, "Writting the k-space box slab by slab...\n");
+  status = 0;
+  for (n_x=0; (n_x<DIM) && !status; n_x++){
+#pragma omp parallel for private(n_z)
+    for (n_y=0; n_y<DIM; n_y++){
+      for (n_z=0; n_z<=MIDDLE; n_z++)
+	slab[n_y*(MID+1llu) + n_z] = hermitian_mode(n_x, n_y, n_z);
+    }
+    status = parallel_io_all(k_fd, (unsigned char *)slab, OOC_SLAB_BYTES, (off_t)(n_x*OOC_SLAB_BYTES), 1);
+  }
+  fftwf_free(slab);
+  if (status)
+    fprintf(stderr, "init.c: Write error occured writting deltak box!\n");
+
+  /***** The low-res density *****/
+  kernel.i = kernel.j = -1;
+  kernel.scale = 1;
+  if (!status){
+    fprintf(stderr, "Filtering and sampling the density box to get low-res version...\n");
+    status = ooc_low_res_box(k_fd, scratch_fd, kernel, smoothed_box);
+  }
+  if (!status){
+    for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+      smoothed_box[ct] /= VOLUME;
+    ooc_write_HII_box(smoothed_box, "smoothed_deltax_z0.00");
+  }
+
+  /***** The real-space density, transformed straight into the deltax file *****/
+  if (!status){
+    fprintf(stderr, "Getting and writting real-space box...\n");
+    sprintf(filename, "../Boxes/deltax_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+    if ((x_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+      fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
+      status = -1;
+    }
+    else{
+      kernel.scale = 1.0/VOLUME;
+      kernel.filter_type = -1;
+      status = ooc_c2r(k_fd, scratch_fd, ooc_set_modes, &kernel, ooc_write_slab, &x_fd);
+      close(x_fd);
+    }
+  }
+
+  /*** The velocity field/dD/dt (in comoving Mpc) ***/
+  for (m=0; (m<3) && !status; m++){
+    fprintf(stderr, "Setting %c velocity field...\n", 'x'+m);
+    kernel.i = m;
+    kernel.scale = 1.0/VOLUME;
+    if (!(status = ooc_low_res_box(k_fd, scratch_fd, kernel, smoothed_box)))
+      ooc_write_HII_box(smoothed_box, VELOCITY_NAMES[m]);
+  }
+
+  /***** 2LPT (see the 2LPT part of main) *****/
+  if (SECOND_ORDER_LPT_CORRECTIONS && !status){
+    fprintf(stderr, "Begin 2LPT part\nGenerating RHS eq. D13b\n");
+    src.a_fd = ooc_scratch_open("phi");
+    src.s_fd = ooc_scratch_open("source");
+    src.a = (float *) fftwf_malloc(OOC_SLAB_BYTES);
+    src.s = (float *) fftwf_malloc(OOC_SLAB_BYTES);
+    status = ((src.a_fd < 0) || (src.s_fd < 0) || !src.a || !src.s) ? -1 : 0;
+    kernel.scale = 1.0/VOLUME;
+    kernel.filter_type = -1;
+    for (src.term=0; (src.term<6) && !status; src.term++){
+      fprintf(stderr, "Computing phi_1[%d, %d]...\n", LPT_TERMS[src.term][0], LPT_TERMS[src.term][1]);
+      kernel.i = LPT_TERMS[src.term][0];
+      kernel.j = LPT_TERMS[src.term][1];
+      status = ooc_c2r(k_fd, scratch_fd, ooc_set_modes, &kernel, ooc_lpt_term, &src);
+    }
+    if (!status){
+      fprintf(stderr, "Done\nNow fft r2c\n");
+      status = ooc_r2c(src.s_fd, ooc_lpt_source_slab, &src);
+    }
+
+    // the velocities, from the k-space source term (the phi_1 file is the scratch file now)
+    kernel.j = -1;
+    kernel.scale = 1;
+    for (m=0; (m<3) && !status; m++){
+      fprintf(stderr, "Setting %c velocity field 2LPT...\n", 'x'+m);
+      kernel.i = m;
+      if (!(status = ooc_low_res_box(src.s_fd, src.a_fd, kernel, smoothed_box)))
+	ooc_write_HII_box(smoothed_box, VELOCITY_2LPT_NAMES[m]);
+    }
+
+    if (src.a_fd >= 0) close(src.a_fd);
+    if (src.s_fd >= 0) close(src.s_fd);
+    if (src.a) fftwf_free(src.a);
+    if (src.s) fftwf_free(src.s);
+  }
+
+  close(k_fd); close(scratch_fd);
+  free(smoothed_box);
+  return status;
+}
+
+
+/*****  Sub-volume initial conditions at a higher resolution (init -zoom)  *****/
+// With COUNTER_RNG each mode depends only on the seed and its wavenumber.  The same realization
+// on a finer grid, ZOOM_DIM = <refinement>*DIM, therefore keeps every mode of the DIM box and
+// adds smaller-scale modes.  init -zoom makes the fields of only a cubic sub-volume of that grid.
+// Each (y,z) column of modes is drawn as needed and transformed along x, and only the x-planes of
+// the sub-volume are kept.  Their 2D transforms are then sampled on the sub-volume.  The result is
+// exactly the sub-volume of the full ZOOM_DIM^3 box, but only those x-planes are held in memory:
+// a fraction side/BOX_LEN of the full box.  The boxes are written to ../Boxes as
+// zoom_<name>_<ZOOM_DIM>_<x0>_<y0>_<z0>_<n>_<BOX_LEN>Mpc.  (x0, y0, z0) is the first cell of the
+// sub-volume on the zoom grid, and n is its side in those cells.  The boxes are n^3 floats,
+// unpadded and periodic across the box edges.  The DIM box holds a single mode for the wavenumbers
+// +-MIDDLE of its Nyquist planes, which the zoom grid holds apart; it is split evenly between them
+// (see zoom_mode), so that the zoom density degraded to DIM is the DIM box's (checked by zoom_check).
+
+typedef struct {
+  int dim, n, x0, y0, z0; // the zoom grid, the side and the first cells of the sub-volume on it
+  int fold; // if > 0, the DIM grid holding the modes of the zoom grid <fold> times finer, degraded to it
+} zoom_region;
+
+/*
+  Function ZOOM_MODE returns the mode (n_x, n_y, n_z) of the zoom grid of <dim> cells a side, a
+  multiple of DIM.  Within the DIM box's band it is the DIM box's mode, halved for each wavenumber
+  on the DIM box's Nyquist planes (+-MIDDLE), which the zoom grid holds twice.  The conjugate
+  relations of the DIM box then keep the zoom field real.
+*/
+fftwf_complex zoom_mode(int dim, int n_x, int n_y, int n_z){
+  int s[3], ct, nyquist = 0;
+
+  s[0] = (n_x > dim/2) ? n_x-dim : n_x;
+  s[1] = (n_y > dim/2) ? n_y-dim : n_y;
+  s[2] = n_z;
+  for (ct=0; ct<3; ct++){
+    if (abs(s[ct]) > MIDDLE) // beyond the DIM box
+      return hermitian_mode_dim(dim, n_x, n_y, n_z);
+    nyquist += (abs(s[ct]) == MIDDLE);
+  }
+  if ((dim == DIM) || !nyquist)
+    return hermitian_mode_dim(dim, n_x, n_y, n_z);
+  return hermitian_mode((s[0]+DIM) % DIM, (s[1]+DIM) % DIM, n_z) / (float)(1 << nyquist);
+}
+
+/*
+  Function ZOOM_FOLDED_MODE returns the mode (n_x, n_y, n_z) of the DIM box degraded from the zoom
+  grid <refinement> times finer: the sum of the zoom modes within the DIM box's band with the same
+  wavenumbers modulo DIM, i.e. both signs on the Nyquist planes.
+*/
+fftwf_complex zoom_folded_mode(int refinement, int n_x, int n_y, int n_z){
+  fftwf_complex mode = 0;
+  int dim = refinement*DIM, a, b, c, s_x, s_y;
+
+  for (a=0; a<=(n_x == MIDDLE); a++){
+    for (b=0; b<=(n_y == MIDDLE); b++){
+      for (c=0; c<=(n_z == MIDDLE); c++){
+	s_x = a ? -MIDDLE : ((n_x > MIDDLE) ? n_x-DIM : n_x);
+	s_y = b ? -MIDDLE : ((n_y > MIDDLE) ? n_y-DIM : n_y);
+	if (c) // n_z = -MIDDLE, the conjugate of the opposite mode
+	  mode += conjf(zoom_mode(dim, (dim-s_x) % dim, (dim-s_y) % dim, MIDDLE));
+	else
+	  mode += zoom_mode(dim, (dim+s_x) % dim, (dim+s_y) % dim, n_z);
+      }
+    }
+  }
+  return mode;
+}
+
+/*
+  Function ZOOM_FIELD sets <out> (n^3) to the density (m<0) or the velocity/dD/dt component m of
+  the zoom grid on the sub-volume, through <planes> (n x-planes of dim*(dim/2+1) modes).
+  Returns 0 on success, -1 on failure.
+*/
+int zoom_field(zoom_region *zr, int m, fftwf_complex *planes, float *out){
+  unsigned long long row = zr->dim/2 + 1llu; // modes per (x,y) row
+  fftwf_complex *col;
+  fftwf_plan col_plan, plane_plan;
+  int dim = zr->dim, n_rows = zr->dim/2 + 1, failed = 0;
+
+  // planned once, and executed by every thread on its own buffer
+  if (!(col = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*dim*row)))
+    return -1;
+  fftwf_plan_with_nthreads(1);
+  col_plan = fftwf_plan_many_dft(1, &dim, n_rows, col, NULL, n_rows, 1, col, NULL, n_rows, 1, FFTW_BACKWARD, FFTW_ESTIMATE);
+  plane_plan = fftwf_plan_dft_c2r_2d(dim, dim, col, (float *)col, FFTW_ESTIMATE);
+  fftwf_free(col);
+
+#pragma omp parallel private(col) reduction(||:failed)
+  {
+    fftwf_complex mode;
+    float k[3], k_sq;
+    int n_x, n_y, n_z, ix, iy, iz;
+
+    col = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*dim*row);
+    failed = !col;
+
+    // the 1D transforms along x of the modes (x, n_y, z), kept at the x-planes of the sub-volume
 #pragma omp for
-        for (n_x=0; n_x<DIM; n_x++){
-          if (n_x>MIDDLE)
-            k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
-          else
-            k_x = n_x * DELTA_K;
-
-          for (n_y=0; n_y<DIM; n_y++){
-            if (n_y>MIDDLE)
-	            k_y =(n_y-DIM) * DELTA_K;
-            else
-	            k_y = n_y * DELTA_K;
-
-            for (n_z=0; n_z<=MIDDLE; n_z++){ 
-	            k_z = n_z * DELTA_K;
-	
-	            k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
-          
-              	    float k[] = {k_x, k_y, k_z};
-              //fprintf(stderr, "(k = %.2e %.2e %.2e) ", k[0], k[1], k[2]); 
-	            // now set the velocities
-	            if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	              phi_1[PHI_INDEX(i, j)][0] = 0;
-	            }
-	            else{
-                //fprintf(stderr, "%.2e ", phi_1[PHI_INDEX(i, j)][C_INDEX(n_x, n_y, n_z)] ); 
-	              phi_1[PHI_INDEX(i, j)][C_INDEX(n_x,n_y,n_z)] = -k[i]*k[j]*box[C_INDEX(n_x, n_y, n_z)]/k_sq/VOLUME;
-                //fprintf(stderr, "%.2e ", phi_1[PHI_INDEX(i, j)][C_INDEX(n_x, n_y, n_z)] ); 
-
-	            // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
-	            }
-            }
-          }
-          fprintf(stderr, "%i ", n_x);
-      //printf("%i, (%f+%f*I)\n", n_x, creal(v_y[C_INDEX(n_x,0,0)]), cimag(v_y[C_INDEX(n_x,0,0)]));
-        }
-        }   
-        fprintf(stderr, "\n");
-       // Now we can generate the real phi_1[i,j]
-    
-        fprintf(stderr, "fftwf c2r phi_1[%d, %d]\n", i, j);
-        plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)phi_1[PHI_INDEX(i, j)], (float *)phi_1[PHI_INDEX(i, j)], FFTW_ESTIMATE);
-        fftwf_execute(plan);
-        
-    
-      }
-    }
-
-
-    
-   // Then we will have the laplacian of phi_2 (eq. D13b)
-   // After that we have to return in Fourier space and generate the Fourier transform of phi_2
+    for (n_y=0; n_y<dim; n_y++){
+      if (!col)
+	continue;
+      k[1] = ((n_y>dim/2) ? n_y-dim : n_y) * DELTA_K;
+      for (n_x=0; n_x<dim; n_x++){
+	k[0] = ((n_x>dim/2) ? n_x-dim : n_x) * DELTA_K;
+	for (n_z=0; n_z<=dim/2; n_z++){
+	  k[2] = n_z * DELTA_K;
+	  k_sq = k[0]*k[0] + k[1]*k[1] + k[2]*k[2];
+	  mode = (zr->fold ? zoom_folded_mode(zr->fold, n_x, n_y, n_z) : zoom_mode(dim, n_x, n_y, n_z))/VOLUME;
+	  if ((m >= 0) && (n_x==0) && (n_y==0) && (n_z==0)) // DC mode
+	    mode = 0;
+	  else if (m >= 0)
+	    mode *= k[m]*I/k_sq;
+	  col[n_x*row + n_z] = mode;
+	}
+      }
+      fftwf_execute_dft(col_plan, col, col);
+      for (ix=0; ix<zr->n; ix++)
+	memcpy(planes + ((unsigned long long)ix*dim + n_y)*row, col + ((zr->x0 + ix) % dim)*row, sizeof(fftwf_complex)*row);
+    }
 
+    // the 2D transforms of those x-planes, sampled on the sub-volume
+#pragma omp for
+    for (ix=0; ix<zr->n; ix++){
+      if (!col)
+	continue;
+      memcpy(col, planes + (unsigned long long)ix*dim*row, sizeof(fftwf_complex)*dim*row);
+      fftwf_execute_dft_c2r(plane_plan, col, (float *)col);
+      for (iy=0; iy<zr->n; iy++){
+	for (iz=0; iz<zr->n; iz++)
+	  out[((unsigned long long)ix*zr->n + iy)*zr->n + iz] = ((float *)col)[((zr->y0 + iy) % dim)*2*row + (zr->z0 + iz) % dim];
+      }
+    }
+    if (col) fftwf_free(col);
+  }
 
-    fprintf(stderr, "Generating RHS eq. D13b\n");
-    int m, l;
-    for (i=0; i<DIM; i++){
-      fprintf(stderr, "%d ", i);
-      for (j=0; j<DIM; j++){
-        for (k=0; k<DIM; k++){
-          //fprintf(stderr, "%d %d %d\n", i, j, k);
-          *( (float *)box + R_FFT_INDEX((unsigned long long)(i), (unsigned long long)(j), (unsigned long long)(k) )) = 0.0;
-          for(m = 0; m < 3; ++m){
-            for(l = m+1; l < 3; ++l){
-              //fprintf(stderr, "(%d %d) %d   ", l, m, PHI_INDEX(l, m));
-    	        *((float *)box + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k)) ) += ( *((float *)(phi_1[PHI_INDEX(l, l)]) + R_FFT_INDEX((unsigned long long) (i),(unsigned long long) (j),(unsigned long long) (k)))  ) * (  *((float *)(phi_1[PHI_INDEX(m, m)]) + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k)))  );
-              //fprintf(stderr, "%.2f ", *((float *)box + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k)) ) ); 
-    	        *((float *)box + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k)) ) -= ( *((float *)(phi_1[PHI_INDEX(l, m)]) + R_FFT_INDEX((unsigned long long)(i),(unsigned long long) (j),(unsigned long long)(k) ) )  ) * (  *((float *)(phi_1[PHI_INDEX(l, m)]) + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k) ))  );
-    	        //box[R_FFT_INDEX(i,j,k)] -= phi_1[PHI_INDEX(l, m)][R_FFT_INDEX(i,j,k)] *  phi_1[PHI_INDEX(l, m)][R_FFT_INDEX(i,j,k)];
-              //fprintf(stderr, "%.2e ", *((float *)box + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k)) ) ); 
-
-//	        smoothed_box[HII_R_INDEX(i,j,k)] = 
-//	          *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-//				       (unsigned long long)(j*f_pixel_factor+0.5),
-//				       (unsigned long long)(k*f_pixel_factor+0.5)));
-            }
-          }
-          //fprintf(stderr, "\n");
-    	  *((float *)box + R_FFT_INDEX((unsigned long long)(i),(unsigned long long)(j),(unsigned long long)(k)) ) /= TOT_NUM_PIXELS;
-        }
-      }
-    }
-    
-    fprintf(stderr, "Done\nNow fft r2c\n");
-    plan = fftwf_plan_dft_r2c_3d(DIM, DIM, DIM, (float *)box, (fftwf_complex *)box, FFTW_ESTIMATE);
+  fftwf_destroy_plan(col_plan);
+  fftwf_destroy_plan(plane_plan);
+  fftwf_plan_with_nthreads(NUMCORES);
+  return failed ? -1 : 0;
+}
+
+/*
+  Function ZOOM_CHECK checks that the zoom density of the sub-volume of <zr>, <refinement> > 1
+  times finer than DIM, degraded to DIM reproduces the DIM box's density on the DIM cells of the
+  sub-volume.  <planes> and <out> are the zoom buffers, which hold both.  Returns 0 if it does
+  (to float rounding), -1 otherwise.
+*/
+int zoom_check(zoom_region *zr, int refinement, fftwf_complex *planes, float *out){
+  zoom_region parent = {DIM, zr->n/refinement, zr->x0/refinement, zr->y0/refinement, zr->z0/refinement, 0};
+  zoom_region degraded = parent;
+  unsigned long long ct, num = pow(parent.n, 3);
+  double diff, max_diff = 0, sum_sq = 0;
+
+  degraded.fold = refinement;
+  if ((zoom_field(&parent, -1, planes, out) != 0) || (zoom_field(&degraded, -1, planes, out + num) != 0)){
+    fprintf(stderr, "init.c: Error allocating the zoom transform buffers\n");
+    return -1;
+  }
+  for (ct=0; ct<num; ct++){
+    diff = fabs(out[ct] - out[num+ct]);
+    if (diff > max_diff)
+      max_diff = diff;
+    sum_sq += out[ct]*(double)out[ct];
+  }
+  fprintf(stderr, "The zoom density degraded to DIM differs from the DIM box's by up to %g (rms %g)\n", max_diff, sqrt(sum_sq/num));
+  if (max_diff > 1e-4*sqrt(sum_sq/num)){
+    fprintf(stderr, "init.c: ERROR: the zoom density does not reproduce the DIM box's\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Function INIT_ZOOM makes the density and velocity fields of the cube of side <side> centred on
+  (<X>, <Y>, <Z>) (in Mpc), plus ZOOM_BUFFER on each side, on the grid <refinement> times finer
+  than DIM (see above).  The sub-volume is rounded out to whole DIM cells.  Those cells contain
+  the zoom cells, and the sub-volume is no larger than the box.  The density is then checked
+  against the DIM box's (see zoom_check).  Returns 0 on success, -1 on failure.
+*/
+int init_zoom(float X, float Y, float Z, float side, int refinement){
+  static const char *ZOOM_NAMES[4] = {"deltax_z0.00", "vxoverddot", "vyoverddot", "vzoverddot"};
+  zoom_region zr;
+  fftwf_complex *planes;
+  float *out, centre[3] = {X, Y, Z};
+  double bytes;
+  char filename[300];
+  FILE *OUT;
+  int first[3], n, m, status = 0;
+
+  if (!COUNTER_RNG){
+    fprintf(stderr, "init.c: ERROR: the zoom initial conditions need COUNTER_RNG\n");
+    return -1;
+  }
+  if ((refinement < 1) || (side <= 0) || ((refinement*DIM) % 2)){
+    fprintf(stderr, "init.c: ERROR: the zoom needs a positive side and refinement (and an even DIM)\n");
+    return -1;
+  }
+
+  // the sub-volume, in DIM cells
+  n = ceil((side + 2*ZOOM_BUFFER)/BOX_LEN*DIM) + 1;
+  if (n > DIM)
+    n = DIM;
+  for (m=0; m<3; m++){
+    first[m] = floor((centre[m] - 0.5*side - ZOOM_BUFFER)/BOX_LEN*DIM);
+    first[m] = ((first[m] % DIM) + DIM) % DIM; // the box is periodic
+  }
+  zr.dim = refinement*DIM;
+  zr.n = refinement*n;
+  zr.x0 = refinement*first[0];
+  zr.y0 = refinement*first[1];
+  zr.z0 = refinement*first[2];
+  zr.fold = 0;
+
+  bytes = sizeof(fftwf_complex)*(zr.n + NUMCORES)*(double)zr.dim*(zr.dim/2+1) + sizeof(float)*pow(zr.n, 3);
+  fprintf(stderr, "Making the %i^3 cells from (%i, %i, %i) of the %i^3 zoom grid (%.2f Mpc cells), with %.2f GB\n",
+	  zr.n, zr.x0, zr.y0, zr.z0, zr.dim, BOX_LEN/zr.dim, bytes/BYTES_PER_GB);
+  if (bytes > RAM*BYTES_PER_GB)
+    fprintf(stderr, "init.c: WARNING: that is more than RAM=%g GB; try a smaller sub-volume or refinement\n", RAM);
+
+  planes = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*zr.n*(unsigned long long)zr.dim*(zr.dim/2+1llu));
+  out = (float *) malloc(sizeof(float)*zr.n*(unsigned long long)zr.n*zr.n);
+  if (!planes || !out){
+    fprintf(stderr, "init.c: Error allocating memory for the zoom sub-volume\n");
+    if (planes) fftwf_free(planes);
+    if (out) free(out);
+    return -1;
+  }
+
+  for (m=-1; (m<3) && !status; m++){
+    fprintf(stderr, "Setting the zoom %s...\n", ZOOM_NAMES[m+1]);
+    if ((status = zoom_field(&zr, m, planes, out)) != 0){
+      fprintf(stderr, "init.c: Error allocating the zoom transform buffers\n");
+      break;
+    }
+    sprintf(filename, "../Boxes/zoom_%s_%i_%i_%i_%i_%i_%.0fMpc", ZOOM_NAMES[m+1], zr.dim, zr.x0, zr.y0, zr.z0, zr.n, BOX_LEN);
+    if (!(OUT=fopen(filename, "wb"))){
+      fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
+      status = -1;
+    }
+    else{
+      if (mod_fwrite(out, sizeof(float)*zr.n*(unsigned long long)zr.n*zr.n, 1, OUT)!=1){
+	fprintf(stderr, "init.c: Write error occured writting %s!\n", filename);
+	status = -1;
+      }
+      fclose(OUT);
+    }
+  }
+
+  // degraded to DIM, the zoom density should be the DIM box's
+  if (!status && (refinement > 1))
+    status = zoom_check(&zr, refinement, planes, out);
+
+  fftwf_free(planes);
+  free(out);
+  return status;
+}
+
+
+#if USE_MPI
+/*****  MPI initial conditions (make init_mpi, see mpi_slabs.c)  *****/
+// Each rank draws the modes of its own x-slabs (with COUNTER_RNG, any mode can be drawn on
+// its own, see hermitian_mode), keeps its part of the k-space density, and makes its part of
+// every DIM box with FFTW's MPI transforms.  The HII_DIM boxes are summed on rank 0, which
+// writes them; the DIM boxes are written uncompressed, by every rank into its part of the file.
+
+/* sets the local modes of <box> with <kernel>, as ooc_set_modes does row by row */
+void mpi_set_modes(fftwf_complex *box, ooc_kernel *kernel){
+  int n_x, n_y;
+
+#pragma omp parallel for private(n_y)
+  for (n_x=mpi_x0; n_x<mpi_x0+mpi_nx; n_x++){
+    for (n_y=0; n_y<DIM; n_y++)
+      ooc_set_modes(box + ((n_x-mpi_x0)*D + n_y)*(MID+1llu), n_x, n_y, kernel);
+  }
+}
+
+/* transforms the local slabs of the k-space box <box> to real space (collective) */
+void mpi_c2r(fftwf_complex *box){
+  fftwf_plan plan;
+
+  plan = fftwf_mpi_plan_dft_c2r_3d(DIM, DIM, DIM, box, (float *)box, MPI_COMM_WORLD, FFTW_ESTIMATE);
+  fftwf_execute(plan);
+  fftwf_destroy_plan(plan);
+}
+
+/*
+  Function MPI_LOW_RES_BOX is low_res_box for the local slabs of the k-space box <box> (which it
+  overwrites), with the modes first set by <kernel>: rank 0 gets the HII_DIM^3 box <smoothed_box>.
+  Collective.  Returns 0 on success, -1 on failure.
+*/
+int mpi_low_res_box(fftwf_complex *box, ooc_kernel kernel, float *smoothed_box){
+  fftwf_complex *hii_box;
+  fftwf_plan plan;
+  float f_pixel_factor = DIM/(float)HII_DIM;
+  unsigned long long x;
+  int i, j, k, n_x, n_y;
+
+  if (!KSPACE_DOWNSAMPLE){
+    kernel.filter_type = (DIM != HII_DIM) ? 0 : -1;
+    mpi_set_modes(box, &kernel);
+    mpi_c2r(box);
+    // sample the local slabs, then sum the samples of all the ranks
+    memset(smoothed_box, 0, sizeof(float)*HII_TOT_NUM_PIXELS);
+    for (i=0; i<HII_DIM; i++){
+      x = (unsigned long long)(i*f_pixel_factor+0.5);
+      if ((x < mpi_x0) || (x >= mpi_x0+mpi_nx))
+	continue;
+      ooc_sample_slab((float *)box + (x-mpi_x0)*2llu*D*(MID+1llu), x, smoothed_box);
+    }
+    mpi_sum_to_root(smoothed_box, HII_TOT_NUM_PIXELS);
+    return 0;
+  }
+
+  // each rank sets the modes of the HII_DIM box in its slabs, and rank 0 transforms their sum
+  kernel.filter_type = (DIM != HII_DIM) ? INIT_DOWNSAMPLE_WINDOW : -1;
+  hii_box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  if (mpi_all_ok(!hii_box) != 0){
+    fprintf(stderr, "init.c: Error allocating memory for the low-res k-space box\n");
+    if (hii_box) fftwf_free(hii_box);
+    return -1;
+  }
+  memset(hii_box, 0, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  for (i=0; i<HII_DIM; i++){
+    n_x = (i < HII_MIDDLE) ? i : i - HII_DIM + DIM; // the same wavenumber in the DIM box
+    if ((i == HII_MIDDLE) || (n_x < mpi_x0) || (n_x >= mpi_x0+mpi_nx))
+      continue;
+#pragma omp parallel for private(k, n_y)
+    for (j=0; j<HII_DIM; j++){
+      if (j == HII_MIDDLE)
+	continue;
+      n_y = (j < HII_MIDDLE) ? j : j - HII_DIM + DIM;
+      ooc_set_modes(box + ((n_x-mpi_x0)*D + n_y)*(MID+1llu), n_x, n_y, &kernel);
+      for (k=0; k<HII_MIDDLE; k++)
+	hii_box[HII_C_INDEX(i,j,k)] = box[((n_x-mpi_x0)*D + n_y)*(MID+1llu) + k];
+    }
+  }
+  mpi_sum_to_root((float *)hii_box, 2llu*HII_KSPACE_NUM_PIXELS);
+  if (!mpi_rank){
+    plan = fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, (fftwf_complex *)hii_box, (float *)hii_box, FFTW_ESTIMATE);
     fftwf_execute(plan);
-    fprintf(stderr, "Done\n");
+    fftwf_destroy_plan(plan);
+    for (i=0; i<HII_DIM; i++){
+      for (j=0; j<HII_DIM; j++){
+	for (k=0; k<HII_DIM; k++){
+	  smoothed_box[HII_R_INDEX(i,j,k)] = *((float *)hii_box + HII_R_FFT_INDEX(i,j,k));
+	}
+      }
+    }
+  }
+  fftwf_free(hii_box);
+  return 0;
+}
 
-    // Now we can store the content of box in a back-up file
-    // Then we can generate the gradients of phi_2 (eq. D13b and D9)
-    
+/*
+  Function INIT_MPI makes all the initial conditions across the MPI ranks (see above).
+  Returns 0 on success, -1 on failure.
+*/
+int init_mpi(int *argc, char ***argv){
+  static const int LPT_TERMS[6][2] = {{0,0}, {1,1}, {2,2}, {1,0}, {2,0}, {2,1}};
+  static const char *VELOCITY_NAMES[3] = {"vxoverddot", "vyoverddot", "vzoverddot"};
+  static const char *VELOCITY_2LPT_NAMES[3] = {"vxoverddot_2LPT", "vyoverddot_2LPT", "vzoverddot_2LPT"};
+  fftwf_complex *box, *deltak, *phi_a = NULL, *phi_b = NULL;
+  float *smoothed_box, *s, *fa, *fb;
+  unsigned long long ct, num_local;
+  char filename[80];
+  ooc_kernel kernel;
+  fftwf_plan plan;
+  int n_x, n_y, n_z, m, term, status, p, need[IC_NUM_PRODUCTS];
 
-    /***** Write out back-up k-box RHS eq. D13b *****/
-    fprintf(stderr, "\nWritting back-up k-space box...\n");
-    sprintf(filename, "../Boxes/backup_eqD13b_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+  if (mpi_slabs_init(argc, argv) != 0)
+    return -1;
+  if (!COUNTER_RNG){
+    if (!mpi_rank) fprintf(stderr, "init.c: ERROR: the MPI initial conditions need COUNTER_RNG\n");
+    return -1;
+  }
+  init_ps();
+  if (!mpi_rank)
+    system("mkdir ../Boxes");
+  // if any box of this realization is missing from ../Boxes, all are made again (see ic_cache.c)
+  if (!mpi_rank)
+    status = ic_cache_check(need);
+  MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (!status){
+    if (!mpi_rank) fprintf(stderr, "init: the initial conditions in ../Boxes are those of this realization, reusing them (see ic_cache.c)\n");
+    free_ps(); return 0;
+  }
+  if (!mpi_rank){
+    need[IC_DELTAK] = 1;
+    ic_cache_begin(need);
+  }
+  fftwf_plan_with_nthreads(NUMCORES);
+  omp_set_num_threads(NUMCORES);
+
+  num_local = mpi_alloc_complex;
+  box = fftwf_alloc_complex(num_local);
+  deltak = fftwf_alloc_complex(num_local);
+  smoothed_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+  if (SECOND_ORDER_LPT_CORRECTIONS){
+    phi_a = fftwf_alloc_complex(num_local);
+    phi_b = fftwf_alloc_complex(num_local);
+  }
+  status = mpi_all_ok(!box || !deltak || !smoothed_box || (SECOND_ORDER_LPT_CORRECTIONS && (!phi_a || !phi_b)));
+  if (status)
+    fprintf(stderr, "init.c: Error allocating memory for the local slabs on rank %i\n", mpi_rank);
+
+  /***** Draw the modes of the local slabs, and keep them in deltak *****/
+  if (!status){
+    if (!mpi_rank) fprintf(stderr, "Creating Gaussian random field.\n");
+#pragma omp parallel for private(n_y, n_z)
+    for (n_x=mpi_x0; n_x<mpi_x0+mpi_nx; n_x++){
+      for (n_y=0; n_y<DIM; n_y++){
+	for (n_z=0; n_z<=MIDDLE; n_z++)
+	  deltak[((n_x-mpi_x0)*D + n_y)*(MID+1llu) + n_z] = hermitian_mode(n_x, n_y, n_z);
+      }
+    }
+    sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+    status = mpi_slab_io(filename, deltak, 1);
+  }
+
+  /***** The low-res density *****/
+  kernel.i = kernel.j = -1;
+  kernel.scale = 1;
+  if (!status){
+    if (!mpi_rank) fprintf(stderr, "Filtering and sampling the density box to get low-res version...\n");
+    memcpy(box, deltak, sizeof(fftwf_complex)*num_local);
+    status = mpi_low_res_box(box, kernel, smoothed_box);
+  }
+  if (!status && !mpi_rank){
+    for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+      smoothed_box[ct] /= VOLUME;
+    ooc_write_HII_box(smoothed_box, "smoothed_deltax_z0.00");
+  }
+
+  /***** The real-space density *****/
+  if (!status){
+    if (!mpi_rank) fprintf(stderr, "Getting and writting real-space box...\n");
+    memcpy(box, deltak, sizeof(fftwf_complex)*num_local);
+    kernel.scale = 1.0/VOLUME;
+    kernel.filter_type = -1;
+    mpi_set_modes(box, &kernel);
+    mpi_c2r(box);
+    sprintf(filename, "../Boxes/deltax_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+    status = mpi_slab_io(filename, box, 1);
+  }
+
+  /*** The velocity field/dD/dt (in comoving Mpc) ***/
+  for (m=0; (m<3) && !status; m++){
+    if (!mpi_rank) fprintf(stderr, "Setting %c velocity field...\n", 'x'+m);
+    memcpy(box, deltak, sizeof(fftwf_complex)*num_local);
+    kernel.i = m;
+    kernel.scale = 1.0/VOLUME;
+    status = mpi_low_res_box(box, kernel, smoothed_box);
+    if (!status && !mpi_rank)
+      ooc_write_HII_box(smoothed_box, VELOCITY_NAMES[m]);
+  }
+
+  /***** 2LPT (the same terms as the 2LPT part of main, accumulated in box) *****/
+  if (SECOND_ORDER_LPT_CORRECTIONS && !status){
+    if (!mpi_rank) fprintf(stderr, "Begin 2LPT part\nGenerating RHS eq. D13b\n");
+    kernel.scale = 1.0/VOLUME;
+    kernel.filter_type = -1;
+    for (term=0; term<6; term++){
+      // phi_1[0,0] stays in phi_a, the others are computed in phi_b
+      kernel.i = LPT_TERMS[term][0];
+      kernel.j = LPT_TERMS[term][1];
+      memcpy(term ? phi_b : phi_a, deltak, sizeof(fftwf_complex)*num_local);
+      mpi_set_modes(term ? phi_b : phi_a, &kernel);
+      mpi_c2r(term ? phi_b : phi_a);
+
+      s = (float *)box; fa = (float *)phi_a; fb = (float *)phi_b;
+#pragma omp parallel for
+      for (ct=0; ct<2llu*mpi_nx*D*(MID+1llu); ct++){
+	if (term == 1){
+	  s[ct] = fa[ct]*fb[ct];
+	  fa[ct] += fb[ct];
+	}
+	else if (term == 2)
+	  s[ct] += fa[ct]*fb[ct];
+	else if (term > 2)
+	  s[ct] -= fb[ct]*fb[ct];
+      }
+    }
+    for (ct=0; ct<2llu*mpi_nx*D*(MID+1llu); ct++)
+      ((float *)box)[ct] /= TOT_NUM_PIXELS;
+
+    if (!mpi_rank) fprintf(stderr, "Done\nNow fft r2c\n");
+    plan = fftwf_mpi_plan_dft_r2c_3d(DIM, DIM, DIM, (float *)box, box, MPI_COMM_WORLD, FFTW_ESTIMATE);
+    fftwf_execute(plan);
+    fftwf_destroy_plan(plan);
+
+    // the velocities, from the k-space source term in box
+    kernel.j = -1;
+    kernel.scale = 1;
+    for (m=0; (m<3) && !status; m++){
+      if (!mpi_rank) fprintf(stderr, "Setting %c velocity field 2LPT...\n", 'x'+m);
+      memcpy(phi_a, box, sizeof(fftwf_complex)*num_local);
+      kernel.i = m;
+      status = mpi_low_res_box(phi_a, kernel, smoothed_box);
+      if (!status && !mpi_rank)
+	ooc_write_HII_box(smoothed_box, VELOCITY_2LPT_NAMES[m]);
+    }
+  }
+
+  for (p=0; (p<IC_NUM_PRODUCTS) && !status && !mpi_rank; p++){
+    if ((p < IC_VELOCITY_2LPT) || SECOND_ORDER_LPT_CORRECTIONS)
+      ic_cache_mark(p);
+  }
+
+  if (box) fftwf_free(box);
+  if (deltak) fftwf_free(deltak);
+  if (phi_a) fftwf_free(phi_a);
+  if (phi_b) fftwf_free(phi_b);
+  if (smoothed_box) free(smoothed_box);
+  free_ps();
+  return status;
+}
+#endif
+
+
+/* MAIN PROGRAM */
+int main(int argc, char ** argv){
+  fftwf_complex *box;
+  fftwf_plan plan;
+  unsigned long long ct;
+  int n_x, n_y, n_z, i, j, k, thread_num, status;
+  float k_x, k_y, k_z, k_sq, *smoothed_box;
+  double pixel_deltax;
+  FILE *OUT;
+  char filename[80];
+  gsl_rng * r[NUMCORES];
+  time_t start_time, curr_time;
+  int NUM_RNG_THREADS, m, p, need[IC_NUM_PRODUCTS], queued[IC_NUM_PRODUCTS], batched_velocities;
+  memory_plan mem_plan;
+
+#if USE_MPI
+  // the MPI build (make init_mpi) makes the boxes across the ranks instead
+  return init_mpi(&argc, &argv);
+#endif
+  // init -zoom <X> <Y> <Z> <SIDE> <REFINEMENT>: a sub-volume at a higher resolution (see init_zoom)
+  if ((argc == 7) && !strcmp(argv[1], "-zoom")){
+    init_ps();
+    system("mkdir ../Boxes");
+    if (fftwf_init_threads()==0){
+      fprintf(stderr, "init: ERROR: problem initializing fftwf threads\nAborting\n.");
+      return -1;
+    }
+    omp_set_num_threads(NUMCORES);
+    fftwf_plan_with_nthreads(NUMCORES);
+    status = init_zoom(atof(argv[2]), atof(argv[3]), atof(argv[4]), atof(argv[5]), atoi(argv[6]));
+    fftwf_cleanup_threads();
+    free_ps(); return status;
+  }
+  else if (argc != 1){
+    fprintf(stderr, "USAGE: init [-zoom <X> <Y> <Z> <SIDE> <REFINEMENT>]\n"
+	    "(the centre and side of the sub-volume in Mpc, and the factor by which DIM is refined)\nAborting...\n");
+    return -1;
+  }
+
+  /************  INITIALIZATION **********************/
+
+  time(&start_time);
+  // initialize power spectrum functions
+  init_ps();
+  system("mkdir ../Boxes");
+
+  // reuse the boxes of this realization already in ../Boxes, making only the missing ones
+  if (ic_cache_check(need) == 0){
+    fprintf(stderr, "init: the initial conditions in ../Boxes are those of this realization, reusing them (see ic_cache.c)\n");
+    free_ps(); return 0;
+  }
+  if (!need[IC_DELTAK]){
+    fprintf(stderr, "init: reusing the initial conditions in ../Boxes, making only");
+    for (p=0; p<IC_NUM_PRODUCTS; p++)
+      if (need[p]) fprintf(stderr, " %s", IC_PRODUCT_NAMES[p]);
+    fprintf(stderr, "\n");
+  }
+
+  // initialize and allocate thread info
+  if (fftwf_init_threads()==0){
+    fprintf(stderr, "init: ERROR: problem initializing fftwf threads\nAborting\n.");
+    return -1;
+  }
+  fftwf_plan_with_nthreads(NUMCORES); // use all processors for init
+  if (COUNTER_RNG) // the modes do not depend on the thread drawing them (see counter_rng.c)
+    NUM_RNG_THREADS = 0;
+  else if (NUMCORES < NUM_HIGH_LEVEL_RNG)
+    NUM_RNG_THREADS = NUMCORES;
+  else
+    NUM_RNG_THREADS = NUM_HIGH_LEVEL_RNG;
+  omp_set_num_threads(COUNTER_RNG ? NUMCORES : NUM_RNG_THREADS);
+
+  // seed the random number generators
+  fprintf(stderr, "Creating Gaussian random field.\n");
+  if (COUNTER_RNG)
+    fprintf(stderr, "Using the counter-based Philox4x32-10 RNG with seed %li on %i threads\n", RANDOM_SEED, NUMCORES);
+  if (FIXED_AMPLITUDE_ICS || PAIRED_ICS)
+    fprintf(stderr, "Drawing %s%s%s initial conditions\n", FIXED_AMPLITUDE_ICS ? "fixed-amplitude" : "",
+	    (FIXED_AMPLITUDE_ICS && PAIRED_ICS) ? ", " : "", PAIRED_ICS ? "paired (phase-shifted by pi)" : "");
+  for (thread_num = 0; thread_num < NUM_RNG_THREADS; thread_num++){
+    switch (thread_num){
+    case 0:
+      r[thread_num] = gsl_rng_alloc(gsl_rng_mt19937);
+      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
+      fprintf(stderr, "Thread #%i will use a Mersenne Twister RNG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
+      break;
+    case 1:
+      r[thread_num] = gsl_rng_alloc(gsl_rng_ranlux389);
+      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
+      fprintf(stderr, "Thread #%i will use a ranlux389 RNG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
+      break;
+    case 2:
+      r[thread_num] = gsl_rng_alloc(gsl_rng_cmrg);
+      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
+      fprintf(stderr, "Thread #%i will use a CMRG by L'Ecuyer seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
+      break;
+    case 3:
+      r[thread_num] = gsl_rng_alloc(gsl_rng_mrg);
+      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
+      fprintf(stderr, "Thread #%i will use a 5th order MRG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
+      break;
+    case 4:
+      r[thread_num] = gsl_rng_alloc(gsl_rng_taus);
+      gsl_rng_set(r[thread_num], RANDOM_SEED+thread_num);
+      fprintf(stderr, "Thread #%i will use a Tausworthe RNG seeded with %u\n", thread_num, RANDOM_SEED+thread_num);
+      break;
+    } // end switch
+  }
+
+  // check the boxes we are about to allocate fit in RAM
+  mem_plan = plan_memory(MEM_STAGE_INIT);
+  print_memory_plan(stderr, &mem_plan);
+  if (mem_plan.strategies & MEM_OUT_OF_CORE_FFT){
+    // which makes all the boxes again
+    need[IC_DELTAK] = 1;
+    ic_cache_begin(need);
+    status = init_out_of_core();
+    for (p=0; (p<IC_NUM_PRODUCTS) && !status; p++){
+      if ((p < IC_VELOCITY_2LPT) || SECOND_ORDER_LPT_CORRECTIONS)
+	ic_cache_mark(p);
+    }
+    gsl_rng_free_threaded (r, NUM_RNG_THREADS); fftwf_cleanup_threads();
+    free_ps(); return status;
+  }
+  ic_cache_begin(need);
+
+  // allocate array for the k-space and real-space boxes
+  // (three in a row for the batched velocity components, the last two also the 2LPT phi_1 boxes)
+  batched_velocities = !(mem_plan.strategies & MEM_SEQUENTIAL_VELOCITIES);
+  box = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS*(batched_velocities ? 3 : 1));
+  if (!box){
+    gsl_rng_free_threaded (r, NUM_RNG_THREADS); fprintf(stderr, "Init.c: Error allocating memory for box.\nAborting...\n");
+    fftwf_cleanup_threads();
+    free_ps(); return -1;
+  }
+
+  // now allocate memory for the lower-resolution box
+  // use HII_DIM from ANAL_PARAMS
+  smoothed_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+  if (!smoothed_box){
+    fprintf(stderr, "Init.c: Error allocating memory for low-res box.\nAborting...\n");
+    gsl_rng_free_threaded (r, NUM_RNG_THREADS); fftwf_free(box);    fftwf_cleanup_threads();
+    free_ps(); return -1;
+  }
+  /************  END INITIALIZATION ******************/
+
+
+  if (!need[IC_DELTAK]){
+    // reuse the k-space density of this realization (see ic_cache.c)
+    fprintf(stderr, "Reading the k-space box of this realization...\n");
+    sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+    if (!(OUT=fopen(filename, "rb")) || (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, OUT)!=1)){
+      fprintf(stderr, "init.c: Read error occured reading %s!\n", filename);
+      if (OUT) fclose(OUT);
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fftwf_cleanup_threads();
+      free_ps(); return -1;
+    }
+    fclose(OUT);
+  }
+  else{
+  /************ CREATE K-SPACE GAUSSIAN RANDOM FIELD ***********/
+#pragma omp parallel shared(box, r) private(n_x, n_y, n_z)
+  { // need to find a parallel random number generator
+    //    fprintf(stderr, "Hello from thread #%i\n", omp_get_thread_num());
+#pragma omp for
+  for (n_x=0; n_x<DIM; n_x++){
+    for (n_y=0; n_y<DIM; n_y++){
+      // since physical space field is real, only half contains independent modes
+      for (n_z=0; n_z<=MIDDLE; n_z++){ 
+	box[C_INDEX(n_x, n_y, n_z)] = gaussian_mode(n_x, n_y, n_z, COUNTER_RNG ? NULL : r[omp_get_thread_num()]);
+      }
+    }
+    //    fprintf(stderr, "%i ", n_x);
+  }
+} // end omp parallel
+
+  /*****  Adjust the complex conjugate relations for a real array  *****/
+  adj_complex_conj(box);
+  }
+
+  // no need to worry about RNG correlated streams, so use all processors now
+  omp_set_num_threads(NUMCORES);
+
+  if (keep_deltak(box, mem_plan.strategies) != 0){
+    gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fftwf_cleanup_threads();
+    free_ps(); return -1;
+  }
+
+  /***** Write out the k-box *****/
+  if (need[IC_DELTAK]){
+    fprintf(stderr, "\nWritting k-space box...\n");
+    sprintf(filename, "../Boxes/deltak_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
     if (!(OUT=fopen(filename, "wb"))){
       fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
     }
     else if (mod_fwrite(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, OUT)!=1){
       fprintf(stderr, "init.c: Write error occured writting deltak box!\n");
     }
+    else
+      ic_cache_mark(IC_DELTAK);
     fclose(OUT);
+  }
 
-    // For each component, we generate the velocity field (same as the ZA part)
 
-    sprintf(filename, "../Boxes/backup_eqD13b_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
-    IN = fopen(filename, "rb");
-    if (!IN){
-      fprintf(stderr, "Couldn't open file %s for reading\nAborting...\n", filename);
-      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
+  /*** Let's also create a lower-resolution version of the density field  ***/
+  if (need[IC_SMOOTHED_DELTAX]){
+    time(&start_time);
+    fprintf(stderr, "Filtering and sampling the density box to get low-res version...\n");
+    if (low_res_box(box, smoothed_box) != 0){
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
       free_ps(); return -1;
     }
-    /*** Now let's set the velocity field/dD/dt (in comoving Mpc) ***/
-    /**** first x component ****/
-    fprintf(stderr, "Setting x velocity field 2LPT...\n");
-    // read in the box
-    // TODO correct free of phi_1
-    rewind(IN);
-    if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-      fprintf(stderr, "init.c: Read error occured!\n");
-      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
-      free_ps(); return -1;
+    for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+      smoothed_box[ct] /= VOLUME;
+    time(&curr_time);
+    fprintf(stderr, "End filtering and sampling which took %g min.\n", difftime(curr_time, start_time)/60.0);
+    // now write the box
+    sprintf(filename, "../Boxes/smoothed_deltax_z0.00_%i_%.0fMpc", HII_DIM, BOX_LEN);
+    OUT=fopen(filename, "wb");
+    if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
+      fprintf(stderr, "init.c: Write error occured writting smoothed deltax box!\n");
     }
-    // set velocities/dD/dt
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
-    {
-#pragma omp for
-    for (n_x=0; n_x<DIM; n_x++){
-      if (n_x>MIDDLE)
-        k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
-      else
-        k_x = n_x * DELTA_K;
+    else
+      ic_cache_mark(IC_SMOOTHED_DELTAX);
+    fclose(OUT);
+  }
 
-      for (n_y=0; n_y<DIM; n_y++){
-        if (n_y>MIDDLE)
-	        k_y =(n_y-DIM) * DELTA_K;
-        else
-	        k_y = n_y * DELTA_K;
-
-        for (n_z=0; n_z<=MIDDLE; n_z++){ 
-	        k_z = n_z * DELTA_K;
-	
-	        k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
-
-	        // now set the velocities
-	        if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	          box[0] = 0;
-	        }
-	        else{
-	          box[C_INDEX(n_x,n_y,n_z)] *= k_x*I/k_sq;
-	          // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
-	        }
-        }
-      }
-        fprintf(stderr, "%i ", n_x);
-      //printf("%i, (%f+%f*I)\n", n_x, creal(v_y[C_INDEX(n_x,0,0)]), cimag(v_y[C_INDEX(n_x,0,0)]));
+
+  /******* PERFORM INVERSE FOURIER TRANSFORM *****************/
+  if (need[IC_DELTAX]){
+    fprintf(stderr, "Getting and writting real-space box...\n");
+    if (load_deltak(box) != 0){
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+      free_ps(); return -1;
     }
+    // add the 1/VOLUME factor when converting from k space to real space
+    for (ct=0; ct<KSPACE_NUM_PIXELS; ct++){
+       box[ct] /= VOLUME;
     }
-    fprintf(stderr, "Filtering the high res box\n");
-
-    if (DIM != HII_DIM)
-      filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-    fprintf(stderr, "Now doing the FFT to get real-space field\n");
     plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
     fftwf_execute(plan);
-    fprintf(stderr, "Sampling...\n");  
-    // now sample to lower res
-    // now sample the filtered box
-    fprintf(stderr, "Sampling...\n");
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-        for (k=0; k<HII_DIM; k++){
-	        smoothed_box[HII_R_INDEX(i,j,k)] = 
-	          *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)));
-        } 
-      }
+    fftwf_destroy_plan(plan);
+    fftwf_cleanup();
+
+    /***** Write the real space field *****/
+    sprintf(filename, "../Boxes/deltax_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+    if (!(OUT=fopen(filename, "wb"))){
+      fprintf(stderr, "init.c: Error openning %s to write to\n", filename);
     }
-    // write out file
-    fprintf(stderr, "Done\n\nNow write out files\n");
-    sprintf(filename, "../Boxes/vxoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    OUT=fopen(filename, "wb");
-    if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-      fprintf(stderr, "init.c: Write error occured writting v_x box!\n");
+    else if (mod_fwrite(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, OUT)!=1){
+      fprintf(stderr, "init.c: Write error occured writting deltax box!\n");
     }
+    else
+      ic_cache_mark(IC_DELTAX);
     fclose(OUT);
+  }
 
-  
-    /**** y component ****/
-    fprintf(stderr, "Setting y velocity field 2LPT...\n");
-    // read in the box
-    rewind(IN);
-    // TODO set free properly
-    if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-      fprintf(stderr, "init.c: Read error occured!\n");
-      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
+  /*** Now let's set the velocity field/dD/dt (in comoving Mpc) ***/
+  // all three components in one batch, written in the background (see low_res_velocities)
+  for (p=0; p<IC_NUM_PRODUCTS; p++)
+    queued[p] = 0;
+  if (batched_velocities && need[IC_VELOCITY] && need[IC_VELOCITY+1] && need[IC_VELOCITY+2]){
+    fprintf(stderr, "Setting the velocity fields...\n");
+    if ((load_deltak(box) != 0) || (low_res_velocities(box, VOLUME, IC_VELOCITY) != 0)){
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+      free_ps(); return -1;
+    }
+    queued[IC_VELOCITY] = queued[IC_VELOCITY+1] = queued[IC_VELOCITY+2] = 1;
+  }
+  // otherwise one component m at a time
+  for (m=0; m<3; m++){
+    if (!need[IC_VELOCITY+m] || queued[IC_VELOCITY+m])
+      continue;
+    fprintf(stderr, "Setting %c velocity field...\n", 'x'+m);
+    // get the k-space density
+    if (load_deltak(box) != 0){
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
       free_ps(); return -1;
     }
     // set velocities/dD/dt
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
+#pragma omp parallel shared(box, m) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
     {
 #pragma omp for
     for (n_x=0; n_x<DIM; n_x++){
       if (n_x>MIDDLE)
-        k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
+	k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
       else
-        k_x = n_x * DELTA_K;
+	k_x = n_x * DELTA_K;
 
       for (n_y=0; n_y<DIM; n_y++){
-        if (n_y>MIDDLE)
-	        k_y =(n_y-DIM) * DELTA_K;
-        else
-	        k_y = n_y * DELTA_K;
-
-        for (n_z=0; n_z<=MIDDLE; n_z++){ 
-	        k_z = n_z * DELTA_K;
-	
-	        k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
-
-	        // now set the velocities
-	        if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	          box[0] = 0;
-	        }
-	        else{
-	        box[C_INDEX(n_x,n_y,n_z)] *= k_y*I/k_sq;
-          //fprintf(stderr, "%.2e ", box[C_INDEX(n_x, n_y, n_z)]);
-	        // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
-	        }
-        }
-      }
-      fprintf(stderr, "%i ", n_x);
-      //printf("%i, (%f+%f*I)\n", n_x, creal(v_y[HII_C_INDEX(n_x,0,0)]), cimag(v_y[HII_C_INDEX(n_x,0,0)]));
+	if (n_y>MIDDLE)
+	  k_y =(n_y-DIM) * DELTA_K;
+	else
+	  k_y = n_y * DELTA_K;
+
+	for (n_z=0; n_z<=MIDDLE; n_z++){ 
+	  k_z = n_z * DELTA_K;
+	  
+	  k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
+	  float k[] = {k_x, k_y, k_z};
+
+	  // now set the velocities
+	  if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
+	    box[0] = 0;
+	  }
+	  else{
+	    box[C_INDEX(n_x,n_y,n_z)] *= k[m]*I/k_sq/VOLUME;
+	    // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
+	  }
+	}
+      }
     }
     }
-    fprintf(stderr, "Filtering the high res box\n");
-    if (DIM != HII_DIM)
-      filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-    fprintf(stderr, "Now doing the FFT to get real-space field\n");
-    plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
-    fftwf_execute(plan);
-    fprintf(stderr, "Sampling...\n");
-    // now sample to lower res
-    // now sample the filtered box
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-        for (k=0; k<HII_DIM; k++){
-	        smoothed_box[HII_R_INDEX(i,j,k)] = 
-	          *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)));
-        }
-      }
+    if (low_res_box(box, smoothed_box) != 0){
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+      free_ps(); return -1;
     }
     // write out file
     fprintf(stderr, "Done\n\nNow write out files\n");
-    sprintf(filename, "../Boxes/vyoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
+    sprintf(filename, "../Boxes/v%coverddot_%i_%.0fMpc", 'x'+m, HII_DIM, BOX_LEN);
     OUT=fopen(filename, "wb");
     if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-      fprintf(stderr, "init.c: Write error occured writting v_y box!\n");
+      fprintf(stderr, "init.c: Write error occured writting v_%c box!\n", 'x'+m);
     }
+    else
+      ic_cache_mark(IC_VELOCITY+m);
     fclose(OUT);
+  }
 
 
-    /**** z component ****/
-    fprintf(stderr, "Setting z velocity field 2LPT...\n");
-    // read in the box
-    rewind(IN);
-    // TODO set free properly
-    if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-      fprintf(stderr, "init.c: Read error occured!\n");
-      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
+/* *************************************************** *
+ *              BEGIN 2LPT PART                        *
+ * *************************************************** */
+
+  // Generation of the second order Lagrangian perturbation theory (2LPT) corrections to
+  // the ZA
+  // reference: Scoccimarro R., 1998, MNRAS, 299, 1097-1118 Appendix D
+ 
+  // Parameter set in ANAL_PARAMS.H
+  if(SECOND_ORDER_LPT_CORRECTIONS && (need[IC_VELOCITY_2LPT] || need[IC_VELOCITY_2LPT+1] || need[IC_VELOCITY_2LPT+2])){
+    fprintf(stderr, "Begin 2LPT part\n");
+    // The source term of eq. D13b is
+    //   sum_{m<l} phi_1[l,l] phi_1[m,m] - phi_1[l,m]^2
+    //   = phi_1[0,0] phi_1[1,1] + (phi_1[0,0] + phi_1[1,1]) phi_1[2,2] - phi_1[1,0]^2 - phi_1[2,0]^2 - phi_1[2,1]^2
+    // so it is accumulated in box from the second derivatives of phi_1, computed two at a time in
+    // phi_a and phi_b: three DIM boxes are resident (besides the k-space density copy), rather
+    // than the six derivatives plus box.
+    static const int LPT_OFF_DIAGONAL[3][2] = {{1,0}, {2,0}, {2,1}};
+    fftwf_complex *phi_a, *phi_b;
+    int lpt_ok;
+
+    if (batched_velocities){ // the boxes after box
+      phi_a = box + KSPACE_NUM_PIXELS;
+      phi_b = box + 2*KSPACE_NUM_PIXELS;
+    }
+    else{
+      phi_a = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+      phi_b = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+    }
+    if (!phi_a || !phi_b){
+      fprintf(stderr, "Init.c: Error allocating memory for the 2LPT boxes.\nAborting...\n");
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+      if (phi_a) fftwf_free(phi_a);
+      if (phi_b) fftwf_free(phi_b);
       free_ps(); return -1;
     }
-    // set velocities/dD/dt
-#pragma omp parallel shared(box, r) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
+
+    fprintf(stderr, "Generating RHS eq. D13b\n");
+    lpt_ok = !lpt_phi_1(phi_a, 0, 0) && !lpt_phi_1(phi_b, 1, 1);
+    if (lpt_ok){
+      lpt_source_add(box, phi_a, phi_b, LPT_SOURCE_SET);
+      lpt_source_add(phi_a, phi_b, NULL, LPT_SOURCE_ADD);
+      lpt_ok = !lpt_phi_1(phi_b, 2, 2);
+    }
+    if (lpt_ok)
+      lpt_source_add(box, phi_a, phi_b, LPT_SOURCE_ADD);
+    for (m=0; lpt_ok && (m<3); m++){ // the off-diagonal terms
+      lpt_ok = !lpt_phi_1(phi_a, LPT_OFF_DIAGONAL[m][0], LPT_OFF_DIAGONAL[m][1]);
+      if (lpt_ok)
+	lpt_source_add(box, phi_a, phi_a, LPT_SOURCE_SUBTRACT);
+    }
+    if (!lpt_ok){
+      gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+      if (!batched_velocities){ fftwf_free(phi_a); fftwf_free(phi_b); }
+      free_ps(); return -1;
+    }
+    if (!batched_velocities)
+      fftwf_free(phi_b);
+#pragma omp parallel shared(box) private(i, j, k)
     {
 #pragma omp for
-    for (n_x=0; n_x<DIM; n_x++){
-      if (n_x>MIDDLE)
-        k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
-      else
-        k_x = n_x * DELTA_K;
-
-      for (n_y=0; n_y<DIM; n_y++){
-        if (n_y>MIDDLE)
-	        k_y =(n_y-DIM) * DELTA_K;
-        else
-	        k_y = n_y * DELTA_K;
-
-        for (n_z=0; n_z<=MIDDLE; n_z++){ 
-	        k_z = n_z * DELTA_K;
-	
-	        k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
-
-	        // now set the velocities
-	        if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
-	          box[0] = 0;
-	        }
-	        else{
-	          box[C_INDEX(n_x,n_y,n_z)] *= k_z*I/k_sq;
-	        // note the last factor of 1/VOLUME accounts for the scaling in real-space, following the FFT
-	        }
-        }
-      }
-        fprintf(stderr, "%i ", n_x);
-    }
-    }
-      fprintf(stderr, "Filtering the high res box\n");
-    if (DIM != HII_DIM)
-      filter(box, 0, L_FACTOR*BOX_LEN/(HII_DIM+0.0));
-    fprintf(stderr, "Now doing the FFT to get real-space field\n");
-    plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
-    fftwf_execute(plan);
-    fprintf(stderr, "Sampling...\n");  
-    // now sample to lower res
-    // now sample the filtered box
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-        for (k=0; k<HII_DIM; k++){
-	        smoothed_box[HII_R_INDEX(i,j,k)] = 
-	          *((float *)box + R_FFT_INDEX((unsigned long long)(i*f_pixel_factor+0.5),
-				       (unsigned long long)(j*f_pixel_factor+0.5),
-				       (unsigned long long)(k*f_pixel_factor+0.5)));
-          //fprintf(stderr, "%.2e ", smoothed_box[HII_R_INDEX(i, j, k)]);
-        } 
+    for (i=0; i<DIM; i++){
+      for (j=0; j<DIM; j++){
+	for (k=0; k<DIM; k++){
+	  *((float *)box + R_FFT_INDEX(i,j,k)) /= TOT_NUM_PIXELS;
+	}
       }
     }
-    // write out file
-    fprintf(stderr, "Done\n\nNow write out files\n");
-    sprintf(filename, "../Boxes/vzoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    OUT=fopen(filename, "wb");
-    if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
-      fprintf(stderr, "init.c: Write error occured writting v_z box!\n");
     }
-    fclose(OUT);
 
-    // deallocate the supplementary boxes
-    for(i = 0; i < 3; ++i){
-      for(j = 0; j <= i; ++j){
-        fftwf_free(phi_1[PHI_INDEX(i,j)]);              
+    fprintf(stderr, "Done\nNow fft r2c\n");
+    plan = fftwf_plan_dft_r2c_3d(DIM, DIM, DIM, (float *)box, (fftwf_complex *)box, FFTW_ESTIMATE);
+    fftwf_execute(plan);
+    fftwf_destroy_plan(plan);
+    fprintf(stderr, "Done\n");
+
+    // For each component, we generate the velocity field (same as the ZA part)
+    // from the k-space source term, in one batch
+    if (batched_velocities && need[IC_VELOCITY_2LPT] && need[IC_VELOCITY_2LPT+1] && need[IC_VELOCITY_2LPT+2]){
+      fprintf(stderr, "Setting the velocity fields 2LPT...\n");
+      if (low_res_velocities(box, 1, IC_VELOCITY_2LPT) != 0){
+	gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+	free_ps(); return -1;
       }
+      queued[IC_VELOCITY_2LPT] = queued[IC_VELOCITY_2LPT+1] = queued[IC_VELOCITY_2LPT+2] = 1;
     }
+    // or one at a time, with the source term staying in box
+    for (m=0; m<3; m++){
+      if (!need[IC_VELOCITY_2LPT+m] || queued[IC_VELOCITY_2LPT+m])
+	continue;
+      fprintf(stderr, "Setting %c velocity field 2LPT...\n", 'x'+m);
+      memcpy(phi_a, box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+
+      // set velocities/dD/dt
+#pragma omp parallel shared(phi_a, m) private(n_x, k_x, n_y, k_y, n_z, k_z, k_sq)
+      {
+#pragma omp for
+      for (n_x=0; n_x<DIM; n_x++){
+	if (n_x>MIDDLE)
+	  k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
+	else
+	  k_x = n_x * DELTA_K;
+
+	for (n_y=0; n_y<DIM; n_y++){
+	  if (n_y>MIDDLE)
+	    k_y =(n_y-DIM) * DELTA_K;
+	  else
+	    k_y = n_y * DELTA_K;
+
+	  for (n_z=0; n_z<=MIDDLE; n_z++){
+	    k_z = n_z * DELTA_K;
+
+	    k_sq = k_x*k_x + k_y*k_y + k_z*k_z;
+	    float k[] = {k_x, k_y, k_z};
+
+	    // now set the velocities
+	    if ((n_x==0) && (n_y==0) && (n_z==0)){ // DC mode
+	      phi_a[0] = 0;
+	    }
+	    else{
+	      phi_a[C_INDEX(n_x,n_y,n_z)] *= k[m]*I/k_sq;
+	    }
+	  }
+	}
+      }
+      }
+      if (low_res_box(phi_a, smoothed_box) != 0){
+	gsl_rng_free_threaded (r, NUM_RNG_THREADS); free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
+	if (!batched_velocities) fftwf_free(phi_a);
+	free_ps(); return -1;
+      }
+      // write out file
+      fprintf(stderr, "Done\n\nNow write out files\n");
+      sprintf(filename, "../Boxes/v%coverddot_2LPT_%i_%.0fMpc", 'x'+m, HII_DIM, BOX_LEN);
+      OUT=fopen(filename, "wb");
+      if (mod_fwrite(smoothed_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, OUT)!=1){
+	fprintf(stderr, "init.c: Write error occured writting v_%c box!\n", 'x'+m);
+      }
+      else
+	ic_cache_mark(IC_VELOCITY_2LPT+m);
+      fclose(OUT);
+    }
+
+    // deallocate the supplementary box
+    if (!batched_velocities)
+      fftwf_free(phi_a);
   }
 /* *********************************************** *
  *               END 2LPT PART                     *
  * *********************************************** */             
 
 
+  // the batched velocity boxes are complete once written
+  status = 0;
+  for (p=0; p<IC_NUM_PRODUCTS; p++)
+    status |= queued[p];
+  if (status && async_write_flush()){
+    fprintf(stderr, "init.c: Write error occured writting the velocity boxes!\n");
+    status = -1;
+  }
+  else{
+    for (p=0; p<IC_NUM_PRODUCTS; p++)
+      if (queued[p]) ic_cache_mark(p);
+    status = 0;
+  }
+
   // deallocate
   gsl_rng_free_threaded (r, NUM_RNG_THREADS);
-  free(smoothed_box);  fftwf_free(box);  fclose(IN); fftwf_cleanup_threads();
+  free(smoothed_box);  fftwf_free(box);  free_deltak(); fftwf_cleanup_threads();
 
-  free_ps(); return 0;
+  free_ps(); return status;
 }
@@ -291,7 +291,7 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
 {
   unsigned long long i, ct;
     int x,y,z;
-    float v, delta, xi;
+    float v, delta, xi, *xH;
     FILE *delta_IN, *xH_IN, *v_IN;
     char filename[200], *token;
 
@@ -301,7 +301,7 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
       fprintf(LOG, "kSZ_power: ERROR: early termination in delta filelist\n.");
       return -1;
     }
-    if( !(delta_IN = fopen(filename, "rb"))){
+    if( !(delta_IN = box_fopen(filename, "rb"))){
 	fprintf(stderr, "Could not read in %s.\n", filename);
 	fprintf(LOG, "Could not read in %s.\n", filename);
 	return -1;
@@ -313,7 +313,7 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
       fprintf(LOG, "kSZ_power: ERROR: early termination in delta filelist\n.");
       return -1;
     }
-    if( !(xH_IN = fopen(filename, "rb"))){
+    if( !(xH_IN = box_fopen(filename, "rb"))){
 	fprintf(stderr, "Could not read in %s.\n", filename);
 	fprintf(LOG, "Could not read in %s.\n", filename);
 	fclose (delta_IN); return -1;
@@ -325,7 +325,7 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
       fprintf(LOG, "kSZ_power: ERROR: early termination in delta filelist\n.");
       return -1;
     }
-    if( !(v_IN = fopen(filename, "rb"))){
+    if( !(v_IN = box_fopen(filename, "rb"))){
 	fprintf(stderr, "Could not read in %s.\n", filename);
 	fprintf(LOG, "Could not read in %s.\n", filename);
 	fclose(delta_IN); fclose(xH_IN); return -1;
@@ -357,24 +357,33 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
       fprintf(LOG, "Starting redshift of new box: %f\n", REDSHIFT);
     }
 
-    // now load the arrays
-    for(i = 0; i < HII_TOT_NUM_PIXELS; i++){  
-      if (fread(&delta, sizeof(float), 1, delta_IN) != 1){
-	fprintf(stderr, "kSZ_power: ERROR: reading from delta box\n.");
-	fprintf(LOG, "kSZ_power: ERROR: reading from delta box\n.");
-	fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
-      }
-      if (fread(&v, sizeof(float), 1, v_IN)	 != 1){
-	fprintf(stderr, "kSZ_power: ERROR: reading from velocity box\n.");
-	fprintf(LOG, "kSZ_power: ERROR: reading from velocity box\n.");
-	fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
-      }
-
-      if (fread(&xi, sizeof(float), 1, xH_IN) != 1) {
-	fprintf(stderr, "kSZ_power: ERROR: reading from xH box\n.");
-	fprintf(LOG, "kSZ_power: ERROR: reading from xH box\n.");
-	fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
-      }
+    // now load the boxes whole, with mod_fread so that they can be in any box format; the density
+    // and velocity go straight into the output arrays, which are overwritten cell by cell below
+    if (!(xH = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
+      fprintf(stderr, "kSZ_power: ERROR allocating memory for xH box\n.");
+      fprintf(LOG, "kSZ_power: ERROR allocating memory for xH box\n.");
+      fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
+    }
+    if (mod_fread(dtau_3d, sizeof(float)*HII_TOT_NUM_PIXELS, 1, delta_IN) != 1){
+      fprintf(stderr, "kSZ_power: ERROR: reading from delta box\n.");
+      fprintf(LOG, "kSZ_power: ERROR: reading from delta box\n.");
+      free(xH); fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
+    }
+    if (mod_fread(Tcmb_3d, sizeof(float)*HII_TOT_NUM_PIXELS, 1, v_IN) != 1){
+      fprintf(stderr, "kSZ_power: ERROR: reading from velocity box\n.");
+      fprintf(LOG, "kSZ_power: ERROR: reading from velocity box\n.");
+      free(xH); fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
+    }
+    if (mod_fread(xH, sizeof(float)*HII_TOT_NUM_PIXELS, 1, xH_IN) != 1){
+      fprintf(stderr, "kSZ_power: ERROR: reading from xH box\n.");
+      fprintf(LOG, "kSZ_power: ERROR: reading from xH box\n.");
+      free(xH); fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
+    }
+
+    for(i = 0; i < HII_TOT_NUM_PIXELS; i++){
+      delta = dtau_3d[i];
+      v = Tcmb_3d[i];
+      xi = xH[i];
 	xi = 1.0-xi; // input is neutral fraction not ionized
 	v *= CMperMPC/C; //in units of C
 	//*****AM:  my velocity fields are in comoving units
@@ -405,7 +414,9 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
     }
 
 
+    free(xH);
     fclose(delta_IN); fclose(v_IN); fclose(xH_IN);
+    return 0;
 }
 
 
@@ -424,7 +435,7 @@ void printTField(float *Tcmb)
 	  fprintf(outfile, "%le\n", Tcmb[i*HII_DIM+j]);
 	}   
     */
-    fwrite(Tcmb, sizeof(float), HII_DIM*HII_DIM, outfile);
+    io_account_fwrite(Tcmb, sizeof(float), HII_DIM*HII_DIM, outfile, __FILE__, __LINE__);
     fprintf(stderr, "Just called fwrite to write file to %s\n", filename);
     fprintf(LOG, "Just called fwrite to write file to %s\n", filename);
     fclose(outfile);
@@ -0,0 +1,262 @@
+#ifndef _MEMORY_PLANNER_
+#define _MEMORY_PLANNER_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "../Parameter_files/HEAT_PARAMS.H"
+
+/*
+  Memory budget planner.
+
+  Before allocating anything, each of the main stages (init, perturb_field, Ts,
+  find_HII_bubbles and delta_T) calls PLAN_MEMORY to tabulate the large boxes it will
+  have resident at its peak, for the current DIM, HII_DIM and options in the parameter files.
+  If the total exceeds RAM (INIT_PARAMS.H), the lower-memory strategies implemented by that
+  stage are switched on one at a time, lowest flag first, until the plan fits.  The stage then
+  checks plan.strategies for the ones it should use.  If nothing fits, the plan is still
+  returned (with fits=0) and a warning printed, so the user knows which boxes to blame
+  before malloc fails.  The halo programs (find_halos and update_halo_pos) implement no
+  strategies; their stages are tabulated so that the driver's scheduler (stage_scheduler.c)
+  knows how much memory they hold.
+
+  Strategies listed in FORCE_MEMORY_STRATEGIES (INIT_PARAMS.H) are used regardless of RAM;
+  those that lose precision (MEM_LOSSY_STRATEGIES) are used only then.
+*/
+
+
+/*** Lower-memory strategies (bit flags) ***/
+#define MEM_QUANTISED_STACK (int) (1) // Ts.c: hold the NUM_FILTER_STEPS_FOR_Ts smoothed density boxes as 16-bit integers
+#define MEM_SEQUENTIAL_VELOCITIES (int) (2) // init.c: set and transform the velocity components one at a time, not in one batch
+#define MEM_DELTAK_REREAD (int) (4) // init.c: keep no resident k-space density copy, re-read it from ../Boxes instead
+#define MEM_DELTAK_BF16 (int) (8) // init.c: hold the resident k-space density copy with 16-bit (bfloat16) components
+#define MEM_OUT_OF_CORE_FFT (int) (16) // init.c: keep only slabs of the DIM boxes resident, transforming them through files (ooc_fft.c)
+#define MEM_NUM_STRATEGIES (int) (5)
+// strategies that lose precision, used only when listed in FORCE_MEMORY_STRATEGIES
+#define MEM_LOSSY_STRATEGIES (int) (MEM_DELTAK_BF16)
+
+/*** Stages ***/
+#define MEM_STAGE_INIT (int) (0)
+#define MEM_STAGE_PERTURB_FIELD (int) (1)
+#define MEM_STAGE_TS (int) (2)
+#define MEM_STAGE_FIND_HII_BUBBLES (int) (3)
+#define MEM_STAGE_DELTA_T (int) (4)
+#define MEM_STAGE_FIND_HALOS (int) (5)
+#define MEM_STAGE_UPDATE_HALO_POS (int) (6)
+#define MEM_NUM_STAGES (int) (7)
+
+#define MEM_MAX_ITEMS (int) (12)
+#define BYTES_PER_GB (double) (1024.0*1024.0*1024.0)
+
+static const char *MEM_STAGE_NAMES[] = {"init", "perturb_field", "Ts", "find_HII_bubbles", "delta_T", "find_halos", "update_halo_pos"};
+static const char *MEM_STRATEGY_NAMES[] = {"16-bit quantised smoothed density stack",
+					   "velocity components set and transformed one at a time",
+					   "k-space density re-read from disk",
+					   "bfloat16 resident k-space density copy",
+					   "out-of-core slab FFTs through OOC_SCRATCH_DIR"};
+// strategies implemented by each stage
+// (init draws the modes out of order out of core, so only with the counter-based generator)
+static const int MEM_STAGE_STRATEGIES[] = {MEM_SEQUENTIAL_VELOCITIES | MEM_DELTAK_REREAD | MEM_DELTAK_BF16 | (COUNTER_RNG ? MEM_OUT_OF_CORE_FFT : 0),
+					   0, MEM_QUANTISED_STACK, 0, 0, 0, 0};
+
+typedef struct {
+  int stage, strategies, fits, n_items;
+  double budget, total; // in bytes
+  const char *item_name[MEM_MAX_ITEMS];
+  double item_bytes[MEM_MAX_ITEMS];
+} memory_plan;
+
+
+void add_memory_item(memory_plan *plan, const char *name, double num_boxes, double bytes_per_box){
+  if (plan->n_items >= MEM_MAX_ITEMS){
+    fprintf(stderr, "memory_planner: WARNING: too many items for stage %s, ignoring %s\n",
+	    MEM_STAGE_NAMES[plan->stage], name);
+    return;
+  }
+  plan->item_name[plan->n_items] = name;
+  plan->item_bytes[plan->n_items] = num_boxes * bytes_per_box;
+  plan->total += plan->item_bytes[plan->n_items];
+  plan->n_items++;
+}
+
+
+/*
+  Function MEMORY_FOOTPRINT fills in the boxes resident at the peak of plan->stage,
+  given the strategies in plan->strategies.  Only arrays that scale with DIM^3 or HII_DIM^3
+  are counted; the interpolation tables are negligible in comparison.
+*/
+void memory_footprint(memory_plan *plan){
+  double K = sizeof(fftwf_complex)*(double)KSPACE_NUM_PIXELS;
+  double HII_K = sizeof(fftwf_complex)*(double)HII_KSPACE_NUM_PIXELS;
+  double R_FFT = sizeof(float)*(double)TOT_FFT_NUM_PIXELS;
+  double HII_R = sizeof(float)*(double)HII_TOT_NUM_PIXELS;
+  double HII_R_FFT = sizeof(float)*(double)HII_TOT_FFT_NUM_PIXELS;
+
+  plan->n_items = 0;
+  plan->total = 0;
+
+  switch (plan->stage){
+  case MEM_STAGE_INIT:
+    if (plan->strategies & MEM_OUT_OF_CORE_FFT){
+      add_memory_item(plan, "smoothed density box (HII_DIM)", 1, HII_R);
+      add_memory_item(plan, "out-of-core FFT pencil buffer (DIM)", 1, (K < 0.5*plan->budget) ? K : 0.5*plan->budget);
+      add_memory_item(plan, "out-of-core FFT slabs (DIM^2)", 3, K/DIM);
+      if (KSPACE_DOWNSAMPLE)
+	add_memory_item(plan, "k-space downsampling box (HII_DIM)", 1, HII_K);
+      break;
+    }
+    add_memory_item(plan, "k-space density box (DIM)", 1, K);
+    add_memory_item(plan, "smoothed density box (HII_DIM)", 1, HII_R);
+    if (!(plan->strategies & MEM_DELTAK_REREAD)){
+      if (plan->strategies & MEM_DELTAK_BF16)
+	add_memory_item(plan, "resident k-space density copy (DIM, bfloat16)", 0.5, K);
+      else
+	add_memory_item(plan, "resident k-space density copy (DIM)", 1, K);
+    }
+    // the batched velocity components share the k-space density box, followed by the two
+    // 2LPT phi_1 boxes, so they cost nothing more with 2LPT
+    if (!(plan->strategies & MEM_SEQUENTIAL_VELOCITIES))
+      add_memory_item(plan, "batched velocity component (and 2LPT phi_1) boxes (DIM)", 2, K);
+    else if (SECOND_ORDER_LPT_CORRECTIONS)
+      add_memory_item(plan, "2LPT phi_1 second derivative boxes (DIM)", 2, K);
+    if (KSPACE_DOWNSAMPLE)
+      add_memory_item(plan, "k-space downsampling boxes (HII_DIM)", (plan->strategies & MEM_SEQUENTIAL_VELOCITIES) ? 1 : 3, HII_K);
+    break;
+
+  case MEM_STAGE_PERTURB_FIELD:
+    add_memory_item(plan, "updated density box (HII_DIM, k-space)", 1, HII_K);
+    add_memory_item(plan, "x velocity box (HII_DIM)", 1, HII_R_FFT);
+    if (!EVOLVE_DENSITY_LINEARLY){
+      add_memory_item(plan, "y and z velocity boxes (HII_DIM)", 2, HII_R);
+      add_memory_item(plan, "linear density box (DIM)", 1, R_FFT);
+      if (SECOND_ORDER_LPT_CORRECTIONS)
+	add_memory_item(plan, "2LPT velocity boxes (HII_DIM)", 3, HII_R);
+    }
+    add_memory_item(plan, "write-behind output buffers (HII_DIM)", ASYNC_WRITE_BUFFERS, HII_R);
+    break;
+
+  case MEM_STAGE_TS:
+    add_memory_item(plan, "unfiltered and filtered density boxes (HII_DIM, k-space)", 2, HII_K);
+    if (plan->strategies & MEM_QUANTISED_STACK)
+      add_memory_item(plan, "smoothed density stack (HII_DIM, 16-bit)", NUM_FILTER_STEPS_FOR_Ts, sizeof(unsigned short)*(double)HII_TOT_NUM_PIXELS);
+    else
+      add_memory_item(plan, "smoothed density stack (HII_DIM)", NUM_FILTER_STEPS_FOR_Ts, HII_R);
+    add_memory_item(plan, "write-behind output buffers (HII_DIM)", ASYNC_WRITE_BUFFERS, HII_R);
+    break;
+
+  case MEM_STAGE_FIND_HII_BUBBLES:
+    add_memory_item(plan, "collapsed fraction box (HII_DIM)", 1, HII_R_FFT);
+    add_memory_item(plan, "neutral fraction box (HII_DIM)", 1, HII_R);
+    add_memory_item(plan, "unfiltered and filtered density boxes (HII_DIM, k-space)", 2, HII_K);
+    if (USE_TS_IN_21CM)
+      add_memory_item(plan, "unfiltered and filtered x_e boxes (HII_DIM, k-space)", 2, HII_K);
+    if (USE_HALO_FIELD)
+      add_memory_item(plan, "unfiltered and filtered halo mass boxes (HII_DIM, k-space)", 2, HII_K);
+    if (INHOMO_RECO){
+      add_memory_item(plan, "z_re and Gamma12 boxes (HII_DIM)", 2, HII_R);
+      add_memory_item(plan, "unfiltered and filtered recombination boxes (HII_DIM, k-space)", 2, HII_K);
+    }
+    add_memory_item(plan, "write-behind output buffers (HII_DIM)", ASYNC_WRITE_BUFFERS, HII_R);
+    break;
+
+  case MEM_STAGE_DELTA_T:
+    add_memory_item(plan, "neutral fraction and delta_T boxes (HII_DIM)", 2, HII_R);
+    add_memory_item(plan, "density and velocity boxes (HII_DIM)", 2, HII_R_FFT);
+    if (USE_TS_IN_21CM)
+      add_memory_item(plan, "spin temperature box (HII_DIM)", 1, HII_R);
+    add_memory_item(plan, "power spectrum box (HII_DIM, k-space)", 1, HII_K);
+    add_memory_item(plan, "write-behind output buffers (HII_DIM)", ASYNC_WRITE_BUFFERS, HII_R);
+    break;
+
+  case MEM_STAGE_FIND_HALOS:
+    add_memory_item(plan, "filtered k-space density box (DIM)", 1, K);
+    add_memory_item(plan, "in_halo (and forbidden) bitsets (DIM)", OPTIMIZE ? 2 : 1, (double)BITSET_WORDS(TOT_NUM_PIXELS)*sizeof(bitset_word));
+    break;
+
+  case MEM_STAGE_UPDATE_HALO_POS:
+    add_memory_item(plan, "velocity boxes (HII_DIM)", SECOND_ORDER_LPT_CORRECTIONS ? 6 : 3, HII_R);
+    break;
+  }
+}
+
+
+/*
+  Function PLAN_MEMORY returns the memory plan for <stage>, with the lower-memory
+  strategies needed to fit within RAM switched on.
+*/
+memory_plan plan_memory(int stage){
+  memory_plan plan;
+  int flag;
+
+  plan.stage = stage;
+  plan.budget = RAM * BYTES_PER_GB;
+  plan.strategies = FORCE_MEMORY_STRATEGIES & MEM_STAGE_STRATEGIES[stage];
+  memory_footprint(&plan);
+
+  for (flag=1; (flag <= MEM_STAGE_STRATEGIES[stage]) && (plan.total > plan.budget); flag <<= 1){
+    if ((MEM_STAGE_STRATEGIES[stage] & flag) && !(MEM_LOSSY_STRATEGIES & flag) && !(plan.strategies & flag)){
+      plan.strategies |= flag;
+      memory_footprint(&plan);
+    }
+  }
+
+  plan.fits = (plan.total <= plan.budget);
+  return plan;
+}
+
+
+void print_memory_plan(FILE *F, memory_plan *plan){
+  int i;
+
+  if (!F)
+    return;
+
+  fprintf(F, "Memory plan for %s (RAM budget %.2f GB):\n", MEM_STAGE_NAMES[plan->stage], RAM);
+  for (i=0; i<plan->n_items; i++)
+    fprintf(F, "  %9.3f GB  %s\n", plan->item_bytes[i]/BYTES_PER_GB, plan->item_name[i]);
+  fprintf(F, "  %9.3f GB  total\n", plan->total/BYTES_PER_GB);
+  for (i=0; i<MEM_NUM_STRATEGIES; i++){
+    if (plan->strategies & (1<<i))
+      fprintf(F, "  using: %s\n", MEM_STRATEGY_NAMES[i]);
+  }
+  if (!plan->fits)
+    fprintf(F, "  WARNING: %s needs more than RAM=%.2f GB and has no further lower-memory strategy; allocation may fail\n",
+	    MEM_STAGE_NAMES[plan->stage], RAM);
+  fflush(F);
+}
+
+
+/*
+  Function QUANTISE_HII_BOX stores the HII_DIM^3 real-space box <box> (padded FFT layout)
+  into <q> as 16-bit integers spanning the range of the box.
+  Cell ct is recovered as *offset + *scale * q[ct], to within half a step, (max-min)/131070.
+*/
+void quantise_HII_box(float *box, unsigned short *q, float *offset, float *scale){
+  int i, j, k;
+  float val, min, max;
+
+  min = max = box[HII_R_FFT_INDEX(0,0,0)];
+  for (i=0; i<HII_DIM; i++){
+    for (j=0; j<HII_DIM; j++){
+      for (k=0; k<HII_DIM; k++){
+	val = box[HII_R_FFT_INDEX(i,j,k)];
+	if (val < min) min = val;
+	if (val > max) max = val;
+      }
+    }
+  }
+
+  *offset = min;
+  *scale = (max - min) / 65535.0;
+  for (i=0; i<HII_DIM; i++){
+    for (j=0; j<HII_DIM; j++){
+      for (k=0; k<HII_DIM; k++){
+	if (*scale > 0)
+	  q[HII_R_INDEX(i,j,k)] = (unsigned short) ((box[HII_R_FFT_INDEX(i,j,k)] - min) / (*scale) + 0.5);
+	else
+	  q[HII_R_INDEX(i,j,k)] = 0;
+      }
+    }
+  }
+}
+
+#endif
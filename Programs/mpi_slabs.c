@@ -0,0 +1,117 @@
+#ifndef _MPI_SLABS_
+#define _MPI_SLABS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include <sys/stat.h>
+#include <mpi.h>
+#include <fftw3-mpi.h>
+
+/*
+  Slab decomposition of the DIM^3 boxes for the MPI builds of init and perturb_field
+  (make init_mpi perturb_field_mpi, which set USE_MPI; run them with e.g. mpirun -np 4).
+
+  Each rank holds the x-slabs [mpi_x0, mpi_x0 + mpi_nx) of a box, as laid out by FFTW's MPI
+  interface (fftwf_mpi_local_size_3d): the local part of a k-space box is mpi_nx slabs of
+  DIM*(MIDDLE+1) modes, and that of a real-space box the same slabs in the padded FFT layout,
+  so a rank's part of a box file is a contiguous range of it.  Rank 0 alone does the HII_DIM
+  work and writes the HII_DIM boxes.
+*/
+
+int mpi_rank = 0, mpi_size = 1;
+ptrdiff_t mpi_nx, mpi_x0, mpi_alloc_complex; // local slabs, and the complex values to allocate for them
+
+#define MPI_SLAB_BYTES ((unsigned long long)(sizeof(fftwf_complex)*D*(MID+1llu))) // bytes per x-slab
+
+
+static void mpi_slabs_exit(void){
+  int finalized;
+
+  MPI_Finalized(&finalized);
+  if (!finalized){
+    fftwf_mpi_cleanup();
+    MPI_Finalize();
+  }
+}
+
+/*
+  Function MPI_SLABS_INIT starts MPI and FFTW's MPI interface, and sets this rank's slabs.
+  MPI is finalized at exit.  Returns 0 on success, -1 on failure.
+*/
+int mpi_slabs_init(int *argc, char ***argv){
+  int provided;
+
+  if (MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided) != MPI_SUCCESS){
+    fprintf(stderr, "mpi_slabs: ERROR: unable to initialize MPI\n");
+    return -1;
+  }
+  atexit(mpi_slabs_exit);
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  if ((provided < MPI_THREAD_FUNNELED) || (fftwf_init_threads() == 0)){
+    fprintf(stderr, "mpi_slabs: ERROR: the MPI library does not support threads\n");
+    return -1;
+  }
+  fftwf_mpi_init();
+  mpi_alloc_complex = fftwf_mpi_local_size_3d(DIM, DIM, MIDDLE+1, MPI_COMM_WORLD, &mpi_nx, &mpi_x0);
+  if (!mpi_rank)
+    fprintf(stderr, "Running on %i MPI ranks of %i threads\n", mpi_size, NUMCORES);
+  return 0;
+}
+
+/* returns -1 on every rank if <status> is non-zero on any */
+int mpi_all_ok(int status){
+  int any;
+
+  MPI_Allreduce(&status, &any, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+  return any ? -1 : 0;
+}
+
+/*
+  Function MPI_SLAB_IO writes (write=1) or reads (write=0) this rank's slabs, <box>, of the
+  uncompressed DIM^3 box file <filename> (k-space or padded real-space).  Collective.
+  Returns 0 on success, -1 on failure (on every rank).
+*/
+int mpi_slab_io(const char *filename, void *box, int write){
+  struct stat st;
+  int fd, status = 0;
+
+  if (write){
+    // rank 0 sizes the file, then every rank writes its part
+    if (!mpi_rank){
+      if (((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) ||
+	  (ftruncate(fd, (off_t)(D*MPI_SLAB_BYTES)) != 0))
+	status = -1;
+      if (fd >= 0) close(fd);
+    }
+    if (mpi_all_ok(status) != 0){
+      if (!mpi_rank) fprintf(stderr, "mpi_slabs: Error openning %s to write to\n", filename);
+      return -1;
+    }
+  }
+
+  if ((fd = open(filename, write ? O_WRONLY : O_RDONLY)) < 0)
+    status = -1;
+  else if (!write && ((fstat(fd, &st) != 0) || (st.st_size != (off_t)(D*MPI_SLAB_BYTES))))
+    status = -2; // compressed, or not a DIM^3 box
+  else if (parallel_io_all(fd, (unsigned char *)box, mpi_nx*MPI_SLAB_BYTES, (off_t)(mpi_x0*MPI_SLAB_BYTES), write) != 0)
+    status = -1;
+  if (fd >= 0) close(fd);
+
+  if (status == -2)
+    fprintf(stderr, "mpi_slabs: ERROR: %s is not an uncompressed DIM=%i box\n", filename, DIM);
+  else if (status)
+    fprintf(stderr, "mpi_slabs: %s error on %s\n", write ? "Write" : "Read", filename);
+  return mpi_all_ok(status);
+}
+
+/* sums the <n> floats of <box> on every rank into rank 0's */
+void mpi_sum_to_root(float *box, unsigned long long n){
+  unsigned long long ct, chunk;
+
+  for (ct=0; ct<n; ct+=chunk){ // in chunks, as MPI counts are ints
+    chunk = (n - ct < (1llu<<30)) ? n - ct : (1llu<<30);
+    MPI_Reduce(mpi_rank ? box + ct : MPI_IN_PLACE, box + ct, (int)chunk, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+  }
+}
+
+#endif
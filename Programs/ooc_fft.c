@@ -0,0 +1,191 @@
+#ifndef _OOC_FFT_
+#define _OOC_FFT_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+
+/*
+  Out-of-core 3D FFTs of DIM^3 boxes held in files, for initial conditions larger than RAM.
+
+  A k-space box is stored as in memory (C_INDEX order: x-slabs of DIM*(MIDDLE+1) modes), and
+  a real-space box in the padded FFT layout (R_FFT_INDEX order), so both take the same space and
+  an x-slab is a contiguous DIM*(MIDDLE+1) complex (DIM*2*(MIDDLE+1) float) record.
+
+  The 3D transform is split into a 2D transform over (y,z) of each x-slab, which only needs
+  the slab, and 1D transforms along x, which need every slab.  For those, the file is read in
+  "pencils": blocks of OOC_PENCIL_ROWS y-rows across all the x-slabs (DIM strided reads), which
+  is the transpose, done through the file rather than in memory.  A pencil is transformed
+  in place along x and written back.
+
+  OOC_C2R transforms a k-space file to real space: pencils first (with a callback to set the
+  modes, e.g. to multiply the density by a velocity kernel, as they are read), then the slabs,
+  handed one at a time, in order, to a consumer callback.  OOC_R2C does the reverse, from slabs
+  produced by a callback.  Like the in-memory FFTW transforms, both are unnormalised.
+*/
+
+#define OOC_SLAB_COMPLEX ((unsigned long long)(D*(MID+1llu))) // modes per x-slab
+#define OOC_SLAB_BYTES (sizeof(fftwf_complex)*OOC_SLAB_COMPLEX)
+#define OOC_ROW_BYTES (sizeof(fftwf_complex)*(MID+1llu)) // one y-row of an x-slab
+
+/* sets the modes of y-row n_y of x-slab n_x, <row> (MIDDLE+1 values), as they are read */
+typedef void (*ooc_row_function)(fftwf_complex *row, int n_x, int n_y, void *arg);
+/* consumes (OOC_C2R) or produces (OOC_R2C) the real-space x-slab x, padded */
+typedef int (*ooc_slab_function)(float *slab, int x, void *arg);
+
+static int ooc_pencil_rows = 0;
+
+
+/* the number of y-rows in a pencil, from the memory left for it by the memory plan */
+int ooc_set_pencil_rows(double bytes){
+  ooc_pencil_rows = bytes / ((double)DIM*OOC_ROW_BYTES);
+  if (ooc_pencil_rows < 1)
+    ooc_pencil_rows = 1;
+  if (ooc_pencil_rows > DIM)
+    ooc_pencil_rows = DIM;
+  return ooc_pencil_rows;
+}
+
+
+/* reads (write=0) or writes (write=1) the rows [y0, y0+rows) of every x-slab of fd to or from pencil */
+static int ooc_pencil_io(int fd, fftwf_complex *pencil, int y0, int rows, int write){
+  unsigned long long x;
+
+  for (x=0; x<D; x++){
+    if (parallel_io_all(fd, (unsigned char *)(pencil + x*rows*(MID+1llu)), rows*OOC_ROW_BYTES,
+			(off_t)(x*OOC_SLAB_BYTES + y0*OOC_ROW_BYTES), write) != 0){
+      fprintf(stderr, "ooc_fft: ERROR: %s error on a scratch file\n", write ? "write" : "read");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* transforms every pencil of fd along x in <direction>, setting the modes of in_fd with <set_row> first */
+static int ooc_pencils(int in_fd, int out_fd, int direction, ooc_row_function set_row, void *arg){
+  fftwf_complex *pencil;
+  fftwf_plan plan;
+  int y0, rows, x, y, n, stride;
+
+  if (!ooc_pencil_rows)
+    ooc_set_pencil_rows(0.5*RAM*BYTES_PER_GB);
+  if (!(pencil = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*D*ooc_pencil_rows*(MID+1llu)))){
+    fprintf(stderr, "ooc_fft: ERROR: unable to allocate a pencil of %i rows\n", ooc_pencil_rows);
+    return -1;
+  }
+
+  for (y0=0; y0<DIM; y0+=ooc_pencil_rows){
+    rows = (DIM - y0 < ooc_pencil_rows) ? DIM - y0 : ooc_pencil_rows;
+    if (ooc_pencil_io(in_fd, pencil, y0, rows, 0) != 0){
+      fftwf_free(pencil);
+      return -1;
+    }
+    if (set_row){
+#pragma omp parallel for private(y)
+      for (x=0; x<DIM; x++){
+	for (y=0; y<rows; y++)
+	  set_row(pencil + ((unsigned long long)x*rows + y)*(MID+1llu), x, y0+y, arg);
+      }
+    }
+    // the x columns of the pencil are rows*(MIDDLE+1) apart
+    n = DIM;
+    stride = rows*(MIDDLE+1);
+    plan = fftwf_plan_many_dft(1, &n, stride, pencil, NULL, stride, 1, pencil, NULL, stride, 1, direction, FFTW_ESTIMATE);
+    fftwf_execute(plan);
+    fftwf_destroy_plan(plan);
+    if (ooc_pencil_io(out_fd, pencil, y0, rows, 1) != 0){
+      fftwf_free(pencil);
+      return -1;
+    }
+  }
+
+  fftwf_free(pencil);
+  return 0;
+}
+
+
+/*
+  Function OOC_C2R transforms the k-space box in the file k_fd to real space, slab by slab,
+  through the scratch file scratch_fd (of the same size), with the modes set by <set_row> (if not
+  NULL) as they are read.  Each real-space x-slab is passed to <consume> in turn; k_fd is not
+  changed, unless it is scratch_fd.  Returns 0 on success, -1 on failure.
+*/
+int ooc_c2r(int k_fd, int scratch_fd, ooc_row_function set_row, void *row_arg, ooc_slab_function consume, void *slab_arg){
+  fftwf_complex *slab;
+  fftwf_plan plan;
+  int x;
+
+  if (ooc_pencils(k_fd, scratch_fd, FFTW_BACKWARD, set_row, row_arg) != 0)
+    return -1;
+
+  if (!(slab = (fftwf_complex *) fftwf_malloc(OOC_SLAB_BYTES))){
+    fprintf(stderr, "ooc_fft: ERROR: unable to allocate a slab\n");
+    return -1;
+  }
+  plan = fftwf_plan_dft_c2r_2d(DIM, DIM, slab, (float *)slab, FFTW_ESTIMATE);
+  for (x=0; x<DIM; x++){
+    if (parallel_io_all(scratch_fd, (unsigned char *)slab, OOC_SLAB_BYTES, (off_t)(x*OOC_SLAB_BYTES), 0) != 0){
+      fprintf(stderr, "ooc_fft: ERROR: read error on a scratch file\n");
+      break;
+    }
+    fftwf_execute(plan);
+    if (consume((float *)slab, x, slab_arg) != 0)
+      break;
+  }
+  fftwf_destroy_plan(plan);
+  fftwf_free(slab);
+  return (x == DIM) ? 0 : -1;
+}
+
+
+/*
+  Function OOC_R2C transforms the real-space box whose x-slabs are set in turn by <produce> to
+  k-space, into the file fd.  Returns 0 on success, -1 on failure.
+*/
+int ooc_r2c(int fd, ooc_slab_function produce, void *slab_arg){
+  fftwf_complex *slab;
+  fftwf_plan plan;
+  int x;
+
+  if (!(slab = (fftwf_complex *) fftwf_malloc(OOC_SLAB_BYTES))){
+    fprintf(stderr, "ooc_fft: ERROR: unable to allocate a slab\n");
+    return -1;
+  }
+  plan = fftwf_plan_dft_r2c_2d(DIM, DIM, (float *)slab, slab, FFTW_ESTIMATE);
+  for (x=0; x<DIM; x++){
+    if (produce((float *)slab, x, slab_arg) != 0)
+      break;
+    fftwf_execute(plan);
+    if (parallel_io_all(fd, (unsigned char *)slab, OOC_SLAB_BYTES, (off_t)(x*OOC_SLAB_BYTES), 1) != 0){
+      fprintf(stderr, "ooc_fft: ERROR: write error on a scratch file\n");
+      break;
+    }
+  }
+  fftwf_destroy_plan(plan);
+  fftwf_free(slab);
+  if (x < DIM)
+    return -1;
+
+  return ooc_pencils(fd, fd, FFTW_FORWARD, NULL, NULL);
+}
+
+
+/* opens a new scratch file of a DIM^3 box named <name> in OOC_SCRATCH_DIR; returns its fd or -1 */
+int ooc_scratch_open(const char *name){
+  char filename[1000];
+  int fd;
+
+  sprintf(filename, "%s/ooc_%s_%i_%i", OOC_SCRATCH_DIR, name, DIM, (int)getpid());
+  if ((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+    fprintf(stderr, "ooc_fft: ERROR: unable to create the scratch file %s\n", filename);
+    return -1;
+  }
+  unlink(filename); // removed once closed
+  if (ftruncate(fd, (off_t)(D*OOC_SLAB_BYTES)) != 0){
+    fprintf(stderr, "ooc_fft: ERROR: unable to extend the scratch file %s\n", filename);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#endif
@@ -1,9 +1,13 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "bubble_helper_progs.c"
+#include "memory_planner.c"
+#if USE_MPI
+#include "mpi_slabs.c"
+#endif
 
 /*
-  USAGE: perturb_field <REDSHIFT>
+  USAGE: perturb_field [-p <NUM THREADS>] <REDSHIFT>
 
   PROGRAM PERTURB_FIELD uses the first-order Langragian displacement field
   to move the masses in the cells of the density field.
@@ -25,8 +29,14 @@
 */
 
 
-int print_box_no_padding(float *box, int d, FILE *F){
+/*
+  Function PRINT_BOX_NO_PADDING copies the padded box into a write-behind buffer (misc.c)
+  without the FFT padding, and queues it for <filename>.  The write itself happens in the
+  background; errors are reported by async_write_flush() at the end of main.
+*/
+int print_box_no_padding(float *box, int d, const char *filename){
   int i,j,k;
+  float *buffer;
   /*
   printf("%e ", *((float *)box+HII_R_FFT_INDEX(0,0,0)));
   printf("%e ", *((float *)box+HII_R_FFT_INDEX(0,10,0)));
@@ -34,21 +44,211 @@ int print_box_no_padding(float *box, int d, FILE *F){
   printf("%e ", *((float *)box+HII_R_FFT_INDEX(10,0,0)));
   printf("%e\n", *((float *)box+HII_R_FFT_INDEX(HII_DIM-1,HII_DIM-1,HII_DIM-1)));
   */
+  if (!(buffer = (float *) async_write_buffer(filename, sizeof(float)*(unsigned long long)d*d*d)))
+    return -1;
   for(i=0; i<d; i++){
     for(j=0; j<d; j++){
       for(k=0; k<d; k++){
-	if (fwrite(box + HII_R_FFT_INDEX(i, j, k), sizeof(float), 1, F)!=1)
-	  return -1;
+	buffer[k + d*(j + d*(unsigned long long)i)] = box[HII_R_FFT_INDEX(i, j, k)];
       }
     }
   }
-  return 0;
+  return async_write_submit();
 }
 
 
+/*
+  The Zel'dovich (and 2LPT) displacements of the grid "particles" of the DIM box, in units of
+  the box size, tabulated on the HII_DIM grid (the 2LPT ones only with SECOND_ORDER_LPT_CORRECTIONS).
+*/
+typedef struct {
+  float *vx, *vy, *vz, *vx_2LPT, *vy_2LPT, *vz_2LPT;
+  float f_pixel_factor; // HII pixel size / deltax pixel size
+} displacement_field;
+
+/* sets (xi, yi, zi) to the HII_DIM cell the mass of the DIM cell (i, j, k) moves to */
+static inline void displaced_cell(displacement_field *disp, int i, int j, int k, int *xi, int *yi, int *zi){
+  unsigned long long HII_i, HII_j, HII_k;
+  float xf, yf, zf;
+
+  // map indeces to locations in units of box size
+  xf = (i+0.5)/(DIM+0.0);
+  yf = (j+0.5)/(DIM+0.0);
+  zf = (k+0.5)/(DIM+0.0);
+
+  // update locations
+  HII_i = (unsigned long long)(i/disp->f_pixel_factor);
+  HII_j = (unsigned long long)(j/disp->f_pixel_factor);
+  HII_k = (unsigned long long)(k/disp->f_pixel_factor);
+  xf += disp->vx[HII_R_INDEX(HII_i, HII_j, HII_k)];
+  yf += disp->vy[HII_R_INDEX(HII_i, HII_j, HII_k)];
+  zf += disp->vz[HII_R_INDEX(HII_i, HII_j, HII_k)];
+
+  // 2LPT PART
+  // add second order corrections
+  if(SECOND_ORDER_LPT_CORRECTIONS){
+    xf -= disp->vx_2LPT[HII_R_INDEX(HII_i,HII_j,HII_k)];
+    yf -= disp->vy_2LPT[HII_R_INDEX(HII_i,HII_j,HII_k)];
+    zf -= disp->vz_2LPT[HII_R_INDEX(HII_i,HII_j,HII_k)];
+  }
+
+  xf *= HII_DIM;
+  yf *= HII_DIM;
+  zf *= HII_DIM;
+  while (xf >= (float)HII_DIM){ xf -= HII_DIM;}
+  while (xf < 0){ xf += HII_DIM;}
+  while (yf >= (float)HII_DIM){ yf -= HII_DIM;}
+  while (yf < 0){ yf += HII_DIM;}
+  while (zf >= (float)HII_DIM){ zf -= HII_DIM;}
+  while (zf < 0){ zf += HII_DIM;}
+  *xi = xf;
+  *yi = yf;
+  *zi = zf;
+  if (*xi >= HII_DIM){ *xi -= HII_DIM;}
+  if (*xi < 0) {*xi += HII_DIM;}
+  if (*yi >= HII_DIM){ *yi -= HII_DIM;}
+  if (*yi < 0) {*yi += HII_DIM;}
+  if (*zi >= HII_DIM){ *zi -= HII_DIM;}
+  if (*zi < 0) {*zi += HII_DIM;}
+}
+
+
+#if USE_MPI
+/*
+  Function MPI_MOVE_MASS is the mass-moving loop of main for the MPI build (make
+  perturb_field_mpi): each rank moves the particles of its x-slabs of the DIM box, <deltax>
+  (see mpi_slabs.c), onto the HII_DIM x-planes it owns, [HII_DIM*rank/size, HII_DIM*(rank+1)/size).
+  The masses moving onto another rank's planes (mostly its neighbours', as the displacements are
+  small) are exchanged with MPI_Alltoallv, in rounds of at most MPI_MOVE_BATCH deposits over all
+  ranks, so that MPI's int counts and displacements cannot overflow however many cross.  Rank 0
+  then gathers the planes into <updated>, counted in whole planes for the same reason.
+  Collective.  Returns 0 on success, -1 on failure.
+*/
+typedef struct {
+  unsigned long long cell; // HII_R_INDEX of the destination
+  float mass;
+} mass_deposit;
+
+#define HII_PLANE_OWNER(xi) ((int)((((xi)+1llu)*mpi_size - 1)/HII_DIM))
+#define HII_FIRST_PLANE(rank) ((int)((rank)*(unsigned long long)HII_DIM/mpi_size))
+#ifndef MPI_MOVE_BATCH
+#define MPI_MOVE_BATCH (unsigned long long) (1<<22) // mass deposits exchanged per round
+#endif
+
+int mpi_move_mass(displacement_field *disp, float *deltax, float init_growth_factor, float *updated){
+  MPI_Datatype deposit_type, plane_type;
+  mass_deposit *send = NULL, *send_batch = NULL, *recv_batch = NULL;
+  float *planes, *all;
+  unsigned long long *send_count, *send_offset, *recv_count, *fill, n_send, chunk, first, n_rounds, round, ct;
+  int *batch_send, *batch_recv, *batch_offset;
+  int i, j, k, xi, yi, zi, r, h0, status;
+
+  h0 = HII_FIRST_PLANE(mpi_rank);
+  chunk = (MPI_MOVE_BATCH > (unsigned long long)mpi_size) ? MPI_MOVE_BATCH/mpi_size : 1; // per rank and round
+  planes = (float *) calloc((HII_FIRST_PLANE(mpi_rank+1) - h0)*(unsigned long long)HII_DIM*HII_DIM + 1, sizeof(float));
+  send_count = (unsigned long long *) calloc(4*mpi_size, sizeof(unsigned long long)); // the four per-rank arrays below
+  batch_send = (int *) calloc(3*mpi_size, sizeof(int)); // and the three of each round
+  if (mpi_all_ok(!planes || !send_count || !batch_send) != 0){
+    fprintf(stderr, "perturb_field: Error allocating memory for the mass exchange on rank %i\n", mpi_rank);
+    if (planes) free(planes);
+    if (send_count) free(send_count);
+    if (batch_send) free(batch_send);
+    return -1;
+  }
+  send_offset = send_count + mpi_size; recv_count = send_offset + mpi_size; fill = recv_count + mpi_size;
+  batch_recv = batch_send + mpi_size; batch_offset = batch_recv + mpi_size;
+
+  // move the mass landing on this rank's planes, and count the rest by destination
+  for (i=mpi_x0; i<mpi_x0+mpi_nx; i++){
+    for (j=0; j<DIM; j++){
+      for (k=0; k<DIM; k++){
+	displaced_cell(disp, i, j, k, &xi, &yi, &zi);
+	r = HII_PLANE_OWNER(xi);
+	if (r == mpi_rank)
+	  planes[HII_R_INDEX(xi-h0, yi, zi)] += (1 + init_growth_factor*deltax[R_FFT_INDEX(i-mpi_x0,j,k)]);
+	else
+	  send_count[r]++;
+      }
+    }
+  }
+
+  // then exchange the rest, in as many rounds as the largest count between two ranks needs
+  MPI_Alltoall(send_count, 1, MPI_UNSIGNED_LONG_LONG, recv_count, 1, MPI_UNSIGNED_LONG_LONG, MPI_COMM_WORLD);
+  for (r=0, n_send=0, n_rounds=0; r<mpi_size; r++){
+    send_offset[r] = n_send; n_send += send_count[r];
+    if ((send_count[r] + chunk-1)/chunk > n_rounds) n_rounds = (send_count[r] + chunk-1)/chunk;
+    if ((recv_count[r] + chunk-1)/chunk > n_rounds) n_rounds = (recv_count[r] + chunk-1)/chunk;
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &n_rounds, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+  send = (mass_deposit *) malloc(sizeof(mass_deposit)*(n_send+1llu));
+  send_batch = (mass_deposit *) malloc(sizeof(mass_deposit)*chunk*mpi_size);
+  recv_batch = (mass_deposit *) malloc(sizeof(mass_deposit)*chunk*mpi_size);
+  status = mpi_all_ok(!send || !send_batch || !recv_batch);
+  if (!status){
+    for (i=mpi_x0; i<mpi_x0+mpi_nx; i++){
+      for (j=0; j<DIM; j++){
+	for (k=0; k<DIM; k++){
+	  displaced_cell(disp, i, j, k, &xi, &yi, &zi);
+	  r = HII_PLANE_OWNER(xi);
+	  if (r == mpi_rank)
+	    continue;
+	  send[send_offset[r] + fill[r]].cell = HII_R_INDEX(xi, yi, zi);
+	  send[send_offset[r] + fill[r]].mass = (1 + init_growth_factor*deltax[R_FFT_INDEX(i-mpi_x0,j,k)]);
+	  fill[r]++;
+	}
+      }
+    }
+    MPI_Type_contiguous(sizeof(mass_deposit), MPI_BYTE, &deposit_type);
+    MPI_Type_commit(&deposit_type);
+    for (round=0; round<n_rounds; round++){
+      first = round*chunk;
+      for (r=0; r<mpi_size; r++){
+	batch_send[r] = (send_count[r] > first) ? ((send_count[r] - first < chunk) ? send_count[r] - first : chunk) : 0;
+	batch_recv[r] = (recv_count[r] > first) ? ((recv_count[r] - first < chunk) ? recv_count[r] - first : chunk) : 0;
+	batch_offset[r] = r*chunk;
+	memcpy(send_batch + r*chunk, send + send_offset[r] + first, sizeof(mass_deposit)*batch_send[r]);
+      }
+      MPI_Alltoallv(send_batch, batch_send, batch_offset, deposit_type, recv_batch, batch_recv, batch_offset, deposit_type, MPI_COMM_WORLD);
+      for (r=0; r<mpi_size; r++){
+	for (ct=r*chunk; ct<r*chunk + batch_recv[r]; ct++)
+	  planes[recv_batch[ct].cell - HII_R_INDEX(h0, 0, 0)] += recv_batch[ct].mass;
+      }
+    }
+    MPI_Type_free(&deposit_type);
+
+    // gather the planes on rank 0, into its padded box
+    MPI_Type_contiguous(HII_DIM*HII_DIM, MPI_FLOAT, &plane_type);
+    MPI_Type_commit(&plane_type);
+    for (r=0; r<mpi_size; r++){
+      batch_recv[r] = HII_FIRST_PLANE(r+1) - HII_FIRST_PLANE(r);
+      batch_offset[r] = HII_FIRST_PLANE(r);
+    }
+    all = mpi_rank ? NULL : (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+    MPI_Gatherv(planes, batch_recv[mpi_rank], plane_type, all, batch_recv, batch_offset, plane_type, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&plane_type);
+    if (all){
+      for (i=0; i<HII_DIM; i++){
+	for (j=0; j<HII_DIM; j++){
+	  for (k=0; k<HII_DIM; k++){
+	    updated[HII_R_FFT_INDEX(i,j,k)] = all[HII_R_INDEX(i,j,k)];
+	  }
+	}
+      }
+      free(all);
+    }
+  }
+
+  if (send) free(send);
+  if (send_batch) free(send_batch);
+  if (recv_batch) free(recv_batch);
+  free(planes); free(send_count); free(batch_send);
+  return status;
+}
+#endif
+
+
 int process_velocity(fftwf_complex *updated, float dDdt_over_D, float REDSHIFT, int component){
   char filename[300];
-  FILE *F;
   float k_x, k_y, k_z, k_sq;
   int n_x, n_y, n_z;
   fftwf_plan plan;
@@ -95,43 +295,52 @@ int process_velocity(fftwf_complex *updated, float dDdt_over_D, float REDSHIFT,
     sprintf(filename, "../Boxes/updated_vy_z%06.2f_%i_%.0fMpc", REDSHIFT, HII_DIM, BOX_LEN);
   else
     sprintf(filename, "../Boxes/updated_vz_z%06.2f_%i_%.0fMpc", REDSHIFT, HII_DIM, BOX_LEN);
-  if (!(F=fopen(filename, "wb"))){
-    fprintf(stderr, "Unable to open file %s to write to.\n", filename);
+  if (print_box_no_padding((float *)updated, HII_DIM, filename) < 0){
+    fprintf(stderr, "perturb_field: Unable to queue %s for writting!\n", filename);
     return -1;
   }
-  if (print_box_no_padding((float *)updated, HII_DIM, F) < 0){
-    fprintf(stderr, "perturb_field: Write error occured writting deltax box!\n");
-    fclose(F);
-    return -1;
-  }
-  fclose(F);
   return 0;
 }
 
 int main (int argc, char ** argv){
   char filename[100];
   FILE *F;
+  memory_plan mem_plan;
   fftwf_complex *updated, *save_updated;
   fftwf_plan plan;
-  float *vx, *vy, *vz, REDSHIFT, growth_factor, displacement_factor_2LPT, init_growth_factor, init_displacement_factor_2LPT, xf, yf, zf, *vx_2LPT, *vy_2LPT, *vz_2LPT;
+  float *vx, *vy, *vz, REDSHIFT, growth_factor, displacement_factor_2LPT, init_growth_factor, init_displacement_factor_2LPT, *vx_2LPT = NULL, *vy_2LPT = NULL, *vz_2LPT = NULL;
   float *deltax, mass_factor, dDdt, f_pixel_factor;
-  unsigned long long ct, HII_i, HII_j, HII_k;
-  int i,j,k, xi, yi, zi;
+  unsigned long long ct;
+  int i,j,k, xi, yi, zi, num_th;
+  displacement_field disp;
   double ave_delta, new_ave_delta;
   /***************   BEGIN INITIALIZATION   **************************/
 
+#if USE_MPI
+  // the MPI build (make perturb_field_mpi) moves the mass across the ranks (see mpi_move_mass)
+  if (mpi_slabs_init(&argc, &argv) != 0)
+    return -1;
+#endif
   // check usage
-  if (argc != 2){
-    fprintf(stderr, "USAGE: perturb_field <REDSHIFT>\nAborting...\n");
+  if ((argc == 4) && (argv[1][0]=='-') && ((argv[1][1]=='p') || (argv[1][1]=='P'))){
+    // user specified num proc
+    num_th = atoi(argv[2]);
+    REDSHIFT = atof(argv[3]);
+  }
+  else if (argc == 2){
+    num_th = NUMCORES;
+    REDSHIFT = atof(argv[1]);
+  }
+  else{
+    fprintf(stderr, "USAGE: perturb_field [-p <NUM THREADS>] <REDSHIFT>\nAborting...\n");
     return -1;
   }
-  REDSHIFT = atof(argv[1]);
   // initialize and allocate thread info
   if (fftwf_init_threads()==0){
     fprintf(stderr, "perturb_field: ERROR: problem initializing fftwf threads\nAborting\n.");
     return -1;
   }
-  omp_set_num_threads(NUMCORES);
+  omp_set_num_threads(num_th);
 
   // perform a very rudimentary check to see if we are underresolved and not using the linear approx
   if ((BOX_LEN > DIM) && !EVOLVE_DENSITY_LINEARLY){
@@ -150,6 +359,16 @@ int main (int argc, char ** argv){
   init_growth_factor = dicke(INITIAL_REDSHIFT);
   init_displacement_factor_2LPT = -(3.0/7.0) * init_growth_factor*init_growth_factor; // 2LPT eq. D8
 
+  // check the boxes we are about to allocate fit in RAM
+  mem_plan = plan_memory(MEM_STAGE_PERTURB_FIELD);
+  print_memory_plan(stderr, &mem_plan);
+#if USE_MPI
+  // rank 0 does everything but moving the mass
+  if (mpi_rank && EVOLVE_DENSITY_LINEARLY){
+    free_ps(); return 0;
+  }
+#endif
+
   // allocate memory for the updated density, and initialize
   updated = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
   if (!updated){
@@ -167,20 +386,19 @@ int main (int argc, char ** argv){
   // check if the linear evolution flag was set
   if (EVOLVE_DENSITY_LINEARLY){
     sprintf(filename, "../Boxes/smoothed_deltax_z0.00_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    if (!(F=fopen(filename, "rb"))){
+    if (!(F=box_fopen(filename, "rb"))){
       fprintf(stderr, "perturb_field.c: Unable to open file %s for reading.\nAborting\n", filename);
       fftwf_free(updated); fftwf_free(vx);
       free_ps(); return -1;
     }
+    if (mod_fread_padded((float *)updated, HII_DIM, F) != 1){
+      fprintf(stderr, "perturb_field.c: Error reading file %s.\nAborting\n", filename);
+      fftwf_free(updated); fclose(F); fftwf_free(vx);
+      free_ps(); return -1;
+    }
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
-	  if (fread(((float *)updated + HII_R_FFT_INDEX(i,j,k)), sizeof(float), 1, F) != 1){
-	    fprintf(stderr, "perturb_field.c: Error reading file %s.\nAborting\n", filename);
-	    fftwf_free(updated); fclose(F); fftwf_free(vx);
-	    free_ps(); return -1;
-	  }
-
 	  *((float *)updated + HII_R_FFT_INDEX(i,j,k)) *= growth_factor;
 	}
       }
@@ -206,7 +424,7 @@ int main (int argc, char ** argv){
       free_ps(); return -1;
     }
     sprintf(filename, "../Boxes/vxoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
+    F=box_fopen(filename, "rb");
     if (mod_fread(vx, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading velocity box.\n");
       fftwf_free(vx);  fftwf_free(vy); fftwf_free(vz); fftwf_free(updated);
@@ -214,7 +432,7 @@ int main (int argc, char ** argv){
     }
     fclose(F);
     sprintf(filename, "../Boxes/vyoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
+    F=box_fopen(filename, "rb");
     if (mod_fread(vy, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading velocity box.\n");
       fftwf_free(vx);  fftwf_free(vy); fftwf_free(vz);fftwf_free(updated);
@@ -222,7 +440,7 @@ int main (int argc, char ** argv){
     }
     fclose(F);
     sprintf(filename, "../Boxes/vzoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
+    F=box_fopen(filename, "rb");
     if (mod_fread(vz, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading velocity box.\n");
       fftwf_free(vx);  fftwf_free(vy); fftwf_free(vz);fftwf_free(updated);
@@ -238,14 +456,34 @@ int main (int argc, char ** argv){
 
     
     // read in the linear density field
+    sprintf(filename, "../Boxes/deltax_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
+#if USE_MPI
+    // each rank reads its own x-slabs
+    deltax = (float *) fftwf_malloc(sizeof(fftwf_complex)*mpi_alloc_complex);
+    if ((mpi_all_ok(!deltax) != 0) || (mpi_slab_io(filename, deltax, 0) != 0)){
+      fprintf(stderr, "perturb_field: Read error occured while reading deltax box.\n");
+      if (deltax) fftwf_free(deltax);
+      fftwf_free(vx);  fftwf_free(vy); fftwf_free(vz);fftwf_free(updated);
+      free_ps(); return -1;
+    }
+#else
+    if (SHM_BOX_STORE){
+      // only read from here on, so attach to the node's shared copy (see shm_store.c)
+      fprintf(stderr, "Attaching to the shared deltax box\n");
+      if (!(deltax = (float *) shm_box_attach(filename, sizeof(float)*TOT_FFT_NUM_PIXELS))){
+	fprintf(stderr, "perturb_field: Read error occured while reading deltax box.\n");
+	fftwf_free(vx);  fftwf_free(vy); fftwf_free(vz);fftwf_free(updated);
+	free_ps(); return -1;
+      }
+    }
+    else{
     deltax = (float *) fftwf_malloc(sizeof(float)*TOT_FFT_NUM_PIXELS);
     if (!deltax){
       fprintf(stderr, "perturb_field.c: Error allocating memory for box.\nAborting...\n");
       fftwf_free(vx);  fftwf_free(vy); fftwf_free(vz);fftwf_free(updated);
       free_ps(); return -1;
     }
-    sprintf(filename, "../Boxes/deltax_z0.00_%i_%.0fMpc", DIM, BOX_LEN);
-    F = fopen(filename, "rb");
+    F = box_fopen(filename, "rb");
     fprintf(stderr, "Reading in deltax box\n");
     if (mod_fread(deltax, sizeof(float)*TOT_FFT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading deltax box.\n");
@@ -253,6 +491,8 @@ int main (int argc, char ** argv){
       free_ps(); return -1;
     }
     fclose(F);
+    }
+#endif
 
 
     // find factor of HII pixel size / deltax pixel size
@@ -293,7 +533,7 @@ int main (int argc, char ** argv){
     // read again velocities
 
     sprintf(filename, "../Boxes/vxoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
+    F=box_fopen(filename, "rb");
     if (mod_fread(vx_2LPT, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading velocity 2LPT box.\n");
       free(vx);  free(vy); free(vz);
@@ -305,7 +545,7 @@ int main (int argc, char ** argv){
     //last_time = time(NULL);
 
     sprintf(filename, "../Boxes/vyoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
+    F=box_fopen(filename, "rb");
     if (mod_fread(vy_2LPT, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading velocity 2LPT box.\n");
       free(vx);  free(vy); free(vz);
@@ -317,7 +557,7 @@ int main (int argc, char ** argv){
     //last_time = time(NULL);
 
     sprintf(filename, "../Boxes/vzoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
+    F=box_fopen(filename, "rb");
    if (mod_fread(vz_2LPT, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
       fprintf(stderr, "perturb_field: Read error occured while reading velocity box.\n");
       free(vx);  free(vy); free(vz);
@@ -345,51 +585,22 @@ int main (int argc, char ** argv){
     /************  END INITIALIZATION ****************************/
 
 
+    disp.vx = vx; disp.vy = vy; disp.vz = vz;
+    disp.vx_2LPT = vx_2LPT; disp.vy_2LPT = vy_2LPT; disp.vz_2LPT = vz_2LPT;
+    disp.f_pixel_factor = f_pixel_factor;
+
+#if USE_MPI
+    int status = mpi_move_mass(&disp, deltax, init_growth_factor, (float *)updated);
+    if (status || mpi_rank){
+      fftwf_free(vx); fftwf_free(vy); fftwf_free(vz); fftwf_free(deltax); fftwf_free(updated);
+      free_ps(); return status;
+    }
+#else
     // go through the high-res box, mapping the mass onto the low-res (updated) box
     for (i=0; i<DIM;i++){
       for (j=0; j<DIM;j++){
 	for (k=0; k<DIM;k++){
-
-	  // map indeces to locations in units of box size
-	  xf = (i+0.5)/(DIM+0.0);
-	  yf = (j+0.5)/(DIM+0.0);
-	  zf = (k+0.5)/(DIM+0.0);
-
-	  // update locations
-	  HII_i = (unsigned long long)(i/f_pixel_factor);
-	  HII_j = (unsigned long long)(j/f_pixel_factor);
-	  HII_k = (unsigned long long)(k/f_pixel_factor);
-	  xf += vx[HII_R_INDEX(HII_i, HII_j, HII_k)];
-	  yf += vy[HII_R_INDEX(HII_i, HII_j, HII_k)];
-	  zf += vz[HII_R_INDEX(HII_i, HII_j, HII_k)];
-
-
-    // 2LPT PART
-    // add second order corrections
-    if(SECOND_ORDER_LPT_CORRECTIONS){
-      xf -= vx_2LPT[HII_R_INDEX(HII_i,HII_j,HII_k)];
-      yf -= vy_2LPT[HII_R_INDEX(HII_i,HII_j,HII_k)];
-      zf -= vz_2LPT[HII_R_INDEX(HII_i,HII_j,HII_k)];
-    }
-
-	  xf *= HII_DIM;
-	  yf *= HII_DIM;
-	  zf *= HII_DIM;
-	  while (xf >= (float)HII_DIM){ xf -= HII_DIM;}
-	  while (xf < 0){ xf += HII_DIM;}
-	  while (yf >= (float)HII_DIM){ yf -= HII_DIM;}
-	  while (yf < 0){ yf += HII_DIM;}
-	  while (zf >= (float)HII_DIM){ zf -= HII_DIM;}
-	  while (zf < 0){ zf += HII_DIM;}
-	  xi = xf;
-	  yi = yf;
-	  zi = zf;
-	  if (xi >= HII_DIM){ xi -= HII_DIM;}
-	  if (xi < 0) {xi += HII_DIM;}
-	  if (yi >= HII_DIM){ yi -= HII_DIM;}
-	  if (yi < 0) {yi += HII_DIM;}
-	  if (zi >= HII_DIM){ zi -= HII_DIM;}
-	  if (zi < 0) {zi += HII_DIM;}
+	  displaced_cell(&disp, i, j, k, &xi, &yi, &zi);
 
 	  // now move the mass
 	  *( (float *)updated + HII_R_FFT_INDEX(xi, yi, zi) ) +=
@@ -397,6 +608,7 @@ int main (int argc, char ** argv){
 	}
       }
     }
+#endif
 
     // renormalize to the new pixel size, and make into delta
     //    ave_delta = 0;
@@ -413,20 +625,23 @@ int main (int argc, char ** argv){
     //    fprintf(stderr, "ave is %e\n", ave_delta);
  
     // deallocate
-    fftwf_free(vy); fftwf_free(vz); fftwf_free(deltax);
+    fftwf_free(vy); fftwf_free(vz);
+    if (SHM_BOX_STORE && !USE_MPI)
+      shm_box_detach(deltax);
+    else
+      fftwf_free(deltax);
   }
 
 
   /****  Print and convert to velocities *****/
   fprintf(stderr, "Done with PT. Printing density field and computing velocity components.\n");
-  fftwf_plan_with_nthreads(NUMCORES); // use all processors for perturb_field
+  fftwf_plan_with_nthreads(num_th); // use all processors for perturb_field
   save_updated = (fftwf_complex *) vx;
   sprintf(filename, "../Boxes/updated_smoothed_deltax_z%06.2f_%i_%.0fMpc", REDSHIFT, HII_DIM, BOX_LEN);
-  F=fopen(filename, "wb");
   if (EVOLVE_DENSITY_LINEARLY){
-    if (print_box_no_padding((float *)updated, HII_DIM, F) < 0){
+    if (print_box_no_padding((float *)updated, HII_DIM, filename) < 0){
       fprintf(stderr, "perturb_field: Write error occured writting deltax box!\n");
-      fftwf_free(updated); fftwf_free(vx); fclose(F);
+      fftwf_free(updated); fftwf_free(vx);
       free_ps(); return -1;
     }
 
@@ -470,15 +685,14 @@ int main (int argc, char ** argv){
       }
     }
 
-    if (print_box_no_padding((float *)updated, HII_DIM, F) < 0){
+    if (print_box_no_padding((float *)updated, HII_DIM, filename) < 0){
       fprintf(stderr, "perturb_field: Write error occured writting deltax box!\n");
-      fftwf_free(updated); fftwf_free(vx); fclose(F);
+      fftwf_free(updated); fftwf_free(vx);
       free_ps(); return -1;
     }
  
     memcpy(updated, save_updated, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
   }
-  fclose(F);
 
   // x-component
   fprintf(stderr, "Generate x-component\n");
@@ -497,6 +711,11 @@ int main (int argc, char ** argv){
   memcpy(updated, save_updated, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
   process_velocity(updated, dDdt/growth_factor, REDSHIFT, 2);
 
+  // make sure the boxes are on disk before reporting success
+  if (async_write_flush()){
+    fprintf(stderr, "perturb_field: Write error occured writting the output boxes!\n");
+    fftwf_free(updated); fftwf_free(vx); fftwf_cleanup_threads(); free_ps(); return -1;
+  }
 
   // deallocate
   fftwf_free(updated);
@@ -0,0 +1,61 @@
+#ifndef _POWER_SPEC_HELPERS_
+#define _POWER_SPEC_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+
+/*
+  Function HII_BIN_POWER_SPEC scrolls through the HII_DIM k-space box <box> and adds the
+  power of each mode, k^3 |box|^2 / (2 pi^2 VOLUME), to logarithmically spaced k bins.
+  The first bin ends at k_first_bin_ceil, and each subsequent bin is k_factor wider, up to k_max.
+  The power, k and number of modes in each bin are accumulated into p_box, k_ave and in_bin_ct,
+  which should be zeroed by the caller.
+*/
+void HII_bin_power_spec(fftwf_complex *box, float k_first_bin_ceil, float k_factor, float k_max,
+			double *p_box, double *k_ave, unsigned long long *in_bin_ct){
+  int n_x, n_y, n_z, ct;
+  float k_x, k_y, k_z, k_mag, k_floor, k_ceil;
+
+  for (n_x=0; n_x<HII_DIM; n_x++){
+    if (n_x>HII_MIDDLE)
+      k_x =(n_x-HII_DIM) * DELTA_K;  // wrap around for FFT convention
+    else
+      k_x = n_x * DELTA_K;
+
+    for (n_y=0; n_y<HII_DIM; n_y++){
+      if (n_y>HII_MIDDLE)
+	k_y =(n_y-HII_DIM) * DELTA_K;
+      else
+	k_y = n_y * DELTA_K;
+
+      for (n_z=0; n_z<=HII_MIDDLE; n_z++){ 
+	k_z = n_z * DELTA_K;
+	
+	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
+
+	// now go through the k bins and update
+	ct = 0;
+	k_floor = 0;
+	k_ceil = k_first_bin_ceil;
+	while (k_ceil < k_max){
+	  // check if we fal in this bin
+	  if ((k_mag>=k_floor) && (k_mag < k_ceil)){
+	    in_bin_ct[ct]++;
+	    p_box[ct] += pow(k_mag,3)*pow(cabs(box[HII_C_INDEX(n_x, n_y, n_z)]), 2)/(2.0*PI*PI*VOLUME);
+	    // note the 1/VOLUME factor, which turns this into a power density in k-space
+
+	    k_ave[ct] += k_mag;
+	    break;
+	  }
+
+	  ct++;
+	  k_floor=k_ceil;
+	  k_ceil*=k_factor;
+	}
+      }
+    }
+  } // end looping through k box
+}
+
+#endif
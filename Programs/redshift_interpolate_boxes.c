@@ -25,10 +25,18 @@
 
 FILE *LOG;
 
-int read_box(char *box_filename, fftwf_complex *box, int format, int LOS_direction){
-  int i,j,k;
-  char *token, input_filename_prefix[300], input_filename_sufix[300];
+/*
+  reads slices [slice_lo, slice_lo+n_slices) along the LOS_direction axis of the box into the
+  FFT-padded array box, without reading the rest of the box (see mod_fread_region); the outdated
+  FFT padded format is always read whole
+*/
+int read_box(char *filename, fftwf_complex *box, int format, int LOS_direction, int slice_lo, int n_slices){
+  int i,j,k, ni,nj,nk;
+  char *token, box_filename[300], input_filename_prefix[300], input_filename_sufix[300];
+  float *slab;
   FILE *F;
+
+  strcpy(box_filename, filename);
   //fprintf(stderr, "%s\n", box_filename);
   // and read-in the first box
   if (format == 2){ // velocity box; we need to decide which component to read
@@ -47,9 +55,9 @@ int read_box(char *box_filename, fftwf_complex *box, int format, int LOS_directi
       sprintf(box_filename, "%svz_%s", input_filename_prefix, input_filename_sufix);
     }
   }
-  fprintf(stderr, "Reading-in box: %s\n", box_filename);
-  fprintf(LOG, "Reading-in box: %s\n", box_filename);
-  if (!(F = fopen(box_filename, "rb"))){
+  fprintf(stderr, "Reading-in slices %i to %i of box: %s\n", slice_lo, slice_lo+n_slices-1, box_filename);
+  fprintf(LOG, "Reading-in slices %i to %i of box: %s\n", slice_lo, slice_lo+n_slices-1, box_filename);
+  if (!(F = box_fopen(box_filename, "rb"))){
     fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to open %s.\nAborting.\n", box_filename);
     fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to open %s.\nAborting.\n", box_filename);
     fclose(LOG);
@@ -63,15 +71,24 @@ int read_box(char *box_filename, fftwf_complex *box, int format, int LOS_directi
       return -1;
   }
   else { // box has no fft padding
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)box + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    return -1;
-	  }
+    ni = (LOS_direction == 0) ? n_slices : HII_DIM;
+    nj = (LOS_direction == 1) ? n_slices : HII_DIM;
+    nk = (LOS_direction == 2) ? n_slices : HII_DIM;
+    if (!(slab = (float *) malloc(sizeof(float)*ni*nj*nk)) ||
+	(mod_fread_region(slab, HII_DIM, (LOS_direction == 0) ? slice_lo : 0, ni, (LOS_direction == 1) ? slice_lo : 0, nj,
+			  (LOS_direction == 2) ? slice_lo : 0, nk, F)!=1)){
+      free(slab); fclose(F);
+      return -1;
+    }
+    for (i=0; i<ni; i++){
+      for (j=0; j<nj; j++){
+	for (k=0; k<nk; k++){
+	  *((float *)box + HII_R_FFT_INDEX(i + ((LOS_direction == 0) ? slice_lo : 0), j + ((LOS_direction == 1) ? slice_lo : 0),
+					   k + ((LOS_direction == 2) ? slice_lo : 0))) = slab[k + nk*(j + nj*(unsigned long long)i)];
 	}
       }
     }
+    free(slab);
   }
 
     
@@ -82,6 +99,17 @@ int read_box(char *box_filename, fftwf_complex *box, int format, int LOS_directi
   return 0;
 }
 
+/* the number of lightcone slices, starting at redshift z, that lie before redshift z2 */
+int slices_before(double z, double z2, double dR){
+  int n = 0;
+
+  while (z < z2){
+    z -= dR / drdz(z);
+    n++;
+  }
+  return n;
+}
+
 void copy_slice(fftwf_complex *box_interpolate, fftwf_complex *box_z1, fftwf_complex *box_z2, 
 		double z, double z1, double z2, int slice_ct, int LOS_direction){
   int i,j,k;
@@ -127,7 +155,7 @@ int main(int argc, char ** argv){
   char input_filename_prefix[300], input_filename_sufix[300];
   FILE *BOX_LIST, *F;
   fftwf_complex *box_z1, *box_z2, *box_interpolate; 
-  int format, LOS_direction, slice_ct;
+  int format, LOS_direction, slice_ct, slices_read;
   double z1, z2, z, dR;
   float start_z, end_z;
   int i,j,k;
@@ -193,15 +221,9 @@ int main(int argc, char ** argv){
     fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fclose(F);
   }
 
-  // read in the first box
+  // the first box (its slices are read as they are needed)
   fscanf(BOX_LIST, "%s\n", box_filename);
   strcpy(box_filename_z1, box_filename);
-  // and read-in the first box
-  if (read_box(box_filename, box_z1, format, LOS_direction) != 0){
-    fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename);
-    fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename);
-    fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); return -1;
-  }
 
   // and get the redshift from the filename
   strcpy(box_filename, box_filename_z1);
@@ -210,8 +232,8 @@ int main(int argc, char ** argv){
   while (!isdigit(token[0]))
     token = strtok(NULL, "z");
   z1 = atof(strtok(token, "_"));
-  fprintf(stderr, "Output filename prefix is %s.\nRead-in box at redshift %f\n", output_filename_prefix, z1);
-  fprintf(LOG, "Output filename prefix is %s.\nRead-in box at redshift %f\n", output_filename_prefix, z1);
+  fprintf(stderr, "Output filename prefix is %s.\nFirst box is at redshift %f\n", output_filename_prefix, z1);
+  fprintf(LOG, "Output filename prefix is %s.\nFirst box is at redshift %f\n", output_filename_prefix, z1);
   /***************************  END INITIALIZATIONS  *****************************************************/
 
 
@@ -219,23 +241,18 @@ int main(int argc, char ** argv){
   z = start_z = z1;
   slice_ct = 0;
   while (!feof(BOX_LIST)){
-    // read in the next box
+    // the next box
     fscanf(BOX_LIST, "%s\n", box_filename);
     strcpy(box_filename_z2, box_filename);
-    if (read_box(box_filename, box_z2, format, LOS_direction) != 0){
-      fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename);
-      fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename);
-      fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate); fclose(F);
-      return -1;
-    }
     // and get the redshift from the filename
     strcpy(box_filename, box_filename_z2);
     token = strtok(box_filename, "z");
     while (!isdigit(token[0]))
       token = strtok(NULL, "z");
     z2 = atof(strtok(token, "_"));
-    fprintf(stderr, "Read-in box at redshift %f\nInterpolating in the direction of %i\n", z2, LOS_direction);
-    fprintf(LOG, "Read-in box at redshift %f\nInterpolating in the direction of %i\n", z2, LOS_direction);
+    fprintf(stderr, "Next box is at redshift %f\nInterpolating in the direction of %i\n", z2, LOS_direction);
+    fprintf(LOG, "Next box is at redshift %f\nInterpolating in the direction of %i\n", z2, LOS_direction);
+    slices_read = 0;
 
     // now do the interpolation
     while (z < z2){ // until we move to the next set of boxes
@@ -250,7 +267,7 @@ int main(int argc, char ** argv){
 	// write out the box
 	sprintf(output_filename, "%s_zstart%09.5f_zend%09.5f_FLIPBOXES%i_%i_%.0fMpc_lighttravel", 
 		output_filename_prefix, start_z, end_z, FLIP_BOX, HII_DIM, BOX_LEN);
-	if (!(F=fopen(output_filename, "wb"))){
+	if (!(F=box_fopen(output_filename, "wb"))){
 	  fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to open file %s.\nAborting\n", output_filename);
 	  fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to open file %s.\nAborting\n", output_filename);
 	  fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate);
@@ -261,17 +278,17 @@ int main(int argc, char ** argv){
 	  for (j=0; j<HII_DIM; j++){
 	    for (k=0; k<HII_DIM; k++){
 
-	      if (fwrite((float *)box_interpolate + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F) != 1){
+	      if (io_account_fwrite((float *)box_interpolate + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F, __FILE__, __LINE__) != 1){
 		fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to open file %s.\nAborting\n", output_filename);
 		fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to open file %s.\nAborting\n", output_filename);
-		fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate); fclose(F);
+		fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate); box_fclose(F);
 		return -1;
 	      }
 	      
 	    }
 	  }
 	}
-	fclose(F);
+	box_fclose(F);
 
 	fprintf(stderr, "Written light travel box at %s.\n", output_filename);
 	fprintf(LOG, "Written light travel box at %s.\n", output_filename);
@@ -280,33 +297,32 @@ int main(int argc, char ** argv){
 	slice_ct=0;
 	start_z = end_z;
 	memset(box_interpolate, 0, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS); //not needed but easier to debug
-	if (FLIP_BOX){
+	if (FLIP_BOX)
 	  LOS_direction = ++LOS_direction % 3;
-	  if (format == 2){  // we are rotating the cube, so we need to read-in the appropriate velocity components
-	    if (read_box(box_filename_z1, box_z1, format, LOS_direction) != 0){
-	      fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename_z1);
-	      fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename_z1);
-	      fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate); fclose(F);
-	      return -1;
-	    }
-	    if (read_box(box_filename_z2, box_z2, format, LOS_direction) != 0){
-	      fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename_z2);
-	      fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to read-in box %s\nAborting\n", box_filename_z2);
-	      fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate); fclose(F);
-	      return -1;
-	    }
-	  }
-	}
+	slices_read = 0; // the next slices (possibly along a new direction) still have to be read
       } // we are now continuing with a new interpolation box
 
+      // read only the slices of the pair of boxes that go into this lightcone box
+      if (!slices_read){
+	slices_read = slices_before(z, z2, dR);
+	if (slices_read > HII_DIM - slice_ct)
+	  slices_read = HII_DIM - slice_ct;
+	if ((read_box(box_filename_z1, box_z1, format, LOS_direction, slice_ct, slices_read) != 0) ||
+	    (read_box(box_filename_z2, box_z2, format, LOS_direction, slice_ct, slices_read) != 0)){
+	  fprintf(stderr, "ERROR: redshift_interpolate_boxes: Unable to read-in boxes %s and %s\nAborting\n", box_filename_z1, box_filename_z2);
+	  fprintf(LOG, "ERROR: redshift_interpolate_boxes: Unable to read-in boxes %s and %s\nAborting\n", box_filename_z1, box_filename_z2);
+	  fclose(LOG); fclose(BOX_LIST); fftwf_free(box_z1); fftwf_free(box_z2); fftwf_free(box_interpolate);
+	  return -1;
+	}
+      }
+
       copy_slice(box_interpolate, box_z1, box_z2, gettime(z), gettime(z1), gettime(z2), slice_ct, LOS_direction);
       // note the interpolation in copy_slice is done linearly in time using the "gettime" function
       slice_ct++;
       z -= dR / drdz(z);
     } // done with this pair of boxes, moving on to the next redshift pair
 
-    // copy the z2 box now to z1, since it is the lower bound, and read the next filename at z2
-    memcpy(box_z1, box_z2, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+    // the z2 box is now the lower bound, and read the next filename at z2
     z1 = z2;
     strcpy(box_filename_z1, box_filename_z2);
     fprintf(stderr, "\n");
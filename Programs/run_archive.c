@@ -0,0 +1,34 @@
+#include "../Parameter_files/INIT_PARAMS.H"
+
+/*
+  USAGE: run_archive list [<pattern>]
+         run_archive extract <pattern>
+
+  Lists, or writes back to the file system, the files held in the run archive RUN_ARCHIVE_FILE
+  (see Cosmo_c_files/run_archive.c) whose paths match the shell pattern, e.g.
+  run_archive extract '../Boxes/delta_T_*'.  Quote the pattern, so that the shell passes it on.
+*/
+
+int main(int argc, char ** argv){
+  int n;
+
+  if ((argc == 2) && !strcmp(argv[1], "list")){
+    run_archive_list("../Boxes/*", stdout);
+    run_archive_list("../Boxes/*/*", stdout);
+    run_archive_list("../Output_files/*/*", stdout);
+    return 0;
+  }
+  if ((argc == 3) && !strcmp(argv[1], "list")){
+    run_archive_list(argv[2], stdout);
+    return 0;
+  }
+  if ((argc == 3) && !strcmp(argv[1], "extract")){
+    if ((n = run_archive_extract(argv[2])) < 0)
+      return -1;
+    fprintf(stderr, "run_archive: extracted %i file(s)\n", n);
+    return 0;
+  }
+
+  fprintf(stderr, "USAGE: run_archive list [<pattern>]\n       run_archive extract <pattern>\nAborting\n");
+  return -1;
+}
@@ -0,0 +1,331 @@
+#ifndef _STAGE_SCHEDULER_
+#define _STAGE_SCHEDULER_
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "memory_planner.c"
+
+/*
+  Dependency-graph scheduler for the driver programs.
+
+  The driver adds one task per program call with ADD_STAGE, and declares which earlier
+  tasks must finish first with ADD_DEPENDENCY (e.g. find_HII_bubbles at z needs perturb_field
+  at z and Ts).  RUN_STAGE_GRAPH then launches every task whose dependencies are done,
+  concurrently, as long as there are free cores and the stages' planned memory
+  (memory_planner.c) fits within RAM.
+
+  Cores are split according to how well each program scales: a task is given more threads
+  only while its Amdahl parallel efficiency stays above SCHED_MIN_EFFICIENCY, so a poorly
+  scaling stage (e.g. the delta_T power spectrum) runs next to a compute-bound FFT stage
+  instead of holding cores it cannot use.  The parallel fraction of each program starts
+  from the guess in SCHED_PROGRAMS and is re-measured from the CPU and wall time of every
+  completed run.  Ready tasks are considered in order of the longest chain of tasks that
+  depends on them, and a lower priority task never takes cores that the highest priority
+  waiting task needs, so the critical path (usually Ts) is not starved.
+
+  Threads are passed to the programs through their "-p <NUM THREADS>" option.
+*/
+
+#define SCHED_MAX_TASKS (int) (2048)
+#define SCHED_MAX_DEPS (int) (6)
+#define SCHED_MIN_EFFICIENCY (double) (0.5)
+
+#define SCHED_WAITING (int) (0)
+#define SCHED_RUNNING (int) (1)
+#define SCHED_DONE (int) (2)
+#define SCHED_FAILED (int) (3)
+
+typedef struct {
+  const char *name;
+  int threads_arg; // 1 if the program takes "-p <NUM THREADS>" as its first arguments
+  int fixed_cores; // cores used by programs that do not take -p
+  int mem_stage; // stage in memory_planner.c, or -1 if its boxes are negligible
+  double parallel_frac; // fraction of the run time that scales with threads
+} sched_program;
+
+static sched_program SCHED_PROGRAMS[] = {
+  {"init", 0, NUMCORES, MEM_STAGE_INIT, 0.9},
+  {"perturb_field", 1, 0, MEM_STAGE_PERTURB_FIELD, 0.6},
+  {"Ts", 1, 0, MEM_STAGE_TS, 0.95},
+  {"find_HII_bubbles", 1, 0, MEM_STAGE_FIND_HII_BUBBLES, 0.8},
+  {"delta_T", 1, 0, MEM_STAGE_DELTA_T, 0.5},
+  {"find_halos", 0, 1, MEM_STAGE_FIND_HALOS, 0},
+  {"update_halo_pos", 0, 1, MEM_STAGE_UPDATE_HALO_POS, 0},
+};
+#define SCHED_NUM_PROGRAMS (int) (sizeof(SCHED_PROGRAMS)/sizeof(sched_program))
+
+typedef struct {
+  int program;
+  char args[500];
+  int n_deps, deps[SCHED_MAX_DEPS];
+  int state, cores, priority;
+  double mem;
+  pid_t pid;
+  struct timeval start;
+} sched_task;
+
+typedef struct {
+  int n_tasks;
+  sched_task task[SCHED_MAX_TASKS];
+} stage_graph;
+
+
+/*
+  Function ADD_STAGE adds a call of <program> with arguments <args> to the graph,
+  and returns its task number, or -1 on error.
+*/
+int add_stage(stage_graph *g, const char *program, const char *args){
+  int i;
+  sched_task *t;
+  memory_plan plan;
+
+  if (g->n_tasks >= SCHED_MAX_TASKS){
+    fprintf(stderr, "stage_scheduler: ERROR: more than %i tasks\n", SCHED_MAX_TASKS);
+    return -1;
+  }
+  t = &(g->task[g->n_tasks]);
+  for (i=0; i<SCHED_NUM_PROGRAMS; i++){
+    if (!strcmp(program, SCHED_PROGRAMS[i].name))
+      break;
+  }
+  if (i == SCHED_NUM_PROGRAMS){
+    fprintf(stderr, "stage_scheduler: ERROR: don't know how to schedule %s\n", program);
+    return -1;
+  }
+  t->program = i;
+  strncpy(t->args, args, sizeof(t->args)-1);
+  t->args[sizeof(t->args)-1] = '\0';
+  t->n_deps = 0;
+  t->state = SCHED_WAITING;
+  t->cores = 0;
+  t->priority = 0;
+  t->mem = 0;
+  if (SCHED_PROGRAMS[i].mem_stage >= 0){
+    plan = plan_memory(SCHED_PROGRAMS[i].mem_stage);
+    t->mem = plan.total;
+  }
+  return g->n_tasks++;
+}
+
+
+/*
+  Function ADD_DEPENDENCY makes <task> wait for <dep> to finish.
+  Negative task numbers are ignored, so optional stages can be passed as -1.
+*/
+void add_dependency(stage_graph *g, int task, int dep){
+  if ((task < 0) || (dep < 0))
+    return;
+  if (dep >= task){
+    fprintf(stderr, "stage_scheduler: WARNING: task %i can only depend on earlier tasks, ignoring %i\n", task, dep);
+    return;
+  }
+  if (g->task[task].n_deps >= SCHED_MAX_DEPS){
+    fprintf(stderr, "stage_scheduler: WARNING: too many dependencies for task %i\n", task);
+    return;
+  }
+  g->task[task].deps[g->task[task].n_deps++] = dep;
+}
+
+
+// number of cores above which <p> gets less than SCHED_MIN_EFFICIENCY out of another core, bounded by <max_cores>
+int useful_cores(sched_program *p, int max_cores){
+  int n;
+
+  if (!p->threads_arg)
+    return p->fixed_cores < max_cores ? p->fixed_cores : max_cores;
+
+  for (n=1; n<max_cores; n++){
+    if ( (n+1) / ((1-p->parallel_frac)*(n+1) + p->parallel_frac) <= SCHED_MIN_EFFICIENCY*(n+1) )
+      break;
+  }
+  return n;
+}
+
+
+// priority = length of the longest chain of tasks waiting on this one (tasks only depend on earlier ones)
+void set_stage_priorities(stage_graph *g){
+  int i, j, d;
+
+  for (i=0; i<g->n_tasks; i++)
+    g->task[i].priority = 1;
+  for (i=g->n_tasks-1; i>=0; i--){
+    for (d=0; d<g->task[i].n_deps; d++){
+      j = g->task[i].deps[d];
+      if (g->task[j].priority < g->task[i].priority + 1)
+	g->task[j].priority = g->task[i].priority + 1;
+    }
+  }
+}
+
+
+int stage_ready(stage_graph *g, int i){
+  int d;
+
+  if (g->task[i].state != SCHED_WAITING)
+    return 0;
+  for (d=0; d<g->task[i].n_deps; d++){
+    if (g->task[g->task[i].deps[d]].state != SCHED_DONE)
+      return 0;
+  }
+  return 1;
+}
+
+
+int launch_stage(stage_graph *g, int i, int cores, time_t start_time, FILE *LOG){
+  sched_task *t = &(g->task[i]);
+  sched_program *p = &(SCHED_PROGRAMS[t->program]);
+  char cmnd[1000];
+  time_t curr_time;
+
+  if (p->threads_arg)
+    sprintf(cmnd, "./%s -p %i %s", p->name, cores, t->args);
+  else
+    sprintf(cmnd, "./%s %s", p->name, t->args);
+
+  time(&curr_time);
+  fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
+  fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
+  fflush(NULL);
+
+  t->pid = fork();
+  if (t->pid < 0){
+    fprintf(stderr, "stage_scheduler: ERROR: unable to fork for %s\n", cmnd);
+    fprintf(LOG, "stage_scheduler: ERROR: unable to fork for %s\n", cmnd);
+    return -1;
+  }
+  if (t->pid == 0){
+    execl("/bin/sh", "sh", "-c", cmnd, (char *) NULL);
+    _exit(127);
+  }
+  t->state = SCHED_RUNNING;
+  t->cores = cores;
+  gettimeofday(&(t->start), NULL);
+  return 0;
+}
+
+
+// update the measured scaling of the program that ran task <i> with its CPU/wall time ratio
+void measure_stage_scaling(stage_graph *g, int i, struct rusage *usage){
+  sched_task *t = &(g->task[i]);
+  sched_program *p = &(SCHED_PROGRAMS[t->program]);
+  struct timeval end;
+  double wall, cpu, speedup, frac;
+
+  if (!p->threads_arg || (t->cores < 2))
+    return;
+
+  gettimeofday(&end, NULL);
+  wall = (end.tv_sec - t->start.tv_sec) + 1e-6*(end.tv_usec - t->start.tv_usec);
+  cpu = usage->ru_utime.tv_sec + 1e-6*usage->ru_utime.tv_usec + usage->ru_stime.tv_sec + 1e-6*usage->ru_stime.tv_usec;
+  if (wall < 1) // too short to tell
+    return;
+
+  speedup = cpu/wall;
+  if (speedup < 1) speedup = 1;
+  if (speedup > t->cores) speedup = t->cores;
+  frac = (1 - 1/speedup) / (1 - 1/(double)t->cores);
+  if (frac > 0.99) frac = 0.99;
+  p->parallel_frac = 0.5*(p->parallel_frac + frac);
+}
+
+
+/*
+  Function RUN_STAGE_GRAPH runs all tasks in <g> on <num_cores> cores, respecting their
+  dependencies.  Returns 0 on success, or -1 if a task failed (returned -1 or was killed),
+  in which case no further tasks are launched.
+*/
+int run_stage_graph(stage_graph *g, int num_cores, FILE *LOG){
+  int i, best, n_running=0, n_finished=0, free_cores=num_cores, cores, status, failed=0;
+  double mem_used=0, budget = RAM*BYTES_PER_GB;
+  struct rusage usage;
+  time_t start_time, curr_time;
+  pid_t pid;
+
+  time(&start_time);
+  set_stage_priorities(g);
+
+  while (n_finished < g->n_tasks){
+
+    // launch ready tasks, highest priority first, until one does not fit
+    while (!failed && (free_cores > 0)){
+      best = -1;
+      for (i=0; i<g->n_tasks; i++){
+	if (stage_ready(g, i) && ((best < 0) || (g->task[i].priority > g->task[best].priority)))
+	  best = i;
+      }
+      if (best < 0)
+	break;
+
+      cores = useful_cores(&(SCHED_PROGRAMS[g->task[best].program]), num_cores);
+      if (n_running > 0){
+	if ((cores > free_cores) || (mem_used + g->task[best].mem > budget))
+	  break; // wait for running tasks rather than starve this one
+      }
+      else if (cores > free_cores)
+	cores = free_cores;
+
+      if (launch_stage(g, best, cores, start_time, LOG) != 0){
+	g->task[best].state = SCHED_FAILED;
+	n_finished++;
+	failed = 1;
+	break;
+      }
+      n_running++;
+      free_cores -= cores;
+      mem_used += g->task[best].mem;
+    }
+
+    if (n_running == 0){
+      if (n_finished < g->n_tasks && !failed){
+	fprintf(stderr, "stage_scheduler: ERROR: %i tasks can never run (circular dependency?)\n", g->n_tasks-n_finished);
+	fprintf(LOG, "stage_scheduler: ERROR: %i tasks can never run (circular dependency?)\n", g->n_tasks-n_finished);
+	failed = 1;
+      }
+      break;
+    }
+
+    // wait for a task to finish
+    pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0){
+      fprintf(stderr, "stage_scheduler: ERROR: lost track of running tasks\n");
+      fprintf(LOG, "stage_scheduler: ERROR: lost track of running tasks\n");
+      return -1;
+    }
+    for (i=0; i<g->n_tasks; i++){
+      if ((g->task[i].state == SCHED_RUNNING) && (g->task[i].pid == pid))
+	break;
+    }
+    if (i == g->n_tasks)
+      continue;
+
+    n_running--;
+    n_finished++;
+    free_cores += g->task[i].cores;
+    mem_used -= g->task[i].mem;
+    time(&curr_time);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) == 255) || (WEXITSTATUS(status) == 127)){
+      g->task[i].state = SCHED_FAILED;
+      failed = 1;
+      fprintf(stderr, "%s %s failed, %g min have ellapsed\nAborting run...\n",
+	      SCHED_PROGRAMS[g->task[i].program].name, g->task[i].args, difftime(curr_time, start_time)/60.0);
+      fprintf(LOG, "%s %s failed, %g min have ellapsed\nAborting run...\n",
+	      SCHED_PROGRAMS[g->task[i].program].name, g->task[i].args, difftime(curr_time, start_time)/60.0);
+    }
+    else{
+      g->task[i].state = SCHED_DONE;
+      measure_stage_scaling(g, i, &usage);
+      fprintf(LOG, "Finished: %s %s on %i cores, %g min have ellapsed\n",
+	      SCHED_PROGRAMS[g->task[i].program].name, g->task[i].args, g->task[i].cores, difftime(curr_time, start_time)/60.0);
+    }
+    fflush(NULL);
+  }
+
+  return failed ? -1 : 0;
+}
+
+#endif
@@ -1,12 +1,13 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
+#include "halo_catalog.c"
 
 /********************************************************************
 USAGE:  update_halo_pos <REDSHIFT>
 
 Program UPDATE_HALO_POS reads in the linear velocity field, and uses
 it to update halo locations with a corresponding displacement field
-creating updated_halo_ in ../Output_files/Halo_lists/ directory
+creating updated_halo_catalog_ in ../Output_files/Halo_lists/ directory
 *********************************************************************/
 
 float max(float a, float b){
@@ -16,10 +17,11 @@ float max(float a, float b){
 
 int main(int argc, char ** argv){
   char filename[100];
-  FILE *F, *OUT;
+  FILE *F;
   float growth_factor, displacement_factor_2LPT, REDSHIFT, mass, xf, yf, zf, *vx, *vy, *vz, *vx_2LPT, *vy_2LPT, *vz_2LPT, z;
-  int i,j,k, xi, yi, zi, DI;
-  unsigned long long ct;
+  int i,j,k, xi, yi, zi, DI, status;
+  unsigned long long ct, halo_ct;
+  halo_catalog halos;
   float dz = 1e-10;
   time_t start_time, last_time;
 
@@ -97,14 +99,6 @@ int main(int argc, char ** argv){
     vy[ct] *= growth_factor / BOX_LEN; // this is now comoving displacement in units of box size
     vz[ct] *= growth_factor / BOX_LEN; // this is now comoving displacement in units of box size
   }
-  // open file to write to
-  sprintf(filename, "../Output_files/Halo_lists/updated_halos_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-    OUT = fopen(filename, "w");
-  if (!OUT){
-    fprintf(stderr, "update_halo_pos: Error opening output file: %s\nAborting\n", filename);
-    free(vx);  free(vy); free(vz);
-    return -1;
-  }
 
 /* ************************************************************************* *
  *                           BEGIN 2LPT PART                                 *
@@ -196,18 +190,22 @@ int main(int argc, char ** argv){
     int den = 0;
 
   last_time = time(NULL);
-  // read in the halo list
-  sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-  F = fopen(filename, "r");
-  if (!F){
-    fprintf(stderr, "update_halo_pos: Error opening input file: %s\nAborting\n", filename);
+  // read in the halo catalogue
+  sprintf(filename, "../Output_files/Halo_lists/halo_catalog_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
+  if (read_halo_catalog(filename, 0, 1, &halos) < 0){
+    fprintf(stderr, "update_halo_pos: Error reading input file: %s\nAborting\n", filename);
     free(vx);  free(vy); free(vz);
     return -1;
   }
-  // now read in all halos above our threshold into the smoothed halo field
+  // now update the positions of all halos, cell by cell of the catalogue's spatial index, so that
+  // consecutive halos read neighbouring velocities (the catalogue stays in mass order)
   fprintf(stderr, "Updating halo positions\n");
-  fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-  while (!feof(F)){
+  for (ct=0; ct<halos.n; ct++){
+    halo_ct = halos.cell_halo[ct];
+    mass = halos.mass[halo_ct];
+    xf = halos.x[halo_ct];
+    yf = halos.y[halo_ct];
+    zf = halos.z[halo_ct];
     i = xf*HII_DIM;
     j = yf*HII_DIM;
     k = zf*HII_DIM;
@@ -278,10 +276,10 @@ int main(int argc, char ** argv){
     yf = ((float)yi) / ((float)DI);
     zf = ((float)zi) / ((float)DI);
     */
-    // now write out the updated positions
-    fprintf(OUT, "%e\t%f\t%f\t%f\n", mass, xf, yf, zf);
-
-    fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
+    // now store the updated positions
+    halos.x[halo_ct] = xf;
+    halos.y[halo_ct] = yf;
+    halos.z[halo_ct] = zf;
   }
   fprintf(stderr, "Done in %ds\nTotal elapsed time: %ds\n", time(NULL) - last_time, time(NULL) - start_time);
 
@@ -290,10 +288,21 @@ int main(int argc, char ** argv){
   mean_ratio /= (float)den;
   fprintf(stderr, "mc = %.2e\tmc2lpt = %.2e\tmr = %.2e\n maxc = %.2e\tmaxc2lpt = %.2e\tmaxr = %.2e\n", mean_correction, mean_correction_2LPT, mean_ratio, max_correction, max_correction_2LPT, max_ratio);
 
+  // write out the updated catalogue
+  status = 0;
+  sprintf(filename, "../Output_files/Halo_lists/updated_halo_catalog_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
+  if (write_halo_catalog(filename, halos.n, halos.mass, halos.x, halos.y, halos.z, REDSHIFT) < 0)
+    status = -1;
+  if (ASCII_HALO_LISTS){
+    sprintf(filename, "../Output_files/Halo_lists/updated_halos_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
+    if (write_halo_list(filename, halos.n, halos.mass, halos.x, halos.y, halos.z) < 0)
+      status = -1;
+  }
+
   // deallocate
   free(vx_2LPT);  free(vy_2LPT); free(vz_2LPT); 
-  free(vx);  free(vy); free(vz);  fclose(F); fclose(OUT);
+  free(vx);  free(vy); free(vz);  free_halo_catalog(&halos);
 
 
-  return 0;
+  return status;
 }